@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * A region allocator for memory that all dies at the same time, like the paths
+ * and listings of one walk over a directory tree. Allocating is a pointer bump
+ * inside a block and nothing is freed on its own, the whole region is released
+ * by arena_free or cut back to an earlier arena_mark with arena_rewind.
+ *
+ * An arena is not thread safe, every thread gets its own from arena_thread.
+ * Anything allocated before a mark must not grow while the mark is in use
+ * since the grown memory would be released by the rewind.
+ */
+
+#define ARENA_OK    1
+#define ARENA_ERROR 0
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGNMENT  16
+
+struct arena_block {
+    struct arena_block* prev;
+    size_t              size;
+    size_t              used;
+    char                data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+struct arena {
+    struct arena_block* block;  // newest block, allocations come from it
+    size_t              block_size;
+};
+
+/**
+ * A position in an arena to go back to.
+ */
+struct arena_mark {
+    struct arena_block* block;
+    size_t              used;
+};
+
+typedef struct arena* Arena;
+
+Arena arena_init(size_t block_size);
+
+void* arena_alloc(Arena arena, size_t size);
+
+char* arena_strdup(Arena arena, const char* str);
+
+struct arena_mark arena_mark(Arena arena);
+
+int arena_rewind(Arena arena, struct arena_mark mark);
+
+int arena_reset(Arena arena);
+
+Arena arena_thread(void);
+
+int arena_free(Arena arena);
+
+#endif  // ARENA_H
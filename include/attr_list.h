@@ -6,6 +6,8 @@
 
 #include <libssh/sftp.h>
 
+#include "arena.h"
+
 /**
  * This file defined structs and functions that are used to create a linked list
  * of sftp_attributes.
@@ -18,15 +20,23 @@ struct attributes_node {
 
 typedef struct attributes_node* AttrNode;
 
+/**
+ * A list made with attr_list_initialize_arena takes its nodes from the arena,
+ * attr_list_free then only frees the attributes.
+ */
 struct attributes_list {
     AttrNode head;
+    AttrNode tail;
     int      size;
+    Arena    arena;
 };
 
 typedef struct attributes_list* AttrList;
 
 AttrList attr_list_initialize(void);
 
+AttrList attr_list_initialize_arena(Arena arena);
+
 int attr_list_add(AttrList list, sftp_attributes attr);
 
 AttrNode attr_list_get_from_postion(AttrList list, int index);
@@ -0,0 +1,87 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "conn_pool.h"
+#include "path.h"
+#include "pssh.h"
+
+/**
+ * Operations run without a user, taken from the command line or a manifest
+ * with one per line:
+ *   get <remote> <local directory>
+ *   put <local> <remote directory>
+ *   sync <local> <remote directory>   a put that only replaces older files
+ *   mkdir <remote directory>          parents are created as well
+ *   rm <remote>                       directories are removed recursively
+ * Arguments with spaces are double quoted and lines starting with # are
+ * comments.
+ *
+ * Every operation runs on a pooled connection as soon as the earlier ones
+ * touching an overlapping path are done, so independent operations run side
+ * by side while dependent ones keep their order. Nothing is asked, existing
+ * destinations are handled by the conflict policy. What every operation did
+ * is reported as one line of JSON.
+ */
+
+#define BATCH_OK    1
+#define BATCH_ERROR 0
+
+#define BATCH_MAX_ARGS    2
+#define BATCH_LINE_SIZE   4096
+#define BATCH_WINDOW      256  // operations looked ahead for one that can run
+#define BATCH_INITIAL_OPS 16
+
+enum batch_type { BATCH_GET, BATCH_PUT, BATCH_SYNC, BATCH_MKDIR, BATCH_RM };
+
+enum batch_state { BATCH_PENDING, BATCH_RUNNING, BATCH_DONE };
+
+struct batch_op {
+    enum batch_type       type;
+    char*                 args[BATCH_MAX_ARGS];
+    char*                 remote;  // what it touches on each side
+    char*                 local;
+    int                   line;  // in the manifest, 0 for the command line
+    enum batch_state      state;
+    bool                  ok;
+    struct transfer_stats stats;
+    double                seconds;
+};
+
+struct batch {
+    struct batch_op*   ops;
+    int                count;
+    int                capacity;
+    int                first_open;  // every operation before it is done
+    enum path_conflict policy;
+    ConnPool           pool;
+    pthread_mutex_t    lock;
+    pthread_cond_t     changed;
+};
+
+typedef struct batch* Batch;
+
+Batch batch_init(enum path_conflict policy);
+
+int batch_parse_policy(const char* name, enum path_conflict* policy);
+
+int batch_add(Batch batch, char** words, int count, int line);
+
+int batch_parse_args(Batch batch, int argc, char** argv);
+
+int batch_load(Batch batch, const char* manifest);
+
+int batch_run(Batch batch, ConnPool pool, int jobs);
+
+int batch_report(Batch batch, FILE* out);
+
+bool batch_succeeded(Batch batch);
+
+int batch_free(Batch batch);
+
+void batch_json_string(FILE* out, const char* str);
+
+#endif  // BATCH_H
@@ -0,0 +1,93 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <libssh/libssh.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Hashes of transferred files and their check against the other side. The
+ * hash is fed the chunks as the transfer moves them so no file is read twice
+ * on this side. The remote hash comes from running the coreutils tool of the
+ * same name, many files at a time over one session, since libssh has no way
+ * to send the check-file sftp extension.
+ */
+
+#define CHECKSUM_OK    1
+#define CHECKSUM_ERROR 0
+
+#define CHECKSUM_HEX_SIZE        (EVP_MAX_MD_SIZE * 2 + 1)
+#define CHECKSUM_INITIAL_ENTRIES 16
+
+enum checksum_type {
+    CHECKSUM_NONE,
+    CHECKSUM_MD5,
+    CHECKSUM_SHA1,
+    CHECKSUM_SHA256,
+    CHECKSUM_SHA512,
+};
+
+struct checksum {
+    enum checksum_type type;
+    EVP_MD_CTX*        ctx;
+};
+
+typedef struct checksum* Checksum;
+
+/**
+ * A remote file and the hash its contents should have.
+ */
+struct checksum_entry {
+    char* path;
+    char  expected[CHECKSUM_HEX_SIZE];
+    bool  verified;
+    void* data;  // handed back to the caller once checked
+};
+
+struct checksum_batch {
+    enum checksum_type     type;
+    struct checksum_entry* entries;
+    int                    count;
+    int                    capacity;
+};
+
+typedef struct checksum_batch* ChecksumBatch;
+
+/**
+ * Told by checksum_batch_verify whether the file at path matched, with the
+ * data it was added with.
+ */
+typedef void (*checksum_callback)(void* data, const char* path, bool verified);
+
+int checksum_parse(const char* name, enum checksum_type* type);
+
+const char* checksum_name(enum checksum_type type);
+
+Checksum checksum_init(enum checksum_type type);
+
+int checksum_update(Checksum sum, const void* data, size_t length);
+
+int checksum_final(Checksum sum, char* hex);
+
+void checksum_free(Checksum sum);
+
+ChecksumBatch checksum_batch_init(enum checksum_type type);
+
+int checksum_batch_add(ChecksumBatch batch,
+                       const char*   path,
+                       const char*   expected,
+                       void*         data);
+
+int checksum_batch_verify(ChecksumBatch     batch,
+                          ssh_session       session,
+                          checksum_callback callback);
+
+void checksum_batch_free(ChecksumBatch batch);
+
+int checksum_remote(ssh_session        session,
+                    enum checksum_type type,
+                    const char*        path,
+                    char*              hex);
+
+#endif  // CHECKSUM_H
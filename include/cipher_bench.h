@@ -0,0 +1,54 @@
+#ifndef CIPHER_BENCH_H
+#define CIPHER_BENCH_H
+
+#include <libssh/libssh.h>
+
+/**
+ * Orders the ciphers and MACs offered to the server by how fast this machine
+ * runs them. Whether AES beats ChaCha20 comes down to the cpu having AES
+ * instructions, which many ARM boards lack, so every candidate is timed once
+ * with libcrypto and the ranking is kept in ~/.cache/pws/ciphers-<machine>.
+ * Only algorithms considered secure are candidates. The slower ones stay in
+ * the lists so a server without the fastest one still finds a match, and the
+ * MACs libssh offers by default that are not timed go after the ranked ones
+ * so a server that only has those can still be reached.
+ *
+ * File layout, one line each:
+ *   CIPHER_BENCH_MAGIC <libcrypto version>
+ *   comma separated ciphers, fastest first
+ *   comma separated MACs, fastest first
+ */
+
+#define CIPHER_BENCH_OK    1
+#define CIPHER_BENCH_ERROR 0
+
+#define CIPHER_BENCH_MAGIC       "PWSCIPHERS1"
+#define CIPHER_BENCH_FILE_PREFIX "ciphers-"
+#define CIPHER_BENCH_ENV         "PWS_CALIBRATE"  // set to time them again
+
+#define CIPHER_BENCH_PACKET_SIZE 32768  // the largest packet libssh sends
+#define CIPHER_BENCH_DURATION    0.05  // seconds spent on every candidate
+#define CIPHER_BENCH_LIST_SIZE   256
+
+// the rest of the default MACs of libssh, offered last
+#define CIPHER_BENCH_MACS_UNTIMED "hmac-sha1-etm@openssh.com,hmac-sha1"
+
+struct cipher_bench_result {
+    char ciphers[CIPHER_BENCH_LIST_SIZE];
+    char macs[CIPHER_BENCH_LIST_SIZE];
+};
+
+int cipher_bench_run(struct cipher_bench_result* result);
+
+int cipher_bench_load(struct cipher_bench_result* result);
+
+int cipher_bench_save(const struct cipher_bench_result* result);
+
+int cipher_bench_ranking(struct cipher_bench_result* result);
+
+int cipher_bench_set(ssh_session                       session,
+                     const struct cipher_bench_result* result);
+
+int cipher_bench_apply(ssh_session session);
+
+#endif  // CIPHER_BENCH_H
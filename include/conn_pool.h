@@ -0,0 +1,94 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+/**
+ * A fixed set of authenticated ssh connections to the same host. The first
+ * one is the session the user logged in with, the others are opened with the
+ * same options when the pool is created. A connection is handed out to one
+ * user at a time since a libssh session cannot be used from two threads, and
+ * it keeps its sftp session open between users so the subsystem is set up
+ * once per connection instead of once per mode.
+ *
+ * Idle connections are sent a keepalive every CONN_POOL_KEEPALIVE seconds and
+ * busy ones rely on tcp keepalives, a connection found dead is opened again
+ * with the same options and authenticated again. The sftp session a dead
+ * connection had is kept until the pool is freed so callers still holding it
+ * can ask for its replacement with conn_pool_current.
+ */
+
+#define CONN_POOL_OK    1
+#define CONN_POOL_ERROR 0
+
+#define CONN_POOL_SIZE_ENV     "PWS_CONNECTIONS"
+#define CONN_POOL_DEFAULT_SIZE 1
+#define CONN_POOL_MAX_SIZE     8
+
+#define CONN_POOL_KEEPALIVE   30  // seconds
+#define CONN_POOL_TIMEOUT     60  // seconds a blocking call waits on the server
+#define CONN_POOL_RETRIES     6
+#define CONN_POOL_BACKOFF     1  // seconds before the first retry, doubled
+#define CONN_POOL_MAX_BACKOFF 60
+
+struct conn_pool_connection {
+    ssh_session  session;
+    sftp_session sftp;  // opened on first use and kept
+    bool         busy;
+    bool         lost;  // a keepalive failed while it was idle
+};
+
+typedef struct conn_pool_connection* PoolConn;
+
+/**
+ * A session replaced by a reconnect and the sftp session that took its place.
+ */
+struct conn_pool_retired {
+    ssh_session               session;
+    sftp_session              sftp;
+    sftp_session              replacement;
+    struct conn_pool_retired* next;
+};
+
+struct conn_pool {
+    struct conn_pool_connection* connections;
+    int                          size;
+    struct conn_pool_retired*    retired;
+    pthread_mutex_t              lock;
+    pthread_cond_t               released;
+    pthread_cond_t               stopping;
+    pthread_t                    keepalive;
+    bool                         keepalive_running;
+    bool                         stop;
+};
+
+typedef struct conn_pool* ConnPool;
+
+ConnPool conn_pool_init(ssh_session session, int size);
+
+int conn_pool_size_from_env(void);
+
+PoolConn conn_pool_acquire(ConnPool pool);
+
+PoolConn conn_pool_try_acquire(ConnPool pool);
+
+sftp_session conn_pool_sftp(PoolConn conn);
+
+int conn_pool_release(ConnPool pool, PoolConn conn);
+
+int conn_pool_keepalive_start(ConnPool pool);
+
+int conn_pool_keepalive_stop(ConnPool pool);
+
+int conn_pool_reconnect(ConnPool pool, PoolConn conn);
+
+sftp_session conn_pool_current(sftp_session sftp);
+
+sftp_session conn_pool_recover(sftp_session sftp);
+
+int conn_pool_free(ConnPool pool);
+
+#endif  // CONN_POOL_H
@@ -0,0 +1,59 @@
+#ifndef DIR_LISTING_H
+#define DIR_LISTING_H
+
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "attr_list.h"
+#include "path.h"
+#include "tree_index.h"
+
+#define DIR_LISTING_OK    1
+#define DIR_LISTING_ERROR 0
+
+#define DIR_LISTING_PAGE_SIZE        40
+#define DIR_LISTING_INITIAL_CAPACITY 256
+
+/**
+ * A remote directory listing that is filled in by a background thread while
+ * the first pages are already being shown. The loader is the only user of the
+ * sftp session until dir_listing_stop returns, after that the session can be
+ * used by the caller again. With a tree index the directory is only read from
+ * the remote when its indexed copy is stale.
+ */
+struct dir_listing {
+    AttrList        list;
+    AttrNode*       index;  // nodes of list by position for O(1) lookups
+    int             capacity;
+    sftp_session    session;
+    TreeIndex       tree;
+    Path            path;
+    pthread_t       loader;
+    pthread_mutex_t lock;
+    pthread_cond_t  grown;
+    bool            done;
+    bool            failed;
+    bool            cancel;
+    bool            joined;
+};
+
+typedef struct dir_listing* DirListing;
+
+DirListing dir_listing_start(sftp_session session,
+                             Path         path,
+                             TreeIndex    index);
+
+int dir_listing_show_page(DirListing listing, int page, const char* filter);
+
+AttrNode dir_listing_get(DirListing listing, int index);
+
+int dir_listing_size(DirListing listing, bool* done);
+
+bool dir_listing_failed(DirListing listing);
+
+int dir_listing_stop(DirListing listing);
+
+int dir_listing_free(DirListing listing);
+
+#endif  // DIR_LISTING_H
@@ -0,0 +1,49 @@
+#ifndef DISK_USAGE_H
+#define DISK_USAGE_H
+
+#include <libssh/sftp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "path.h"
+
+/**
+ * Recursive size and file count of remote directories. Every subdirectory of
+ * the requested directory is measured by its own `find` on a separate exec
+ * channel, several at a time over the one session, with an sftp walk as the
+ * fallback. The totals of every subdirectory are kept with the newest ctime
+ * found under it, so asking again only measures the subdirectories where the
+ * remote finds something changed since. The mtime of a directory would miss a
+ * file growing or anything deeper down changing, a ctime cannot be set back.
+ * The totals also serve as an estimate for the download ETA.
+ */
+
+#define DISK_USAGE_OK    1
+#define DISK_USAGE_ERROR 0
+
+#define DISK_USAGE_MAX_CHANNELS 8
+#define DISK_USAGE_TOP          15
+#define DISK_USAGE_CACHE_SIZE   1024  // buckets, the cache chains past that
+
+struct disk_usage {
+    char*              path;
+    uint64_t           bytes;
+    uint64_t           files;
+    uint64_t           stamp;  // newest ctime under it in ns, 0 if unknown
+    struct disk_usage* next;
+};
+
+typedef struct disk_usage* DiskUsage;
+
+int disk_usage_show(sftp_session session, Path dir, int top);
+
+int disk_usage_measure(sftp_session session,
+                       Path         dir,
+                       uint64_t*    bytes,
+                       uint64_t*    files);
+
+bool disk_usage_cached(const char* path, uint64_t* bytes, uint64_t* files);
+
+void disk_usage_clear_cache(void);
+
+#endif  // DISK_USAGE_H
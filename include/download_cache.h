@@ -0,0 +1,72 @@
+#ifndef DOWNLOAD_CACHE_H
+#define DOWNLOAD_CACHE_H
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "checksum.h"
+
+/**
+ * A local cache of downloaded files so the same remote file is not fetched
+ * again for another name or directory on this machine. A file is known by its
+ * host, path, size and modification time, and by the hash of its contents when
+ * transfers are checked, so the same contents under another remote name are
+ * found too. Files are stored once per contents under the cache directory and
+ * handed out as a reflink where the file system can and as a copy otherwise,
+ * a hard link would let writes to the download change the cached file.
+ *
+ * The index lists every known file with the object holding it and when it was
+ * last used, objects are evicted least recently used first once they take up
+ * more than the limit. Threads share it through a mutex and processes through
+ * a lock on a file next to it.
+ */
+
+#define DOWNLOAD_CACHE_OK    1
+#define DOWNLOAD_CACHE_ERROR 0
+
+#define DOWNLOAD_CACHE_SIZE_ENV        "PWS_DOWNLOAD_CACHE"
+#define DOWNLOAD_CACHE_DIRECTORY       "downloads"
+#define DOWNLOAD_CACHE_INDEX           "index"
+#define DOWNLOAD_CACHE_LOCK            "lock"
+#define DOWNLOAD_CACHE_MIN_SIZE        (1024 * 1024)  // smaller files are sent
+#define DOWNLOAD_CACHE_INITIAL_ENTRIES 64
+#define DOWNLOAD_CACHE_NAME_SIZE       (CHECKSUM_HEX_SIZE + 16)
+
+struct download_cache_entry {
+    char     key[CHECKSUM_HEX_SIZE];  // hash of host, path, size and mtime
+    char     object[DOWNLOAD_CACHE_NAME_SIZE];  // file holding the contents
+    uint64_t size;
+    int64_t  used;  // seconds since the epoch
+};
+
+struct download_cache_index {
+    struct download_cache_entry* entries;
+    int                          count;
+    int                          capacity;
+};
+
+void download_cache_set_limit(uint64_t bytes);
+
+bool download_cache_wants(sftp_attributes attr);
+
+int download_cache_lookup(ssh_session        session,
+                          const char*        remote,
+                          sftp_attributes    attr,
+                          enum checksum_type type);
+
+int download_cache_fetch(int cached, FILE* to);
+
+int download_cache_store(ssh_session     session,
+                         const char*     remote,
+                         sftp_attributes attr,
+                         const char*     object,
+                         const char*     local);
+
+int download_cache_object_name(enum checksum_type type,
+                               const char*        hex,
+                               char*              name);
+
+#endif  // DOWNLOAD_CACHE_H
@@ -1,24 +1,48 @@
 #ifndef DYNAMIC_STR_H
 #define DYNAMIC_STR_H
 
+#include "arena.h"
+
 #define DYNAMIC_STR_ERROR 0
 #define DYNAMIC_STR_OK    1
 
+// strings shorter than this are kept inside the struct without a heap buffer
+#define DYNAMIC_STR_INLINE_SIZE 48
+
+/**
+ * A growable string. size is the length plus the terminating NUL and capacity
+ * is how much str can hold, it grows by doubling so appending is amortized
+ * O(1) and never rescans the string. When arena is set the struct and its
+ * buffers come from it and dynamic_str_free does nothing.
+ */
 struct dynamic_str {
     char* str;
     int   size;
+    int   capacity;
+    Arena arena;
+    char  inline_str[DYNAMIC_STR_INLINE_SIZE];
 };
 
 typedef struct dynamic_str* DynamicStr;
 
 DynamicStr dynamic_str_init(const char* str);
 
+DynamicStr dynamic_str_init_arena(Arena arena, const char* str);
+
 int dynamic_str_cat(DynamicStr dest, const char* src);
 
+int dynamic_str_append(DynamicStr dest, const char* src, int len);
+
 int dynamic_str_change(DynamicStr dest, char* src);
 
 int dynamic_str_remove(DynamicStr str, int from);
 
+int dynamic_str_truncate(DynamicStr str, int length);
+
+int dynamic_str_reserve(DynamicStr str, int capacity);
+
+int dynamic_str_length(DynamicStr str);
+
 int dynamic_str_free(DynamicStr str);
 
 #endif  // DYNAMIC_STR_H
@@ -0,0 +1,93 @@
+#ifndef EXEC_GROUP_H
+#define EXEC_GROUP_H
+
+#include <libssh/libssh.h>
+#include <stddef.h>
+
+/**
+ * Runs many remote commands at once, each on an exec channel of its own over
+ * one session. A single loop opens the channels, starts the commands and reads
+ * their output without blocking on any of them, so a set of small commands
+ * costs about as many round trips as the slowest of them instead of the sum.
+ *
+ * Every command has a buffer of its own. Output is read into it only while it
+ * has room, so a consumer that leaves output in the buffer stops its command
+ * through the ssh window instead of using up memory. Without a consumer the
+ * whole output is collected, up to EXEC_GROUP_MAX_OUTPUT.
+ */
+
+#define EXEC_GROUP_OK    1
+#define EXEC_GROUP_ERROR 0
+
+#define EXEC_GROUP_CHANNELS      8  // sshd allows 10 sessions per connection
+#define EXEC_GROUP_INITIAL_JOBS  16
+#define EXEC_GROUP_BUFFER_SIZE   32768
+#define EXEC_GROUP_MAX_OUTPUT    (1024 * 1024)
+#define EXEC_GROUP_ERROR_SIZE    1024  // stderr kept of every command
+#define EXEC_GROUP_POLL_INTERVAL 100  // ms, the longest wait on the socket
+
+enum exec_job_state {
+    EXEC_JOB_QUEUED,
+    EXEC_JOB_OPENING,
+    EXEC_JOB_STARTING,
+    EXEC_JOB_RUNNING,
+    EXEC_JOB_DONE,
+    EXEC_JOB_FAILED,
+    EXEC_JOB_TIMED_OUT,
+};
+
+struct exec_job {
+    char*               command;
+    void*               data;  // given back to the callbacks
+    enum exec_job_state state;
+    ssh_channel         channel;
+    char*               output;  // stdout not taken by the consumer yet
+    size_t              length;
+    size_t              capacity;
+    char                errors[EXEC_GROUP_ERROR_SIZE];
+    size_t              error_length;
+    int                 exit_status;  // -1 if the command did not send one
+    double              started;
+};
+
+/**
+ * Gets the output of job as it arrives and returns how much of it was used,
+ * the rest is given again with what comes after it.
+ */
+typedef size_t (*exec_group_output)(struct exec_job* job,
+                                    const char*      data,
+                                    size_t           length,
+                                    void*            user);
+
+/**
+ * Called once for every job when it is over, whatever its state.
+ */
+typedef void (*exec_group_done)(struct exec_job* job, void* user);
+
+struct exec_group {
+    ssh_session       session;
+    struct exec_job*  jobs;
+    int               count;
+    int               capacity;
+    int               channels;  // commands running at the same time
+    int               timeout;  // ms a command may take, 0 for no limit
+    int               running;
+    exec_group_output output;  // the callbacks of the current run
+    exec_group_done   done;
+    void*             user;
+};
+
+typedef struct exec_group* ExecGroup;
+
+ExecGroup exec_group_init(ssh_session session, int channels, int timeout);
+
+int exec_group_add(ExecGroup group, const char* command, void* data);
+
+int exec_group_run(ExecGroup         group,
+                   exec_group_output output,
+                   exec_group_done   done,
+                   void*             user);
+
+int exec_group_free(ExecGroup group);
+
+#endif  // EXEC_GROUP_H
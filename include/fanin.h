@@ -0,0 +1,59 @@
+#ifndef FANIN_H
+#define FANIN_H
+
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "fleet.h"
+#include "path.h"
+
+/**
+ * Collects the remote paths matching a set of patterns from every host of a
+ * fleet into a directory named after the host under a local directory. Hosts
+ * are worked on jobs at a time, each by a thread with a connection of its own,
+ * so a run takes about as long as its slowest host instead of the sum of all
+ * of them. Patterns take *, ? and [] in any component and matched directories
+ * are downloaded whole.
+ */
+
+#define FANIN_OK    1
+#define FANIN_ERROR 0
+
+#define FANIN_MAX_JOBS        32  // hosts downloaded from at the same time
+#define FANIN_INITIAL_MATCHES 16
+
+struct fanin_match {
+    char*           path;
+    sftp_attributes attr;
+};
+
+struct fanin_matches {
+    struct fanin_match* items;
+    int                 count;
+    int                 capacity;
+};
+
+struct fanin {
+    char**             patterns;
+    int                pattern_count;
+    char*              local;
+    enum path_conflict policy;
+    Fleet              fleet;
+    int                next;  // the host the next free thread takes
+    int                finished;
+    pthread_mutex_t    lock;
+};
+
+typedef struct fanin* Fanin;
+
+Fanin fanin_init(char**             patterns,
+                 int                count,
+                 const char*        local,
+                 enum path_conflict policy);
+
+int fanin_run(Fanin fanin, Fleet fleet, int jobs);
+
+int fanin_free(Fanin fanin);
+
+#endif  // FANIN_H
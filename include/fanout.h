@@ -0,0 +1,111 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fleet.h"
+#include "path.h"
+#include "pssh.h"
+
+/**
+ * Uploads one local file or directory to every host of a fleet at once. The
+ * local files are read a single time into a ring of shared chunks and every
+ * host writes them from there on its own thread and connection, so the disk
+ * is read once however many hosts there are.
+ *
+ * The reader waits for the slowest host while it is less than FANOUT_SLOTS
+ * records behind. A host that far behind is let go as soon as another host is
+ * left waiting for data and reads the rest of the files itself from where it
+ * was, so one slow host never holds up the others by more than the ring.
+ */
+
+#define FANOUT_OK    1
+#define FANOUT_ERROR 0
+
+#define FANOUT_SLOTS           256  // records a host can fall behind
+#define FANOUT_MAX_HOSTS       64   // hosts uploaded to at the same time
+#define FANOUT_INITIAL_ENTRIES 64
+
+enum fanout_record {
+    FANOUT_DIRECTORY,
+    FANOUT_BEGIN,  // of a file
+    FANOUT_DATA,
+    FANOUT_END,
+};
+
+/**
+ * A file or directory to upload, the root comes first and every directory
+ * comes before its contents.
+ */
+struct fanout_entry {
+    char*    local;
+    char*    remote;
+    bool     directory;
+    uint64_t size;
+    int64_t  mtime;
+};
+
+/**
+ * Data read from a file, shared by the hosts writing it. A chunk still being
+ * written by a host that was let go when its slot is reused is orphaned and
+ * freed by the last host done with it.
+ */
+struct fanout_chunk {
+    int    users;
+    bool   orphaned;
+    size_t length;
+    char   data[CHUNK_SIZE];
+};
+
+struct fanout_slot {
+    enum fanout_record   type;
+    int                  entry;
+    bool                 failed;  // the local file could not be read to the end
+    struct fanout_chunk* chunk;   // only read by FANOUT_DATA
+};
+
+struct fanout_target {
+    struct fanout*     fanout;
+    struct fleet_host* host;
+    pthread_t          thread;
+    bool               started;
+    uint64_t           next;      // record of the shared stream read next
+    bool               attached;  // false once it reads the files itself
+    bool               done;
+    int                entry;  // where it is, to carry on from when let go
+    uint64_t           offset;
+    bool               in_file;
+    sftp_file          file;  // NULL while the current file is left out
+};
+
+struct fanout {
+    struct fanout_entry*  entries;
+    int                   entry_count;
+    int                   entry_capacity;
+    enum path_conflict    policy;
+    Fleet                 fleet;
+    struct fanout_slot    slots[FANOUT_SLOTS];
+    uint64_t              produced;  // records put in the ring so far
+    bool                  finished;
+    struct fanout_target* targets;
+    int                   target_count;
+    pthread_mutex_t       lock;
+    pthread_cond_t        ready;     // a record was added
+    pthread_cond_t        consumed;  // a host read a record or stopped
+};
+
+typedef struct fanout* Fanout;
+
+Fanout fanout_init(const char*        local,
+                   const char*        remote_directory,
+                   enum path_conflict policy);
+
+int fanout_run(Fanout fanout, Fleet fleet, int jobs);
+
+int fanout_free(Fanout fanout);
+
+#endif  // FANOUT_H
@@ -0,0 +1,66 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "cipher_bench.h"
+#include "pssh.h"
+
+/**
+ * A set of hosts worked on side by side, named in a file with one host per
+ * line or in a comma separated list. Every host gets a connection of its own,
+ * opened from the thread working on it without asking anything: its key has
+ * to be in known_hosts already and only public keys are tried.
+ */
+
+#define FLEET_OK    1
+#define FLEET_ERROR 0
+
+#define FLEET_MAX_HOSTS        1024
+#define FLEET_INITIAL_HOSTS    16
+#define FLEET_ERROR_SIZE       256
+#define FLEET_LINE_SIZE        1024
+
+enum fleet_status { FLEET_PENDING, FLEET_DONE, FLEET_FAILED };
+
+struct fleet_host {
+    char*                 name;
+    ssh_session           session;
+    sftp_session          sftp;
+    enum fleet_status     status;
+    char                  error[FLEET_ERROR_SIZE];  // the first failure
+    struct transfer_stats stats;
+    double                seconds;
+    bool                  exited;  // a command ran to the end
+    int                   exit_status;
+};
+
+struct fleet {
+    struct fleet_host*         hosts;
+    int                        count;
+    int                        capacity;
+    struct cipher_bench_result ciphers;
+    bool                       ranked;  // false leaves the library defaults
+};
+
+typedef struct fleet* Fleet;
+
+Fleet fleet_load(const char* hosts);
+
+int fleet_connect(Fleet fleet, struct fleet_host* host, bool sftp);
+
+void fleet_fail(struct fleet_host* host, const char* format, ...);
+
+void fleet_disconnect(struct fleet_host* host);
+
+int fleet_report(Fleet fleet, FILE* out);
+
+bool fleet_succeeded(Fleet fleet);
+
+int fleet_free(Fleet fleet);
+
+#endif  // FLEET_H
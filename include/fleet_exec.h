@@ -0,0 +1,54 @@
+#ifndef FLEET_EXEC_H
+#define FLEET_EXEC_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "dynamic_str.h"
+#include "fleet.h"
+
+/**
+ * Runs one command on every host of a fleet, jobs hosts at a time, each on an
+ * exec channel of a connection of its own so nothing is echoed or wrapped by
+ * a terminal. Output is passed on while it comes, every line with the name of
+ * its host in front and stderr kept apart from stdout, or written whole into
+ * <host>.out and <host>.err under a directory. The exit status of every host
+ * ends up in the fleet for its report.
+ */
+
+#define FLEET_EXEC_OK    1
+#define FLEET_EXEC_ERROR 0
+
+#define FLEET_EXEC_MAX_JOBS    32
+#define FLEET_EXEC_BUFFER_SIZE 16384
+
+/**
+ * Where one stream of one host goes: into file if there is one, otherwise a
+ * line at a time to out with what is left of the last line kept in pending.
+ */
+struct fleet_exec_stream {
+    FILE*      out;
+    FILE*      file;
+    DynamicStr pending;
+};
+
+struct fleet_exec {
+    char*           command;
+    char*           output_dir;  // NULL prints with host prefixes
+    Fleet           fleet;
+    int             next;  // the host the next free thread takes
+    int             finished;
+    int             failed;  // hosts that could not run the command
+    int             nonzero;  // hosts where it exited with another status
+    pthread_mutex_t lock;  // one line is printed at a time
+};
+
+typedef struct fleet_exec* FleetExec;
+
+FleetExec fleet_exec_init(const char* command, const char* output_dir);
+
+int fleet_exec_run(FleetExec exec, Fleet fleet, int jobs);
+
+int fleet_exec_free(FleetExec exec);
+
+#endif  // FLEET_EXEC_H
@@ -0,0 +1,40 @@
+#ifndef INODE_SET_H
+#define INODE_SET_H
+
+#include <stdint.h>
+
+/**
+ * Local files seen by their device and inode, each with the path it was first
+ * seen at, so a file reached through several names is only sent once. An open
+ * addressing hash table that is not thread safe.
+ */
+
+#define INODE_SET_OK    1
+#define INODE_SET_ERROR 0
+
+#define INODE_SET_INITIAL_CAPACITY 64
+
+struct inode_set_entry {
+    uint64_t device;
+    uint64_t inode;
+    char*    path;  // NULL for a free slot
+};
+
+struct inode_set {
+    struct inode_set_entry* entries;
+    uint64_t                count;
+    uint64_t                capacity;  // a power of two
+};
+
+typedef struct inode_set* InodeSet;
+
+InodeSet inode_set_init(void);
+
+const char* inode_set_add(InodeSet    set,
+                          uint64_t    device,
+                          uint64_t    inode,
+                          const char* path);
+
+int inode_set_free(InodeSet set);
+
+#endif  // INODE_SET_H
@@ -0,0 +1,105 @@
+#ifndef LOCAL_SCAN_H
+#define LOCAL_SCAN_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "inode_set.h"
+
+/**
+ * Scans a local tree with a pool of threads and hands out a stream of jobs,
+ * one per file or directory, that the caller can start working on while the
+ * scan is still running. Every thread owns a deque of directories to read, it
+ * takes the newest one from its own deque and steals the oldest one from the
+ * others when its own runs dry. Entries are read relative to directory fds
+ * with d_type and fstatat.
+ *
+ * A directory's job always comes before the jobs of anything inside it. Hidden
+ * entries are skipped and symbolic links to directories are only followed
+ * when asked to. A followed directory that was reached before, through a link
+ * or as one of its own parents, is handed out with link set to where it was
+ * first reached and is not read again.
+ */
+
+#define LOCAL_SCAN_OK    1
+#define LOCAL_SCAN_ERROR 0
+
+#define LOCAL_SCAN_MAX_THREADS   16
+#define LOCAL_SCAN_QUEUE_SIZE    65536  // jobs waiting for the consumer
+#define LOCAL_SCAN_BATCH_SIZE    256
+#define LOCAL_SCAN_INITIAL_DEQUE 64
+
+enum local_scan_type { LOCAL_SCAN_FILE, LOCAL_SCAN_DIRECTORY };
+
+/**
+ * path and link are relative to the scanned root and are owned by whoever
+ * received the job. Directories only have type, path, inode and link filled
+ * in, and device when links are followed.
+ */
+struct local_scan_job {
+    char*                path;
+    char*                link;  // NULL unless the directory was seen before
+    enum local_scan_type type;
+    mode_t               mode;
+    uint64_t             size;
+    int64_t              mtime;
+    uint64_t             device;
+    uint64_t             inode;
+    uint64_t             links;   // names the file has
+    uint64_t             blocks;  // 512 byte blocks in use, fewer with holes
+};
+
+/**
+ * Directories waiting to be read, stolen from head and owned at tail.
+ */
+struct local_scan_deque {
+    pthread_mutex_t lock;
+    char**          tasks;
+    size_t          head;
+    size_t          count;
+    size_t          capacity;
+};
+
+struct local_scan_worker {
+    struct local_scan*      scan;
+    int                     id;
+    pthread_t               thread;
+    bool                    started;
+    struct local_scan_deque deque;
+};
+
+struct local_scan {
+    int                       root_fd;
+    int                       thread_count;
+    struct local_scan_worker* workers;
+    struct local_scan_job*    jobs;  // ring buffer of LOCAL_SCAN_QUEUE_SIZE
+    size_t                    jobs_head;
+    size_t                    jobs_count;
+    int                       pending;  // directories queued or being read
+    int                       queued;   // directories sitting in a deque
+    pthread_mutex_t           lock;
+    pthread_cond_t            work;
+    pthread_cond_t            ready;
+    pthread_cond_t            space;
+    bool                      done;
+    bool                      failed;
+    bool                      cancel;
+    bool                      follow;  // into symbolic links to directories
+    InodeSet                  seen;    // directories read, when following
+    pthread_mutex_t           seen_lock;
+};
+
+typedef struct local_scan* LocalScan;
+
+LocalScan local_scan_start(const char* root, int threads, bool follow);
+
+bool local_scan_next(LocalScan scan, struct local_scan_job* job);
+
+bool local_scan_failed(LocalScan scan);
+
+int local_scan_free(LocalScan scan);
+
+#endif  // LOCAL_SCAN_H
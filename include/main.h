@@ -1 +1,34 @@
+#include <libssh/libssh.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "path.h"
+
+#define DEFAULT_USER "remoteuser"
+#define DEFAULT_PORT 22
+
+ssh_session create_session(const char* host);
+
+ssh_session open_session(const char* host);
+
+int batch_main(int argc, char** argv);
+
+int fleet_main(const char*        hosts,
+               enum path_conflict policy,
+               int                jobs,
+               const char*        report_name,
+               const char*        output_dir,
+               int                argc,
+               char**             argv);
+
+int parse_bandwidth(const char* str, uint64_t* bandwidth);
+
+void download_cache_from_env(void);
+
+void print_batch_usage(void);
+
 void print_home_menu(void);
+
+bool attached_mode(const char* host);
+
+void print_attached_menu(void);
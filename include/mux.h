@@ -0,0 +1,56 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "conn_pool.h"
+
+/**
+ * Keeps the authenticated connections of a host alive in a background master
+ * process after pws quits, so later runs for the same host skip the connect,
+ * key exchange and login and send their work to the master over a Unix socket
+ * in ~/.cache/pws/<host>.sock instead. Each request is one socket connection
+ * and the master runs it on a channel of one of its pooled connections.
+ *
+ * A libssh session cannot be handed to another process so attached runs can
+ * only use what the master does for them, which is running commands with
+ * their output streamed back.
+ *
+ * Every frame is a struct mux_header followed by length bytes of payload.
+ */
+
+#define MUX_OK    1
+#define MUX_ERROR 0
+
+#define MUX_SOCKET_EXTENSION ".sock"
+#define MUX_IDLE_TIMEOUT     600  // seconds without requests before exiting
+#define MUX_POLL_INTERVAL    1000  // milliseconds
+#define MUX_READ_TIMEOUT     100  // milliseconds
+#define MUX_BUFFER_SIZE      32768
+#define MUX_MAX_PAYLOAD      (1024 * 1024)
+
+enum mux_type {
+    MUX_EXEC = 1,  // payload is the command
+    MUX_STOP,
+    MUX_PING,
+    MUX_STDOUT,
+    MUX_STDERR,
+    MUX_EXIT,    // payload is the int32_t exit status
+    MUX_FAILED,  // payload is the error message
+};
+
+struct mux_header {
+    uint32_t type;
+    uint32_t length;
+};
+
+int mux_start_master(ConnPool pool, const char* host);
+
+bool mux_available(const char* host);
+
+int mux_exec(const char* host, const char* command, int* exit_status);
+
+int mux_stop(const char* host);
+
+#endif  // MUX_H
@@ -6,12 +6,19 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <time.h>
 
+#include "arena.h"
 #include "dynamic_str.h"
 
 #define PATH_OK    1
 #define PATH_ERROR 0
 
+#define PATH_INITIAL_DEPTH 16
+
+// under the home directory, where pws keeps its per host files
+#define PATH_CACHE_DIRECTORY ".cache/pws"
+
 #ifndef _WIN32
 #  define HOME_DIRECTORY (getenv("HOME"))
 #  define CURR_PLATFORM  PLATFORM_LINUX
@@ -24,25 +31,67 @@
 
 enum platform { PLATFORM_WINDOWS, PLATFORM_LINUX };
 
+/**
+ * What happens when a transfer finds its destination already there. Each
+ * thread has its own policy and starts out asking the user, threads that run
+ * without a user set one of the others.
+ */
+enum path_conflict {
+    PATH_CONFLICT_ASK,
+    PATH_CONFLICT_OVERWRITE,
+    PATH_CONFLICT_SKIP,
+    PATH_CONFLICT_NEWER  // overwrite only if the source is newer
+};
+
+/**
+ * components holds the offset in path where each component starts so going
+ * into or out of a directory never searches the string. Paths made with
+ * path_init_arena live in the arena and path_free does nothing for them.
+ *
+ * The local stat of the path is cached after the first query and dropped when
+ * the path changes or the file is created or removed through these functions.
+ */
 struct path {
     DynamicStr    path;
     enum platform platform;
+    int*          components;
+    int           depth;
+    int           capacity;
+    Arena         arena;
+    struct stat   cached_stat;
+    bool          stat_cached;
 };
 
 typedef struct path* Path;
 
 Path path_init(const char* path, enum platform platform);
 
+Path path_init_arena(Arena arena, const char* path, enum platform platform);
+
 Path path_duplicate(Path path);
 
+Path path_duplicate_arena(Arena arena, Path path);
+
 int path_prev(Path path);
 
-int path_go_into(Path path, char* s);
+int path_set(Path path, const char* str);
+
+int path_go_into(Path path, const char* s);
+
+const char* path_basename(Path path);
 
 char* path_get_curr(Path path);
 
 Path path_get_downloads_directory(void);
 
+Path path_get_cache_directory(bool create);
+
+const struct stat* path_stat(Path path);
+
+void path_set_stat(Path path, const struct stat* info);
+
+void path_invalidate(Path path);
+
 unsigned long long path_get_file_size(Path path);
 
 bool path_is_directory(Path path);
@@ -53,6 +102,12 @@ bool path_exists(Path path);
 
 DIR* path_opendir(Path path);
 
+void path_set_conflict(enum path_conflict policy);
+
+enum path_conflict path_get_conflict(void);
+
+bool path_keep_existing(Path path, time_t source_mtime);
+
 FILE* path_fopen(Path path, const char* modes);
 
 int path_rm_directory(Path path);
@@ -7,9 +7,16 @@
 #define PSSH_H
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
+#include "arena.h"
 #include "attr_list.h"
+#include "checksum.h"
+#include "conn_pool.h"
 #include "path.h"
+#include "tree_search.h"
 
 #define BUFFER_SIZE 256
 
@@ -21,6 +28,10 @@
 
 #define MAX_DIRECTORY_LENGTH 256
 
+#define DOWNLOAD_FILES_MAX_SIZE  (8 * CHUNK_SIZE)  // read in one go
+#define DOWNLOAD_FILES_MAX_COUNT 16
+#define DOWNLOAD_FILES_REQUESTS  (DOWNLOAD_FILES_MAX_SIZE / CHUNK_SIZE + 1)
+
 #define INITIAL_WORKING_DIRECTORY "/media/ssd"
 
 #define FILE_TYPE_REGULAR_STR   "regular"
@@ -35,6 +46,27 @@
 #define FILE_TYPE_SPECIAL_COLOR   "0;32"  // green
 #define FILE_TYPE_UNKNOWN_COLOR   "0;31"  // red
 
+/**
+ * Counts kept by the transfers of a thread, failed only counts files lost
+ * inside a directory transfer that carried on without them.
+ */
+struct transfer_stats {
+    uint64_t files;
+    uint64_t skipped;
+    uint64_t failed;
+    uint64_t bytes;
+};
+
+/**
+ * A remote file to download into the local directory, planned ahead of the
+ * download. attr is a copy of the listing without its strings.
+ */
+struct download_job {
+    Path                          remote;
+    Path                          local;
+    struct sftp_attributes_struct attr;
+};
+
 int verify_knownhost(ssh_session session);
 
 int pauthenticate(ssh_session session);
@@ -43,7 +75,7 @@ ssh_channel create_channel_with_open_session(ssh_session session);
 
 sftp_session create_sftp_session(ssh_session session);
 
-AttrList directory_ls_sftp(sftp_session session_sftp, Path path);
+AttrList directory_ls_sftp(sftp_session session_sftp, Path path, Arena arena);
 
 int handle_file_sftp(sftp_session session, Path pwd, AttrNode node);
 
@@ -56,19 +88,50 @@ int download_file(sftp_session    session,
                   Path            location,
                   sftp_attributes attr);
 
+int download_files(sftp_session         session,
+                   struct download_job* jobs,
+                   int                  count);
+
 int upload_directory(sftp_session session, Path from, Path to);
 
 int upload_file(sftp_session session, Path from, Path to_directory);
 
+void transfer_set_quiet(bool quiet);
+
+void transfer_set_bandwidth(uint64_t bytes_per_second);
+
+void transfer_throttle(size_t nbytes);
+
+void transfer_set_checksum(enum checksum_type type);
+
+void transfer_set_follow_links(bool follow);
+
+bool transfer_checks_begin(void);
+
+void transfer_checks_end(sftp_session session);
+
+void transfer_stats_reset(void);
+
+void transfer_stats_add(const struct transfer_stats* stats);
+
+struct transfer_stats transfer_stats_get(void);
+
 int request_interactive_shell(ssh_channel channel);
 
 int execute_command_on_shell(ssh_channel channel, char* command);
 
 int terminal_session(ssh_session session);
 
-int easy_navigate_mode_sftp(ssh_session session);
+int easy_navigate_mode_sftp(ConnPool pool);
+
+int search_mode_sftp(sftp_session sftp, TreeSearch search, Path pwd);
 
-int upload_mode(ssh_session session);
+int read_search_pattern(TreeSearch                 search,
+                        char*                      pattern,
+                        struct tree_search_result* results,
+                        int*                       count);
+
+int upload_mode(ConnPool pool);
 
 char* pfgets(char* string, int size);
 
@@ -76,6 +139,8 @@ char* get_file_type_str(int type);
 
 char* get_file_type_color(int type);
 
+void print_directory_eta(time_t now);
+
 char* get_readable_size(size_t size);
 
 #ifdef _WIN32
@@ -0,0 +1,48 @@
+#ifndef REMOTE_LS_H
+#define REMOTE_LS_H
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdbool.h>
+
+#include "attr_list.h"
+#include "path.h"
+
+/**
+ * Fast remote listing that runs a single `find -printf` over an exec channel
+ * instead of walking the directory with sftp_readdir. Every entry comes back
+ * as one NUL terminated record carrying its type, size, mtime and mode so the
+ * whole listing costs one round trip no matter how many entries there are.
+ */
+
+#define REMOTE_LS_OK    1
+#define REMOTE_LS_ERROR 0
+
+// max_depth value that lists the whole tree under the path
+#define REMOTE_LS_RECURSIVE -1
+
+#define REMOTE_LS_READ_SIZE 65536
+
+/**
+ * Called for every entry of a streamed listing. Takes ownership of attr.
+ */
+typedef int (*remote_ls_callback)(void* data, sftp_attributes attr);
+
+bool remote_ls_supported(ssh_session session);
+
+void remote_ls_set_enabled(bool enabled);
+
+AttrList remote_ls_exec(ssh_session session,
+                        Path        path,
+                        int         max_depth,
+                        Arena       arena);
+
+int remote_ls_each(ssh_session        session,
+                   Path               path,
+                   int                max_depth,
+                   remote_ls_callback callback,
+                   void*              data);
+
+char* remote_ls_quote(const char* str);
+
+#endif  // REMOTE_LS_H
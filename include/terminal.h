@@ -0,0 +1,26 @@
+#ifndef TERMINAL_H
+#define TERMINAL_H
+
+#include <libssh/libssh.h>
+
+/**
+ * Connects the local terminal to a remote shell. One thread waits in poll on
+ * the terminal and the ssh socket, so it takes no cpu while nothing is typed
+ * or printed and a key goes out as soon as it is read. The terminal is in raw
+ * mode for the session so the remote shell does the echoing and line editing,
+ * and window size changes are passed on as they happen.
+ */
+
+#define TERMINAL_OK    1
+#define TERMINAL_ERROR 0
+
+#define TERMINAL_BUFFER_SIZE     65536
+#define TERMINAL_DEFAULT_COLUMNS 80
+#define TERMINAL_DEFAULT_ROWS    24
+#define TERMINAL_QUIET_TIMEOUT   200  // ms without output that ends a command
+
+void terminal_get_size(int* columns, int* rows);
+
+int terminal_run(ssh_session session, ssh_channel channel);
+
+#endif  // TERMINAL_H
@@ -0,0 +1,66 @@
+#ifndef TRANSFER_PLAN_H
+#define TRANSFER_PLAN_H
+
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "conn_pool.h"
+#include "path.h"
+#include "pssh.h"
+
+/**
+ * A directory download planned by the size of its files instead of walked
+ * file by file. The whole tree is listed first, then the files are handed to
+ * one thread per connection the pool has free. Large files go out largest
+ * first so the longest ones are not left for the end, small ones go out
+ * DOWNLOAD_FILES_MAX_COUNT at a time with their reads sent together. A
+ * quarter of the threads take small files first and the others large ones
+ * first, so a tree of a few huge files and many tiny ones keeps both moving.
+ */
+
+#define TRANSFER_PLAN_OK    1
+#define TRANSFER_PLAN_ERROR 0
+
+#define TRANSFER_PLAN_INITIAL_FILES 64
+#define TRANSFER_PLAN_SMALL_SHARE   4  // one in this many threads
+
+struct transfer_plan {
+    struct download_job* files;  // large ones first, by size
+    int                  count;
+    int                  capacity;
+    int                  large;  // how many files are large
+    int                  next_large;
+    int                  next_small;
+    int                  unlisted;  // directories in the tree left out
+    ConnPool             pool;
+    enum path_conflict   policy;
+    pthread_mutex_t      lock;
+};
+
+typedef struct transfer_plan* TransferPlan;
+
+/**
+ * A thread helping the caller on a connection of its own.
+ */
+struct transfer_plan_helper {
+    TransferPlan          plan;
+    PoolConn              conn;
+    pthread_t             thread;
+    bool                  started;
+    bool                  small_first;
+    struct transfer_stats stats;
+};
+
+TransferPlan transfer_plan_init(ConnPool pool);
+
+int transfer_plan_scan(TransferPlan plan,
+                       sftp_session session,
+                       Path         dir,
+                       Path         location);
+
+int transfer_plan_run(TransferPlan plan, sftp_session session);
+
+int transfer_plan_free(TransferPlan plan);
+
+#endif  // TRANSFER_PLAN_H
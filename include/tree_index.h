@@ -0,0 +1,130 @@
+#ifndef TREE_INDEX_H
+#define TREE_INDEX_H
+
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "attr_list.h"
+#include "path.h"
+
+/**
+ * A persistent index of a host's remote tree kept in ~/.cache/pws/<host>.idx.
+ * The file is memory mapped on open and only checked, not parsed, so it is
+ * usable right away even when it is large. Directories listed during a run are kept in an overlay and
+ * merged into a new file on save.
+ *
+ * An indexed directory is fresh as long as its mtime on the remote matches the
+ * one stored with it. A directory's mtime only changes when entries are added,
+ * removed or renamed so size changes of existing files are not picked up until
+ * the directory itself changes.
+ *
+ * File layout, all integers in host byte order:
+ *   header | dirs[dir_count] | entries[entry_count] | strings[strings_size]
+ * dirs are sorted by path and the entries of a directory are contiguous.
+ */
+
+#define TREE_INDEX_OK    1
+#define TREE_INDEX_ERROR 0
+
+#define TREE_INDEX_MAGIC     "PWSIDX1"
+#define TREE_INDEX_VERSION   1
+#define TREE_INDEX_EXTENSION ".idx"
+
+#define TREE_INDEX_INITIAL_CAPACITY 64
+
+struct tree_index_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t dir_count;
+    uint64_t entry_count;
+    uint64_t strings_size;
+};
+
+struct tree_index_dir {
+    uint64_t path;  // offset in the string table
+    uint64_t mtime;
+    uint64_t first;
+    uint64_t count;
+};
+
+struct tree_index_entry {
+    uint64_t name;  // offset in the string table of its directory
+    uint64_t size;
+    uint32_t mtime;
+    uint32_t permissions;
+    uint8_t  type;
+    uint8_t  padding[7];
+};
+
+/**
+ * A directory read either from the mapped file or from the overlay.
+ */
+struct tree_index_view {
+    const char*                    path;
+    uint64_t                       mtime;
+    const struct tree_index_entry* entries;
+    uint64_t                       count;
+    const char*                    strings;
+};
+
+/**
+ * A directory refreshed during this run, owns its entries and names.
+ */
+struct tree_index_overlay {
+    char*                    path;
+    uint64_t                 mtime;
+    struct tree_index_entry* entries;
+    uint64_t                 count;
+    char*                    strings;
+};
+
+struct tree_index {
+    char*                       file;
+    void*                       map;
+    size_t                      map_size;
+    struct tree_index_header*   header;
+    struct tree_index_dir*      dirs;
+    struct tree_index_entry*    entries;
+    const char*                 strings;
+    struct tree_index_overlay** overlay;  // open addressing hash table
+    int                         overlay_size;
+    int                         overlay_capacity;
+    bool                        dirty;  // updated since the last save
+    pthread_mutex_t             lock;
+};
+
+typedef struct tree_index* TreeIndex;
+
+/**
+ * Called for every indexed directory by tree_index_for_each.
+ */
+typedef int (*tree_index_callback)(void*                         data,
+                                   const struct tree_index_view* view);
+
+TreeIndex tree_index_open(const char* host);
+
+bool tree_index_find(TreeIndex               index,
+                     const char*             dir,
+                     struct tree_index_view* view);
+
+AttrList tree_index_lookup(TreeIndex index, const char* dir, uint64_t mtime);
+
+int tree_index_update(TreeIndex   index,
+                      const char* dir,
+                      uint64_t    mtime,
+                      AttrList    list);
+
+int tree_index_for_each(TreeIndex           index,
+                        tree_index_callback callback,
+                        void*               data);
+
+int tree_index_refresh(TreeIndex index, sftp_session session, Path root);
+
+int tree_index_save(TreeIndex index);
+
+int tree_index_free(TreeIndex index);
+
+#endif  // TREE_INDEX_H
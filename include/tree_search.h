@@ -0,0 +1,58 @@
+#ifndef TREE_SEARCH_H
+#define TREE_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tree_index.h"
+
+/**
+ * Search over every path in a tree index. The full paths are packed into one
+ * NUL separated buffer (plus a lower case copy for case insensitive matching)
+ * so a substring search is a single memmem over the whole buffer, which libc
+ * does with vector instructions. When the substring search finds too little a
+ * fuzzy subsequence match is used as well. Typing more characters only
+ * searches the previous matches again.
+ */
+
+#define TREE_SEARCH_OK    1
+#define TREE_SEARCH_ERROR 0
+
+#define TREE_SEARCH_MAX_RESULTS 20
+#define TREE_SEARCH_MAX_PATTERN 256
+
+#define TREE_SEARCH_INITIAL_CAPACITY 4096
+
+struct tree_search_result {
+    size_t      index;
+    int         score;
+    const char* path;
+    uint8_t     type;
+};
+
+struct tree_search {
+    char*     paths;
+    char*     lower;
+    size_t    paths_size;
+    size_t    paths_capacity;
+    uint64_t* offsets;  // start of every path, one extra for the end
+    uint8_t*  types;
+    size_t    count;
+    size_t    capacity;
+    size_t*   candidates;  // substring matches of the last pattern
+    size_t    candidate_count;
+    char      last_pattern[TREE_SEARCH_MAX_PATTERN];
+};
+
+typedef struct tree_search* TreeSearch;
+
+TreeSearch tree_search_build(TreeIndex index);
+
+int tree_search_run(TreeSearch                 search,
+                    const char*                pattern,
+                    struct tree_search_result* results,
+                    int                        max_results);
+
+int tree_search_free(TreeSearch search);
+
+#endif  // TREE_SEARCH_H
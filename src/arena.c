@@ -0,0 +1,183 @@
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_key_t  arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static struct arena_block* arena_new_block(Arena arena, size_t size);
+static void                arena_make_key(void);
+static void                arena_thread_exit(void* data);
+
+Arena arena_init(size_t block_size) {
+    Arena arena;
+
+    arena = (Arena)malloc(sizeof(struct arena));
+    if(arena == NULL) {
+        fprintf(stderr, "failed to allocate memory for the arena\n");
+        return NULL;
+    }
+
+    arena->block      = NULL;
+    arena->block_size = (block_size == 0) ? ARENA_BLOCK_SIZE : block_size;
+
+    return arena;
+}
+
+/**
+ * Returns size bytes aligned to ARENA_ALIGNMENT. The memory is not zeroed.
+ */
+void* arena_alloc(Arena arena, size_t size) {
+    struct arena_block* block;
+    size_t              start;
+
+    if(arena == NULL) {
+        fprintf(stderr, "arena cannot be null\n");
+        return NULL;
+    }
+
+    block = arena->block;
+    if(block != NULL) {
+        start = (block->used + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+        if(start + size <= block->size) {
+            block->used = start + size;
+            return block->data + start;
+        }
+    }
+
+    block = arena_new_block(arena, size);
+    if(block == NULL) return NULL;
+
+    block->used = size;
+    return block->data;
+}
+
+char* arena_strdup(Arena arena, const char* str) {
+    size_t len = strlen(str) + 1;
+    char*  copy;
+
+    copy = (char*)arena_alloc(arena, len);
+    if(copy != NULL) memcpy(copy, str, len);
+
+    return copy;
+}
+
+struct arena_mark arena_mark(Arena arena) {
+    struct arena_mark mark;
+
+    mark.block = arena->block;
+    mark.used  = (arena->block == NULL) ? 0 : arena->block->used;
+
+    return mark;
+}
+
+/**
+ * Releases everything allocated since mark was taken.
+ */
+int arena_rewind(Arena arena, struct arena_mark mark) {
+    struct arena_block* prev;
+
+    if(arena == NULL) {
+        fprintf(stderr, "arena cannot be null\n");
+        return ARENA_ERROR;
+    }
+
+    while(arena->block != mark.block) {
+        if(arena->block == NULL) {
+            fprintf(stderr, "the mark does not belong to this arena\n");
+            return ARENA_ERROR;
+        }
+        prev = arena->block->prev;
+        free(arena->block);
+        arena->block = prev;
+    }
+
+    if(arena->block != NULL) arena->block->used = mark.used;
+
+    return ARENA_OK;
+}
+
+/**
+ * Releases everything but keeps the first block for the next use.
+ */
+int arena_reset(Arena arena) {
+    struct arena_mark mark;
+
+    if(arena == NULL) {
+        fprintf(stderr, "arena cannot be null\n");
+        return ARENA_ERROR;
+    }
+
+    mark.block = arena->block;
+    while(mark.block != NULL && mark.block->prev != NULL) {
+        mark.block = mark.block->prev;
+    }
+    mark.used = 0;
+
+    return arena_rewind(arena, mark);
+}
+
+/**
+ * The calling thread's own arena, created on first use and freed when the
+ * thread exits.
+ */
+Arena arena_thread(void) {
+    Arena arena;
+
+    pthread_once(&arena_key_once, arena_make_key);
+
+    arena = (Arena)pthread_getspecific(arena_key);
+    if(arena == NULL) {
+        arena = arena_init(ARENA_BLOCK_SIZE);
+        if(arena == NULL) return NULL;
+        pthread_setspecific(arena_key, arena);
+    }
+
+    return arena;
+}
+
+int arena_free(Arena arena) {
+    struct arena_block* prev;
+
+    if(arena == NULL) return ARENA_ERROR;
+
+    while(arena->block != NULL) {
+        prev = arena->block->prev;
+        free(arena->block);
+        arena->block = prev;
+    }
+    free(arena);
+
+    return ARENA_OK;
+}
+
+static struct arena_block* arena_new_block(Arena arena, size_t size) {
+    struct arena_block* block;
+    size_t              block_size = arena->block_size;
+
+    // oversized allocations get a block of their own
+    if(size > block_size) block_size = size;
+
+    block =
+        (struct arena_block*)malloc(sizeof(struct arena_block) + block_size);
+    if(block == NULL) {
+        fprintf(stderr, "failed to allocate a new arena block\n");
+        return NULL;
+    }
+
+    block->prev  = arena->block;
+    block->size  = block_size;
+    block->used  = 0;
+    arena->block = block;
+
+    return block;
+}
+
+static void arena_make_key(void) {
+    pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+static void arena_thread_exit(void* data) { arena_free((Arena)data); }
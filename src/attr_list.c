@@ -6,15 +6,25 @@
 
 #include "pssh.h"
 
-AttrList attr_list_initialize(void) {
-    AttrList list = (AttrList)malloc(sizeof(struct attributes_list));
+AttrList attr_list_initialize(void) { return attr_list_initialize_arena(NULL); }
+
+AttrList attr_list_initialize_arena(Arena arena) {
+    AttrList list;
+
+    if(arena != NULL) {
+        list = (AttrList)arena_alloc(arena, sizeof(struct attributes_list));
+    } else {
+        list = (AttrList)malloc(sizeof(struct attributes_list));
+    }
     if(list == NULL) {
         fprintf(stderr, "allocating memory to a list of attributes failed\n");
         return NULL;
     }
 
-    list->head = NULL;
-    list->size = 0;
+    list->head  = NULL;
+    list->tail  = NULL;
+    list->size  = 0;
+    list->arena = arena;
 
     return list;
 }
@@ -25,16 +35,8 @@ int attr_list_add(struct attributes_list* list, sftp_attributes attr) {
         return ATTR_LIST_ERROR;
     }
 
-    struct attributes_node* temp = list->head;
-
-    for(int i = 0; i < list->size - 1; i++) {
-        temp = temp->next;
-        if(i != list->size - 1 && temp == NULL) {
-            fprintf(stderr,
-                    "Found NULL in the list before reaching the size\n");
-            return ATTR_LIST_ERROR;
-        }
-    }
+    // append at the tail so building a listing stays linear in its size
+    struct attributes_node* temp = list->tail;
 
     if(temp != NULL && temp->next != NULL) {
         fprintf(
@@ -43,8 +45,14 @@ int attr_list_add(struct attributes_list* list, sftp_attributes attr) {
         return ATTR_LIST_ERROR;
     }
 
-    struct attributes_node* new =
-        (struct attributes_node*)malloc(sizeof(struct attributes_node));
+    struct attributes_node* new;
+    if(list->arena != NULL) {
+        new = (struct attributes_node*)arena_alloc(
+            list->arena,
+            sizeof(struct attributes_node));
+    } else {
+        new = (struct attributes_node*)malloc(sizeof(struct attributes_node));
+    }
     if(new == NULL) {
         fprintf(stderr, "could not allocate memory for the node\n");
         return ATTR_LIST_ERROR;
@@ -59,6 +67,7 @@ int attr_list_add(struct attributes_list* list, sftp_attributes attr) {
         list->head = new;
         list->size++;
     }
+    list->tail = new;
 
     return ATTR_LIST_OK;
 }
@@ -139,9 +148,9 @@ int attr_list_free(AttrList list) {
         perv = temp;
         temp = temp->next;
         sftp_attributes_free(perv->data);
-        free(perv);
+        if(list->arena == NULL) free(perv);
     }
 
-    free(list);
+    if(list->arena == NULL) free(list);
     return ATTR_LIST_OK;
 }
@@ -0,0 +1,718 @@
+#include "batch.h"
+
+#include <fcntl.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "conn_pool.h"
+#include "path.h"
+#include "pssh.h"
+#include "transfer_plan.h"
+
+/**
+ * How an operation is written and how many arguments it takes.
+ */
+struct batch_syntax {
+    const char*     name;
+    enum batch_type type;
+    int             args;
+};
+
+static const struct batch_syntax batch_syntax[] = {
+    {"get",   BATCH_GET,   2},
+    {"put",   BATCH_PUT,   2},
+    {"sync",  BATCH_SYNC,  2},
+    {"mkdir", BATCH_MKDIR, 1},
+    {"rm",    BATCH_RM,    1},
+};
+
+#define BATCH_SYNTAX_COUNT (sizeof(batch_syntax) / sizeof(batch_syntax[0]))
+
+static const char* batch_policies[] = {"ask", "overwrite", "skip", "newer"};
+
+static char*            batch_join(const char*   dir,
+                                   enum platform dir_platform,
+                                   const char*   source,
+                                   enum platform source_platform);
+static int              batch_split(char* line, char** words, int max);
+static bool             batch_overlaps(const char* a, const char* b);
+static struct batch_op* batch_next(Batch batch);
+static void*            batch_worker(void* data);
+static void             batch_execute(Batch batch, struct batch_op* op);
+static int              batch_get(Batch            batch,
+                                  sftp_session     session,
+                                  struct batch_op* op);
+static int              batch_put(sftp_session session, struct batch_op* op);
+static int              batch_mkdir(sftp_session session, const char* dir);
+static int              batch_rm(sftp_session session, const char* path);
+static double           batch_now(void);
+
+Batch batch_init(enum path_conflict policy) {
+    Batch batch;
+
+    batch = (Batch)calloc(1, sizeof(struct batch));
+    if(batch == NULL) {
+        fprintf(stderr, "failed to allocate memory for the batch\n");
+        return NULL;
+    }
+
+    batch->ops = (struct batch_op*)malloc(sizeof(struct batch_op) *
+                                          BATCH_INITIAL_OPS);
+    if(batch->ops == NULL) {
+        fprintf(stderr, "failed to allocate memory for the batch\n");
+        free(batch);
+        return NULL;
+    }
+
+    batch->capacity = BATCH_INITIAL_OPS;
+    batch->policy   = policy;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->changed, NULL);
+
+    return batch;
+}
+
+/**
+ * Reads a conflict policy given by name, asking is not one a batch can use.
+ */
+int batch_parse_policy(const char* name, enum path_conflict* policy) {
+    for(int i = PATH_CONFLICT_OVERWRITE; i <= PATH_CONFLICT_NEWER; i++) {
+        if(strcmp(name, batch_policies[i]) == 0) {
+            *policy = (enum path_conflict)i;
+            return BATCH_OK;
+        }
+    }
+
+    fprintf(stderr,
+            "unknown conflict policy %s, use overwrite, skip or newer\n",
+            name);
+    return BATCH_ERROR;
+}
+
+/**
+ * Adds the operation named by words[0] with the arguments after it.
+ */
+int batch_add(Batch batch, char** words, int count, int line) {
+    const struct batch_syntax* syntax = NULL;
+    struct batch_op*           op;
+
+    if(batch == NULL || words == NULL || count < 1) return BATCH_ERROR;
+
+    for(size_t i = 0; i < BATCH_SYNTAX_COUNT; i++) {
+        if(strcmp(words[0], batch_syntax[i].name) == 0) {
+            syntax = &batch_syntax[i];
+            break;
+        }
+    }
+    if(syntax == NULL) {
+        fprintf(stderr, "line %d: unknown operation %s\n", line, words[0]);
+        return BATCH_ERROR;
+    }
+    if(count - 1 != syntax->args) {
+        fprintf(stderr,
+                "line %d: %s takes %d arguments\n",
+                line,
+                syntax->name,
+                syntax->args);
+        return BATCH_ERROR;
+    }
+
+    if(batch->count == batch->capacity) {
+        struct batch_op* temp = (struct batch_op*)realloc(
+            batch->ops,
+            sizeof(struct batch_op) * batch->capacity * 2);
+        if(temp == NULL) {
+            fprintf(stderr, "failed to grow the batch\n");
+            return BATCH_ERROR;
+        }
+        batch->ops       = temp;
+        batch->capacity *= 2;
+    }
+
+    op = &batch->ops[batch->count];
+    memset(op, 0, sizeof(struct batch_op));
+    op->type  = syntax->type;
+    op->line  = line;
+    op->state = BATCH_PENDING;
+    for(int i = 0; i < syntax->args; i++) {
+        op->args[i] = strdup(words[i + 1]);
+        if(op->args[i] == NULL) {
+            fprintf(stderr, "failed to allocate memory for the operation\n");
+            for(int j = 0; j < i; j++) free(op->args[j]);
+            return BATCH_ERROR;
+        }
+    }
+
+    switch(op->type) {
+        case BATCH_GET:
+            op->remote = strdup(op->args[0]);
+            op->local  = batch_join(op->args[1],
+                                   CURR_PLATFORM,
+                                   op->args[0],
+                                   PLATFORM_LINUX);
+            break;
+        case BATCH_PUT:
+        case BATCH_SYNC:
+            op->local  = strdup(op->args[0]);
+            op->remote = batch_join(op->args[1],
+                                    PLATFORM_LINUX,
+                                    op->args[0],
+                                    CURR_PLATFORM);
+            break;
+        case BATCH_MKDIR:
+        case BATCH_RM:    op->remote = strdup(op->args[0]); break;
+    }
+
+    batch->count++;
+    return BATCH_OK;
+}
+
+/**
+ * Adds the operations written out on the command line one after the other.
+ */
+int batch_parse_args(Batch batch, int argc, char** argv) {
+    int i = 0;
+
+    if(batch == NULL) return BATCH_ERROR;
+
+    while(i < argc) {
+        int count = 1;
+
+        for(size_t j = 0; j < BATCH_SYNTAX_COUNT; j++) {
+            if(strcmp(argv[i], batch_syntax[j].name) == 0) {
+                count += batch_syntax[j].args;
+                break;
+            }
+        }
+        if(i + count > argc) count = argc - i;
+
+        if(batch_add(batch, argv + i, count, 0) != BATCH_OK) {
+            return BATCH_ERROR;
+        }
+        i += count;
+    }
+
+    return BATCH_OK;
+}
+
+int batch_load(Batch batch, const char* manifest) {
+    char  line[BATCH_LINE_SIZE];
+    char* words[BATCH_MAX_ARGS + 2];
+    FILE* fp;
+    int   count;
+    int   number = 0;
+    int   rc     = BATCH_OK;
+
+    if(batch == NULL || manifest == NULL) return BATCH_ERROR;
+
+    fp = fopen(manifest, "r");
+    if(fp == NULL) {
+        fprintf(stderr, "failed to open the manifest %s\n", manifest);
+        return BATCH_ERROR;
+    }
+
+    while(rc == BATCH_OK && fgets(line, BATCH_LINE_SIZE, fp) != NULL) {
+        number++;
+        count = batch_split(line, words, BATCH_MAX_ARGS + 2);
+        if(count == 0 || words[0][0] == '#') continue;
+
+        if(count < 0) {
+            fprintf(stderr, "line %d: unterminated quote\n", number);
+            rc = BATCH_ERROR;
+        } else {
+            rc = batch_add(batch, words, count, number);
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+/**
+ * Runs every operation on up to jobs connections of pool and returns once all
+ * of them are done.
+ */
+int batch_run(Batch batch, ConnPool pool, int jobs) {
+    pthread_t* workers;
+    int        started = 0;
+
+    if(batch == NULL || pool == NULL) return BATCH_ERROR;
+
+    if(jobs > pool->size) jobs = pool->size;
+    if(jobs > batch->count) jobs = batch->count;
+    if(jobs < 1) return BATCH_OK;
+
+    workers = (pthread_t*)malloc(sizeof(pthread_t) * jobs);
+    if(workers == NULL) {
+        fprintf(stderr, "failed to allocate memory for the workers\n");
+        return BATCH_ERROR;
+    }
+
+    batch->pool = pool;
+    for(int i = 0; i < jobs; i++) {
+        if(pthread_create(&workers[started], NULL, batch_worker, batch) != 0) {
+            fprintf(stderr, "failed to start a worker\n");
+            continue;
+        }
+        started++;
+    }
+    for(int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    return (started > 0) ? BATCH_OK : BATCH_ERROR;
+}
+
+/**
+ * Writes one line of JSON for every operation in the order they were given.
+ */
+int batch_report(Batch batch, FILE* out) {
+    struct batch_op* op;
+    const char*      status;
+
+    if(batch == NULL || out == NULL) return BATCH_ERROR;
+
+    for(int i = 0; i < batch->count; i++) {
+        op = &batch->ops[i];
+
+        if(op->state != BATCH_DONE) {
+            status = "not run";
+        } else if(!op->ok) {
+            status = "failed";
+        } else if(op->stats.files == 0 && op->stats.skipped > 0) {
+            status = "skipped";
+        } else {
+            status = "ok";
+        }
+
+        fprintf(out, "{\"line\":%d,\"op\":", op->line);
+        for(size_t j = 0; j < BATCH_SYNTAX_COUNT; j++) {
+            if(batch_syntax[j].type != op->type) continue;
+
+            batch_json_string(out, batch_syntax[j].name);
+            fprintf(out, ",\"args\":[");
+            for(int k = 0; k < batch_syntax[j].args; k++) {
+                if(k > 0) fputc(',', out);
+                batch_json_string(out, op->args[k]);
+            }
+            fputc(']', out);
+        }
+        fprintf(out,
+                ",\"status\":\"%s\",\"files\":%llu,\"skipped\":%llu,"
+                "\"failed\":%llu,\"bytes\":%llu,\"seconds\":%.3f}\n",
+                status,
+                (unsigned long long)op->stats.files,
+                (unsigned long long)op->stats.skipped,
+                (unsigned long long)op->stats.failed,
+                (unsigned long long)op->stats.bytes,
+                op->seconds);
+    }
+    fflush(out);
+
+    return BATCH_OK;
+}
+
+bool batch_succeeded(Batch batch) {
+    if(batch == NULL) return false;
+
+    for(int i = 0; i < batch->count; i++) {
+        if(batch->ops[i].state != BATCH_DONE || !batch->ops[i].ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int batch_free(Batch batch) {
+    if(batch == NULL) return BATCH_ERROR;
+
+    for(int i = 0; i < batch->count; i++) {
+        for(int j = 0; j < BATCH_MAX_ARGS; j++) free(batch->ops[i].args[j]);
+        free(batch->ops[i].remote);
+        free(batch->ops[i].local);
+    }
+
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->changed);
+    free(batch->ops);
+    free(batch);
+
+    return BATCH_OK;
+}
+
+/**
+ * Writes str as a quoted JSON string, for the reports of batch and fleet runs.
+ */
+void batch_json_string(FILE* out, const char* str) {
+    fputc('"', out);
+    for(const unsigned char* p = (const unsigned char*)str; *p != '\0'; p++) {
+        if(*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if(*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * Where source ends up when it is copied into dir.
+ */
+static char* batch_join(const char*   dir,
+                        enum platform dir_platform,
+                        const char*   source,
+                        enum platform source_platform) {
+    Path  path;
+    Path  target;
+    char* joined;
+
+    path   = path_init(source, source_platform);
+    target = path_init(dir, dir_platform);
+    if(path == NULL || target == NULL) {
+        if(path != NULL) path_free(path);
+        if(target != NULL) path_free(target);
+        return NULL;
+    }
+
+    path_go_into(target, path_basename(path));
+    joined = strdup(target->path->str);
+
+    path_free(path);
+    path_free(target);
+    return joined;
+}
+
+/**
+ * Splits line into at most max words in place. Returns how many there are or
+ * -1 if a quote is not closed.
+ */
+static int batch_split(char* line, char** words, int max) {
+    char* p     = line;
+    int   count = 0;
+
+    while(count < max) {
+        while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+        if(*p == '\0') break;
+
+        if(*p == '"') {
+            words[count++] = ++p;
+            p              = strchr(p, '"');
+            if(p == NULL) return -1;
+        } else {
+            words[count++] = p;
+            while(*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n' &&
+                  *p != '\r') {
+                p++;
+            }
+            if(*p == '\0') break;
+        }
+        *p++ = '\0';
+    }
+
+    // anything left over makes it too many for every operation
+    while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return (*p == '\0') ? count : max + 1;
+}
+
+/**
+ * True if one of the paths is the other or inside it.
+ */
+static bool batch_overlaps(const char* a, const char* b) {
+    size_t a_len;
+    size_t b_len;
+
+    if(a == NULL || b == NULL) return false;
+
+    a_len = strlen(a);
+    b_len = strlen(b);
+    if(a_len > b_len) {
+        const char* temp = a;
+        size_t      len  = a_len;
+
+        a     = b;
+        a_len = b_len;
+        b     = temp;
+        b_len = len;
+    }
+
+    if(strncmp(a, b, a_len) != 0) return false;
+
+    return a_len == b_len || b[a_len] == '/' || b[a_len] == '\\' ||
+           (a_len > 0 && (a[a_len - 1] == '/' || a[a_len - 1] == '\\'));
+}
+
+/**
+ * The first pending operation that overlaps none of the unfinished ones
+ * before it, NULL if none can start yet. The batch lock has to be held.
+ */
+static struct batch_op* batch_next(Batch batch) {
+    int end;
+
+    while(batch->first_open < batch->count &&
+          batch->ops[batch->first_open].state == BATCH_DONE) {
+        batch->first_open++;
+    }
+
+    end = batch->first_open + BATCH_WINDOW;
+    if(end > batch->count) end = batch->count;
+
+    for(int i = batch->first_open; i < end; i++) {
+        struct batch_op* op    = &batch->ops[i];
+        bool             ready = true;
+
+        if(op->state != BATCH_PENDING) continue;
+
+        for(int j = batch->first_open; j < i && ready; j++) {
+            struct batch_op* earlier = &batch->ops[j];
+
+            if(earlier->state == BATCH_DONE) continue;
+            if(batch_overlaps(earlier->remote, op->remote) ||
+               batch_overlaps(earlier->local, op->local)) {
+                ready = false;
+            }
+        }
+
+        if(ready) return op;
+    }
+
+    return NULL;
+}
+
+static void* batch_worker(void* data) {
+    Batch            batch = (Batch)data;
+    struct batch_op* op;
+
+    // nobody is there to answer a prompt or read a progress line
+    transfer_set_quiet(true);
+
+    pthread_mutex_lock(&batch->lock);
+    while(batch->first_open < batch->count) {
+        op = batch_next(batch);
+        if(op == NULL) {
+            if(batch->first_open < batch->count) {
+                pthread_cond_wait(&batch->changed, &batch->lock);
+            }
+            continue;
+        }
+
+        op->state = BATCH_RUNNING;
+        pthread_mutex_unlock(&batch->lock);
+
+        batch_execute(batch, op);
+
+        pthread_mutex_lock(&batch->lock);
+        op->state = BATCH_DONE;
+        pthread_cond_broadcast(&batch->changed);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    return NULL;
+}
+
+static void batch_execute(Batch batch, struct batch_op* op) {
+    PoolConn     conn;
+    sftp_session session;
+    double       start = batch_now();
+    int          rc    = SSH_ERROR;
+
+    transfer_stats_reset();
+    path_set_conflict((op->type == BATCH_SYNC) ? PATH_CONFLICT_NEWER
+                                               : batch->policy);
+
+    conn    = conn_pool_acquire(batch->pool);
+    session = conn_pool_sftp(conn);
+    if(session != NULL) {
+        switch(op->type) {
+            case BATCH_GET:   rc = batch_get(batch, session, op); break;
+            case BATCH_PUT:
+            case BATCH_SYNC:  rc = batch_put(session, op); break;
+            case BATCH_MKDIR: rc = batch_mkdir(session, op->args[0]); break;
+            case BATCH_RM:    rc = batch_rm(session, op->args[0]); break;
+        }
+    }
+    conn_pool_release(batch->pool, conn);
+
+    op->stats   = transfer_stats_get();
+    op->ok      = rc == SSH_OK && op->stats.failed == 0;
+    op->seconds = batch_now() - start;
+}
+
+/**
+ * Directories are planned by the size of their files and downloaded with the
+ * connections the other operations leave free.
+ */
+static int batch_get(Batch batch, sftp_session session, struct batch_op* op) {
+    sftp_attributes attr;
+    TransferPlan    plan;
+    Path            remote;
+    Path            local;
+    int             rc = SSH_ERROR;
+
+    attr = sftp_stat(session, op->args[0]);
+    if(attr == NULL) {
+        fprintf(stderr, "%s could not be found\n", op->args[0]);
+        return SSH_ERROR;
+    }
+
+    remote = path_init(op->args[0], PLATFORM_LINUX);
+    local  = path_init(op->args[1], CURR_PLATFORM);
+    if(remote != NULL && local != NULL) {
+        if(!path_exists(local) && path_create_directory(local) != 0) {
+            fprintf(stderr, "%s could not be created\n", op->args[1]);
+        } else if(attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+            plan = transfer_plan_init(batch->pool);
+            if(plan != NULL &&
+               transfer_plan_scan(plan, session, remote, local) ==
+                   TRANSFER_PLAN_OK &&
+               transfer_plan_run(plan, conn_pool_current(session)) ==
+                   TRANSFER_PLAN_OK) {
+                rc = SSH_OK;
+            }
+            transfer_plan_free(plan);
+        } else if(attr->type == SSH_FILEXFER_TYPE_REGULAR) {
+            rc = download_file(session, remote, local, attr);
+        } else {
+            fprintf(stderr, "download not supported for %s\n", op->args[0]);
+        }
+    }
+
+    if(remote != NULL) path_free(remote);
+    if(local != NULL) path_free(local);
+    sftp_attributes_free(attr);
+    return rc;
+}
+
+static int batch_put(sftp_session session, struct batch_op* op) {
+    Path local;
+    Path remote;
+    int  rc = SSH_ERROR;
+
+    local  = path_init(op->args[0], CURR_PLATFORM);
+    remote = path_init(op->args[1], PLATFORM_LINUX);
+    if(local != NULL && remote != NULL) {
+        if(path_is_directory(local)) {
+            rc = upload_directory(session, local, remote);
+        } else if(path_is_file(local)) {
+            rc = upload_file(session, local, remote);
+        } else {
+            fprintf(stderr, "%s could not be found\n", op->args[0]);
+        }
+    }
+
+    if(local != NULL) path_free(local);
+    if(remote != NULL) path_free(remote);
+    return rc;
+}
+
+/**
+ * Creates dir and every missing directory above it.
+ */
+static int batch_mkdir(sftp_session session, const char* dir) {
+    sftp_attributes attr;
+    char*           partial;
+    char            end;
+    int             rc = SSH_OK;
+
+    // the walk below starts past the first character
+    if(dir[0] == '\0') {
+        fprintf(stderr, "cannot create a directory with an empty name\n");
+        return SSH_ERROR;
+    }
+
+    partial = strdup(dir);
+    if(partial == NULL) {
+        fprintf(stderr, "failed to allocate memory for the directory\n");
+        return SSH_ERROR;
+    }
+
+    for(char* p = partial + 1; rc == SSH_OK; p++) {
+        if(*p != '/' && *p != '\0') continue;
+
+        end = *p;
+        *p  = '\0';
+        if(sftp_mkdir(session, partial, S_IRWXU | S_IRWXG) != SSH_OK) {
+            attr = sftp_stat(session, partial);
+            if(attr == NULL || attr->type != SSH_FILEXFER_TYPE_DIRECTORY) {
+                fprintf(stderr, "Failed to create %s\n", partial);
+                rc = SSH_ERROR;
+            }
+            if(attr != NULL) sftp_attributes_free(attr);
+        }
+        *p = end;
+
+        if(end == '\0') break;
+    }
+
+    free(partial);
+    return rc;
+}
+
+/**
+ * Removes path, and everything in it if it is a directory. Links are removed
+ * and not followed.
+ */
+static int batch_rm(sftp_session session, const char* path) {
+    sftp_attributes attr;
+    sftp_dir        dir;
+    Path            child;
+    int             rc = SSH_OK;
+
+    attr = sftp_lstat(session, path);
+    if(attr == NULL) {
+        fprintf(stderr, "%s could not be found\n", path);
+        return SSH_ERROR;
+    }
+
+    if(attr->type != SSH_FILEXFER_TYPE_DIRECTORY) {
+        sftp_attributes_free(attr);
+        if(sftp_unlink(session, path) != SSH_OK) {
+            fprintf(stderr, "Failed to remove %s\n", path);
+            return SSH_ERROR;
+        }
+        return SSH_OK;
+    }
+    sftp_attributes_free(attr);
+
+    dir   = sftp_opendir(session, path);
+    child = path_init(path, PLATFORM_LINUX);
+    if(dir == NULL || child == NULL) {
+        fprintf(stderr, "Failed to open directory %s\n", path);
+        if(dir != NULL) sftp_closedir(dir);
+        if(child != NULL) path_free(child);
+        return SSH_ERROR;
+    }
+
+    while(rc == SSH_OK && (attr = sftp_readdir(session, dir)) != NULL) {
+        if(strcmp(attr->name, ".") != 0 && strcmp(attr->name, "..") != 0) {
+            path_go_into(child, attr->name);
+            rc = batch_rm(session, child->path->str);
+            path_prev(child);
+        }
+        sftp_attributes_free(attr);
+    }
+    sftp_closedir(dir);
+    path_free(child);
+
+    if(rc == SSH_OK && sftp_rmdir(session, path) != SSH_OK) {
+        fprintf(stderr, "Failed to remove %s\n", path);
+        rc = SSH_ERROR;
+    }
+
+    return rc;
+}
+
+static double batch_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,346 @@
+#include "checksum.h"
+
+#include <libssh/libssh.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exec_group.h"
+#include "remote_ls.h"
+
+/**
+ * The names taken on the command line and the remote tool printing the same
+ * hash, in the order of enum checksum_type.
+ */
+static const struct {
+    const char* name;
+    const char* command;
+    const EVP_MD* (*digest)(void);
+} checksum_types[] = {
+    {"none",   NULL,        NULL      },
+    {"md5",    "md5sum",    EVP_md5   },
+    {"sha1",   "sha1sum",   EVP_sha1  },
+    {"sha256", "sha256sum", EVP_sha256},
+    {"sha512", "sha512sum", EVP_sha512},
+};
+
+#define CHECKSUM_TYPES (int)(sizeof(checksum_types) / sizeof(checksum_types[0]))
+
+static char* checksum_command(enum checksum_type type, const char* path);
+static int   checksum_check(struct checksum_entry* entry, struct exec_job* job);
+
+/**
+ * Returns CHECKSUM_OK and sets type if name is one of the hashes.
+ */
+int checksum_parse(const char* name, enum checksum_type* type) {
+    for(int i = 0; i < CHECKSUM_TYPES; i++) {
+        if(strcmp(name, checksum_types[i].name) == 0) {
+            *type = (enum checksum_type)i;
+            return CHECKSUM_OK;
+        }
+    }
+
+    fprintf(stderr, "unknown checksum %s, use", name);
+    for(int i = 0; i < CHECKSUM_TYPES; i++) {
+        fprintf(stderr, " %s", checksum_types[i].name);
+    }
+    fputc('\n', stderr);
+    return CHECKSUM_ERROR;
+}
+
+const char* checksum_name(enum checksum_type type) {
+    if(type < CHECKSUM_NONE || type >= CHECKSUM_TYPES) return NULL;
+
+    return checksum_types[type].name;
+}
+
+Checksum checksum_init(enum checksum_type type) {
+    Checksum sum;
+
+    if(type <= CHECKSUM_NONE || type >= CHECKSUM_TYPES) {
+        fprintf(stderr, "cannot hash with checksum %d\n", type);
+        return NULL;
+    }
+
+    sum = (Checksum)malloc(sizeof(struct checksum));
+    if(sum == NULL) {
+        fprintf(stderr, "failed to allocate memory for the checksum\n");
+        return NULL;
+    }
+
+    sum->type = type;
+    sum->ctx  = EVP_MD_CTX_new();
+    if(sum->ctx == NULL ||
+       EVP_DigestInit_ex(sum->ctx, checksum_types[type].digest(), NULL) != 1) {
+        fprintf(stderr, "failed to start the checksum\n");
+        checksum_free(sum);
+        return NULL;
+    }
+
+    return sum;
+}
+
+int checksum_update(Checksum sum, const void* data, size_t length) {
+    if(sum == NULL) return CHECKSUM_ERROR;
+
+    return (EVP_DigestUpdate(sum->ctx, data, length) == 1) ? CHECKSUM_OK
+                                                           : CHECKSUM_ERROR;
+}
+
+/**
+ * Writes the hash as lower case hex into hex, which has to hold
+ * CHECKSUM_HEX_SIZE chars.
+ */
+int checksum_final(Checksum sum, char* hex) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int  length;
+
+    if(sum == NULL || EVP_DigestFinal_ex(sum->ctx, hash, &length) != 1) {
+        return CHECKSUM_ERROR;
+    }
+
+    for(unsigned int i = 0; i < length; i++) {
+        sprintf(hex + i * 2, "%02x", hash[i]);
+    }
+    hex[length * 2] = '\0';
+
+    return CHECKSUM_OK;
+}
+
+void checksum_free(Checksum sum) {
+    if(sum == NULL) return;
+
+    EVP_MD_CTX_free(sum->ctx);
+    free(sum);
+}
+
+ChecksumBatch checksum_batch_init(enum checksum_type type) {
+    ChecksumBatch batch;
+
+    if(type <= CHECKSUM_NONE || type >= CHECKSUM_TYPES) {
+        fprintf(stderr, "cannot check files with checksum %d\n", type);
+        return NULL;
+    }
+
+    batch = (ChecksumBatch)calloc(1, sizeof(struct checksum_batch));
+    if(batch == NULL) {
+        fprintf(stderr, "failed to allocate memory for the checksums\n");
+        return NULL;
+    }
+    batch->type = type;
+
+    return batch;
+}
+
+/**
+ * Remembers that the remote path should hash to expected. data is handed to
+ * the callback of checksum_batch_verify with the outcome.
+ */
+int checksum_batch_add(ChecksumBatch batch,
+                       const char*   path,
+                       const char*   expected,
+                       void*         data) {
+    struct checksum_entry* entries;
+    struct checksum_entry* entry;
+    int                    capacity;
+
+    if(batch == NULL || path == NULL || expected == NULL) {
+        fprintf(stderr, "cannot pass null values to checksum_batch_add\n");
+        return CHECKSUM_ERROR;
+    }
+
+    if(batch->count == batch->capacity) {
+        capacity = (batch->capacity == 0) ? CHECKSUM_INITIAL_ENTRIES
+                                          : batch->capacity * 2;
+        entries  = (struct checksum_entry*)realloc(
+            batch->entries,
+            capacity * sizeof(struct checksum_entry));
+        if(entries == NULL) {
+            fprintf(stderr, "failed to allocate memory for the checksums\n");
+            return CHECKSUM_ERROR;
+        }
+        batch->entries  = entries;
+        batch->capacity = capacity;
+    }
+
+    entry       = &batch->entries[batch->count];
+    entry->path = strdup(path);
+    if(entry->path == NULL) {
+        fprintf(stderr, "failed to allocate memory for the checksums\n");
+        return CHECKSUM_ERROR;
+    }
+    snprintf(entry->expected, CHECKSUM_HEX_SIZE, "%s", expected);
+    entry->verified = false;
+    entry->data     = data;
+    batch->count++;
+
+    return CHECKSUM_OK;
+}
+
+/**
+ * Hashes every remembered file on the remote, several at a time, and compares
+ * it with what was sent or received. callback, unless it is NULL, is told the
+ * outcome of every file. Returns how many of them do not match or could not be
+ * checked and empties the batch.
+ */
+int checksum_batch_verify(ChecksumBatch     batch,
+                          ssh_session       session,
+                          checksum_callback callback) {
+    ExecGroup group = NULL;
+    char*     command;
+    int       failed = 0;
+
+    if(batch == NULL || batch->count == 0) return 0;
+
+    if(session == NULL) {
+        fprintf(stderr, "cannot pass null values to checksum_batch_verify\n");
+    } else {
+        group = exec_group_init(session, 0, 0);
+    }
+    for(int i = 0; group != NULL && i < batch->count; i++) {
+        command = checksum_command(batch->type, batch->entries[i].path);
+        if(command == NULL) break;
+
+        exec_group_add(group, command, &batch->entries[i]);
+        free(command);
+    }
+    if(group != NULL) {
+        exec_group_run(group, NULL, NULL, NULL);
+        for(int i = 0; i < group->count; i++) {
+            checksum_check((struct checksum_entry*)group->jobs[i].data,
+                           &group->jobs[i]);
+        }
+    }
+
+    for(int i = 0; i < batch->count; i++) {
+        if(!batch->entries[i].verified) failed++;
+        if(callback != NULL) {
+            callback(batch->entries[i].data,
+                     batch->entries[i].path,
+                     batch->entries[i].verified);
+        }
+        free(batch->entries[i].path);
+    }
+    batch->count = 0;
+
+    exec_group_free(group);
+    return failed;
+}
+
+void checksum_batch_free(ChecksumBatch batch) {
+    if(batch == NULL) return;
+
+    for(int i = 0; i < batch->count; i++) free(batch->entries[i].path);
+    free(batch->entries);
+    free(batch);
+}
+
+/**
+ * Hashes the remote file at path and writes the hash into hex, which has to
+ * hold CHECKSUM_HEX_SIZE chars.
+ */
+int checksum_remote(ssh_session        session,
+                    enum checksum_type type,
+                    const char*        path,
+                    char*              hex) {
+    ExecGroup        group;
+    struct exec_job* job;
+    char*            command;
+    const char*      output;
+    size_t           length;
+    int              rc = CHECKSUM_ERROR;
+
+    if(session == NULL || path == NULL || hex == NULL) {
+        fprintf(stderr, "cannot pass null values to checksum_remote\n");
+        return CHECKSUM_ERROR;
+    }
+    if(type <= CHECKSUM_NONE || type >= CHECKSUM_TYPES) return CHECKSUM_ERROR;
+
+    command = checksum_command(type, path);
+    if(command == NULL) return CHECKSUM_ERROR;
+
+    group = exec_group_init(session, 1, 0);
+    if(group != NULL && exec_group_add(group, command, NULL) == EXEC_GROUP_OK) {
+        exec_group_run(group, NULL, NULL, NULL);
+
+        job    = &group->jobs[0];
+        output = job->output;
+        if(job->state == EXEC_JOB_DONE && job->exit_status == 0 &&
+           output != NULL) {
+            if(output[0] == '\\') output++;
+            length = strspn(output, "0123456789abcdef");
+            if(length > 0 && length < CHECKSUM_HEX_SIZE &&
+               output[length] == ' ') {
+                memcpy(hex, output, length);
+                hex[length] = '\0';
+                rc          = CHECKSUM_OK;
+            }
+        }
+    }
+
+    exec_group_free(group);
+    free(command);
+    return rc;
+}
+
+/**
+ * The command printing the hash of the remote file at path.
+ */
+static char* checksum_command(enum checksum_type type, const char* path) {
+    const char* tool = checksum_types[type].command;
+    char*       quoted;
+    char*       command;
+    size_t      size;
+
+    quoted = remote_ls_quote(path);
+    if(quoted == NULL) return NULL;
+
+    size    = strlen(tool) + strlen(quoted) + 5;
+    command = (char*)malloc(size);
+    if(command == NULL) {
+        fprintf(stderr, "failed to allocate memory for the checksums\n");
+    } else {
+        snprintf(command, size, "%s -- %s", tool, quoted);
+    }
+
+    free(quoted);
+    return command;
+}
+
+/**
+ * Compares the hash printed by job with the one entry expects and marks entry
+ * verified if they are the same.
+ */
+static int checksum_check(struct checksum_entry* entry, struct exec_job* job) {
+    const char* output = job->output;
+    size_t      length = strlen(entry->expected);
+    size_t      errors = job->error_length;
+
+    if(job->state != EXEC_JOB_DONE || job->exit_status != 0 ||
+       output == NULL) {
+        while(errors > 0 && job->errors[errors - 1] == '\n') errors--;
+        if(errors == 0) {
+            fprintf(stderr, "[%s] could not be checked\n", entry->path);
+        } else {
+            fprintf(stderr,
+                    "[%s] could not be checked: %.*s\n",
+                    entry->path,
+                    (int)errors,
+                    job->errors);
+        }
+        return CHECKSUM_ERROR;
+    }
+
+    // names with a backslash or a newline in them are printed escaped
+    if(output[0] == '\\') output++;
+    if(strncmp(output, entry->expected, length) != 0 ||
+       output[length] != ' ') {
+        fprintf(stderr, "[%s] checksum mismatch\n", entry->path);
+        return CHECKSUM_ERROR;
+    }
+
+    entry->verified = true;
+    return CHECKSUM_OK;
+}
@@ -0,0 +1,425 @@
+#include "cipher_bench.h"
+
+#include <libssh/libssh.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "path.h"
+#include "pssh.h"
+
+/**
+ * A cipher as libssh calls it and the libcrypto cipher it is timed with. The
+ * OpenSSH chacha20-poly1305 is built from the same primitives as the IETF one
+ * so it costs the same.
+ */
+struct cipher_bench_cipher {
+    const char* name;
+    const EVP_CIPHER* (*cipher)(void);
+    bool aead;  // needs no separate MAC
+};
+
+/**
+ * The MACs that hash with digest, encrypt-then-mac first since it is the
+ * safer construction for the same cost.
+ */
+struct cipher_bench_mac {
+    const char* names;
+    const EVP_MD* (*digest)(void);
+};
+
+static const struct cipher_bench_cipher cipher_bench_ciphers[] = {
+    {"chacha20-poly1305@openssh.com", EVP_chacha20_poly1305, true },
+    {"aes128-gcm@openssh.com",        EVP_aes_128_gcm,       true },
+    {"aes256-gcm@openssh.com",        EVP_aes_256_gcm,       true },
+    {"aes128-ctr",                    EVP_aes_128_ctr,       false},
+    {"aes192-ctr",                    EVP_aes_192_ctr,       false},
+    {"aes256-ctr",                    EVP_aes_256_ctr,       false},
+};
+
+static const struct cipher_bench_mac cipher_bench_macs[] = {
+    {"hmac-sha2-256-etm@openssh.com,hmac-sha2-256", EVP_sha256},
+    {"hmac-sha2-512-etm@openssh.com,hmac-sha2-512", EVP_sha512},
+};
+
+#define CIPHER_BENCH_CIPHER_COUNT \
+    (sizeof(cipher_bench_ciphers) / sizeof(cipher_bench_ciphers[0]))
+#define CIPHER_BENCH_MAC_COUNT \
+    (sizeof(cipher_bench_macs) / sizeof(cipher_bench_macs[0]))
+
+static double cipher_bench_now(void);
+static double cipher_bench_cipher(const EVP_CIPHER*    cipher,
+                                  bool                 aead,
+                                  const unsigned char* in,
+                                  unsigned char*       out);
+static double cipher_bench_digest(const EVP_MD*        digest,
+                                  const unsigned char* in);
+static void   cipher_bench_rank(const double* speeds, int count, int* order);
+static char*  cipher_bench_file(bool create);
+
+/**
+ * Times every candidate on packet sized buffers and writes them to result
+ * from fastest to slowest. A cipher that needs a MAC is timed together with
+ * the fastest MAC.
+ */
+int cipher_bench_run(struct cipher_bench_result* result) {
+    unsigned char* in;
+    unsigned char* out;
+    double         cipher_speeds[CIPHER_BENCH_CIPHER_COUNT];
+    double         mac_speeds[CIPHER_BENCH_MAC_COUNT];
+    int            cipher_order[CIPHER_BENCH_CIPHER_COUNT];
+    int            mac_order[CIPHER_BENCH_MAC_COUNT];
+    double         mac_speed;
+
+    if(result == NULL) return CIPHER_BENCH_ERROR;
+
+    in  = (unsigned char*)calloc(1, CIPHER_BENCH_PACKET_SIZE);
+    out = (unsigned char*)malloc(CIPHER_BENCH_PACKET_SIZE + 64);
+    if(in == NULL || out == NULL) {
+        fprintf(stderr, "failed to allocate memory for the cipher timing\n");
+        free(in);
+        free(out);
+        return CIPHER_BENCH_ERROR;
+    }
+
+    for(size_t i = 0; i < CIPHER_BENCH_MAC_COUNT; i++) {
+        mac_speeds[i] = cipher_bench_digest(cipher_bench_macs[i].digest(), in);
+    }
+    cipher_bench_rank(mac_speeds, CIPHER_BENCH_MAC_COUNT, mac_order);
+    mac_speed = mac_speeds[mac_order[0]];
+
+    for(size_t i = 0; i < CIPHER_BENCH_CIPHER_COUNT; i++) {
+        const struct cipher_bench_cipher* candidate = &cipher_bench_ciphers[i];
+
+        cipher_speeds[i] = cipher_bench_cipher(candidate->cipher(),
+                                               candidate->aead,
+                                               in,
+                                               out);
+        // every byte goes through the cipher and then the MAC
+        if(!candidate->aead && cipher_speeds[i] > 0 && mac_speed > 0) {
+            cipher_speeds[i] = 1 / (1 / cipher_speeds[i] + 1 / mac_speed);
+        } else if(!candidate->aead) {
+            cipher_speeds[i] = 0;
+        }
+    }
+    cipher_bench_rank(cipher_speeds, CIPHER_BENCH_CIPHER_COUNT, cipher_order);
+
+    free(in);
+    free(out);
+
+    result->ciphers[0] = '\0';
+    for(size_t i = 0; i < CIPHER_BENCH_CIPHER_COUNT; i++) {
+        // libcrypto without it means libssh is without it as well
+        if(cipher_speeds[cipher_order[i]] <= 0) continue;
+
+        if(result->ciphers[0] != '\0') {
+            strncat(result->ciphers,
+                    ",",
+                    CIPHER_BENCH_LIST_SIZE - strlen(result->ciphers) - 1);
+        }
+        strncat(result->ciphers,
+                cipher_bench_ciphers[cipher_order[i]].name,
+                CIPHER_BENCH_LIST_SIZE - strlen(result->ciphers) - 1);
+    }
+
+    result->macs[0] = '\0';
+    for(size_t i = 0; i < CIPHER_BENCH_MAC_COUNT; i++) {
+        if(mac_speeds[mac_order[i]] <= 0) continue;
+
+        if(result->macs[0] != '\0') {
+            strncat(result->macs,
+                    ",",
+                    CIPHER_BENCH_LIST_SIZE - strlen(result->macs) - 1);
+        }
+        strncat(result->macs,
+                cipher_bench_macs[mac_order[i]].names,
+                CIPHER_BENCH_LIST_SIZE - strlen(result->macs) - 1);
+    }
+
+    if(result->ciphers[0] == '\0' || result->macs[0] == '\0') {
+        fprintf(stderr, "none of the ciphers could be timed\n");
+        return CIPHER_BENCH_ERROR;
+    }
+
+    return CIPHER_BENCH_OK;
+}
+
+/**
+ * Reads the ranking saved on this machine. Fails if there is none or if it
+ * was made with another libcrypto.
+ */
+int cipher_bench_load(struct cipher_bench_result* result) {
+    char  header[CIPHER_BENCH_LIST_SIZE];
+    char  expected[CIPHER_BENCH_LIST_SIZE];
+    char* file_name;
+    FILE* fp;
+    bool  valid;
+
+    if(result == NULL) return CIPHER_BENCH_ERROR;
+
+    file_name = cipher_bench_file(false);
+    if(file_name == NULL) return CIPHER_BENCH_ERROR;
+
+    fp = fopen(file_name, "r");
+    free(file_name);
+    if(fp == NULL) return CIPHER_BENCH_ERROR;
+
+    snprintf(expected,
+             CIPHER_BENCH_LIST_SIZE,
+             "%s %lx\n",
+             CIPHER_BENCH_MAGIC,
+             (unsigned long)OpenSSL_version_num());
+
+    valid = fgets(header, CIPHER_BENCH_LIST_SIZE, fp) != NULL &&
+            strcmp(header, expected) == 0 &&
+            fgets(result->ciphers, CIPHER_BENCH_LIST_SIZE, fp) != NULL &&
+            fgets(result->macs, CIPHER_BENCH_LIST_SIZE, fp) != NULL;
+    fclose(fp);
+    if(!valid) return CIPHER_BENCH_ERROR;
+
+    result->ciphers[strcspn(result->ciphers, "\n")] = '\0';
+    result->macs[strcspn(result->macs, "\n")]       = '\0';
+    if(result->ciphers[0] == '\0' || result->macs[0] == '\0') {
+        return CIPHER_BENCH_ERROR;
+    }
+
+    return CIPHER_BENCH_OK;
+}
+
+int cipher_bench_save(const struct cipher_bench_result* result) {
+    char* file_name;
+    FILE* fp;
+    int   rc;
+
+    if(result == NULL) return CIPHER_BENCH_ERROR;
+
+    file_name = cipher_bench_file(true);
+    if(file_name == NULL) return CIPHER_BENCH_ERROR;
+
+    fp = fopen(file_name, "w");
+    if(fp == NULL) {
+        fprintf(stderr, "failed to save the cipher ranking to %s\n", file_name);
+        free(file_name);
+        return CIPHER_BENCH_ERROR;
+    }
+    free(file_name);
+
+    fprintf(fp,
+            "%s %lx\n%s\n%s\n",
+            CIPHER_BENCH_MAGIC,
+            (unsigned long)OpenSSL_version_num(),
+            result->ciphers,
+            result->macs);
+    rc = fclose(fp);
+
+    return (rc == 0) ? CIPHER_BENCH_OK : CIPHER_BENCH_ERROR;
+}
+
+/**
+ * The ranking of this machine, timed now if it was not kept or PWS_CALIBRATE
+ * asks for it.
+ */
+int cipher_bench_ranking(struct cipher_bench_result* result) {
+    char* calibrate;
+
+    if(result == NULL) return CIPHER_BENCH_ERROR;
+
+    calibrate = getenv(CIPHER_BENCH_ENV);
+    if((calibrate != NULL && calibrate[0] != '\0') ||
+       cipher_bench_load(result) != CIPHER_BENCH_OK) {
+        // stdout may be carrying a batch report
+        fprintf(stderr,
+                "Timing the ciphers of this machine, this is only done once\n");
+        if(cipher_bench_run(result) != CIPHER_BENCH_OK) {
+            return CIPHER_BENCH_ERROR;
+        }
+        cipher_bench_save(result);
+    }
+
+    return CIPHER_BENCH_OK;
+}
+
+/**
+ * Offers the ciphers and MACs of result to the server in their order, followed
+ * by the MACs that were not timed.
+ */
+int cipher_bench_set(ssh_session                       session,
+                     const struct cipher_bench_result* result) {
+    char macs[CIPHER_BENCH_LIST_SIZE + sizeof(CIPHER_BENCH_MACS_UNTIMED)];
+
+    if(session == NULL || result == NULL) return CIPHER_BENCH_ERROR;
+
+    snprintf(macs,
+             sizeof(macs),
+             "%s,%s",
+             result->macs,
+             CIPHER_BENCH_MACS_UNTIMED);
+
+    if(ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, result->ciphers) < 0 ||
+       ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, result->ciphers) < 0 ||
+       ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, macs) < 0 ||
+       ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, macs) < 0) {
+        fprintf(stderr,
+                "failed to set the preferred ciphers: %s\n",
+                ssh_get_error(session));
+        return CIPHER_BENCH_ERROR;
+    }
+
+    return CIPHER_BENCH_OK;
+}
+
+/**
+ * Sets the ciphers and MACs of session, both directions, in the order this
+ * machine runs them fastest. Has to be called before connecting. The ranking
+ * is made on the first run and read from the cache after that.
+ */
+int cipher_bench_apply(ssh_session session) {
+    struct cipher_bench_result result;
+
+    if(session == NULL) return CIPHER_BENCH_ERROR;
+
+    if(cipher_bench_ranking(&result) != CIPHER_BENCH_OK) {
+        return CIPHER_BENCH_ERROR;
+    }
+
+    return cipher_bench_set(session, &result);
+}
+
+static double cipher_bench_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Bytes per second cipher encrypts, 0 if libcrypto does not have it. An AEAD
+ * cipher starts over and produces its tag for every packet like ssh does.
+ */
+static double cipher_bench_cipher(const EVP_CIPHER*    cipher,
+                                  bool                 aead,
+                                  const unsigned char* in,
+                                  unsigned char*       out) {
+    EVP_CIPHER_CTX* ctx;
+    unsigned char   key[EVP_MAX_KEY_LENGTH] = {0};
+    unsigned char   iv[EVP_MAX_IV_LENGTH]   = {0};
+    unsigned char   tag[16];
+    uint64_t        bytes = 0;
+    double          start;
+    double          elapsed;
+    int             len;
+
+    if(cipher == NULL) return 0;
+
+    ctx = EVP_CIPHER_CTX_new();
+    if(ctx == NULL) return 0;
+
+    if(EVP_EncryptInit_ex(ctx, cipher, NULL, key, iv) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return 0;
+    }
+
+    start = cipher_bench_now();
+    do {
+        if(aead && EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1) break;
+        if(EVP_EncryptUpdate(ctx, out, &len, in, CIPHER_BENCH_PACKET_SIZE) !=
+           1) {
+            break;
+        }
+        if(aead && (EVP_EncryptFinal_ex(ctx, out + len, &len) != 1 ||
+                    EVP_CIPHER_CTX_ctrl(ctx,
+                                        EVP_CTRL_AEAD_GET_TAG,
+                                        sizeof(tag),
+                                        tag) != 1)) {
+            break;
+        }
+        bytes   += CIPHER_BENCH_PACKET_SIZE;
+        elapsed  = cipher_bench_now() - start;
+    } while(elapsed < CIPHER_BENCH_DURATION);
+
+    EVP_CIPHER_CTX_free(ctx);
+    return (bytes == 0) ? 0 : bytes / (cipher_bench_now() - start);
+}
+
+/**
+ * Bytes per second digest hashes. An HMAC over a packet costs about as much
+ * as hashing it so the digest alone ranks the MACs.
+ */
+static double cipher_bench_digest(const EVP_MD*        digest,
+                                  const unsigned char* in) {
+    EVP_MD_CTX*   ctx;
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int  len;
+    uint64_t      bytes = 0;
+    double        start;
+    double        elapsed;
+
+    if(digest == NULL) return 0;
+
+    ctx = EVP_MD_CTX_new();
+    if(ctx == NULL) return 0;
+
+    start = cipher_bench_now();
+    do {
+        if(EVP_DigestInit_ex(ctx, digest, NULL) != 1 ||
+           EVP_DigestUpdate(ctx, in, CIPHER_BENCH_PACKET_SIZE) != 1 ||
+           EVP_DigestFinal_ex(ctx, hash, &len) != 1) {
+            break;
+        }
+        bytes   += CIPHER_BENCH_PACKET_SIZE;
+        elapsed  = cipher_bench_now() - start;
+    } while(elapsed < CIPHER_BENCH_DURATION);
+
+    EVP_MD_CTX_free(ctx);
+    return (bytes == 0) ? 0 : bytes / (cipher_bench_now() - start);
+}
+
+/**
+ * Writes the indexes of speeds to order from fastest to slowest, keeping the
+ * listed order between equals.
+ */
+static void cipher_bench_rank(const double* speeds, int count, int* order) {
+    for(int i = 0; i < count; i++) {
+        int j = i;
+
+        while(j > 0 && speeds[order[j - 1]] < speeds[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+/**
+ * The cache file of this machine. The home directory can be shared between
+ * machines so the file is named after the local host name.
+ */
+static char* cipher_bench_file(bool create) {
+    Path  file;
+    char  machine[BUFFER_SIZE / 2];
+    char  name[BUFFER_SIZE];
+    char* file_name;
+
+    if(gethostname(machine, sizeof(machine)) != 0) strcpy(machine, "local");
+    machine[sizeof(machine) - 1] = '\0';
+
+    file = path_get_cache_directory(create);
+    if(file == NULL) return NULL;
+
+    snprintf(name, BUFFER_SIZE, "%s%s", CIPHER_BENCH_FILE_PREFIX, machine);
+    path_go_into(file, name);
+
+    file_name = strdup(file->path->str);
+    path_free(file);
+    if(file_name == NULL) {
+        fprintf(stderr, "failed to allocate memory for the cache file name\n");
+    }
+
+    return file_name;
+}
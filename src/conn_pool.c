@@ -0,0 +1,511 @@
+#include "conn_pool.h"
+
+#include <errno.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pssh.h"
+
+static ssh_session conn_pool_connect(ssh_session template);
+static void        conn_pool_watch(ssh_session session);
+static PoolConn    conn_pool_take(ConnPool pool);
+static PoolConn    conn_pool_owner(ConnPool pool, sftp_session sftp);
+static void*       conn_pool_keepalive(void* data);
+
+/**
+ * The pool of this process. Transfers only see sftp sessions so a lost
+ * connection is looked up here to be opened again.
+ */
+static ConnPool conn_pool_active = NULL;
+
+/**
+ * Creates a pool of size connections. The pool takes over session, which has
+ * to be connected and authenticated already, and frees it in conn_pool_free.
+ * Connections that fail to open are left out so the pool can end up smaller
+ * than asked for.
+ */
+ConnPool conn_pool_init(ssh_session session, int size) {
+    ConnPool pool;
+
+    if(session == NULL) {
+        fprintf(stderr, "the first session of the pool cannot be null\n");
+        return NULL;
+    }
+
+    if(size < 1) size = 1;
+    if(size > CONN_POOL_MAX_SIZE) size = CONN_POOL_MAX_SIZE;
+
+    pool = (ConnPool)malloc(sizeof(struct conn_pool));
+    if(pool == NULL) {
+        fprintf(stderr, "failed to allocate memory for the connection pool\n");
+        return NULL;
+    }
+
+    pool->connections = (struct conn_pool_connection*)calloc(
+        size,
+        sizeof(struct conn_pool_connection));
+    if(pool->connections == NULL) {
+        fprintf(stderr, "failed to allocate memory for the connection pool\n");
+        free(pool);
+        return NULL;
+    }
+
+    // copied by every connection opened from it
+    conn_pool_watch(session);
+
+    pool->connections[0].session = session;
+    pool->size                   = 1;
+    pool->retired                = NULL;
+    pool->keepalive_running      = false;
+    pool->stop                   = false;
+    for(int i = 1; i < size; i++) {
+        fprintf(stderr, "Opening connection %d of %d\n", i + 1, size);
+        pool->connections[pool->size].session = conn_pool_connect(session);
+        if(pool->connections[pool->size].session == NULL) {
+            fprintf(stderr, "continuing with %d connections\n", pool->size);
+            break;
+        }
+        conn_pool_watch(pool->connections[pool->size].session);
+        pool->size++;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->released, NULL);
+    pthread_cond_init(&pool->stopping, NULL);
+
+    conn_pool_keepalive_start(pool);
+    conn_pool_active = pool;
+
+    return pool;
+}
+
+/**
+ * The number of connections asked for in the environment, the default if it
+ * is not set or not a number.
+ */
+int conn_pool_size_from_env(void) {
+    char* value = getenv(CONN_POOL_SIZE_ENV);
+    char* end;
+    long  size;
+
+    if(value == NULL || value[0] == '\0') return CONN_POOL_DEFAULT_SIZE;
+
+    size = strtol(value, &end, 10);
+    if(*end != '\0' || size < 1) {
+        fprintf(stderr,
+                "ignoring %s=%s, it should be a positive number\n",
+                CONN_POOL_SIZE_ENV,
+                value);
+        return CONN_POOL_DEFAULT_SIZE;
+    }
+
+    return (size > CONN_POOL_MAX_SIZE) ? CONN_POOL_MAX_SIZE : (int)size;
+}
+
+/**
+ * Waits until a connection is free and hands it out. It belongs to the caller
+ * until conn_pool_release. A connection that was lost while nobody used it is
+ * opened again first.
+ */
+PoolConn conn_pool_acquire(ConnPool pool) {
+    PoolConn conn;
+
+    if(pool == NULL) return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while((conn = conn_pool_take(pool)) == NULL) {
+        pthread_cond_wait(&pool->released, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if(conn->lost || !ssh_is_connected(conn->session)) {
+        conn_pool_reconnect(pool, conn);
+    }
+
+    return conn;
+}
+
+/**
+ * Like conn_pool_acquire but returns NULL right away when every connection is
+ * in use, for work that can run with fewer connections.
+ */
+PoolConn conn_pool_try_acquire(ConnPool pool) {
+    PoolConn conn;
+
+    if(pool == NULL) return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    conn = conn_pool_take(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+    if(conn != NULL && (conn->lost || !ssh_is_connected(conn->session))) {
+        conn_pool_reconnect(pool, conn);
+    }
+
+    return conn;
+}
+
+/**
+ * The sftp session of the connection, started the first time it is asked
+ * for.
+ */
+sftp_session conn_pool_sftp(PoolConn conn) {
+    if(conn == NULL) return NULL;
+
+    if(conn->sftp == NULL) conn->sftp = create_sftp_session(conn->session);
+
+    return conn->sftp;
+}
+
+int conn_pool_release(ConnPool pool, PoolConn conn) {
+    if(pool == NULL || conn == NULL) return CONN_POOL_ERROR;
+
+    pthread_mutex_lock(&pool->lock);
+    conn->busy = false;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+
+    return CONN_POOL_OK;
+}
+
+/**
+ * Sends a keepalive on every idle connection every CONN_POOL_KEEPALIVE
+ * seconds from a thread of its own, so firewalls keep the connections open and
+ * one that died is noticed before it is handed out. The thread has to be
+ * stopped before the process forks.
+ */
+int conn_pool_keepalive_start(ConnPool pool) {
+    if(pool == NULL) return CONN_POOL_ERROR;
+    if(pool->keepalive_running) return CONN_POOL_OK;
+
+    pool->stop = false;
+    if(pthread_create(&pool->keepalive, NULL, conn_pool_keepalive, pool) !=
+       0) {
+        fprintf(stderr, "failed to start the keepalive thread\n");
+        return CONN_POOL_ERROR;
+    }
+    pool->keepalive_running = true;
+
+    return CONN_POOL_OK;
+}
+
+int conn_pool_keepalive_stop(ConnPool pool) {
+    if(pool == NULL) return CONN_POOL_ERROR;
+    if(!pool->keepalive_running) return CONN_POOL_OK;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_signal(&pool->stopping);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_join(pool->keepalive, NULL);
+    pool->keepalive_running = false;
+
+    return CONN_POOL_OK;
+}
+
+/**
+ * Opens conn again with the options it was opened with, waiting longer after
+ * every failed attempt. conn has to belong to the caller. Its old sessions are
+ * kept until the pool is freed since callers may still hold them.
+ */
+int conn_pool_reconnect(ConnPool pool, PoolConn conn) {
+    struct conn_pool_retired* retired;
+    ssh_session               session = NULL;
+    sftp_session              sftp    = NULL;
+    int                       delay   = CONN_POOL_BACKOFF;
+
+    if(pool == NULL || conn == NULL) return CONN_POOL_ERROR;
+
+    retired = (struct conn_pool_retired*)malloc(
+        sizeof(struct conn_pool_retired));
+    if(retired == NULL) {
+        fprintf(stderr, "failed to allocate memory for the reconnect\n");
+        return CONN_POOL_ERROR;
+    }
+
+    for(int attempt = 1; attempt <= CONN_POOL_RETRIES; attempt++) {
+        fprintf(stderr,
+                "\nConnection lost, reconnecting in %d seconds (attempt %d of "
+                "%d)\n",
+                delay,
+                attempt,
+                CONN_POOL_RETRIES);
+        sleep(delay);
+        delay = (delay * 2 > CONN_POOL_MAX_BACKOFF) ? CONN_POOL_MAX_BACKOFF
+                                                    : delay * 2;
+
+        session = conn_pool_connect(conn->session);
+        if(session == NULL) continue;
+
+        // only connections that had an sftp session get one again
+        if(conn->sftp == NULL) break;
+        sftp = create_sftp_session(session);
+        if(sftp != NULL) break;
+
+        ssh_disconnect(session);
+        ssh_free(session);
+        session = NULL;
+    }
+
+    if(session == NULL) {
+        fprintf(stderr, "giving up on the connection\n");
+        free(retired);
+        return CONN_POOL_ERROR;
+    }
+    conn_pool_watch(session);
+
+    pthread_mutex_lock(&pool->lock);
+    retired->session     = conn->session;
+    retired->sftp        = conn->sftp;
+    retired->replacement = sftp;
+    retired->next        = pool->retired;
+    pool->retired        = retired;
+    conn->session        = session;
+    conn->sftp           = sftp;
+    conn->lost           = false;
+    pthread_mutex_unlock(&pool->lock);
+
+    fprintf(stderr, "Reconnected\n");
+    return CONN_POOL_OK;
+}
+
+/**
+ * The sftp session that replaced sftp after its connection was opened again,
+ * sftp itself if it was not replaced.
+ */
+sftp_session conn_pool_current(sftp_session sftp) {
+    ConnPool                  pool = conn_pool_active;
+    struct conn_pool_retired* retired;
+
+    if(pool == NULL || sftp == NULL) return sftp;
+
+    pthread_mutex_lock(&pool->lock);
+    retired = pool->retired;
+    while(retired != NULL) {
+        if(retired->sftp == sftp && retired->replacement != NULL) {
+            // the replacement may have been replaced as well
+            sftp    = retired->replacement;
+            retired = pool->retired;
+            continue;
+        }
+        retired = retired->next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return sftp;
+}
+
+/**
+ * Called after a call on sftp failed. If the connection was lost it is opened
+ * again and the new sftp session is returned to retry the call on. Returns
+ * NULL if the connection is fine, the call failed for a reason of its own, or
+ * if it could not be opened again.
+ */
+sftp_session conn_pool_recover(sftp_session sftp) {
+    ConnPool        pool = conn_pool_active;
+    PoolConn        conn;
+    sftp_session    current;
+    sftp_attributes attr;
+
+    if(pool == NULL || sftp == NULL) return NULL;
+
+    current = conn_pool_current(sftp);
+    if(current != sftp) return current;
+
+    pthread_mutex_lock(&pool->lock);
+    conn = conn_pool_owner(pool, sftp);
+    pthread_mutex_unlock(&pool->lock);
+    if(conn == NULL) return NULL;
+
+    // a server that still answers is not worth reconnecting to
+    if(ssh_is_connected(conn->session)) {
+        attr = sftp_stat(sftp, ".");
+        if(attr != NULL) {
+            sftp_attributes_free(attr);
+            return NULL;
+        }
+    }
+
+    if(conn_pool_reconnect(pool, conn) != CONN_POOL_OK) return NULL;
+
+    return conn->sftp;
+}
+
+/**
+ * Closes every connection including the one the pool was created with. None
+ * of them can be in use.
+ */
+int conn_pool_free(ConnPool pool) {
+    struct conn_pool_retired* retired;
+
+    if(pool == NULL) return CONN_POOL_ERROR;
+
+    conn_pool_keepalive_stop(pool);
+    if(conn_pool_active == pool) conn_pool_active = NULL;
+
+    while(pool->retired != NULL) {
+        retired       = pool->retired;
+        pool->retired = retired->next;
+        if(retired->sftp != NULL) sftp_free(retired->sftp);
+        ssh_disconnect(retired->session);
+        ssh_free(retired->session);
+        free(retired);
+    }
+
+    for(int i = 0; i < pool->size; i++) {
+        if(pool->connections[i].sftp != NULL) {
+            sftp_free(pool->connections[i].sftp);
+        }
+        ssh_disconnect(pool->connections[i].session);
+        ssh_free(pool->connections[i].session);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->released);
+    pthread_cond_destroy(&pool->stopping);
+    free(pool->connections);
+    free(pool);
+
+    return CONN_POOL_OK;
+}
+
+/**
+ * Opens another connection with the options of template. Public keys are
+ * tried first so extra connections only ask for a password when they have to.
+ */
+static ssh_session conn_pool_connect(ssh_session template) {
+    ssh_session session = NULL;
+    int         rc;
+
+    if(ssh_options_copy(template, &session) != SSH_OK || session == NULL) {
+        fprintf(stderr, "failed to copy the ssh options\n");
+        return NULL;
+    }
+
+    if(ssh_connect(session) != SSH_OK) {
+        fprintf(stderr, "Error connecting: %s\n", ssh_get_error(session));
+        ssh_free(session);
+        return NULL;
+    }
+
+    if(verify_knownhost(session) < 0) {
+        ssh_disconnect(session);
+        ssh_free(session);
+        return NULL;
+    }
+
+    rc = ssh_userauth_publickey_auto(session, NULL, NULL);
+    if(rc != SSH_AUTH_SUCCESS) rc = pauthenticate(session);
+    if(rc != SSH_AUTH_SUCCESS) {
+        fprintf(stderr, "failed to authenticate the connection\n");
+        ssh_disconnect(session);
+        ssh_free(session);
+        return NULL;
+    }
+
+    return session;
+}
+
+/**
+ * Makes a dead server show up as a failed call instead of a call that never
+ * returns. Blocking calls give up after CONN_POOL_TIMEOUT seconds and the
+ * kernel probes the socket while a long transfer keeps the connection busy.
+ */
+static void conn_pool_watch(ssh_session session) {
+    long timeout = CONN_POOL_TIMEOUT;
+    int  fd      = ssh_get_fd(session);
+    int  on      = 1;
+
+    ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
+    if(fd < 0) return;
+
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    int idle     = CONN_POOL_KEEPALIVE;
+    int interval = 5;
+    int count    = 3;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
+
+/**
+ * Marks the first free connection as busy, the pool lock has to be held.
+ */
+static PoolConn conn_pool_take(ConnPool pool) {
+    for(int i = 0; i < pool->size; i++) {
+        if(!pool->connections[i].busy) {
+            pool->connections[i].busy = true;
+            return &pool->connections[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * The connection whose sftp session is sftp, the pool lock has to be held.
+ */
+static PoolConn conn_pool_owner(ConnPool pool, sftp_session sftp) {
+    for(int i = 0; i < pool->size; i++) {
+        if(pool->connections[i].sftp == sftp) return &pool->connections[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * An idle connection is taken out of the pool while its keepalive is sent so
+ * nobody gets it in the meantime, one whose keepalive fails is marked lost and
+ * opened again the next time it is handed out.
+ */
+static void* conn_pool_keepalive(void* data) {
+    ConnPool        pool = (ConnPool)data;
+    PoolConn        conn;
+    struct timespec deadline;
+    int             rc;
+
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CONN_POOL_KEEPALIVE;
+        rc = 0;
+        while(!pool->stop && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&pool->stopping,
+                                        &pool->lock,
+                                        &deadline);
+        }
+        if(pool->stop) break;
+
+        for(int i = 0; i < pool->size; i++) {
+            conn = &pool->connections[i];
+            if(conn->busy || conn->lost) continue;
+
+            conn->busy = true;
+            pthread_mutex_unlock(&pool->lock);
+            rc = ssh_send_keepalive(conn->session);
+            pthread_mutex_lock(&pool->lock);
+
+            if(rc == SSH_ERROR || !ssh_is_connected(conn->session)) {
+                conn->lost = true;
+            }
+            conn->busy = false;
+            pthread_cond_signal(&pool->released);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
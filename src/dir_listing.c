@@ -0,0 +1,370 @@
+#include "dir_listing.h"
+
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attr_list.h"
+#include "path.h"
+#include "pssh.h"
+#include "remote_ls.h"
+#include "tree_index.h"
+
+static void* dir_listing_load(void* arg);
+static int   dir_listing_add(void* data, sftp_attributes attr);
+static void  dir_listing_finish(DirListing listing, bool failed);
+static bool  dir_listing_load_index(DirListing listing, uint64_t* mtime);
+
+/**
+ * Starts reading the directory in the background and returns right away. The
+ * index can be NULL.
+ */
+DirListing dir_listing_start(sftp_session session,
+                             Path         path,
+                             TreeIndex    index) {
+    DirListing listing;
+
+    if(session == NULL || path == NULL) {
+        fprintf(stderr, "sftp session and path cannot be null\n");
+        return NULL;
+    }
+
+    listing = (DirListing)malloc(sizeof(struct dir_listing));
+    if(listing == NULL) {
+        fprintf(stderr, "failed to allocate memory for directory listing\n");
+        return NULL;
+    }
+
+    listing->list = attr_list_initialize();
+    listing->index =
+        (AttrNode*)malloc(sizeof(AttrNode) * DIR_LISTING_INITIAL_CAPACITY);
+    listing->path = path_duplicate(path);
+    if(listing->list == NULL || listing->index == NULL ||
+       listing->path == NULL) {
+        fprintf(stderr, "failed to initialize directory listing\n");
+        if(listing->list != NULL) attr_list_free(listing->list);
+        if(listing->path != NULL) path_free(listing->path);
+        free(listing->index);
+        free(listing);
+        return NULL;
+    }
+
+    listing->capacity = DIR_LISTING_INITIAL_CAPACITY;
+    listing->session  = session;
+    listing->tree     = index;
+    listing->done     = false;
+    listing->failed   = false;
+    listing->cancel   = false;
+    listing->joined   = false;
+    pthread_mutex_init(&listing->lock, NULL);
+    pthread_cond_init(&listing->grown, NULL);
+
+    if(pthread_create(&listing->loader, NULL, dir_listing_load, listing) !=
+       0) {
+        fprintf(stderr, "failed to start directory listing thread\n");
+        pthread_mutex_destroy(&listing->lock);
+        pthread_cond_destroy(&listing->grown);
+        attr_list_free(listing->list);
+        path_free(listing->path);
+        free(listing->index);
+        free(listing);
+        return NULL;
+    }
+
+    return listing;
+}
+
+/**
+ * Prints one page of the entries whose name contains filter (every entry when
+ * filter is NULL or empty). Entries keep their position in the full listing as
+ * their number so they can be picked with dir_listing_get. Only waits for the
+ * loader until the page is full. Returns the number of entries printed.
+ */
+int dir_listing_show_page(DirListing listing, int page, const char* filter) {
+    int first   = page * DIR_LISTING_PAGE_SIZE;
+    int last    = first + DIR_LISTING_PAGE_SIZE;
+    int matched = 0;
+    int shown   = 0;
+    int i       = 0;
+
+    if(listing == NULL) {
+        fprintf(stdout, "directory listing should not be null\n");
+        return 0;
+    }
+
+    if(filter != NULL && filter[0] == '\0') filter = NULL;
+
+    if(page == 0) printf("0. (previous directory)\n");
+
+    pthread_mutex_lock(&listing->lock);
+    while(matched < last) {
+        for(; i < listing->list->size && matched < last; i++) {
+            sftp_attributes attr = listing->index[i]->data;
+
+            if(filter != NULL && strstr(attr->name, filter) == NULL) continue;
+
+            if(matched >= first) {
+                printf("%d. \e[%sm%s\e[0m\n",
+                       i + 1,
+                       get_file_type_color(attr->type),
+                       attr->name);
+                shown++;
+            }
+            matched++;
+        }
+
+        if(matched >= last || listing->done) break;
+        pthread_cond_wait(&listing->grown, &listing->lock);
+    }
+
+    printf("-- page %d, %d entries loaded%s --\n",
+           page + 1,
+           listing->list->size,
+           !listing->done    ? " (still loading)"
+           : listing->failed ? " (incomplete)"
+                             : "");
+    pthread_mutex_unlock(&listing->lock);
+
+    return shown;
+}
+
+/**
+ * Returns the node at the position (starting from 1), waiting for the loader
+ * if it has not got that far yet. NULL if the directory has fewer entries.
+ */
+AttrNode dir_listing_get(DirListing listing, int index) {
+    AttrNode node = NULL;
+
+    if(listing == NULL || index <= 0) return NULL;
+
+    pthread_mutex_lock(&listing->lock);
+    while(listing->list->size < index && !listing->done) {
+        pthread_cond_wait(&listing->grown, &listing->lock);
+    }
+    if(index <= listing->list->size) node = listing->index[index - 1];
+    pthread_mutex_unlock(&listing->lock);
+
+    return node;
+}
+
+int dir_listing_size(DirListing listing, bool* done) {
+    int size;
+
+    pthread_mutex_lock(&listing->lock);
+    size = listing->list->size;
+    if(done != NULL) *done = listing->done;
+    pthread_mutex_unlock(&listing->lock);
+
+    return size;
+}
+
+/**
+ * Waits for the loader to at least start producing entries and reports if it
+ * could not read the directory. A listing that breaks off after its first
+ * entries is only seen as failed once it is done.
+ */
+bool dir_listing_failed(DirListing listing) {
+    bool failed;
+
+    pthread_mutex_lock(&listing->lock);
+    while(listing->list->size == 0 && !listing->done) {
+        pthread_cond_wait(&listing->grown, &listing->lock);
+    }
+    failed = listing->failed;
+    pthread_mutex_unlock(&listing->lock);
+
+    return failed;
+}
+
+/**
+ * Stops the loader and waits for it to let go of the sftp session. Entries
+ * already loaded stay available.
+ */
+int dir_listing_stop(DirListing listing) {
+    if(listing == NULL) return DIR_LISTING_ERROR;
+
+    if(listing->joined) return DIR_LISTING_OK;
+
+    pthread_mutex_lock(&listing->lock);
+    listing->cancel = true;
+    pthread_mutex_unlock(&listing->lock);
+
+    pthread_join(listing->loader, NULL);
+    listing->joined = true;
+
+    return DIR_LISTING_OK;
+}
+
+int dir_listing_free(DirListing listing) {
+    if(listing == NULL) return DIR_LISTING_ERROR;
+
+    dir_listing_stop(listing);
+
+    pthread_mutex_destroy(&listing->lock);
+    pthread_cond_destroy(&listing->grown);
+    attr_list_free(listing->list);
+    path_free(listing->path);
+    free(listing->index);
+    free(listing);
+
+    return DIR_LISTING_OK;
+}
+
+static void* dir_listing_load(void* arg) {
+    DirListing      listing = (DirListing)arg;
+    sftp_session    session = listing->session;
+    sftp_dir        directory;
+    sftp_attributes attr;
+    uint64_t        mtime   = 0;
+    bool            stopped = false;
+
+    if(dir_listing_load_index(listing, &mtime)) {
+        dir_listing_finish(listing, false);
+        return NULL;
+    }
+
+    if(remote_ls_supported(session->session) &&
+       remote_ls_each(session->session,
+                      listing->path,
+                      1,
+                      dir_listing_add,
+                      listing) == REMOTE_LS_OK) {
+        pthread_mutex_lock(&listing->lock);
+        stopped = listing->cancel;
+        pthread_mutex_unlock(&listing->lock);
+    } else if(dir_listing_size(listing, NULL) > 0) {
+        // entries may already be shown, a fallback would list them twice
+        fprintf(stderr,
+                "Listing of %s broke off, it is incomplete\n",
+                listing->path->path->str);
+        dir_listing_finish(listing, true);
+        return NULL;
+    } else {
+        directory = sftp_opendir(session, listing->path->path->str);
+        if(!directory) {
+            fprintf(stderr,
+                    "Failed to open directory: %s\n",
+                    ssh_get_error(session));
+            dir_listing_finish(listing, true);
+            return NULL;
+        }
+
+        while((attr = sftp_readdir(session, directory)) != NULL) {
+            // skip hidden files
+            if(attr->name[0] == '.') {
+                sftp_attributes_free(attr);
+                continue;
+            }
+            if(dir_listing_add(listing, attr) != REMOTE_LS_OK) {
+                stopped = true;
+                break;
+            }
+        }
+
+        if(!stopped && sftp_dir_eof(directory) != 1) {
+            fprintf(stderr,
+                    "Failed to read directory: %s\n",
+                    ssh_get_error(session));
+            sftp_closedir(directory);
+            dir_listing_finish(listing, true);
+            return NULL;
+        }
+
+        sftp_closedir(directory);
+    }
+
+    dir_listing_finish(listing, false);
+
+    // only a complete listing may replace what the index has
+    if(!stopped && listing->tree != NULL && mtime != 0) {
+        tree_index_update(listing->tree,
+                          listing->path->path->str,
+                          mtime,
+                          listing->list);
+    }
+
+    return NULL;
+}
+
+/**
+ * Fills the listing from the tree index if the indexed copy of the directory
+ * is still fresh. Costs a single stat instead of reading the directory.
+ * Leaves the current mtime of the directory in mtime either way.
+ */
+static bool dir_listing_load_index(DirListing listing, uint64_t* mtime) {
+    sftp_attributes attr;
+    AttrList        cached;
+    AttrNode        node;
+
+    if(listing->tree == NULL) return false;
+
+    attr = sftp_stat(listing->session, listing->path->path->str);
+    if(attr == NULL) return false;
+    *mtime = attr->mtime;
+    sftp_attributes_free(attr);
+
+    cached = tree_index_lookup(listing->tree, listing->path->path->str, *mtime);
+    if(cached == NULL) return false;
+
+    // hand the attributes over to the listing, the nodes are freed empty
+    for(node = cached->head; node != NULL; node = node->next) {
+        attr       = node->data;
+        node->data = NULL;
+        if(dir_listing_add(listing, attr) != REMOTE_LS_OK) break;
+    }
+    attr_list_free(cached);
+
+    return true;
+}
+
+/**
+ * Appends an entry and wakes up anyone waiting for more. Returns
+ * REMOTE_LS_ERROR once the listing was stopped so the reader quits early.
+ */
+static int dir_listing_add(void* data, sftp_attributes attr) {
+    DirListing listing = (DirListing)data;
+
+    pthread_mutex_lock(&listing->lock);
+    if(listing->cancel) {
+        pthread_mutex_unlock(&listing->lock);
+        sftp_attributes_free(attr);
+        return REMOTE_LS_ERROR;
+    }
+
+    if(listing->list->size == listing->capacity) {
+        AttrNode* temp = (AttrNode*)realloc(
+            listing->index,
+            sizeof(AttrNode) * listing->capacity * 2);
+        if(temp == NULL) {
+            fprintf(stderr, "failed to grow the directory listing\n");
+            pthread_mutex_unlock(&listing->lock);
+            sftp_attributes_free(attr);
+            return REMOTE_LS_ERROR;
+        }
+        listing->index     = temp;
+        listing->capacity *= 2;
+    }
+
+    if(attr_list_add(listing->list, attr) != ATTR_LIST_OK) {
+        pthread_mutex_unlock(&listing->lock);
+        sftp_attributes_free(attr);
+        return REMOTE_LS_OK;
+    }
+    listing->index[listing->list->size - 1] = listing->list->tail;
+
+    pthread_cond_broadcast(&listing->grown);
+    pthread_mutex_unlock(&listing->lock);
+
+    return REMOTE_LS_OK;
+}
+
+static void dir_listing_finish(DirListing listing, bool failed) {
+    pthread_mutex_lock(&listing->lock);
+    listing->done   = true;
+    listing->failed = failed;
+    pthread_cond_broadcast(&listing->grown);
+    pthread_mutex_unlock(&listing->lock);
+}
@@ -0,0 +1,560 @@
+#include "disk_usage.h"
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exec_group.h"
+#include "path.h"
+#include "pssh.h"
+#include "remote_ls.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+// type, size and ctime of everything under the path, one NUL terminated
+// record each
+#define DISK_USAGE_COMMAND "find %s -printf '%%y %%s %%C@\\0' 2>/dev/null"
+
+// a single "u" record when nothing under the path changed since the stamp
+#define DISK_USAGE_COMMAND_SINCE                                      \
+    "c=$(find %s -newerct @%llu.%09llu -print -quit 2>/dev/null) && " \
+    "[ -z \"$c\" ] && printf 'u\\0' || " DISK_USAGE_COMMAND
+
+#define DISK_USAGE_NSEC 1000000000ULL
+
+/**
+ * One entry of the measured directory. Files directly in the directory are
+ * summed up in the directory's own totals instead.
+ */
+struct du_item {
+    char*     name;
+    uint64_t  bytes;
+    uint64_t  files;
+    uint64_t  stamp;
+    DiskUsage cached;  // totals of the last time, NULL if there are none
+    bool      pending;
+};
+
+/**
+ * How many of the finds have ended, for the progress line.
+ */
+struct du_progress {
+    int measured;
+    int pending;
+    int unchanged;
+};
+
+static DiskUsage cache[DISK_USAGE_CACHE_SIZE];
+
+static int    du_list(sftp_session     session,
+                      Path             dir,
+                      struct du_item** items,
+                      int*             count,
+                      uint64_t*        bytes,
+                      uint64_t*        files);
+static int    du_measure_concurrent(sftp_session    session,
+                                    Path            dir,
+                                    struct du_item* items,
+                                    int             count);
+static char*  du_command(Path dir, DiskUsage cached);
+static size_t du_parse_output(struct exec_job* job,
+                              const char*      data,
+                              size_t           length,
+                              void*            user);
+static void   du_parse_record(struct du_item* item, const char* record);
+static void   du_job_done(struct exec_job* job, void* user);
+static int    du_walk_sftp(sftp_session session,
+                           Path         dir,
+                           uint64_t*    bytes,
+                           uint64_t*    files);
+static DiskUsage du_cache_find(const char* path);
+static void      du_cache_store(const char* path,
+                                uint64_t    bytes,
+                                uint64_t    files,
+                                uint64_t    stamp);
+static int       du_compare_items(const void* a, const void* b);
+static void      du_free_items(struct du_item* items, int count);
+
+/**
+ * Measures the directory and prints its largest top subdirectories.
+ */
+int disk_usage_show(sftp_session session, Path dir, int top) {
+    struct du_item* items;
+    int             count;
+    uint64_t        own_bytes;
+    uint64_t        own_files;
+    uint64_t        total_bytes;
+    uint64_t        total_files;
+    char*           readable;
+
+    if(session == NULL || dir == NULL) {
+        fprintf(stderr, "session and directory cannot be null\n");
+        return DISK_USAGE_ERROR;
+    }
+
+    if(du_list(session, dir, &items, &count, &own_bytes, &own_files) !=
+       DISK_USAGE_OK) {
+        return DISK_USAGE_ERROR;
+    }
+
+    total_bytes = own_bytes;
+    total_files = own_files;
+    for(int i = 0; i < count; i++) {
+        total_bytes += items[i].bytes;
+        total_files += items[i].files;
+    }
+
+    qsort(items, count, sizeof(struct du_item), du_compare_items);
+
+    printf("\nDisk usage of %s\n", dir->path->str);
+    for(int i = 0; i < count && i < top; i++) {
+        readable = get_readable_size(items[i].bytes);
+        printf("%12s %10llu files  \e[%sm%s/\e[0m\n",
+               readable,
+               (unsigned long long)items[i].files,
+               FILE_TYPE_DIRECTORY_COLOR,
+               items[i].name);
+        free(readable);
+    }
+    if(count > top) printf("... %d more directories\n", count - top);
+
+    readable = get_readable_size(own_bytes);
+    printf("%12s %10llu files  (directly in this directory)\n",
+           readable,
+           (unsigned long long)own_files);
+    free(readable);
+
+    readable = get_readable_size(total_bytes);
+    printf("%12s %10llu files  total\n",
+           readable,
+           (unsigned long long)total_files);
+    free(readable);
+
+    du_free_items(items, count);
+    return DISK_USAGE_OK;
+}
+
+/**
+ * Recursive size of the regular files under dir and how many there are.
+ */
+int disk_usage_measure(sftp_session session,
+                       Path         dir,
+                       uint64_t*    bytes,
+                       uint64_t*    files) {
+    struct du_item* items;
+    int             count;
+
+    if(session == NULL || dir == NULL || bytes == NULL || files == NULL) {
+        fprintf(stderr, "session, directory and totals cannot be null\n");
+        return DISK_USAGE_ERROR;
+    }
+
+    if(du_list(session, dir, &items, &count, bytes, files) != DISK_USAGE_OK) {
+        return DISK_USAGE_ERROR;
+    }
+
+    for(int i = 0; i < count; i++) {
+        *bytes += items[i].bytes;
+        *files += items[i].files;
+    }
+
+    du_free_items(items, count);
+    return DISK_USAGE_OK;
+}
+
+/**
+ * Totals of the directory from the last time it was measured, without touching
+ * the network. The tree may have changed since, so they are an estimate.
+ */
+bool disk_usage_cached(const char* path, uint64_t* bytes, uint64_t* files) {
+    DiskUsage usage = du_cache_find(path);
+
+    if(usage == NULL) return false;
+
+    if(bytes != NULL) *bytes = usage->bytes;
+    if(files != NULL) *files = usage->files;
+    return true;
+}
+
+void disk_usage_clear_cache(void) {
+    DiskUsage usage;
+
+    for(int i = 0; i < DISK_USAGE_CACHE_SIZE; i++) {
+        while(cache[i] != NULL) {
+            usage    = cache[i];
+            cache[i] = usage->next;
+            free(usage->path);
+            free(usage);
+        }
+    }
+}
+
+/**
+ * Lists dir, sums up the files directly in it and measures every subdirectory,
+ * reusing the last totals of the ones where nothing changed since. The totals
+ * of dir and its subdirectories are remembered for disk_usage_cached.
+ */
+static int du_list(sftp_session     session,
+                   Path             dir,
+                   struct du_item** items,
+                   int*             count,
+                   uint64_t*        bytes,
+                   uint64_t*        files) {
+    sftp_dir        directory;
+    sftp_attributes attr;
+    Path            sub;
+    int             capacity = DISK_USAGE_MAX_CHANNELS;
+    uint64_t        total_bytes;
+    uint64_t        total_files;
+
+    *count = 0;
+    *bytes = 0;
+    *files = 0;
+    *items = (struct du_item*)malloc(sizeof(struct du_item) * capacity);
+    if(*items == NULL) {
+        fprintf(stderr, "failed to allocate memory for disk usage\n");
+        return DISK_USAGE_ERROR;
+    }
+
+    directory = sftp_opendir(session, dir->path->str);
+    if(directory == NULL) {
+        fprintf(stderr,
+                "Failed to open directory: %s\n",
+                ssh_get_error(session));
+        free(*items);
+        return DISK_USAGE_ERROR;
+    }
+
+    sub = path_duplicate(dir);
+    while((attr = sftp_readdir(session, directory)) != NULL) {
+        if(strcmp(attr->name, ".") == 0 || strcmp(attr->name, "..") == 0) {
+            sftp_attributes_free(attr);
+            continue;
+        }
+
+        if(attr->type == SSH_FILEXFER_TYPE_REGULAR) {
+            *bytes += attr->size;
+            (*files)++;
+        } else if(attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+            if(*count == capacity) {
+                struct du_item* temp = (struct du_item*)realloc(
+                    *items,
+                    sizeof(struct du_item) * capacity * 2);
+                if(temp == NULL) {
+                    fprintf(stderr, "failed to grow disk usage list\n");
+                    sftp_attributes_free(attr);
+                    break;
+                }
+                *items    = temp;
+                capacity *= 2;
+            }
+
+            struct du_item* item = &(*items)[(*count)++];
+            item->name           = strdup(attr->name);
+            item->bytes          = 0;
+            item->files          = 0;
+            item->stamp          = 0;
+            item->cached         = NULL;
+            item->pending        = true;
+        }
+        sftp_attributes_free(attr);
+    }
+    sftp_closedir(directory);
+
+    du_measure_concurrent(session, dir, *items, *count);
+
+    total_bytes = *bytes;
+    total_files = *files;
+    for(int i = 0; i < *count; i++) {
+        path_go_into(sub, (*items)[i].name);
+        du_cache_store(sub->path->str,
+                       (*items)[i].bytes,
+                       (*items)[i].files,
+                       (*items)[i].stamp);
+        path_prev(sub);
+        total_bytes += (*items)[i].bytes;
+        total_files += (*items)[i].files;
+    }
+    path_free(sub);
+
+    // the files directly in dir have no ctime, so dir is measured in full
+    du_cache_store(dir->path->str, total_bytes, total_files, 0);
+
+    return DISK_USAGE_OK;
+}
+
+/**
+ * Measures the pending items with up to DISK_USAGE_MAX_CHANNELS finds running
+ * at once, each first asking whether anything changed since the totals the
+ * item has from last time. Items that could not be measured that way are
+ * walked over sftp afterwards.
+ */
+static int du_measure_concurrent(sftp_session    session,
+                                 Path            dir,
+                                 struct du_item* items,
+                                 int             count) {
+    struct du_progress progress = {0, 0, 0};
+    ExecGroup          group    = NULL;
+    Path               sub;
+    char*              command;
+
+    for(int i = 0; i < count; i++) {
+        if(items[i].pending) progress.pending++;
+    }
+    if(progress.pending == 0) return DISK_USAGE_OK;
+
+    sub = path_duplicate(dir);
+    if(sub == NULL) return DISK_USAGE_ERROR;
+
+    if(remote_ls_supported(session->session)) {
+        group = exec_group_init(session->session, DISK_USAGE_MAX_CHANNELS, 0);
+    }
+    if(group != NULL) {
+        for(int i = 0; i < count; i++) {
+            if(!items[i].pending) continue;
+
+            path_go_into(sub, items[i].name);
+            items[i].cached = du_cache_find(sub->path->str);
+            command         = du_command(sub, items[i].cached);
+            if(command != NULL) {
+                items[i].bytes = 0;
+                items[i].files = 0;
+                items[i].stamp = 0;
+                exec_group_add(group, command, &items[i]);
+                free(command);
+            }
+            path_prev(sub);
+        }
+
+        exec_group_run(group, du_parse_output, du_job_done, &progress);
+        printf(", %d unchanged\n", progress.unchanged);
+        exec_group_free(group);
+    }
+
+    // whatever the finds could not do is walked one directory at a time
+    for(int i = 0; i < count; i++) {
+        if(!items[i].pending) continue;
+
+        path_go_into(sub, items[i].name);
+        items[i].bytes = 0;
+        items[i].files = 0;
+        items[i].stamp = 0;
+        if(du_walk_sftp(session, sub, &items[i].bytes, &items[i].files) ==
+           DISK_USAGE_OK) {
+            items[i].pending = false;
+        }
+        path_prev(sub);
+    }
+
+    path_free(sub);
+    return DISK_USAGE_OK;
+}
+
+/**
+ * The find that measures dir, or that only reports it unchanged when nothing
+ * under it has a newer ctime than the stamp of the cached totals.
+ */
+static char* du_command(Path dir, DiskUsage cached) {
+    char*  quoted;
+    char*  command;
+    size_t size;
+
+    quoted = remote_ls_quote(dir->path->str);
+    if(quoted == NULL) return NULL;
+
+    // room for the path twice and the stamp
+    size    = strlen(quoted) * 2 + sizeof(DISK_USAGE_COMMAND_SINCE) + 64;
+    command = (char*)malloc(size);
+    if(command != NULL && cached != NULL && cached->stamp != 0) {
+        snprintf(command,
+                 size,
+                 DISK_USAGE_COMMAND_SINCE,
+                 quoted,
+                 (unsigned long long)(cached->stamp / DISK_USAGE_NSEC),
+                 (unsigned long long)(cached->stamp % DISK_USAGE_NSEC),
+                 quoted);
+    } else if(command != NULL) {
+        snprintf(command, size, DISK_USAGE_COMMAND, quoted);
+    }
+    free(quoted);
+
+    return command;
+}
+
+/**
+ * Adds up every complete "type size ctime" record, keeping the newest ctime,
+ * and leaves the incomplete one for the next read. A "u" record stands for
+ * the cached totals.
+ */
+static size_t du_parse_output(struct exec_job* job,
+                              const char*      data,
+                              size_t           length,
+                              void*            user) {
+    struct du_item* item   = (struct du_item*)job->data;
+    const char*     record = data;
+    const char*     end;
+
+    (void)user;
+    while((end = memchr(record, '\0', length - (record - data))) != NULL) {
+        if(record[0] == 'u' && item->cached != NULL) {
+            item->bytes = item->cached->bytes;
+            item->files = item->cached->files;
+            item->stamp = item->cached->stamp;
+        } else {
+            du_parse_record(item, record);
+        }
+        record = end + 1;
+    }
+
+    // a full buffer without a whole record in it is not find output
+    if(record == data && length == EXEC_GROUP_BUFFER_SIZE) return length;
+
+    return record - data;
+}
+
+/**
+ * Adds one "type size seconds.fraction" record to the item.
+ */
+static void du_parse_record(struct du_item* item, const char* record) {
+    char*    p;
+    uint64_t size;
+    uint64_t stamp;
+
+    size  = strtoull(record + 1, &p, 10);
+    stamp = strtoull(p, &p, 10) * DISK_USAGE_NSEC;
+    if(*p == '.') p++;
+    for(uint64_t unit = DISK_USAGE_NSEC / 10;
+        unit > 0 && *p >= '0' && *p <= '9';
+        unit /= 10) {
+        stamp += (uint64_t)(*p++ - '0') * unit;
+    }
+
+    if(record[0] == 'f') {
+        item->bytes += size;
+        item->files++;
+    }
+    if(stamp > item->stamp) item->stamp = stamp;
+}
+
+static void du_job_done(struct exec_job* job, void* user) {
+    struct du_progress* progress = (struct du_progress*)user;
+    struct du_item*     item     = (struct du_item*)job->data;
+
+    if(job->state == EXEC_JOB_DONE) {
+        item->pending = false;
+        if(item->cached != NULL && item->stamp == item->cached->stamp) {
+            progress->unchanged++;
+        }
+    } else {
+        fprintf(stderr,
+                "\nFailed to measure %s: %s\n",
+                item->name,
+                job->errors);
+    }
+
+    progress->measured++;
+    printf("\rmeasured %d of %d directories",
+           progress->measured,
+           progress->pending);
+    fflush(stdout);
+}
+
+/**
+ * Plain recursive sftp walk for remotes whose find cannot do -printf.
+ */
+static int du_walk_sftp(sftp_session session,
+                        Path         dir,
+                        uint64_t*    bytes,
+                        uint64_t*    files) {
+    sftp_dir        directory;
+    sftp_attributes attr;
+
+    directory = sftp_opendir(session, dir->path->str);
+    if(directory == NULL) {
+        fprintf(stderr,
+                "Failed to open directory %s: %s\n",
+                dir->path->str,
+                ssh_get_error(session));
+        return DISK_USAGE_ERROR;
+    }
+
+    while((attr = sftp_readdir(session, directory)) != NULL) {
+        if(attr->type == SSH_FILEXFER_TYPE_REGULAR) {
+            *bytes += attr->size;
+            (*files)++;
+        } else if(attr->type == SSH_FILEXFER_TYPE_DIRECTORY &&
+                  strcmp(attr->name, ".") != 0 &&
+                  strcmp(attr->name, "..") != 0) {
+            path_go_into(dir, attr->name);
+            du_walk_sftp(session, dir, bytes, files);
+            path_prev(dir);
+        }
+        sftp_attributes_free(attr);
+    }
+
+    sftp_closedir(directory);
+    return DISK_USAGE_OK;
+}
+
+static DiskUsage du_cache_find(const char* path) {
+    uint64_t  hash = FNV_OFFSET_BASIS;
+    DiskUsage usage;
+
+    for(const char* p = path; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * FNV_PRIME;
+    }
+
+    for(usage = cache[hash % DISK_USAGE_CACHE_SIZE]; usage != NULL;
+        usage = usage->next) {
+        if(strcmp(usage->path, path) == 0) return usage;
+    }
+
+    return NULL;
+}
+
+static void du_cache_store(const char* path,
+                           uint64_t    bytes,
+                           uint64_t    files,
+                           uint64_t    stamp) {
+    uint64_t  hash  = FNV_OFFSET_BASIS;
+    DiskUsage usage = du_cache_find(path);
+
+    if(usage == NULL) {
+        for(const char* p = path; *p != '\0'; p++) {
+            hash = (hash ^ (unsigned char)*p) * FNV_PRIME;
+        }
+
+        usage = (DiskUsage)malloc(sizeof(struct disk_usage));
+        if(usage == NULL) return;
+        usage->path = strdup(path);
+        if(usage->path == NULL) {
+            free(usage);
+            return;
+        }
+        usage->next = cache[hash % DISK_USAGE_CACHE_SIZE];
+        cache[hash % DISK_USAGE_CACHE_SIZE] = usage;
+    }
+
+    usage->bytes = bytes;
+    usage->files = files;
+    usage->stamp = stamp;
+}
+
+static int du_compare_items(const void* a, const void* b) {
+    uint64_t first  = ((const struct du_item*)a)->bytes;
+    uint64_t second = ((const struct du_item*)b)->bytes;
+
+    return (first < second) - (first > second);
+}
+
+static void du_free_items(struct du_item* items, int count) {
+    for(int i = 0; i < count; i++) {
+        free(items[i].name);
+    }
+    free(items);
+}
@@ -0,0 +1,679 @@
+#include "download_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#  include <linux/fs.h>
+#endif
+
+#include "checksum.h"
+#include "path.h"
+
+#define DOWNLOAD_CACHE_BUFFER_SIZE 65536
+
+/**
+ * The limit is set once at the start, the directory is found the first time
+ * the cache is used and kept for the rest of the run.
+ */
+static pthread_mutex_t download_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        download_cache_limit = 0;
+static char*           download_cache_root  = NULL;
+
+static int   download_cache_lock(void);
+static void  download_cache_unlock(int lock);
+static char* download_cache_file(const char* name);
+static int   download_cache_key(ssh_session     session,
+                                const char*     remote,
+                                sftp_attributes attr,
+                                char*           key);
+static int   download_cache_load(struct download_cache_index* index);
+static int   download_cache_save(struct download_cache_index* index);
+static struct download_cache_entry* download_cache_find(
+    struct download_cache_index* index,
+    const char*                  key,
+    const char*                  object);
+static struct download_cache_entry* download_cache_add(
+    struct download_cache_index* index,
+    const char*                  key,
+    const char*                  object,
+    uint64_t                     size);
+static void download_cache_drop(struct download_cache_index* index,
+                                const char*                  object);
+static void download_cache_evict(struct download_cache_index* index,
+                                 const char*                  keep);
+static int64_t download_cache_last_used(struct download_cache_index* index,
+                                        const char*                  object);
+static int  download_cache_open(struct download_cache_entry* entry);
+static int  download_cache_copy(int from, int to);
+
+/**
+ * Lets the cache take up to bytes, 0 turns it off.
+ */
+void download_cache_set_limit(uint64_t bytes) {
+    pthread_mutex_lock(&download_cache_mutex);
+    download_cache_limit = bytes;
+    pthread_mutex_unlock(&download_cache_mutex);
+}
+
+/**
+ * Whether the remote file described by attr is worth keeping. Small files
+ * cost less to send again than to look up and a file larger than the whole
+ * cache would only push everything else out.
+ */
+bool download_cache_wants(sftp_attributes attr) {
+    uint64_t limit;
+
+    pthread_mutex_lock(&download_cache_mutex);
+    limit = download_cache_limit;
+    pthread_mutex_unlock(&download_cache_mutex);
+
+    return attr != NULL && limit > 0 && attr->size >= DOWNLOAD_CACHE_MIN_SIZE &&
+           attr->size <= limit;
+}
+
+/**
+ * Opens the cached contents of the remote file for download_cache_fetch
+ * before anything is done to the local file. The file is looked up by what it
+ * is known by and then, unless type is CHECKSUM_NONE, by the hash of its
+ * contents made on the remote. Returns the descriptor, which the caller
+ * closes, or -1 if the file has to be downloaded.
+ */
+int download_cache_lookup(ssh_session        session,
+                          const char*        remote,
+                          sftp_attributes    attr,
+                          enum checksum_type type) {
+    struct download_cache_index  index = {0};
+    struct download_cache_entry* entry;
+    char                         key[CHECKSUM_HEX_SIZE];
+    char                         hex[CHECKSUM_HEX_SIZE];
+    char                         object[DOWNLOAD_CACHE_NAME_SIZE];
+    bool                         hashed = false;
+    int                          from   = -1;
+    int                          lock;
+
+    if(session == NULL || remote == NULL) {
+        fprintf(stderr, "cannot pass null values to download_cache_lookup\n");
+        return -1;
+    }
+    if(!download_cache_wants(attr) ||
+       download_cache_key(session, remote, attr, key) != DOWNLOAD_CACHE_OK) {
+        return -1;
+    }
+
+    lock = download_cache_lock();
+    if(lock < 0) return -1;
+    download_cache_load(&index);
+    entry = download_cache_find(&index, key, NULL);
+
+    if(entry == NULL && type != CHECKSUM_NONE) {
+        // the remote hash takes a round trip, other threads and processes
+        // keep using the cache meanwhile
+        download_cache_unlock(lock);
+        hashed =
+            checksum_remote(session, type, remote, hex) == CHECKSUM_OK &&
+            download_cache_object_name(type, hex, object) == DOWNLOAD_CACHE_OK;
+
+        lock = download_cache_lock();
+        if(lock < 0) {
+            free(index.entries);
+            return -1;
+        }
+        download_cache_load(&index);
+        entry = download_cache_find(&index, key, NULL);
+        if(entry == NULL && hashed &&
+           download_cache_find(&index, NULL, object) != NULL) {
+            // the same contents under another name, known by this one too
+            entry = download_cache_add(&index, key, object, attr->size);
+        }
+    }
+
+    if(entry != NULL) {
+        from = download_cache_open(entry);
+        if(from < 0) {
+            download_cache_drop(&index, entry->object);
+        } else {
+            entry->used = (int64_t)time(NULL);
+        }
+        download_cache_save(&index);
+    }
+    download_cache_unlock(lock);
+    free(index.entries);
+
+    // an object evicted meanwhile stays readable through from
+    return from;
+}
+
+/**
+ * Writes the contents opened by download_cache_lookup into to, which has to
+ * be empty. Leaves to empty if that fails.
+ */
+int download_cache_fetch(int cached, FILE* to) {
+    if(cached < 0 || to == NULL) {
+        fprintf(stderr, "cannot pass null values to download_cache_fetch\n");
+        return DOWNLOAD_CACHE_ERROR;
+    }
+
+    return download_cache_copy(cached, fileno(to));
+}
+
+/**
+ * Keeps the downloaded file at local as the contents of the remote file.
+ * object names the contents when their hash is known, made with
+ * download_cache_object_name, NULL keeps them under the remote file alone.
+ */
+int download_cache_store(ssh_session     session,
+                         const char*     remote,
+                         sftp_attributes attr,
+                         const char*     object,
+                         const char*     local) {
+    struct download_cache_index index = {0};
+    char                        key[CHECKSUM_HEX_SIZE];
+    char                        name[DOWNLOAD_CACHE_NAME_SIZE];
+    char*                       stored;
+    char*                       temp;
+    int                         lock;
+    int                         from;
+    int                         to;
+    int                         rc = DOWNLOAD_CACHE_ERROR;
+
+    if(session == NULL || remote == NULL || local == NULL) {
+        fprintf(stderr, "cannot pass null values to download_cache_store\n");
+        return DOWNLOAD_CACHE_ERROR;
+    }
+    if(!download_cache_wants(attr) ||
+       download_cache_key(session, remote, attr, key) != DOWNLOAD_CACHE_OK) {
+        return DOWNLOAD_CACHE_ERROR;
+    }
+    if(object != NULL) {
+        snprintf(name, DOWNLOAD_CACHE_NAME_SIZE, "%s", object);
+    } else {
+        snprintf(name, DOWNLOAD_CACHE_NAME_SIZE, "id-%s", key);
+    }
+
+    lock = download_cache_lock();
+    if(lock < 0) return DOWNLOAD_CACHE_ERROR;
+    stored = download_cache_file(name);
+    download_cache_load(&index);
+    if(stored != NULL && download_cache_find(&index, NULL, name) != NULL &&
+       access(stored, F_OK) == 0) {
+        // the contents are there already, only the name is new
+        download_cache_add(&index, key, name, attr->size);
+        rc = download_cache_save(&index);
+        download_cache_unlock(lock);
+        free(index.entries);
+        free(stored);
+        return rc;
+    }
+    download_cache_unlock(lock);
+
+    // copied outside the lock and moved in whole, nobody sees half an object
+    temp = download_cache_file("object.XXXXXX");
+    to   = (temp != NULL) ? mkstemp(temp) : -1;
+    from = open(local, O_RDONLY);
+    if(stored == NULL || to < 0 || from < 0 ||
+       download_cache_copy(from, to) != DOWNLOAD_CACHE_OK) {
+        fprintf(stderr, "could not keep %s in the download cache\n", local);
+        if(to >= 0) unlink(temp);
+    } else {
+        rc = DOWNLOAD_CACHE_OK;
+    }
+    if(from >= 0) close(from);
+    if(to >= 0) close(to);
+
+    if(rc == DOWNLOAD_CACHE_OK) {
+        rc   = DOWNLOAD_CACHE_ERROR;
+        lock = download_cache_lock();
+        if(lock >= 0) {
+            download_cache_load(&index);
+            if(rename(temp, stored) == 0) {
+                download_cache_add(&index, key, name, attr->size);
+                download_cache_evict(&index, name);
+                rc = download_cache_save(&index);
+            } else {
+                unlink(temp);
+            }
+            download_cache_unlock(lock);
+        }
+    }
+
+    free(index.entries);
+    free(stored);
+    free(temp);
+    return rc;
+}
+
+/**
+ * Writes the name of the object holding contents that hash to hex into name,
+ * which has to hold DOWNLOAD_CACHE_NAME_SIZE chars.
+ */
+int download_cache_object_name(enum checksum_type type,
+                               const char*        hex,
+                               char*              name) {
+    const char* type_name = checksum_name(type);
+
+    if(type == CHECKSUM_NONE || type_name == NULL || hex == NULL ||
+       hex[0] == '\0') {
+        return DOWNLOAD_CACHE_ERROR;
+    }
+
+    snprintf(name, DOWNLOAD_CACHE_NAME_SIZE, "%s-%s", type_name, hex);
+    return DOWNLOAD_CACHE_OK;
+}
+
+/**
+ * Takes the cache for the calling thread and process, creating its directory
+ * the first time. Returns the lock to give to download_cache_unlock or -1.
+ */
+static int download_cache_lock(void) {
+    Path  dir;
+    char* name;
+    int   lock;
+
+    pthread_mutex_lock(&download_cache_mutex);
+
+    if(download_cache_root == NULL) {
+        dir = path_get_cache_directory(true);
+        if(dir != NULL) {
+            path_go_into(dir, DOWNLOAD_CACHE_DIRECTORY);
+            if(mkdir(dir->path->str, 0700) == 0 || errno == EEXIST) {
+                download_cache_root = strdup(dir->path->str);
+            }
+            path_free(dir);
+        }
+        if(download_cache_root == NULL) {
+            fprintf(stderr, "could not create the download cache\n");
+            pthread_mutex_unlock(&download_cache_mutex);
+            return -1;
+        }
+    }
+
+    name = download_cache_file(DOWNLOAD_CACHE_LOCK);
+    lock = (name != NULL) ? open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600) : -1;
+    free(name);
+    if(lock < 0 || flock(lock, LOCK_EX) != 0) {
+        fprintf(stderr, "could not lock the download cache\n");
+        if(lock >= 0) close(lock);
+        pthread_mutex_unlock(&download_cache_mutex);
+        return -1;
+    }
+
+    return lock;
+}
+
+static void download_cache_unlock(int lock) {
+    flock(lock, LOCK_UN);
+    close(lock);
+    pthread_mutex_unlock(&download_cache_mutex);
+}
+
+/**
+ * The path of name inside the cache directory, freed by the caller.
+ */
+static char* download_cache_file(const char* name) {
+    char*  file;
+    size_t size;
+
+    size = strlen(download_cache_root) + strlen(name) + 2;
+    file = (char*)malloc(size);
+    if(file == NULL) {
+        fprintf(stderr, "failed to allocate memory for the download cache\n");
+        return NULL;
+    }
+    snprintf(file, size, "%s/%s", download_cache_root, name);
+
+    return file;
+}
+
+/**
+ * Writes the hash of what the remote file is known by into key, a change to
+ * its size or modification time makes it another file.
+ */
+static int download_cache_key(ssh_session     session,
+                              const char*     remote,
+                              sftp_attributes attr,
+                              char*           key) {
+    Checksum     sum;
+    char*        host = NULL;
+    char*        user = NULL;
+    char         numbers[64];
+    unsigned int port = 0;
+    int          rc   = DOWNLOAD_CACHE_ERROR;
+
+    if(ssh_options_get(session, SSH_OPTIONS_HOST, &host) != SSH_OK) {
+        return DOWNLOAD_CACHE_ERROR;
+    }
+    if(ssh_options_get(session, SSH_OPTIONS_USER, &user) != SSH_OK) {
+        user = NULL;
+    }
+    ssh_options_get_port(session, &port);
+    snprintf(numbers,
+             sizeof(numbers),
+             "%u %" PRIu64 " %" PRIu32,
+             port,
+             attr->size,
+             attr->mtime);
+
+    // the parts keep their NUL so no two of them run together the same way
+    sum = checksum_init(CHECKSUM_SHA256);
+    if(sum != NULL) {
+        if(user == NULL) checksum_update(sum, "", 1);
+        if(user != NULL) checksum_update(sum, user, strlen(user) + 1);
+        checksum_update(sum, host, strlen(host) + 1);
+        checksum_update(sum, numbers, strlen(numbers) + 1);
+        checksum_update(sum, remote, strlen(remote) + 1);
+        rc = (checksum_final(sum, key) == CHECKSUM_OK) ? DOWNLOAD_CACHE_OK
+                                                       : DOWNLOAD_CACHE_ERROR;
+        checksum_free(sum);
+    }
+
+    ssh_string_free_char(host);
+    if(user != NULL) ssh_string_free_char(user);
+    return rc;
+}
+
+/**
+ * Reads the index into index, replacing what it held. A missing index is an
+ * empty one and lines that do not make sense are left out.
+ */
+static int download_cache_load(struct download_cache_index* index) {
+    struct download_cache_entry* entry;
+    char                         line[CHECKSUM_HEX_SIZE * 2 + 64];
+    char*                        fields[4];
+    char*                        rest;
+    char*                        name;
+    FILE*                        fp;
+    int                          count;
+
+    index->count = 0;
+
+    name = download_cache_file(DOWNLOAD_CACHE_INDEX);
+    if(name == NULL) return DOWNLOAD_CACHE_ERROR;
+    fp = fopen(name, "r");
+    free(name);
+    if(fp == NULL) {
+        return (errno == ENOENT) ? DOWNLOAD_CACHE_OK : DOWNLOAD_CACHE_ERROR;
+    }
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        count = 0;
+        for(char* field = strtok_r(line, " \n", &rest);
+            field != NULL && count < 4;
+            field = strtok_r(NULL, " \n", &rest)) {
+            fields[count++] = field;
+        }
+        if(count < 4 || strlen(fields[0]) >= CHECKSUM_HEX_SIZE ||
+           strlen(fields[1]) >= DOWNLOAD_CACHE_NAME_SIZE ||
+           strchr(fields[1], '/') != NULL) {
+            continue;
+        }
+
+        entry = download_cache_add(index,
+                                   fields[0],
+                                   fields[1],
+                                   strtoull(fields[2], NULL, 10));
+        if(entry != NULL) entry->used = strtoll(fields[3], NULL, 10);
+    }
+
+    fclose(fp);
+    return DOWNLOAD_CACHE_OK;
+}
+
+/**
+ * Replaces the index with index, whole so a crash leaves the old one.
+ */
+static int download_cache_save(struct download_cache_index* index) {
+    char* name;
+    char* temp;
+    FILE* fp;
+    int   rc = DOWNLOAD_CACHE_ERROR;
+
+    name = download_cache_file(DOWNLOAD_CACHE_INDEX);
+    temp = download_cache_file(DOWNLOAD_CACHE_INDEX ".new");
+    fp   = (name != NULL && temp != NULL) ? fopen(temp, "w") : NULL;
+    if(fp != NULL) {
+        for(int i = 0; i < index->count; i++) {
+            fprintf(fp,
+                    "%s %s %" PRIu64 " %" PRId64 "\n",
+                    index->entries[i].key,
+                    index->entries[i].object,
+                    index->entries[i].size,
+                    index->entries[i].used);
+        }
+        if(fclose(fp) == 0 && rename(temp, name) == 0) {
+            rc = DOWNLOAD_CACHE_OK;
+        } else {
+            unlink(temp);
+        }
+    }
+    if(rc != DOWNLOAD_CACHE_OK) {
+        fprintf(stderr, "could not save the download cache index\n");
+    }
+
+    free(name);
+    free(temp);
+    return rc;
+}
+
+/**
+ * The entry for key, or the first one held by object if key is NULL. NULL if
+ * there is none or both are NULL.
+ */
+static struct download_cache_entry* download_cache_find(
+    struct download_cache_index* index,
+    const char*                  key,
+    const char*                  object) {
+    for(int i = 0; i < index->count; i++) {
+        if(key != NULL && strcmp(index->entries[i].key, key) == 0) {
+            return &index->entries[i];
+        }
+        if(key == NULL && object != NULL &&
+           strcmp(index->entries[i].object, object) == 0) {
+            return &index->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Points key at object, used now. Returns the entry, which stays valid until
+ * the index changes again.
+ */
+static struct download_cache_entry* download_cache_add(
+    struct download_cache_index* index,
+    const char*                  key,
+    const char*                  object,
+    uint64_t                     size) {
+    struct download_cache_entry* entries;
+    struct download_cache_entry* entry;
+    int                          capacity;
+
+    entry = download_cache_find(index, key, NULL);
+    if(entry == NULL) {
+        if(index->count == index->capacity) {
+            capacity = (index->capacity == 0) ? DOWNLOAD_CACHE_INITIAL_ENTRIES
+                                              : index->capacity * 2;
+            entries  = (struct download_cache_entry*)realloc(
+                index->entries,
+                capacity * sizeof(struct download_cache_entry));
+            if(entries == NULL) {
+                fprintf(stderr,
+                        "failed to allocate memory for the download cache\n");
+                return NULL;
+            }
+            index->entries  = entries;
+            index->capacity = capacity;
+        }
+        entry = &index->entries[index->count++];
+        snprintf(entry->key, CHECKSUM_HEX_SIZE, "%s", key);
+    }
+
+    snprintf(entry->object, DOWNLOAD_CACHE_NAME_SIZE, "%s", object);
+    entry->size = size;
+    entry->used = (int64_t)time(NULL);
+
+    return entry;
+}
+
+/**
+ * Forgets object and every name it was known by and removes its file.
+ */
+static void download_cache_drop(struct download_cache_index* index,
+                                const char*                  object) {
+    char  name[DOWNLOAD_CACHE_NAME_SIZE];
+    char* file;
+    int   kept = 0;
+
+    // object may point into the entries about to move
+    snprintf(name, DOWNLOAD_CACHE_NAME_SIZE, "%s", object);
+
+    for(int i = 0; i < index->count; i++) {
+        if(strcmp(index->entries[i].object, name) != 0) {
+            index->entries[kept++] = index->entries[i];
+        }
+    }
+    index->count = kept;
+
+    file = download_cache_file(name);
+    if(file != NULL) {
+        unlink(file);
+        free(file);
+    }
+}
+
+/**
+ * Drops the least recently used objects until the rest fit the limit. keep,
+ * the object just stored, is never dropped.
+ */
+static void download_cache_evict(struct download_cache_index* index,
+                                 const char*                  keep) {
+    struct download_cache_entry* entry;
+    struct download_cache_entry* oldest;
+    int64_t                      oldest_used = 0;
+    int64_t                      used;
+    uint64_t                     total = 0;
+    bool                         counted;
+
+    // an object known by several names takes up its size once, it is as
+    // recently used as the last of them
+    for(int i = 0; i < index->count; i++) {
+        counted = false;
+        for(int j = 0; j < i && !counted; j++) {
+            counted = strcmp(index->entries[j].object,
+                             index->entries[i].object) == 0;
+        }
+        if(!counted) total += index->entries[i].size;
+    }
+
+    while(total > download_cache_limit) {
+        oldest = NULL;
+        for(int i = 0; i < index->count; i++) {
+            entry = &index->entries[i];
+            if(strcmp(entry->object, keep) == 0) continue;
+
+            used = download_cache_last_used(index, entry->object);
+            if(oldest == NULL || used < oldest_used) {
+                oldest      = entry;
+                oldest_used = used;
+            }
+        }
+        if(oldest == NULL) break;
+
+        total -= oldest->size;
+        download_cache_drop(index, oldest->object);
+    }
+}
+
+/**
+ * When any name of object was last used.
+ */
+static int64_t download_cache_last_used(struct download_cache_index* index,
+                                        const char*                  object) {
+    int64_t used = 0;
+
+    for(int i = 0; i < index->count; i++) {
+        if(strcmp(index->entries[i].object, object) == 0 &&
+           index->entries[i].used > used) {
+            used = index->entries[i].used;
+        }
+    }
+
+    return used;
+}
+
+/**
+ * Opens the object of entry for reading, -1 if it is gone or not what the
+ * index says it is.
+ */
+static int download_cache_open(struct download_cache_entry* entry) {
+    struct stat info;
+    char*       file;
+    int         fd;
+
+    file = download_cache_file(entry->object);
+    if(file == NULL) return -1;
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    free(file);
+    if(fd < 0) return -1;
+
+    if(fstat(fd, &info) != 0 || (uint64_t)info.st_size != entry->size) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Fills the empty file to with the contents of from, sharing their blocks
+ * where the file system can. to is left empty if that fails.
+ */
+static int download_cache_copy(int from, int to) {
+    char    buffer[DOWNLOAD_CACHE_BUFFER_SIZE];
+    ssize_t nbytes;
+    ssize_t written;
+
+#ifdef FICLONE
+    if(ioctl(to, FICLONE, from) == 0) return DOWNLOAD_CACHE_OK;
+#endif
+
+    while((nbytes = read(from, buffer, DOWNLOAD_CACHE_BUFFER_SIZE)) != 0) {
+        if(nbytes < 0 && errno == EINTR) continue;
+        if(nbytes < 0) break;
+
+        for(ssize_t done = 0; done < nbytes; done += written) {
+            written = write(to, buffer + done, nbytes - done);
+            if(written < 0 && errno == EINTR) {
+                written = 0;
+            } else if(written < 0) {
+                nbytes = -1;
+                break;
+            }
+        }
+        if(nbytes < 0) break;
+    }
+
+    if(nbytes != 0) {
+        if(ftruncate(to, 0) != 0 || lseek(to, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "could not empty a file after a failed copy\n");
+        }
+        return DOWNLOAD_CACHE_ERROR;
+    }
+
+    return DOWNLOAD_CACHE_OK;
+}
@@ -5,26 +5,42 @@
 #include <string.h>
 
 DynamicStr dynamic_str_init(const char* str) {
+    return dynamic_str_init_arena(NULL, str);
+}
+
+DynamicStr dynamic_str_init_arena(Arena arena, const char* str) {
+    DynamicStr new_str;
+    int        len;
+
     if(str == NULL) {
         fprintf(stderr, "the initial string cannot be null\n");
         return NULL;
     }
 
-    DynamicStr new_str = (DynamicStr)malloc(sizeof(struct dynamic_str));
+    if(arena != NULL) {
+        new_str = (DynamicStr)arena_alloc(arena, sizeof(struct dynamic_str));
+    } else {
+        new_str = (DynamicStr)malloc(sizeof(struct dynamic_str));
+    }
     if(new_str == NULL) {
         fprintf(stderr, "failed to allocate memory to a DynamicStr\n");
         return NULL;
     }
 
-    new_str->str = strdup(str);
-    if(new_str->str == NULL) {
+    new_str->str      = new_str->inline_str;
+    new_str->size     = 1;
+    new_str->capacity = DYNAMIC_STR_INLINE_SIZE;
+    new_str->arena    = arena;
+    new_str->str[0]   = '\0';
+
+    len = strlen(str);
+    if(dynamic_str_append(new_str, str, len) != DYNAMIC_STR_OK) {
         fprintf(
             stderr,
             "failed to allocate memory for the string inside the dynamic str\n");
-        free(new_str);
+        if(arena == NULL) free(new_str);
         return NULL;
     }
-    new_str->size = strlen(str) + 1;
 
     return new_str;
 }
@@ -36,16 +52,26 @@ int dynamic_str_cat(DynamicStr dest, const char* src) {
         return DYNAMIC_STR_ERROR;
     }
 
-    dest->str =
-        (char*)realloc(dest->str, sizeof(char) * (dest->size + strlen(src)));
-    if(dest->str == NULL) {
-        fprintf(stderr,
-                "error occured while reallcoating memory to dynamic string\n");
+    return dynamic_str_append(dest, src, strlen(src));
+}
+
+/**
+ * Appends the first len chars of src. Only src is read, the length of dest is
+ * already known.
+ */
+int dynamic_str_append(DynamicStr dest, const char* src, int len) {
+    if(dest == NULL || src == NULL || len < 0) {
+        fprintf(stderr, "destination or src cannot be null when appending\n");
         return DYNAMIC_STR_ERROR;
     }
-    dest->size = dest->size + strlen(src);
 
-    strcat(dest->str, src);
+    if(dynamic_str_reserve(dest, dest->size + len) != DYNAMIC_STR_OK) {
+        return DYNAMIC_STR_ERROR;
+    }
+
+    memcpy(dest->str + dest->size - 1, src, len);
+    dest->size                += len;
+    dest->str[dest->size - 1]  = '\0';
 
     return DYNAMIC_STR_OK;
 }
@@ -57,17 +83,10 @@ int dynamic_str_change(DynamicStr dest, char* src) {
         return DYNAMIC_STR_ERROR;
     }
 
-    dest->str = (char*)realloc(dest->str, sizeof(char) * (strlen(src) + 1));
-    if(dest->str == NULL) {
-        fprintf(stderr,
-                "error occured while reallcoating memory to dynamic string\n");
-        return DYNAMIC_STR_ERROR;
-    }
-    dest->size = strlen(src) + 1;
+    dest->size   = 1;
+    dest->str[0] = '\0';
 
-    strcpy(dest->str, src);
-
-    return DYNAMIC_STR_OK;
+    return dynamic_str_append(dest, src, strlen(src));
 }
 
 /**
@@ -87,20 +106,71 @@ int dynamic_str_remove(DynamicStr str, int index) {
         return DYNAMIC_STR_ERROR;
     }
 
-    str->str = (char*)realloc(str->str, index + 1);
-    if(str->str == NULL) {
-        fprintf(stderr, "failed to resize string when removing\n");
+    return dynamic_str_truncate(str, index);
+}
+
+/**
+ * Cuts the string down to length chars. The memory is kept for the next
+ * append.
+ */
+int dynamic_str_truncate(DynamicStr str, int length) {
+    if(str == NULL || length < 0 || length > str->size - 1) {
+        fprintf(stderr, "cannot truncate dynamic string to %d\n", length);
+        return DYNAMIC_STR_ERROR;
+    }
+
+    str->str[length] = '\0';
+    str->size        = length + 1;
+
+    return DYNAMIC_STR_OK;
+}
+
+/**
+ * Makes sure the string can hold capacity chars including the NUL, at least
+ * doubling the buffer when it has to grow.
+ */
+int dynamic_str_reserve(DynamicStr str, int capacity) {
+    char* temp;
+    int   new_capacity;
+
+    if(str == NULL) {
+        fprintf(stderr, "dynamic string cannot be null\n");
         return DYNAMIC_STR_ERROR;
     }
 
-    str->str[index] = '\0';
-    str->size       = index + 1;
+    if(capacity <= str->capacity) return DYNAMIC_STR_OK;
+
+    new_capacity = str->capacity * 2;
+    while(new_capacity < capacity) new_capacity *= 2;
+
+    if(str->arena != NULL) {
+        // the old buffer stays in the arena until it is released
+        temp = (char*)arena_alloc(str->arena, sizeof(char) * new_capacity);
+        if(temp != NULL) memcpy(temp, str->str, str->size);
+    } else if(str->str == str->inline_str) {
+        temp = (char*)malloc(sizeof(char) * new_capacity);
+        if(temp != NULL) memcpy(temp, str->inline_str, str->size);
+    } else {
+        temp = (char*)realloc(str->str, sizeof(char) * new_capacity);
+    }
+    if(temp == NULL) {
+        fprintf(stderr,
+                "error occured while reallcoating memory to dynamic string\n");
+        return DYNAMIC_STR_ERROR;
+    }
+
+    str->str      = temp;
+    str->capacity = new_capacity;
 
     return DYNAMIC_STR_OK;
 }
 
+int dynamic_str_length(DynamicStr str) { return str->size - 1; }
+
 int dynamic_str_free(DynamicStr str) {
-    free(str->str);
+    if(str->arena != NULL) return DYNAMIC_STR_OK;
+
+    if(str->str != str->inline_str) free(str->str);
     free(str);
     return DYNAMIC_STR_OK;
 }
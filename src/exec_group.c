@@ -0,0 +1,391 @@
+#include "exec_group.h"
+
+#include <libssh/libssh.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static bool   exec_group_start(ExecGroup group, struct exec_job* job);
+static bool   exec_group_step(ExecGroup group, struct exec_job* job);
+static bool   exec_group_read(ExecGroup group, struct exec_job* job);
+static size_t exec_group_room(ExecGroup group, struct exec_job* job);
+static void   exec_group_error(struct exec_job* job, const char* error);
+static void   exec_group_finish(ExecGroup           group,
+                                struct exec_job*    job,
+                                enum exec_job_state state);
+static double exec_group_now(void);
+
+/**
+ * A group running at most channels commands at a time on session, each for at
+ * most timeout ms unless it is 0. The session has to be connected and stays
+ * owned by the caller.
+ */
+ExecGroup exec_group_init(ssh_session session, int channels, int timeout) {
+    ExecGroup group;
+
+    if(session == NULL) {
+        fprintf(stderr, "cannot pass null values to exec_group_init\n");
+        return NULL;
+    }
+
+    group = (ExecGroup)calloc(1, sizeof(struct exec_group));
+    if(group == NULL) {
+        fprintf(stderr, "failed to allocate memory for the commands\n");
+        return NULL;
+    }
+
+    group->session  = session;
+    group->channels = (channels > 0) ? channels : EXEC_GROUP_CHANNELS;
+    group->timeout  = (timeout > 0) ? timeout : 0;
+
+    return group;
+}
+
+/**
+ * Queues command for the next run. data is handed to the callbacks with it.
+ */
+int exec_group_add(ExecGroup group, const char* command, void* data) {
+    struct exec_job* jobs;
+    struct exec_job* job;
+    int              capacity;
+
+    if(group == NULL || command == NULL) {
+        fprintf(stderr, "cannot pass null values to exec_group_add\n");
+        return EXEC_GROUP_ERROR;
+    }
+
+    if(group->count == group->capacity) {
+        capacity = (group->capacity == 0) ? EXEC_GROUP_INITIAL_JOBS
+                                          : group->capacity * 2;
+        jobs     = (struct exec_job*)realloc(group->jobs,
+                                         capacity * sizeof(struct exec_job));
+        if(jobs == NULL) {
+            fprintf(stderr, "failed to allocate memory for the commands\n");
+            return EXEC_GROUP_ERROR;
+        }
+        group->jobs     = jobs;
+        group->capacity = capacity;
+    }
+
+    job = &group->jobs[group->count];
+    memset(job, 0, sizeof(struct exec_job));
+    job->command = strdup(command);
+    if(job->command == NULL) {
+        fprintf(stderr, "failed to allocate memory for the commands\n");
+        return EXEC_GROUP_ERROR;
+    }
+    job->data        = data;
+    job->state       = EXEC_JOB_QUEUED;
+    job->exit_status = -1;
+    group->count++;
+
+    return EXEC_GROUP_OK;
+}
+
+/**
+ * Runs every queued command and returns once all of them are over. Output is
+ * passed to output as it arrives, without it every job keeps all of its
+ * output, NUL terminated. done is called for every job as it ends, with
+ * whatever output was left unused still in the job. Neither may use the
+ * session, which is non blocking while the group runs.
+ */
+int exec_group_run(ExecGroup         group,
+                   exec_group_output output,
+                   exec_group_done   done,
+                   void*             user) {
+    struct pollfd    fds;
+    struct exec_job* job;
+    int              first = 0;  // every job before it is over
+    int              blocking;
+    bool             progress;
+
+    if(group == NULL) {
+        fprintf(stderr, "cannot pass null values to exec_group_run\n");
+        return EXEC_GROUP_ERROR;
+    }
+
+    group->output  = output;
+    group->done    = done;
+    group->user    = user;
+    group->running = 0;
+
+    blocking = ssh_is_blocking(group->session);
+    ssh_set_blocking(group->session, 0);
+
+    fds.fd     = ssh_get_fd(group->session);
+    fds.events = POLLIN;
+
+    while(first < group->count) {
+        progress = false;
+        for(int i = first; i < group->count; i++) {
+            job = &group->jobs[i];
+            if(job->state == EXEC_JOB_QUEUED) {
+                if(group->running >= group->channels) continue;
+                if(!exec_group_start(group, job)) {
+                    progress = true;
+                    continue;
+                }
+            }
+            if(job->state < EXEC_JOB_DONE && exec_group_step(group, job)) {
+                progress = true;
+            }
+        }
+        while(first < group->count &&
+              group->jobs[first].state >= EXEC_JOB_DONE) {
+            first++;
+        }
+
+        // the wait is bounded so timeouts and held back output are looked at
+        // again even if the socket stays quiet
+        if(!progress && first < group->count) {
+            poll(&fds, 1, EXEC_GROUP_POLL_INTERVAL);
+        }
+    }
+
+    ssh_set_blocking(group->session, blocking);
+    group->output = NULL;
+    group->done   = NULL;
+    group->user   = NULL;
+
+    return EXEC_GROUP_OK;
+}
+
+int exec_group_free(ExecGroup group) {
+    if(group == NULL) return EXEC_GROUP_ERROR;
+
+    for(int i = 0; i < group->count; i++) {
+        if(group->jobs[i].channel != NULL) {
+            ssh_channel_close(group->jobs[i].channel);
+            ssh_channel_free(group->jobs[i].channel);
+        }
+        free(group->jobs[i].command);
+        free(group->jobs[i].output);
+    }
+    free(group->jobs);
+    free(group);
+
+    return EXEC_GROUP_OK;
+}
+
+/**
+ * Creates the channel of job. Returns false if the job failed instead.
+ */
+static bool exec_group_start(ExecGroup group, struct exec_job* job) {
+    group->running++;
+    job->started = exec_group_now();
+    job->channel = ssh_channel_new(group->session);
+    if(job->channel == NULL) {
+        exec_group_error(job, ssh_get_error(group->session));
+        exec_group_finish(group, job, EXEC_JOB_FAILED);
+        return false;
+    }
+
+    job->state = EXEC_JOB_OPENING;
+    return true;
+}
+
+/**
+ * Moves job on as far as it goes without waiting. Returns true if anything
+ * happened.
+ */
+static bool exec_group_step(ExecGroup group, struct exec_job* job) {
+    bool opened = false;
+    int  rc;
+
+    switch(job->state) {
+        case EXEC_JOB_OPENING:
+            rc = ssh_channel_open_session(job->channel);
+            if(rc == SSH_AGAIN) break;
+            if(rc != SSH_OK && group->running > 1) {
+                // the server allows fewer sessions than there are channels,
+                // the job waits for one of the running ones to end
+                ssh_channel_free(job->channel);
+                job->channel    = NULL;
+                job->state      = EXEC_JOB_QUEUED;
+                group->channels = --group->running;
+                return true;
+            }
+            if(rc != SSH_OK) {
+                exec_group_error(job, ssh_get_error(group->session));
+                exec_group_finish(group, job, EXEC_JOB_FAILED);
+                return true;
+            }
+            job->state = EXEC_JOB_STARTING;
+            opened     = true;
+            // fall through
+
+        case EXEC_JOB_STARTING:
+            rc = ssh_channel_request_exec(job->channel, job->command);
+            if(rc == SSH_AGAIN && opened) return true;
+            if(rc == SSH_AGAIN) break;
+            if(rc != SSH_OK) {
+                exec_group_error(job, ssh_get_error(group->session));
+                exec_group_finish(group, job, EXEC_JOB_FAILED);
+                return true;
+            }
+            job->state = EXEC_JOB_RUNNING;
+            return true;
+
+        case EXEC_JOB_RUNNING: return exec_group_read(group, job);
+
+        default: break;
+    }
+
+    if(group->timeout > 0 &&
+       (exec_group_now() - job->started) * 1000 > group->timeout) {
+        exec_group_finish(group, job, EXEC_JOB_TIMED_OUT);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Reads what the command of job wrote while its buffer has room and ends the
+ * job once the command has exited.
+ */
+static bool exec_group_read(ExecGroup group, struct exec_job* job) {
+    char   errors[EXEC_GROUP_ERROR_SIZE];
+    size_t room;
+    size_t used;
+    int    nbytes;
+    bool   progress = false;
+
+    room = exec_group_room(group, job);
+    if(room == 0 && group->output == NULL) {
+        exec_group_error(job, "the command wrote too much output");
+        exec_group_finish(group, job, EXEC_JOB_FAILED);
+        return true;
+    }
+
+    if(room > 0) {
+        nbytes = ssh_channel_read_nonblocking(job->channel,
+                                              job->output + job->length,
+                                              room,
+                                              0);
+        if(nbytes == SSH_ERROR) {
+            exec_group_error(job, ssh_get_error(group->session));
+            exec_group_finish(group, job, EXEC_JOB_FAILED);
+            return true;
+        }
+        if(nbytes > 0) {
+            job->length              += nbytes;
+            job->output[job->length]  = '\0';
+            progress                  = true;
+        }
+    }
+
+    // stderr is never held back, what does not fit is dropped
+    nbytes = ssh_channel_read_nonblocking(job->channel,
+                                          errors,
+                                          EXEC_GROUP_ERROR_SIZE - 1,
+                                          1);
+    if(nbytes > 0) {
+        errors[nbytes] = '\0';
+        exec_group_error(job, errors);
+        progress = true;
+    }
+
+    if(group->output != NULL && job->length > 0) {
+        used = group->output(job, job->output, job->length, group->user);
+        if(used > job->length) used = job->length;
+        if(used > 0) {
+            memmove(job->output, job->output + used, job->length - used);
+            job->length              -= used;
+            job->output[job->length]  = '\0';
+            progress                  = true;
+        }
+    }
+
+    if(ssh_channel_is_eof(job->channel) ||
+       ssh_channel_is_closed(job->channel)) {
+        // the exit status comes right after the end of the output
+        job->exit_status = ssh_channel_get_exit_status(job->channel);
+        if(job->exit_status != -1 || ssh_channel_is_closed(job->channel)) {
+            exec_group_finish(group, job, EXEC_JOB_DONE);
+            return true;
+        }
+    }
+
+    if(!progress && group->timeout > 0 &&
+       (exec_group_now() - job->started) * 1000 > group->timeout) {
+        exec_group_finish(group, job, EXEC_JOB_TIMED_OUT);
+        return true;
+    }
+
+    return progress;
+}
+
+/**
+ * How much more output job can take, growing a collecting buffer on the way.
+ * A consumed buffer never grows past EXEC_GROUP_BUFFER_SIZE.
+ */
+static size_t exec_group_room(ExecGroup group, struct exec_job* job) {
+    size_t limit;
+    size_t capacity;
+    char*  output;
+
+    limit = (group->output != NULL) ? EXEC_GROUP_BUFFER_SIZE
+                                    : EXEC_GROUP_MAX_OUTPUT;
+    if(job->length == job->capacity && job->capacity < limit) {
+        capacity = (job->capacity == 0) ? EXEC_GROUP_BUFFER_SIZE
+                                        : job->capacity * 2;
+        if(capacity > limit) capacity = limit;
+
+        output = (char*)realloc(job->output, capacity + 1);
+        if(output == NULL) {
+            fprintf(stderr, "failed to allocate memory for the output\n");
+            return 0;
+        }
+        job->output   = output;
+        job->capacity = capacity;
+    }
+
+    return job->capacity - job->length;
+}
+
+static void exec_group_error(struct exec_job* job, const char* error) {
+    size_t length = strlen(error);
+
+    if(length > EXEC_GROUP_ERROR_SIZE - 1 - job->error_length) {
+        length = EXEC_GROUP_ERROR_SIZE - 1 - job->error_length;
+    }
+    memcpy(job->errors + job->error_length, error, length);
+    job->error_length               += length;
+    job->errors[job->error_length]  = '\0';
+}
+
+/**
+ * Ends job in state, closing its channel. A consumed buffer is let go of once
+ * done has seen it.
+ */
+static void exec_group_finish(ExecGroup           group,
+                              struct exec_job*    job,
+                              enum exec_job_state state) {
+    job->state = state;
+    if(job->channel != NULL) {
+        ssh_channel_close(job->channel);
+        ssh_channel_free(job->channel);
+        job->channel = NULL;
+    }
+    group->running--;
+
+    if(group->done != NULL) group->done(job, group->user);
+
+    if(group->output != NULL) {
+        free(job->output);
+        job->output   = NULL;
+        job->length   = 0;
+        job->capacity = 0;
+    }
+}
+
+static double exec_group_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
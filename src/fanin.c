@@ -0,0 +1,395 @@
+#include "fanin.h"
+
+#include <fnmatch.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fleet.h"
+#include "path.h"
+#include "pssh.h"
+
+static void*  fanin_worker(void* data);
+static void   fanin_host(Fanin fanin, struct fleet_host* host);
+static int    fanin_get(struct fleet_host* host,
+                        Path               local,
+                        const char*        pattern);
+static int    fanin_expand(sftp_session          sftp,
+                           const char*           base,
+                           const char*           pattern,
+                           struct fanin_matches* matches);
+static int    fanin_add(struct fanin_matches* matches,
+                        char*                 path,
+                        sftp_attributes       attr);
+static char*  fanin_join(const char* dir, const char* name);
+static double fanin_now(void);
+
+/**
+ * Copies the patterns and local, which has to be a directory or is created.
+ */
+Fanin fanin_init(char**             patterns,
+                 int                count,
+                 const char*        local,
+                 enum path_conflict policy) {
+    Fanin fanin;
+    Path  dir;
+    int   rc;
+
+    if(patterns == NULL || count < 1 || local == NULL) {
+        fprintf(stderr, "cannot pass null values to fanin_init\n");
+        return NULL;
+    }
+
+    dir = path_init(local, CURR_PLATFORM);
+    if(dir == NULL) return NULL;
+    rc = (!path_exists(dir) && path_create_directory(dir) != 0) ? FANIN_ERROR
+                                                                 : FANIN_OK;
+    if(rc == FANIN_OK && !path_is_directory(dir)) rc = FANIN_ERROR;
+    path_free(dir);
+    if(rc != FANIN_OK) {
+        fprintf(stderr, "%s could not be created\n", local);
+        return NULL;
+    }
+
+    fanin = (Fanin)calloc(1, sizeof(struct fanin));
+    if(fanin == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fan in\n");
+        return NULL;
+    }
+    pthread_mutex_init(&fanin->lock, NULL);
+
+    fanin->patterns = (char**)calloc(count, sizeof(char*));
+    fanin->local    = strdup(local);
+    if(fanin->patterns == NULL || fanin->local == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fan in\n");
+        fanin_free(fanin);
+        return NULL;
+    }
+
+    for(int i = 0; i < count; i++) {
+        fanin->patterns[i] = strdup(patterns[i]);
+        if(fanin->patterns[i] == NULL) {
+            fprintf(stderr, "failed to allocate memory for the fan in\n");
+            fanin_free(fanin);
+            return NULL;
+        }
+        fanin->pattern_count++;
+    }
+
+    fanin->policy = policy;
+
+    return fanin;
+}
+
+/**
+ * Downloads from every host of fleet with at most jobs connections open at a
+ * time. What happened on every host is left in the fleet.
+ */
+int fanin_run(Fanin fanin, Fleet fleet, int jobs) {
+    pthread_t* threads;
+    int        started = 0;
+
+    if(fanin == NULL || fleet == NULL) {
+        fprintf(stderr, "cannot pass null values to fanin_run\n");
+        return FANIN_ERROR;
+    }
+
+    if(jobs < 1 || jobs > FANIN_MAX_JOBS) jobs = FANIN_MAX_JOBS;
+    if(jobs > fleet->count) jobs = fleet->count;
+
+    threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+    if(threads == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fan in\n");
+        return FANIN_ERROR;
+    }
+
+    fanin->fleet    = fleet;
+    fanin->next     = 0;
+    fanin->finished = 0;
+    for(int i = 0; i < jobs; i++) {
+        if(pthread_create(&threads[started], NULL, fanin_worker, fanin) != 0) {
+            fprintf(stderr, "continuing with %d threads\n", started);
+            break;
+        }
+        started++;
+    }
+
+    // with no thread at all the hosts are still worked on, one by one
+    if(started == 0) fanin_worker(fanin);
+
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    return FANIN_OK;
+}
+
+int fanin_free(Fanin fanin) {
+    if(fanin == NULL) return FANIN_ERROR;
+
+    for(int i = 0; i < fanin->pattern_count; i++) free(fanin->patterns[i]);
+    free(fanin->patterns);
+    free(fanin->local);
+    pthread_mutex_destroy(&fanin->lock);
+    free(fanin);
+
+    return FANIN_OK;
+}
+
+static void* fanin_worker(void* data) {
+    Fanin fanin = (Fanin)data;
+    int   host;
+
+    // nobody is there to answer a prompt or read a progress line
+    transfer_set_quiet(true);
+    path_set_conflict(fanin->policy);
+
+    for(;;) {
+        pthread_mutex_lock(&fanin->lock);
+        host = fanin->next;
+        if(host < fanin->fleet->count) fanin->next++;
+        pthread_mutex_unlock(&fanin->lock);
+
+        if(host >= fanin->fleet->count) break;
+        fanin_host(fanin, &fanin->fleet->hosts[host]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Downloads everything matching the patterns from host into its directory
+ * and prints how it went.
+ */
+static void fanin_host(Fanin fanin, struct fleet_host* host) {
+    double   start  = fanin_now();
+    uint64_t failed = 0;
+    Path     local;
+    char*    readable;
+
+    transfer_stats_reset();
+
+    if(fleet_connect(fanin->fleet, host, true) == FLEET_OK) {
+        local = path_init(fanin->local, CURR_PLATFORM);
+        if(local == NULL || path_go_into(local, host->name) != PATH_OK ||
+           path_create_directory(local) != 0) {
+            fleet_fail(host, "failed to create its local directory");
+        } else {
+            for(int i = 0; i < fanin->pattern_count; i++) {
+                failed += fanin_get(host, local, fanin->patterns[i]);
+                if(!ssh_is_connected(host->session)) {
+                    fleet_fail(host, "lost the connection");
+                    break;
+                }
+            }
+        }
+        if(local != NULL) path_free(local);
+    }
+
+    host->stats         = transfer_stats_get();
+    host->stats.failed += failed;
+    host->seconds       = fanin_now() - start;
+    if(host->status != FLEET_FAILED) host->status = FLEET_DONE;
+    fleet_disconnect(host);
+
+    readable = get_readable_size(host->stats.bytes);
+    pthread_mutex_lock(&fanin->lock);
+    fanin->finished++;
+    fprintf(stderr,
+            "[%s] %s after %.1fs, %llu files and %s, %llu failed "
+            "(%d of %d hosts)\n",
+            host->name,
+            (host->status == FLEET_DONE) ? "done" : "failed",
+            host->seconds,
+            (unsigned long long)host->stats.files,
+            readable,
+            (unsigned long long)host->stats.failed,
+            fanin->finished,
+            fanin->fleet->count);
+    pthread_mutex_unlock(&fanin->lock);
+    free(readable);
+}
+
+/**
+ * Downloads every match of pattern on host into local. Returns how many of
+ * them failed, a pattern matching nothing fails the host.
+ */
+static int fanin_get(struct fleet_host* host,
+                     Path               local,
+                     const char*        pattern) {
+    struct fanin_matches matches = {NULL, 0, 0};
+    struct fanin_match*  match;
+    Path                 remote;
+    int                  failed = 0;
+    int                  rc;
+
+    fanin_expand(host->sftp,
+                 (pattern[0] == '/') ? "/" : "",
+                 pattern,
+                 &matches);
+    if(matches.count == 0 && ssh_is_connected(host->session)) {
+        fleet_fail(host, "nothing matches %s", pattern);
+    }
+
+    for(int i = 0; i < matches.count; i++) {
+        match  = &matches.items[i];
+        remote = path_init(match->path, PLATFORM_LINUX);
+        rc     = SSH_ERROR;
+
+        if(remote == NULL) {
+            fprintf(stderr, "[%s] failed to get %s\n", host->name, match->path);
+        } else if(match->attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+            rc = download_directory(host->sftp, remote, local);
+        } else if(match->attr->type == SSH_FILEXFER_TYPE_REGULAR) {
+            rc = download_file(host->sftp, remote, local, match->attr);
+        } else {
+            fprintf(stderr,
+                    "[%s] download not supported for %s\n",
+                    host->name,
+                    match->path);
+        }
+        if(rc != SSH_OK) failed++;
+
+        if(remote != NULL) path_free(remote);
+        free(match->path);
+        sftp_attributes_free(match->attr);
+    }
+    free(matches.items);
+
+    return failed;
+}
+
+/**
+ * Adds every remote path under base matching pattern to matches. Only the
+ * components with a wildcard are listed, the others are gone into directly.
+ */
+static int fanin_expand(sftp_session          sftp,
+                        const char*           base,
+                        const char*           pattern,
+                        struct fanin_matches* matches) {
+    sftp_attributes attr;
+    sftp_dir        dir;
+    const char*     rest;
+    char*           component;
+    char*           path;
+    size_t          length;
+    int             rc = FANIN_OK;
+
+    while(*pattern == '/') pattern++;
+
+    if(*pattern == '\0') {
+        attr = sftp_stat(sftp, (base[0] != '\0') ? base : ".");
+        if(attr == NULL) return FANIN_OK;
+
+        path = strdup(base);
+        return (path != NULL) ? fanin_add(matches, path, attr) : FANIN_ERROR;
+    }
+
+    length = strcspn(pattern, "/");
+    rest   = pattern + length;
+    while(*rest == '/') rest++;
+
+    component = strndup(pattern, length);
+    if(component == NULL) return FANIN_ERROR;
+
+    if(strpbrk(component, "*?[") == NULL) {
+        path = fanin_join(base, component);
+        rc   = (path != NULL) ? fanin_expand(sftp, path, rest, matches)
+                              : FANIN_ERROR;
+        free(path);
+        free(component);
+        return rc;
+    }
+
+    dir = sftp_opendir(sftp, (base[0] != '\0') ? base : ".");
+    if(dir == NULL) {
+        free(component);
+        return FANIN_OK;
+    }
+
+    while(rc == FANIN_OK && (attr = sftp_readdir(sftp, dir)) != NULL) {
+        if(strcmp(attr->name, ".") == 0 || strcmp(attr->name, "..") == 0 ||
+           fnmatch(component, attr->name, FNM_PERIOD) != 0) {
+            sftp_attributes_free(attr);
+            continue;
+        }
+
+        path = fanin_join(base, attr->name);
+        if(path == NULL) {
+            rc = FANIN_ERROR;
+        } else if(*rest == '\0') {
+            // the listing already has what a stat would return
+            rc   = fanin_add(matches, path, attr);
+            attr = NULL;
+        } else {
+            rc = fanin_expand(sftp, path, rest, matches);
+            free(path);
+        }
+        if(attr != NULL) sftp_attributes_free(attr);
+    }
+
+    sftp_closedir(dir);
+    free(component);
+    return rc;
+}
+
+/**
+ * Takes over path and attr.
+ */
+static int fanin_add(struct fanin_matches* matches,
+                     char*                 path,
+                     sftp_attributes       attr) {
+    struct fanin_match* items;
+    int                 capacity;
+
+    if(matches->count == matches->capacity) {
+        capacity = (matches->capacity == 0) ? FANIN_INITIAL_MATCHES
+                                            : matches->capacity * 2;
+        items    = (struct fanin_match*)realloc(
+            matches->items,
+            capacity * sizeof(struct fanin_match));
+        if(items == NULL) {
+            fprintf(stderr, "failed to allocate memory for the matches\n");
+            free(path);
+            sftp_attributes_free(attr);
+            return FANIN_ERROR;
+        }
+        matches->items    = items;
+        matches->capacity = capacity;
+    }
+
+    matches->items[matches->count].path = path;
+    matches->items[matches->count].attr = attr;
+    matches->count++;
+
+    return FANIN_OK;
+}
+
+static char* fanin_join(const char* dir, const char* name) {
+    size_t length = strlen(dir);
+    char*  joined;
+
+    if(length == 0) return strdup(name);
+
+    joined = (char*)malloc(length + strlen(name) + 2);
+    if(joined == NULL) return NULL;
+
+    if(dir[length - 1] == '/') {
+        sprintf(joined, "%s%s", dir, name);
+    } else {
+        sprintf(joined, "%s/%s", dir, name);
+    }
+
+    return joined;
+}
+
+static double fanin_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
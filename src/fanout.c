@@ -0,0 +1,730 @@
+#include "fanout.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fleet.h"
+#include "local_scan.h"
+#include "pssh.h"
+
+static int    fanout_add(Fanout      fanout,
+                         char*       local,
+                         char*       remote,
+                         bool        directory,
+                         struct stat info);
+static char*  fanout_join(const char* dir, const char* name);
+static void   fanout_wave(Fanout fanout, struct fleet_host* hosts, int count);
+static void   fanout_read(Fanout fanout);
+static bool   fanout_publish(Fanout                fanout,
+                             enum fanout_record    type,
+                             int                   entry,
+                             bool                  failed,
+                             struct fanout_chunk** chunk);
+static void*  fanout_target_run(void* data);
+static int    fanout_follow(struct fanout_target* target, bool* behind);
+static int    fanout_catch_up(struct fanout_target* target);
+static int    fanout_mkdir(struct fanout_target* target, int entry);
+static int    fanout_begin(struct fanout_target* target, int entry);
+static int    fanout_write(struct fanout_target* target,
+                           const char*           data,
+                           size_t                length);
+static int    fanout_end(struct fanout_target* target, bool failed);
+static int    fanout_send(struct fanout_target* target);
+static int    fanout_lose(struct fanout_target* target, const char* action);
+static bool   fanout_keep_remote(struct fanout_target*      target,
+                                 const struct fanout_entry* entry);
+static double fanout_now(void);
+
+/**
+ * Lists what uploading local into remote_directory takes. A directory is read
+ * whole here since a host that falls behind has to find any file again.
+ */
+Fanout fanout_init(const char*        local,
+                   const char*        remote_directory,
+                   enum path_conflict policy) {
+    Fanout      fanout;
+    LocalScan   scan;
+    char*       root;
+    char*       name;
+    size_t      length;
+    struct stat info;
+    int         rc;
+
+    struct local_scan_job job;
+
+    if(local == NULL || remote_directory == NULL) {
+        fprintf(stderr, "cannot pass null values to fanout_init\n");
+        return NULL;
+    }
+
+    if(stat(local, &info) != 0) {
+        fprintf(stderr, "Failed to read %s: %s\n", local, strerror(errno));
+        return NULL;
+    }
+
+    fanout = (Fanout)calloc(1, sizeof(struct fanout));
+    if(fanout == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fan out\n");
+        return NULL;
+    }
+    fanout->policy = policy;
+    pthread_mutex_init(&fanout->lock, NULL);
+    pthread_cond_init(&fanout->ready, NULL);
+    pthread_cond_init(&fanout->consumed, NULL);
+
+    // the root keeps its name on the hosts, trailing slashes aside
+    root   = strdup(local);
+    length = (root != NULL) ? strlen(root) : 0;
+    while(length > 1 && root[length - 1] == '/') root[--length] = '\0';
+    name = (root != NULL) ? strrchr(root, '/') : NULL;
+    name = (name != NULL) ? name + 1 : root;
+
+    rc = (root != NULL) ? fanout_add(fanout,
+                                     strdup(root),
+                                     fanout_join(remote_directory, name),
+                                     S_ISDIR(info.st_mode),
+                                     info)
+                        : FANOUT_ERROR;
+    if(rc != FANOUT_OK || !S_ISDIR(info.st_mode)) {
+        free(root);
+        if(rc != FANOUT_OK) {
+            fanout_free(fanout);
+            return NULL;
+        }
+        return fanout;
+    }
+
+    scan = local_scan_start(root, 0, false);
+    if(scan == NULL) {
+        free(root);
+        fanout_free(fanout);
+        return NULL;
+    }
+
+    while(local_scan_next(scan, &job)) {
+        memset(&info, 0, sizeof(struct stat));
+        info.st_size  = job.size;
+        info.st_mtime = job.mtime;
+
+        if(rc == FANOUT_OK) {
+            rc = fanout_add(fanout,
+                            fanout_join(root, job.path),
+                            fanout_join(fanout->entries[0].remote, job.path),
+                            job.type == LOCAL_SCAN_DIRECTORY,
+                            info);
+        }
+        free(job.path);
+        free(job.link);
+    }
+
+    if(rc == FANOUT_OK && local_scan_failed(scan)) {
+        fprintf(stderr, "Parts of %s could not be read\n", root);
+        rc = FANOUT_ERROR;
+    }
+
+    local_scan_free(scan);
+    free(root);
+    if(rc != FANOUT_OK) {
+        fanout_free(fanout);
+        return NULL;
+    }
+
+    return fanout;
+}
+
+/**
+ * Uploads to every host of fleet, jobs hosts at a time. The local files are
+ * read once for each group of hosts. What happened on every host is left in
+ * the fleet.
+ */
+int fanout_run(Fanout fanout, Fleet fleet, int jobs) {
+    int count;
+
+    if(fanout == NULL || fleet == NULL) {
+        fprintf(stderr, "cannot pass null values to fanout_run\n");
+        return FANOUT_ERROR;
+    }
+
+    if(jobs < 1 || jobs > FANOUT_MAX_HOSTS) jobs = FANOUT_MAX_HOSTS;
+    fanout->fleet = fleet;
+
+    for(int first = 0; first < fleet->count; first += count) {
+        count = fleet->count - first;
+        if(count > jobs) count = jobs;
+
+        fanout_wave(fanout, &fleet->hosts[first], count);
+    }
+
+    return FANOUT_OK;
+}
+
+int fanout_free(Fanout fanout) {
+    if(fanout == NULL) return FANOUT_ERROR;
+
+    for(int i = 0; i < fanout->entry_count; i++) {
+        free(fanout->entries[i].local);
+        free(fanout->entries[i].remote);
+    }
+    free(fanout->entries);
+
+    for(int i = 0; i < FANOUT_SLOTS; i++) free(fanout->slots[i].chunk);
+
+    pthread_mutex_destroy(&fanout->lock);
+    pthread_cond_destroy(&fanout->ready);
+    pthread_cond_destroy(&fanout->consumed);
+    free(fanout);
+
+    return FANOUT_OK;
+}
+
+/**
+ * Takes over local and remote, which may be NULL if they could not be made.
+ */
+static int fanout_add(Fanout      fanout,
+                      char*       local,
+                      char*       remote,
+                      bool        directory,
+                      struct stat info) {
+    struct fanout_entry* entries;
+    int                  capacity;
+
+    if(local == NULL || remote == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fan out\n");
+        free(local);
+        free(remote);
+        return FANOUT_ERROR;
+    }
+
+    if(fanout->entry_count == fanout->entry_capacity) {
+        capacity = (fanout->entry_capacity == 0) ? FANOUT_INITIAL_ENTRIES
+                                                 : fanout->entry_capacity * 2;
+        entries  = (struct fanout_entry*)realloc(
+            fanout->entries,
+            capacity * sizeof(struct fanout_entry));
+        if(entries == NULL) {
+            fprintf(stderr, "failed to allocate memory for the fan out\n");
+            free(local);
+            free(remote);
+            return FANOUT_ERROR;
+        }
+        fanout->entries        = entries;
+        fanout->entry_capacity = capacity;
+    }
+
+    fanout->entries[fanout->entry_count].local     = local;
+    fanout->entries[fanout->entry_count].remote    = remote;
+    fanout->entries[fanout->entry_count].directory = directory;
+    fanout->entries[fanout->entry_count].size      = info.st_size;
+    fanout->entries[fanout->entry_count].mtime     = info.st_mtime;
+    fanout->entry_count++;
+
+    return FANOUT_OK;
+}
+
+static char* fanout_join(const char* dir, const char* name) {
+    size_t length = strlen(dir);
+    char*  joined;
+
+    joined = (char*)malloc(length + strlen(name) + 2);
+    if(joined == NULL) return NULL;
+
+    if(length > 0 && dir[length - 1] == '/') {
+        sprintf(joined, "%s%s", dir, name);
+    } else {
+        sprintf(joined, "%s/%s", dir, name);
+    }
+
+    return joined;
+}
+
+/**
+ * Uploads to count hosts at once, each from its own thread, while this thread
+ * reads the files into the ring.
+ */
+static void fanout_wave(Fanout fanout, struct fleet_host* hosts, int count) {
+    struct fanout_target* target;
+
+    fanout->targets =
+        (struct fanout_target*)calloc(count, sizeof(struct fanout_target));
+    if(fanout->targets == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fan out\n");
+        for(int i = 0; i < count; i++) {
+            fleet_fail(&hosts[i], "failed to allocate memory");
+        }
+        return;
+    }
+
+    fanout->target_count = count;
+    fanout->produced     = 0;
+    fanout->finished     = false;
+
+    for(int i = 0; i < count; i++) {
+        target           = &fanout->targets[i];
+        target->fanout   = fanout;
+        target->host     = &hosts[i];
+        target->attached = true;
+    }
+
+    // started after every target is set up since the threads read each other
+    for(int i = 0; i < count; i++) {
+        target = &fanout->targets[i];
+        if(pthread_create(&target->thread,
+                          NULL,
+                          fanout_target_run,
+                          target) != 0) {
+            fleet_fail(target->host, "failed to start a thread");
+            pthread_mutex_lock(&fanout->lock);
+            target->done = true;
+            pthread_mutex_unlock(&fanout->lock);
+            continue;
+        }
+        target->started = true;
+    }
+
+    fanout_read(fanout);
+
+    pthread_mutex_lock(&fanout->lock);
+    fanout->finished = true;
+    pthread_cond_broadcast(&fanout->ready);
+    pthread_mutex_unlock(&fanout->lock);
+
+    for(int i = 0; i < count; i++) {
+        if(fanout->targets[i].started) {
+            pthread_join(fanout->targets[i].thread, NULL);
+        }
+    }
+
+    free(fanout->targets);
+    fanout->targets      = NULL;
+    fanout->target_count = 0;
+}
+
+/**
+ * Reads every entry into the ring once. Stops early if no host is left to
+ * write to.
+ */
+static void fanout_read(Fanout fanout) {
+    struct fanout_chunk* spare = NULL;
+    struct fanout_entry* entry;
+    ssize_t              nbytes;
+    bool                 failed;
+    bool                 live = true;
+    int                  fd;
+
+    for(int i = 0; live && i < fanout->entry_count; i++) {
+        entry = &fanout->entries[i];
+
+        if(entry->directory) {
+            live = fanout_publish(fanout, FANOUT_DIRECTORY, i, false, NULL);
+            continue;
+        }
+
+        if(!fanout_publish(fanout, FANOUT_BEGIN, i, false, NULL)) break;
+
+        fd     = open(entry->local, O_RDONLY);
+        failed = fd < 0;
+        while(!failed && live) {
+            if(spare == NULL) {
+                spare = (struct fanout_chunk*)malloc(
+                    sizeof(struct fanout_chunk));
+                if(spare == NULL) {
+                    failed = true;
+                    break;
+                }
+            }
+
+            nbytes = read(fd, spare->data, CHUNK_SIZE);
+            if(nbytes < 0 && errno == EINTR) continue;
+            if(nbytes <= 0) {
+                failed = nbytes < 0;
+                break;
+            }
+
+            spare->length   = nbytes;
+            spare->users    = 0;
+            spare->orphaned = false;
+            live = fanout_publish(fanout, FANOUT_DATA, i, false, &spare);
+        }
+        if(fd >= 0) close(fd);
+
+        if(failed) fprintf(stderr, "Failed to read %s\n", entry->local);
+        if(live) live = fanout_publish(fanout, FANOUT_END, i, failed, NULL);
+    }
+
+    free(spare);
+}
+
+/**
+ * Adds a record to the ring, waiting for the hosts that have not read the one
+ * it replaces unless another host is waiting for it, in which case they are
+ * let go. A chunk passed in is swapped for the one it replaces, or for NULL if
+ * that one is still in use. Returns false if there is no host left.
+ */
+static bool fanout_publish(Fanout                fanout,
+                           enum fanout_record    type,
+                           int                   entry,
+                           bool                  failed,
+                           struct fanout_chunk** chunk) {
+    struct fanout_target* target;
+    struct fanout_slot*   slot;
+    struct fanout_chunk*  old;
+    uint64_t              sequence;
+    bool                  live;
+    bool                  blocked;
+    bool                  starving;
+
+    pthread_mutex_lock(&fanout->lock);
+    sequence = fanout->produced;
+    for(;;) {
+        live     = false;
+        blocked  = false;
+        starving = false;
+        for(int i = 0; i < fanout->target_count; i++) {
+            target = &fanout->targets[i];
+            if(target->done) continue;
+
+            live = true;
+            if(!target->attached) continue;
+
+            if(target->next + FANOUT_SLOTS <= sequence) {
+                blocked = true;
+            } else if(target->next == sequence) {
+                starving = true;
+            }
+        }
+        if(!live || !blocked) break;
+
+        if(starving) {
+            for(int i = 0; i < fanout->target_count; i++) {
+                target = &fanout->targets[i];
+                if(!target->done && target->attached &&
+                   target->next + FANOUT_SLOTS <= sequence) {
+                    target->attached = false;
+                }
+            }
+            break;
+        }
+
+        pthread_cond_wait(&fanout->consumed, &fanout->lock);
+    }
+
+    if(!live) {
+        pthread_mutex_unlock(&fanout->lock);
+        return false;
+    }
+
+    slot         = &fanout->slots[sequence % FANOUT_SLOTS];
+    slot->type   = type;
+    slot->entry  = entry;
+    slot->failed = failed;
+    if(chunk != NULL) {
+        old         = slot->chunk;
+        slot->chunk = *chunk;
+        if(old != NULL && old->users > 0) {
+            old->orphaned = true;
+            old           = NULL;
+        }
+        *chunk = old;
+    }
+
+    fanout->produced++;
+    pthread_cond_broadcast(&fanout->ready);
+    pthread_mutex_unlock(&fanout->lock);
+
+    return true;
+}
+
+static void* fanout_target_run(void* data) {
+    struct fanout_target* target = (struct fanout_target*)data;
+    struct fleet_host*    host   = target->host;
+    Fanout                fanout = target->fanout;
+    double                start  = fanout_now();
+    bool                  behind = false;
+    int                   rc;
+
+    rc = (fleet_connect(fanout->fleet, host, true) == FLEET_OK)
+             ? FANOUT_OK
+             : FANOUT_ERROR;
+    if(rc == FANOUT_OK) {
+        rc = fanout_follow(target, &behind);
+        if(rc == FANOUT_OK && behind) {
+            fprintf(stderr,
+                    "[%s] fell behind, reading on its own\n",
+                    host->name);
+            rc = fanout_catch_up(target);
+        }
+    }
+
+    if(target->file != NULL) sftp_close(target->file);
+    target->file = NULL;
+
+    if(rc == FANOUT_OK && host->status != FLEET_FAILED) {
+        host->status = FLEET_DONE;
+    }
+    host->seconds = fanout_now() - start;
+    fleet_disconnect(host);
+
+    pthread_mutex_lock(&fanout->lock);
+    target->done = true;
+    pthread_cond_broadcast(&fanout->consumed);
+    pthread_mutex_unlock(&fanout->lock);
+
+    return NULL;
+}
+
+/**
+ * Writes the records of the ring until the last one or until the target is
+ * let go, in which case behind is set.
+ */
+static int fanout_follow(struct fanout_target* target, bool* behind) {
+    Fanout               fanout = target->fanout;
+    struct fanout_slot   slot;
+    struct fanout_chunk* chunk;
+    int                  rc;
+
+    for(;;) {
+        pthread_mutex_lock(&fanout->lock);
+        while(target->attached && target->next == fanout->produced &&
+              !fanout->finished) {
+            pthread_cond_wait(&fanout->ready, &fanout->lock);
+        }
+
+        if(!target->attached || target->next == fanout->produced) {
+            *behind = !target->attached;
+            pthread_mutex_unlock(&fanout->lock);
+            return FANOUT_OK;
+        }
+
+        slot  = fanout->slots[target->next % FANOUT_SLOTS];
+        chunk = (slot.type == FANOUT_DATA) ? slot.chunk : NULL;
+        if(chunk != NULL) chunk->users++;
+        pthread_mutex_unlock(&fanout->lock);
+
+        switch(slot.type) {
+            case FANOUT_DIRECTORY: rc = fanout_mkdir(target, slot.entry); break;
+            case FANOUT_BEGIN:     rc = fanout_begin(target, slot.entry); break;
+            case FANOUT_DATA:
+                rc = fanout_write(target, chunk->data, chunk->length);
+                break;
+            default: rc = fanout_end(target, slot.failed); break;
+        }
+
+        pthread_mutex_lock(&fanout->lock);
+        if(chunk != NULL && --chunk->users == 0 && chunk->orphaned) {
+            free(chunk);
+        }
+        target->next++;
+        pthread_cond_broadcast(&fanout->consumed);
+        pthread_mutex_unlock(&fanout->lock);
+
+        if(rc != FANOUT_OK) return rc;
+    }
+}
+
+/**
+ * Uploads what is left after the target was let go, reading the files itself.
+ */
+static int fanout_catch_up(struct fanout_target* target) {
+    Fanout fanout = target->fanout;
+    int    rc     = FANOUT_OK;
+
+    if(target->in_file) rc = fanout_send(target);
+
+    while(rc == FANOUT_OK && target->entry < fanout->entry_count) {
+        if(fanout->entries[target->entry].directory) {
+            rc = fanout_mkdir(target, target->entry);
+        } else {
+            rc = fanout_begin(target, target->entry);
+            if(rc == FANOUT_OK) rc = fanout_send(target);
+        }
+    }
+
+    return rc;
+}
+
+/**
+ * Creates a directory on the host, one that is already there is merged into.
+ */
+static int fanout_mkdir(struct fanout_target* target, int entry) {
+    struct fleet_host*   host = target->host;
+    struct fanout_entry* dir  = &target->fanout->entries[entry];
+    sftp_attributes      attr;
+    int                  rc = FANOUT_OK;
+
+    target->entry   = entry;
+    target->in_file = false;
+
+    if(sftp_mkdir(host->sftp, dir->remote, S_IRWXU | S_IRWXG) != SSH_OK) {
+        attr = sftp_stat(host->sftp, dir->remote);
+        if(attr == NULL || attr->type != SSH_FILEXFER_TYPE_DIRECTORY) {
+            rc = fanout_lose(target, "create");
+        }
+        if(attr != NULL) sftp_attributes_free(attr);
+    }
+
+    target->entry = entry + 1;
+    return rc;
+}
+
+/**
+ * Opens the remote side of a file unless the conflict policy keeps the one
+ * that is there.
+ */
+static int fanout_begin(struct fanout_target* target, int entry) {
+    struct fleet_host*   host = target->host;
+    struct fanout_entry* file = &target->fanout->entries[entry];
+
+    target->entry   = entry;
+    target->offset  = 0;
+    target->in_file = true;
+    target->file    = NULL;
+
+    if(fanout_keep_remote(target, file)) {
+        host->stats.skipped++;
+        return FANOUT_OK;
+    }
+
+    target->file = sftp_open(host->sftp,
+                             file->remote,
+                             O_WRONLY | O_CREAT | O_TRUNC,
+                             S_IRWXU | S_IRWXG);
+    if(target->file == NULL) return fanout_lose(target, "open");
+
+    return FANOUT_OK;
+}
+
+static int fanout_write(struct fanout_target* target,
+                        const char*           data,
+                        size_t                length) {
+    target->offset += length;
+    if(target->file == NULL) return FANOUT_OK;
+
+    if(sftp_write(target->file, data, length) != (ssize_t)length) {
+        return fanout_lose(target, "write");
+    }
+    transfer_throttle(length);
+
+    return FANOUT_OK;
+}
+
+/**
+ * Closes the current file, which only counts as uploaded if the whole local
+ * file could be read.
+ */
+static int fanout_end(struct fanout_target* target, bool failed) {
+    struct fleet_host* host = target->host;
+    sftp_file          file = target->file;
+    int                rc   = FANOUT_OK;
+
+    target->file = NULL;
+    if(file != NULL && (sftp_close(file) != SSH_OK || failed)) {
+        rc = fanout_lose(target, "write");
+    } else if(file != NULL) {
+        host->stats.files++;
+        host->stats.bytes += target->offset;
+    }
+
+    target->entry++;
+    target->in_file = false;
+    return rc;
+}
+
+/**
+ * Writes the current file from where the target is in it to the end, read
+ * from the local file instead of the ring.
+ */
+static int fanout_send(struct fanout_target* target) {
+    struct fanout_entry* file = &target->fanout->entries[target->entry];
+    char                 chunk[CHUNK_SIZE];
+    ssize_t              nbytes;
+    bool                 failed = false;
+    int                  rc     = FANOUT_OK;
+    int                  fd;
+
+    if(target->file == NULL) return fanout_end(target, false);
+
+    fd = open(file->local, O_RDONLY);
+    if(fd < 0) failed = true;
+
+    while(!failed && target->file != NULL) {
+        nbytes = pread(fd, chunk, CHUNK_SIZE, target->offset);
+        if(nbytes < 0 && errno == EINTR) continue;
+        if(nbytes <= 0) {
+            failed = nbytes < 0;
+            break;
+        }
+
+        rc = fanout_write(target, chunk, nbytes);
+        if(rc != FANOUT_OK) break;
+    }
+    if(fd >= 0) close(fd);
+    if(rc != FANOUT_OK) return rc;
+
+    if(failed) fprintf(stderr, "Failed to read %s\n", file->local);
+    return fanout_end(target, failed);
+}
+
+/**
+ * Gives up on the current entry of the target, or on the whole host if the
+ * connection is gone. The rest of a file given up on is not written.
+ */
+static int fanout_lose(struct fanout_target* target, const char* action) {
+    struct fleet_host*   host  = target->host;
+    struct fanout_entry* entry = &target->fanout->entries[target->entry];
+
+    if(target->file != NULL) sftp_close(target->file);
+    target->file = NULL;
+
+    if(!ssh_is_connected(host->session)) {
+        fleet_fail(host, "lost the connection at %s", entry->remote);
+        return FANOUT_ERROR;
+    }
+
+    fprintf(stderr,
+            "[%s] failed to %s %s: %d\n",
+            host->name,
+            action,
+            entry->remote,
+            sftp_get_error(host->sftp));
+    host->stats.failed++;
+
+    return FANOUT_OK;
+}
+
+/**
+ * True if the conflict policy keeps the file already on the host.
+ */
+static bool fanout_keep_remote(struct fanout_target*      target,
+                               const struct fanout_entry* entry) {
+    enum path_conflict policy = target->fanout->policy;
+    sftp_attributes    attr;
+    bool               keep;
+
+    if(policy == PATH_CONFLICT_OVERWRITE) return false;
+
+    attr = sftp_stat(target->host->sftp, entry->remote);
+    if(attr == NULL) return false;
+
+    keep = policy != PATH_CONFLICT_NEWER ||
+           (int64_t)attr->mtime >= entry->mtime;
+    sftp_attributes_free(attr);
+
+    return keep;
+}
+
+static double fanout_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
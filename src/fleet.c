@@ -0,0 +1,283 @@
+#include "fleet.h"
+
+#include <ctype.h>
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+#include "cipher_bench.h"
+#include "conn_pool.h"
+#include "main.h"
+
+static int  fleet_add(Fleet fleet, const char* name, size_t length);
+
+/**
+ * Reads the hosts from the file named hosts, one per line with # starting a
+ * comment, or from hosts itself as a comma separated list if there is no such
+ * file. A host named twice is only kept once.
+ */
+Fleet fleet_load(const char* hosts) {
+    Fleet       fleet;
+    FILE*       file;
+    char        line[FLEET_LINE_SIZE];
+    const char* start;
+    const char* end;
+    struct stat info;
+    int         rc = FLEET_OK;
+
+    if(hosts == NULL) {
+        fprintf(stderr, "the hosts of a fleet cannot be null\n");
+        return NULL;
+    }
+
+    fleet = (Fleet)calloc(1, sizeof(struct fleet));
+    if(fleet == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fleet\n");
+        return NULL;
+    }
+
+    if(stat(hosts, &info) == 0 && S_ISREG(info.st_mode)) {
+        file = fopen(hosts, "r");
+        if(file == NULL) {
+            fprintf(stderr, "failed to open the host list %s\n", hosts);
+            free(fleet);
+            return NULL;
+        }
+
+        while(rc == FLEET_OK && fgets(line, FLEET_LINE_SIZE, file) != NULL) {
+            line[strcspn(line, "#\r\n")] = '\0';
+
+            start = line;
+            while(isspace((unsigned char)*start)) start++;
+            end = start + strlen(start);
+            while(end > start && isspace((unsigned char)end[-1])) end--;
+
+            if(end > start) rc = fleet_add(fleet, start, end - start);
+        }
+        fclose(file);
+    } else {
+        for(start = hosts; rc == FLEET_OK && *start != '\0'; start = end) {
+            end = start + strcspn(start, ",");
+            if(end > start) rc = fleet_add(fleet, start, end - start);
+            if(*end == ',') end++;
+        }
+    }
+
+    if(rc == FLEET_OK && fleet->count == 0) {
+        fprintf(stderr, "no hosts in %s\n", hosts);
+        rc = FLEET_ERROR;
+    }
+    if(rc != FLEET_OK) {
+        fleet_free(fleet);
+        return NULL;
+    }
+
+    // ranked once here instead of by every connecting thread
+    fleet->ranked = cipher_bench_ranking(&fleet->ciphers) == CIPHER_BENCH_OK;
+
+    return fleet;
+}
+
+/**
+ * Connects to host and opens its sftp session if sftp is set. Safe to call
+ * for different hosts at the same time, what went wrong is kept in the host.
+ */
+int fleet_connect(Fleet fleet, struct fleet_host* host, bool sftp) {
+    long timeout = CONN_POOL_TIMEOUT;
+
+    if(fleet == NULL || host == NULL) return FLEET_ERROR;
+
+    host->session = create_session(host->name);
+    if(host->session == NULL) {
+        fleet_fail(host, "failed to create ssh session");
+        return FLEET_ERROR;
+    }
+
+    ssh_options_set(host->session, SSH_OPTIONS_TIMEOUT, &timeout);
+    if(fleet->ranked) cipher_bench_set(host->session, &fleet->ciphers);
+
+    if(ssh_connect(host->session) != SSH_OK) {
+        fleet_fail(host,
+                   "failed to connect: %s",
+                   ssh_get_error(host->session));
+        fleet_disconnect(host);
+        return FLEET_ERROR;
+    }
+
+    // there is nobody to ask whether to trust a new key
+    if(ssh_session_is_known_server(host->session) != SSH_KNOWN_HOSTS_OK) {
+        fleet_fail(host, "the host key is not known, log in to it once first");
+        fleet_disconnect(host);
+        return FLEET_ERROR;
+    }
+
+    if(ssh_userauth_publickey_auto(host->session, NULL, NULL) !=
+       SSH_AUTH_SUCCESS) {
+        fleet_fail(host, "no public key was accepted");
+        fleet_disconnect(host);
+        return FLEET_ERROR;
+    }
+
+    if(!sftp) return FLEET_OK;
+
+    host->sftp = sftp_new(host->session);
+    if(host->sftp == NULL || sftp_init(host->sftp) != SSH_OK) {
+        fleet_fail(host,
+                   "failed to open sftp session: %s",
+                   ssh_get_error(host->session));
+        fleet_disconnect(host);
+        return FLEET_ERROR;
+    }
+
+    return FLEET_OK;
+}
+
+/**
+ * Marks host as failed and prints why. Only the first reason is kept for the
+ * report.
+ */
+void fleet_fail(struct fleet_host* host, const char* format, ...) {
+    char    message[FLEET_ERROR_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, FLEET_ERROR_SIZE, format, args);
+    va_end(args);
+
+    if(host->status != FLEET_FAILED) {
+        strcpy(host->error, message);
+        host->status = FLEET_FAILED;
+    }
+
+    // a single call so lines of hosts failing together do not mix
+    fprintf(stderr, "[%s] %s\n", host->name, message);
+}
+
+void fleet_disconnect(struct fleet_host* host) {
+    if(host->sftp != NULL) sftp_free(host->sftp);
+    if(host->session != NULL) {
+        ssh_disconnect(host->session);
+        ssh_free(host->session);
+    }
+    host->sftp    = NULL;
+    host->session = NULL;
+}
+
+/**
+ * Writes one line of JSON per host with what was done on it.
+ */
+int fleet_report(Fleet fleet, FILE* out) {
+    struct fleet_host* host;
+    const char*        status;
+
+    if(fleet == NULL || out == NULL) return FLEET_ERROR;
+
+    for(int i = 0; i < fleet->count; i++) {
+        host = &fleet->hosts[i];
+
+        switch(host->status) {
+            case FLEET_DONE:   status = "ok"; break;
+            case FLEET_FAILED: status = "failed"; break;
+            default:           status = "not run"; break;
+        }
+
+        fprintf(out, "{\"host\":");
+        batch_json_string(out, host->name);
+        fprintf(out,
+                ",\"status\":\"%s\",\"files\":%llu,\"skipped\":%llu,"
+                "\"failed\":%llu,\"bytes\":%llu,\"seconds\":%.3f",
+                status,
+                (unsigned long long)host->stats.files,
+                (unsigned long long)host->stats.skipped,
+                (unsigned long long)host->stats.failed,
+                (unsigned long long)host->stats.bytes,
+                host->seconds);
+        if(host->exited) fprintf(out, ",\"exit\":%d", host->exit_status);
+        if(host->status == FLEET_FAILED) {
+            fprintf(out, ",\"error\":");
+            batch_json_string(out, host->error);
+        }
+        fprintf(out, "}\n");
+    }
+    fflush(out);
+
+    return FLEET_OK;
+}
+
+/**
+ * True if every host is done, none of them lost a file on the way and every
+ * command exited with 0.
+ */
+bool fleet_succeeded(Fleet fleet) {
+    if(fleet == NULL) return false;
+
+    for(int i = 0; i < fleet->count; i++) {
+        if(fleet->hosts[i].status != FLEET_DONE ||
+           fleet->hosts[i].stats.failed > 0 ||
+           (fleet->hosts[i].exited && fleet->hosts[i].exit_status != 0)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int fleet_free(Fleet fleet) {
+    if(fleet == NULL) return FLEET_ERROR;
+
+    for(int i = 0; i < fleet->count; i++) {
+        fleet_disconnect(&fleet->hosts[i]);
+        free(fleet->hosts[i].name);
+    }
+    free(fleet->hosts);
+    free(fleet);
+
+    return FLEET_OK;
+}
+
+static int fleet_add(Fleet fleet, const char* name, size_t length) {
+    struct fleet_host* hosts;
+    int                capacity;
+
+    for(int i = 0; i < fleet->count; i++) {
+        if(strlen(fleet->hosts[i].name) == length &&
+           strncmp(fleet->hosts[i].name, name, length) == 0) {
+            return FLEET_OK;
+        }
+    }
+
+    if(fleet->count == FLEET_MAX_HOSTS) {
+        fprintf(stderr, "a fleet has at most %d hosts\n", FLEET_MAX_HOSTS);
+        return FLEET_ERROR;
+    }
+
+    if(fleet->count == fleet->capacity) {
+        capacity = (fleet->capacity == 0) ? FLEET_INITIAL_HOSTS
+                                          : fleet->capacity * 2;
+        hosts    = (struct fleet_host*)realloc(
+            fleet->hosts,
+            capacity * sizeof(struct fleet_host));
+        if(hosts == NULL) {
+            fprintf(stderr, "failed to allocate memory for the fleet\n");
+            return FLEET_ERROR;
+        }
+        fleet->hosts    = hosts;
+        fleet->capacity = capacity;
+    }
+
+    memset(&fleet->hosts[fleet->count], 0, sizeof(struct fleet_host));
+    fleet->hosts[fleet->count].name = strndup(name, length);
+    if(fleet->hosts[fleet->count].name == NULL) {
+        fprintf(stderr, "failed to allocate memory for the fleet\n");
+        return FLEET_ERROR;
+    }
+    fleet->count++;
+
+    return FLEET_OK;
+}
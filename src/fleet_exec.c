@@ -0,0 +1,471 @@
+#include "fleet_exec.h"
+
+#include <errno.h>
+#include <libssh/libssh.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "conn_pool.h"
+#include "dynamic_str.h"
+#include "fleet.h"
+#include "path.h"
+
+static void*  fleet_exec_worker(void* data);
+static void   fleet_exec_host(FleetExec exec, struct fleet_host* host);
+static int    fleet_exec_command(FleetExec                 exec,
+                                 struct fleet_host*        host,
+                                 struct fleet_exec_stream* streams);
+static int    fleet_exec_pump(FleetExec                 exec,
+                              struct fleet_host*        host,
+                              ssh_channel               channel,
+                              struct fleet_exec_stream* streams);
+static int    fleet_exec_output(FleetExec                 exec,
+                                struct fleet_host*        host,
+                                struct fleet_exec_stream* stream,
+                                const char*               data,
+                                int                       length);
+static void   fleet_exec_line(struct fleet_host*        host,
+                              struct fleet_exec_stream* stream,
+                              const char*               data,
+                              int                       length);
+static int    fleet_exec_open(FleetExec                 exec,
+                              struct fleet_host*        host,
+                              struct fleet_exec_stream* streams);
+static void   fleet_exec_close(FleetExec                 exec,
+                               struct fleet_host*        host,
+                               struct fleet_exec_stream* streams);
+static double fleet_exec_now(void);
+
+/**
+ * Copies command and output_dir, which has to be a directory or is created.
+ * Without output_dir the output is printed.
+ */
+FleetExec fleet_exec_init(const char* command, const char* output_dir) {
+    FleetExec exec;
+    Path      dir;
+    int       rc;
+
+    if(command == NULL) {
+        fprintf(stderr, "cannot pass null values to fleet_exec_init\n");
+        return NULL;
+    }
+
+    if(output_dir != NULL) {
+        dir = path_init(output_dir, CURR_PLATFORM);
+        if(dir == NULL) return NULL;
+        rc = (!path_exists(dir) && path_create_directory(dir) != 0)
+                 ? FLEET_EXEC_ERROR
+                 : FLEET_EXEC_OK;
+        if(rc == FLEET_EXEC_OK && !path_is_directory(dir)) {
+            rc = FLEET_EXEC_ERROR;
+        }
+        path_free(dir);
+        if(rc != FLEET_EXEC_OK) {
+            fprintf(stderr, "%s could not be created\n", output_dir);
+            return NULL;
+        }
+    }
+
+    exec = (FleetExec)calloc(1, sizeof(struct fleet_exec));
+    if(exec == NULL) {
+        fprintf(stderr, "failed to allocate memory for the command\n");
+        return NULL;
+    }
+    pthread_mutex_init(&exec->lock, NULL);
+
+    exec->command = strdup(command);
+    if(output_dir != NULL) exec->output_dir = strdup(output_dir);
+    if(exec->command == NULL ||
+       (output_dir != NULL && exec->output_dir == NULL)) {
+        fprintf(stderr, "failed to allocate memory for the command\n");
+        fleet_exec_free(exec);
+        return NULL;
+    }
+
+    return exec;
+}
+
+/**
+ * Runs the command on every host of fleet with at most jobs connections open
+ * at a time and prints how many hosts it succeeded on.
+ */
+int fleet_exec_run(FleetExec exec, Fleet fleet, int jobs) {
+    pthread_t* threads;
+    int        started = 0;
+
+    if(exec == NULL || fleet == NULL) {
+        fprintf(stderr, "cannot pass null values to fleet_exec_run\n");
+        return FLEET_EXEC_ERROR;
+    }
+
+    if(jobs < 1 || jobs > FLEET_EXEC_MAX_JOBS) jobs = FLEET_EXEC_MAX_JOBS;
+    if(jobs > fleet->count) jobs = fleet->count;
+
+    threads = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+    if(threads == NULL) {
+        fprintf(stderr, "failed to allocate memory for the command\n");
+        return FLEET_EXEC_ERROR;
+    }
+
+    exec->fleet    = fleet;
+    exec->next     = 0;
+    exec->finished = 0;
+    exec->failed   = 0;
+    exec->nonzero  = 0;
+    for(int i = 0; i < jobs; i++) {
+        if(pthread_create(&threads[started], NULL, fleet_exec_worker, exec) !=
+           0) {
+            fprintf(stderr, "continuing with %d threads\n", started);
+            break;
+        }
+        started++;
+    }
+
+    // with no thread at all the hosts are still worked on, one by one
+    if(started == 0) fleet_exec_worker(exec);
+
+    for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+
+    fprintf(stderr,
+            "%d hosts exited with 0, %d with another status, %d failed\n",
+            fleet->count - exec->nonzero - exec->failed,
+            exec->nonzero,
+            exec->failed);
+
+    return FLEET_EXEC_OK;
+}
+
+int fleet_exec_free(FleetExec exec) {
+    if(exec == NULL) return FLEET_EXEC_ERROR;
+
+    free(exec->command);
+    free(exec->output_dir);
+    pthread_mutex_destroy(&exec->lock);
+    free(exec);
+
+    return FLEET_EXEC_OK;
+}
+
+static void* fleet_exec_worker(void* data) {
+    FleetExec exec = (FleetExec)data;
+    int       host;
+
+    for(;;) {
+        pthread_mutex_lock(&exec->lock);
+        host = exec->next;
+        if(host < exec->fleet->count) exec->next++;
+        pthread_mutex_unlock(&exec->lock);
+
+        if(host >= exec->fleet->count) break;
+        fleet_exec_host(exec, &exec->fleet->hosts[host]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs the command on host and prints how it ended.
+ */
+static void fleet_exec_host(FleetExec exec, struct fleet_host* host) {
+    struct fleet_exec_stream streams[2];
+    double                   start = fleet_exec_now();
+
+    memset(streams, 0, sizeof(streams));
+    streams[0].out = stdout;
+    streams[1].out = stderr;
+
+    if(fleet_connect(exec->fleet, host, false) == FLEET_OK &&
+       fleet_exec_open(exec, host, streams) == FLEET_EXEC_OK) {
+        fleet_exec_command(exec, host, streams);
+    }
+    fleet_exec_close(exec, host, streams);
+
+    host->seconds = fleet_exec_now() - start;
+    if(host->status != FLEET_FAILED) host->status = FLEET_DONE;
+    fleet_disconnect(host);
+
+    pthread_mutex_lock(&exec->lock);
+    exec->finished++;
+    if(host->status == FLEET_FAILED) {
+        exec->failed++;
+    } else if(host->exit_status != 0) {
+        exec->nonzero++;
+    }
+    if(host->status == FLEET_FAILED) {
+        fprintf(stderr,
+                "[%s] failed after %.1fs (%d of %d hosts)\n",
+                host->name,
+                host->seconds,
+                exec->finished,
+                exec->fleet->count);
+    } else {
+        fprintf(stderr,
+                "[%s] exited with %d after %.1fs (%d of %d hosts)\n",
+                host->name,
+                host->exit_status,
+                host->seconds,
+                exec->finished,
+                exec->fleet->count);
+    }
+    pthread_mutex_unlock(&exec->lock);
+}
+
+/**
+ * Runs the command on an exec channel of host without a terminal and passes
+ * its output on until it exits.
+ */
+static int fleet_exec_command(FleetExec                 exec,
+                              struct fleet_host*        host,
+                              struct fleet_exec_stream* streams) {
+    ssh_channel channel;
+    int         rc;
+
+    channel = ssh_channel_new(host->session);
+    if(channel == NULL || ssh_channel_open_session(channel) != SSH_OK) {
+        fleet_fail(host,
+                   "failed to open a channel: %s",
+                   ssh_get_error(host->session));
+        if(channel != NULL) ssh_channel_free(channel);
+        return FLEET_EXEC_ERROR;
+    }
+
+    if(ssh_channel_request_exec(channel, exec->command) != SSH_OK) {
+        fleet_fail(host,
+                   "failed to run the command: %s",
+                   ssh_get_error(host->session));
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return FLEET_EXEC_ERROR;
+    }
+
+    // nothing is typed in, a command reading stdin sees its end right away
+    ssh_channel_send_eof(channel);
+
+    rc = fleet_exec_pump(exec, host, channel, streams);
+    if(rc == FLEET_EXEC_OK) {
+        host->exit_status = ssh_channel_get_exit_status(channel);
+        if(host->exit_status < 0) {
+            fleet_fail(host, "the command ended without an exit status");
+            rc = FLEET_EXEC_ERROR;
+        } else {
+            host->exited = true;
+        }
+    }
+
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return rc;
+}
+
+/**
+ * Passes the output of channel on until the command closes it. Between reads
+ * the thread waits in poll on the socket of host instead of spinning. A quiet
+ * command is not a hung host, so after CONN_POOL_TIMEOUT seconds of silence
+ * the host is sent a keepalive, which a live server answers, and it is given
+ * up on once that goes unanswered as long again.
+ */
+static int fleet_exec_pump(FleetExec                 exec,
+                           struct fleet_host*        host,
+                           ssh_channel               channel,
+                           struct fleet_exec_stream* streams) {
+    struct pollfd fds;
+    char          buffer[FLEET_EXEC_BUFFER_SIZE];
+    bool          hung_up = false;
+    bool          probed  = false;
+    int           nbytes;
+    int           ready;
+
+    fds.fd     = ssh_get_fd(host->session);
+    fds.events = POLLIN;
+
+    for(;;) {
+        // libssh may have read more than it handed out, so the channel is
+        // emptied before waiting on the socket
+        for(int is_stderr = 0; is_stderr <= 1; is_stderr++) {
+            while((nbytes = ssh_channel_read_nonblocking(channel,
+                                                         buffer,
+                                                         sizeof(buffer),
+                                                         is_stderr)) > 0) {
+                if(fleet_exec_output(exec,
+                                     host,
+                                     &streams[is_stderr],
+                                     buffer,
+                                     nbytes) != FLEET_EXEC_OK) {
+                    fleet_fail(host, "failed to write its output");
+                    return FLEET_EXEC_ERROR;
+                }
+            }
+            if(nbytes == SSH_ERROR) {
+                fleet_fail(host,
+                           "lost the connection: %s",
+                           ssh_get_error(host->session));
+                return FLEET_EXEC_ERROR;
+            }
+        }
+
+        if(ssh_channel_is_eof(channel) || ssh_channel_is_closed(channel)) {
+            return FLEET_EXEC_OK;
+        }
+        if(hung_up) {
+            fleet_fail(host, "lost the connection");
+            return FLEET_EXEC_ERROR;
+        }
+
+        ready = poll(&fds, 1, CONN_POOL_TIMEOUT * 1000);
+        if(ready < 0 && errno != EINTR) {
+            fleet_fail(host, "failed to wait for output: %s", strerror(errno));
+            return FLEET_EXEC_ERROR;
+        }
+        if(ready == 0 && probed) {
+            fleet_fail(host, "stopped answering");
+            return FLEET_EXEC_ERROR;
+        }
+        if(ready == 0) {
+            probed = ssh_send_keepalive(host->session) == SSH_OK;
+            if(!probed) {
+                fleet_fail(host,
+                           "lost the connection: %s",
+                           ssh_get_error(host->session));
+                return FLEET_EXEC_ERROR;
+            }
+            continue;
+        }
+        if(ready > 0) probed = false;
+        // whatever came before the hang up is still passed on
+        if(fds.revents & (POLLERR | POLLHUP | POLLNVAL)) hung_up = true;
+    }
+}
+
+/**
+ * Writes data into the file of stream, or prints every line it completes with
+ * the name of host in front. A line longer than the buffer is cut in pieces.
+ */
+static int fleet_exec_output(FleetExec                 exec,
+                             struct fleet_host*        host,
+                             struct fleet_exec_stream* stream,
+                             const char*               data,
+                             int                       length) {
+    const char* newline;
+    int         rc = FLEET_EXEC_OK;
+
+    if(stream->file != NULL) {
+        return (fwrite(data, 1, length, stream->file) == (size_t)length)
+                   ? FLEET_EXEC_OK
+                   : FLEET_EXEC_ERROR;
+    }
+
+    pthread_mutex_lock(&exec->lock);
+    while(length > 0 &&
+          (newline = (const char*)memchr(data, '\n', length)) != NULL) {
+        fleet_exec_line(host, stream, data, newline - data);
+        length -= newline - data + 1;
+        data    = newline + 1;
+    }
+    pthread_mutex_unlock(&exec->lock);
+
+    if(length > 0 &&
+       dynamic_str_append(stream->pending, data, length) != DYNAMIC_STR_OK) {
+        rc = FLEET_EXEC_ERROR;
+    }
+
+    if(dynamic_str_length(stream->pending) >= FLEET_EXEC_BUFFER_SIZE) {
+        pthread_mutex_lock(&exec->lock);
+        fleet_exec_line(host, stream, "", 0);
+        pthread_mutex_unlock(&exec->lock);
+    }
+
+    return rc;
+}
+
+/**
+ * Prints what is pending on stream followed by data as one line. The caller
+ * holds the lock.
+ */
+static void fleet_exec_line(struct fleet_host*        host,
+                            struct fleet_exec_stream* stream,
+                            const char*               data,
+                            int                       length) {
+    fprintf(stream->out, "[%s] ", host->name);
+    fwrite(stream->pending->str,
+           1,
+           dynamic_str_length(stream->pending),
+           stream->out);
+    fwrite(data, 1, length, stream->out);
+    fputc('\n', stream->out);
+    fflush(stream->out);
+    dynamic_str_truncate(stream->pending, 0);
+}
+
+/**
+ * Opens <host>.out and <host>.err in the output directory, or the buffers for
+ * the lines being printed without one.
+ */
+static int fleet_exec_open(FleetExec                 exec,
+                           struct fleet_host*        host,
+                           struct fleet_exec_stream* streams) {
+    const char* suffixes[2] = {"out", "err"};
+    char*       name;
+
+    for(int i = 0; i < 2; i++) {
+        if(exec->output_dir == NULL) {
+            streams[i].pending = dynamic_str_init("");
+            if(streams[i].pending == NULL) {
+                fleet_fail(host, "failed to allocate memory for its output");
+                return FLEET_EXEC_ERROR;
+            }
+            continue;
+        }
+
+        name = (char*)malloc(strlen(exec->output_dir) + strlen(host->name) +
+                             6);
+        if(name == NULL) {
+            fleet_fail(host, "failed to allocate memory for its output");
+            return FLEET_EXEC_ERROR;
+        }
+        sprintf(name, "%s/%s.%s", exec->output_dir, host->name, suffixes[i]);
+        streams[i].file = fopen(name, "w");
+        if(streams[i].file == NULL) {
+            fleet_fail(host, "failed to open %s: %s", name, strerror(errno));
+            free(name);
+            return FLEET_EXEC_ERROR;
+        }
+        free(name);
+    }
+
+    return FLEET_EXEC_OK;
+}
+
+/**
+ * Prints the last line if the command did not end it and lets go of the
+ * streams.
+ */
+static void fleet_exec_close(FleetExec                 exec,
+                             struct fleet_host*        host,
+                             struct fleet_exec_stream* streams) {
+    for(int i = 0; i < 2; i++) {
+        if(streams[i].pending != NULL) {
+            if(dynamic_str_length(streams[i].pending) > 0) {
+                pthread_mutex_lock(&exec->lock);
+                fleet_exec_line(host, &streams[i], "", 0);
+                pthread_mutex_unlock(&exec->lock);
+            }
+            dynamic_str_free(streams[i].pending);
+        }
+        if(streams[i].file != NULL && fclose(streams[i].file) != 0) {
+            fleet_fail(host, "failed to write its output: %s", strerror(errno));
+        }
+    }
+}
+
+static double fleet_exec_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,132 @@
+#include "inode_set.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct inode_set_entry* inode_set_slot(struct inode_set_entry* entries,
+                                              uint64_t                capacity,
+                                              uint64_t                device,
+                                              uint64_t                inode);
+static int                     inode_set_grow(InodeSet set);
+
+InodeSet inode_set_init(void) {
+    InodeSet set;
+
+    set = (InodeSet)malloc(sizeof(struct inode_set));
+    if(set == NULL) {
+        fprintf(stderr, "failed to allocate memory for the inode set\n");
+        return NULL;
+    }
+
+    set->entries = (struct inode_set_entry*)calloc(
+        INODE_SET_INITIAL_CAPACITY,
+        sizeof(struct inode_set_entry));
+    if(set->entries == NULL) {
+        fprintf(stderr, "failed to allocate memory for the inode set\n");
+        free(set);
+        return NULL;
+    }
+    set->count    = 0;
+    set->capacity = INODE_SET_INITIAL_CAPACITY;
+
+    return set;
+}
+
+/**
+ * Remembers that the file on device with inode is at path unless it was seen
+ * before. Returns the path it was first seen at in that case, NULL if it is
+ * new or could not be remembered.
+ */
+const char* inode_set_add(InodeSet    set,
+                          uint64_t    device,
+                          uint64_t    inode,
+                          const char* path) {
+    struct inode_set_entry* slot;
+
+    if(set == NULL || path == NULL) {
+        fprintf(stderr, "cannot pass null values to inode_set_add\n");
+        return NULL;
+    }
+
+    slot = inode_set_slot(set->entries, set->capacity, device, inode);
+    if(slot->path != NULL) return slot->path;
+
+    // kept at most half full so probes stay short
+    if((set->count + 1) * 2 > set->capacity) {
+        if(inode_set_grow(set) != INODE_SET_OK) return NULL;
+        slot = inode_set_slot(set->entries, set->capacity, device, inode);
+    }
+
+    slot->path = strdup(path);
+    if(slot->path == NULL) {
+        fprintf(stderr, "failed to allocate memory for the inode set\n");
+        return NULL;
+    }
+    slot->device = device;
+    slot->inode  = inode;
+    set->count++;
+
+    return NULL;
+}
+
+int inode_set_free(InodeSet set) {
+    if(set == NULL) return INODE_SET_ERROR;
+
+    for(uint64_t i = 0; i < set->capacity; i++) free(set->entries[i].path);
+    free(set->entries);
+    free(set);
+
+    return INODE_SET_OK;
+}
+
+/**
+ * The slot holding device and inode, or the free one they would go in.
+ */
+static struct inode_set_entry* inode_set_slot(struct inode_set_entry* entries,
+                                              uint64_t                capacity,
+                                              uint64_t                device,
+                                              uint64_t                inode) {
+    uint64_t hash;
+
+    // inodes are mostly handed out in sequence, the multiply spreads them
+    hash = (inode ^ (device * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+
+    for(uint64_t i = hash & (capacity - 1);; i = (i + 1) & (capacity - 1)) {
+        if(entries[i].path == NULL ||
+           (entries[i].device == device && entries[i].inode == inode)) {
+            return &entries[i];
+        }
+    }
+}
+
+static int inode_set_grow(InodeSet set) {
+    struct inode_set_entry* entries;
+    struct inode_set_entry* slot;
+    uint64_t                capacity = set->capacity * 2;
+
+    entries = (struct inode_set_entry*)calloc(capacity,
+                                              sizeof(struct inode_set_entry));
+    if(entries == NULL) {
+        fprintf(stderr, "failed to allocate memory for the inode set\n");
+        return INODE_SET_ERROR;
+    }
+
+    for(uint64_t i = 0; i < set->capacity; i++) {
+        if(set->entries[i].path == NULL) continue;
+
+        slot = inode_set_slot(entries,
+                              capacity,
+                              set->entries[i].device,
+                              set->entries[i].inode);
+        *slot = set->entries[i];
+    }
+
+    free(set->entries);
+    set->entries  = entries;
+    set->capacity = capacity;
+
+    return INODE_SET_OK;
+}
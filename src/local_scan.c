@@ -0,0 +1,619 @@
+#include "local_scan.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Jobs a worker collects before taking the queue lock.
+ */
+struct local_scan_batch {
+    struct local_scan_job jobs[LOCAL_SCAN_BATCH_SIZE];
+    int                   count;
+};
+
+static void* local_scan_work(void* arg);
+static char* local_scan_take(struct local_scan_worker* worker);
+static void  local_scan_read(struct local_scan_worker* worker,
+                             const char*               dir,
+                             struct local_scan_batch*  batch);
+static bool  local_scan_flush(LocalScan scan, struct local_scan_batch* batch);
+static void  local_scan_push(struct local_scan_worker* worker,
+                             char**                    dirs,
+                             int                       count);
+static bool  local_scan_visit(LocalScan scan, struct local_scan_job* job);
+static void  local_scan_fail(LocalScan scan);
+static char* local_scan_join(const char* dir, const char* name);
+static bool  local_scan_deque_init(struct local_scan_deque* deque);
+static bool  local_scan_deque_push(struct local_scan_deque* deque, char* dir);
+static char* local_scan_deque_pop(struct local_scan_deque* deque);
+static char* local_scan_deque_steal(struct local_scan_deque* deque);
+
+/**
+ * Starts scanning root with the given number of threads, 0 uses one per
+ * processor. follow goes into symbolic links to directories. Returns right
+ * away, the jobs are read with local_scan_next.
+ */
+LocalScan local_scan_start(const char* root, int threads, bool follow) {
+    LocalScan   scan;
+    char*       first;
+    long        processors;
+    struct stat info;
+
+    if(root == NULL) {
+        fprintf(stderr, "the root of the scan cannot be null\n");
+        return NULL;
+    }
+
+    if(threads <= 0) {
+        processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threads    = (processors > 0) ? (int)processors : 1;
+    }
+    if(threads > LOCAL_SCAN_MAX_THREADS) threads = LOCAL_SCAN_MAX_THREADS;
+
+    scan = (LocalScan)calloc(1, sizeof(struct local_scan));
+    if(scan == NULL) {
+        fprintf(stderr, "failed to allocate memory for the local scan\n");
+        return NULL;
+    }
+
+    scan->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(scan->root_fd == -1) {
+        fprintf(stderr, "Failed to open local directory %s: %d\n", root, errno);
+        free(scan);
+        return NULL;
+    }
+
+    scan->thread_count = threads;
+    scan->jobs         = (struct local_scan_job*)malloc(
+        sizeof(struct local_scan_job) * LOCAL_SCAN_QUEUE_SIZE);
+    scan->workers = (struct local_scan_worker*)calloc(
+        threads,
+        sizeof(struct local_scan_worker));
+    first = strdup("");
+    if(scan->jobs == NULL || scan->workers == NULL || first == NULL) {
+        fprintf(stderr, "failed to allocate memory for the local scan\n");
+        close(scan->root_fd);
+        free(scan->jobs);
+        free(scan->workers);
+        free(first);
+        free(scan);
+        return NULL;
+    }
+
+    // the root is seen first so a link back up to it ends there
+    scan->follow = follow;
+    if(follow) {
+        scan->seen = inode_set_init();
+        if(scan->seen == NULL || fstat(scan->root_fd, &info) != 0) {
+            fprintf(stderr, "failed to start following links in %s\n", root);
+            close(scan->root_fd);
+            inode_set_free(scan->seen);
+            free(scan->jobs);
+            free(scan->workers);
+            free(first);
+            free(scan);
+            return NULL;
+        }
+        inode_set_add(scan->seen, info.st_dev, info.st_ino, "");
+    }
+
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_mutex_init(&scan->seen_lock, NULL);
+    pthread_cond_init(&scan->work, NULL);
+    pthread_cond_init(&scan->ready, NULL);
+    pthread_cond_init(&scan->space, NULL);
+
+    for(int i = 0; i < threads; i++) {
+        scan->workers[i].scan = scan;
+        scan->workers[i].id   = i;
+        if(!local_scan_deque_init(&scan->workers[i].deque)) {
+            free(first);
+            local_scan_free(scan);
+            return NULL;
+        }
+    }
+
+    // the root is the first directory to read
+    local_scan_deque_push(&scan->workers[0].deque, first);
+    scan->pending = 1;
+    scan->queued  = 1;
+
+    for(int i = 0; i < threads; i++) {
+        if(pthread_create(&scan->workers[i].thread,
+                          NULL,
+                          local_scan_work,
+                          &scan->workers[i]) != 0) {
+            fprintf(stderr, "failed to start local scan thread %d\n", i);
+            if(i == 0) {
+                local_scan_free(scan);
+                return NULL;
+            }
+            // the others steal whatever this one would have done
+            break;
+        }
+        scan->workers[i].started = true;
+    }
+
+    return scan;
+}
+
+/**
+ * Waits for the next job. Returns false once the whole tree has been handed
+ * out or the scan was stopped.
+ */
+bool local_scan_next(LocalScan scan, struct local_scan_job* job) {
+    if(scan == NULL || job == NULL) return false;
+
+    pthread_mutex_lock(&scan->lock);
+    while(scan->jobs_count == 0 && !scan->done && !scan->cancel) {
+        pthread_cond_wait(&scan->ready, &scan->lock);
+    }
+
+    if(scan->jobs_count == 0) {
+        pthread_mutex_unlock(&scan->lock);
+        return false;
+    }
+
+    *job            = scan->jobs[scan->jobs_head];
+    scan->jobs_head = (scan->jobs_head + 1) % LOCAL_SCAN_QUEUE_SIZE;
+    scan->jobs_count--;
+    if(LOCAL_SCAN_QUEUE_SIZE - scan->jobs_count >= LOCAL_SCAN_BATCH_SIZE) {
+        pthread_cond_broadcast(&scan->space);
+    }
+    pthread_mutex_unlock(&scan->lock);
+
+    return true;
+}
+
+/**
+ * True if some part of the tree could not be read. The rest is still scanned.
+ */
+bool local_scan_failed(LocalScan scan) {
+    bool failed;
+
+    pthread_mutex_lock(&scan->lock);
+    failed = scan->failed;
+    pthread_mutex_unlock(&scan->lock);
+
+    return failed;
+}
+
+/**
+ * Stops the scan if it is still running, waits for the threads and frees
+ * everything including the jobs that were not handed out.
+ */
+int local_scan_free(LocalScan scan) {
+    char* dir;
+
+    if(scan == NULL) return LOCAL_SCAN_ERROR;
+
+    pthread_mutex_lock(&scan->lock);
+    scan->cancel = true;
+    pthread_cond_broadcast(&scan->work);
+    pthread_cond_broadcast(&scan->space);
+    pthread_cond_broadcast(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+
+    for(int i = 0; i < scan->thread_count; i++) {
+        if(scan->workers[i].started) {
+            pthread_join(scan->workers[i].thread, NULL);
+        }
+    }
+
+    for(int i = 0; i < scan->thread_count; i++) {
+        struct local_scan_deque* deque = &scan->workers[i].deque;
+
+        if(deque->tasks == NULL) continue;
+        while((dir = local_scan_deque_pop(deque)) != NULL) free(dir);
+        free(deque->tasks);
+        pthread_mutex_destroy(&deque->lock);
+    }
+
+    for(size_t i = 0; i < scan->jobs_count; i++) {
+        free(scan->jobs[(scan->jobs_head + i) % LOCAL_SCAN_QUEUE_SIZE].path);
+        free(scan->jobs[(scan->jobs_head + i) % LOCAL_SCAN_QUEUE_SIZE].link);
+    }
+
+    close(scan->root_fd);
+    inode_set_free(scan->seen);
+    pthread_mutex_destroy(&scan->seen_lock);
+    pthread_mutex_destroy(&scan->lock);
+    pthread_cond_destroy(&scan->work);
+    pthread_cond_destroy(&scan->ready);
+    pthread_cond_destroy(&scan->space);
+    free(scan->jobs);
+    free(scan->workers);
+    free(scan);
+
+    return LOCAL_SCAN_OK;
+}
+
+static void* local_scan_work(void* arg) {
+    struct local_scan_worker* worker = (struct local_scan_worker*)arg;
+    LocalScan                 scan   = worker->scan;
+    struct local_scan_batch   batch;
+    char*                     dir;
+
+    batch.count = 0;
+    while((dir = local_scan_take(worker)) != NULL) {
+        local_scan_read(worker, dir, &batch);
+        free(dir);
+
+        pthread_mutex_lock(&scan->lock);
+        scan->pending--;
+        if(scan->pending == 0) {
+            scan->done = true;
+            pthread_cond_broadcast(&scan->work);
+            pthread_cond_signal(&scan->ready);
+        }
+        pthread_mutex_unlock(&scan->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Takes the newest directory of the worker's own deque or steals the oldest
+ * from another one. Returns NULL when nothing is left anywhere.
+ */
+static char* local_scan_take(struct local_scan_worker* worker) {
+    LocalScan scan = worker->scan;
+    char*     dir;
+    bool      busy;
+
+    while(true) {
+        dir = local_scan_deque_pop(&worker->deque);
+        for(int i = 1; dir == NULL && i < scan->thread_count; i++) {
+            int victim = (worker->id + i) % scan->thread_count;
+
+            dir = local_scan_deque_steal(&scan->workers[victim].deque);
+        }
+
+        pthread_mutex_lock(&scan->lock);
+        if(dir != NULL) {
+            scan->queued--;
+            pthread_mutex_unlock(&scan->lock);
+            return dir;
+        }
+        if(scan->cancel || scan->pending == 0) {
+            pthread_mutex_unlock(&scan->lock);
+            return NULL;
+        }
+
+        // a directory counted in queued may not be in its deque just yet
+        busy = scan->queued > 0;
+        if(!busy) pthread_cond_wait(&scan->work, &scan->lock);
+        pthread_mutex_unlock(&scan->lock);
+
+        if(busy) sched_yield();
+    }
+}
+
+/**
+ * Reads one directory. Its entries go to the job queue before its
+ * subdirectories are queued for reading so a directory is always handed out
+ * before what is inside it.
+ */
+static void local_scan_read(struct local_scan_worker* worker,
+                            const char*               dir,
+                            struct local_scan_batch*  batch) {
+    LocalScan             scan     = worker->scan;
+    char**                subdirs  = NULL;
+    int                   count    = 0;
+    int                   capacity = 0;
+    int                   fd;
+    DIR*                  stream;
+    struct dirent*        entry;
+    struct stat           info;
+    struct local_scan_job job;
+
+    fd = openat(scan->root_fd,
+                (dir[0] == '\0') ? "." : dir,
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1) {
+        fprintf(stderr, "Failed to open local directory %s: %d\n", dir, errno);
+        local_scan_fail(scan);
+        return;
+    }
+
+    stream = fdopendir(fd);
+    if(stream == NULL) {
+        fprintf(stderr, "Failed to open local directory %s: %d\n", dir, errno);
+        close(fd);
+        local_scan_fail(scan);
+        return;
+    }
+
+    errno = 0;
+    while((entry = readdir(stream)) != NULL) {
+        if(entry->d_name[0] == '.') continue;
+
+        job.link   = NULL;
+        job.device = 0;
+        job.inode  = entry->d_ino;
+        job.links  = 1;
+        job.size   = 0;
+        job.mtime  = 0;
+        job.blocks = 0;
+        job.mode   = S_IFDIR;
+        job.type   = LOCAL_SCAN_DIRECTORY;
+
+        // d_type saves the stat for directories, files need it for the size
+        // and followed directories for their device
+        if(entry->d_type != DT_DIR || scan->follow) {
+            if(fstatat(dirfd(stream), entry->d_name, &info, 0) != 0) {
+                fprintf(stderr,
+                        "Could not stat for %s error: %d\n",
+                        entry->d_name,
+                        errno);
+                local_scan_fail(scan);
+                errno = 0;
+                continue;
+            }
+
+            if(S_ISREG(info.st_mode)) {
+                job.type   = LOCAL_SCAN_FILE;
+                job.mode   = info.st_mode;
+                job.size   = info.st_size;
+                job.mtime  = info.st_mtime;
+                job.device = info.st_dev;
+                job.inode  = info.st_ino;
+                job.links  = info.st_nlink;
+                job.blocks = info.st_blocks;
+            } else if(S_ISDIR(info.st_mode) &&
+                      (entry->d_type != DT_LNK || scan->follow)) {
+                job.device = info.st_dev;
+                job.inode  = info.st_ino;
+            } else {
+                fprintf(stderr,
+                        "skipping %s%s%s\n",
+                        dir,
+                        (dir[0] == '\0') ? "" : "/",
+                        entry->d_name);
+                errno = 0;
+                continue;
+            }
+        }
+
+        job.path = local_scan_join(dir, entry->d_name);
+        if(job.path == NULL) {
+            local_scan_fail(scan);
+            break;
+        }
+
+        if(job.type == LOCAL_SCAN_DIRECTORY && local_scan_visit(scan, &job)) {
+            if(count == capacity) {
+                int    new_capacity = (capacity == 0) ? 16 : capacity * 2;
+                char** temp =
+                    (char**)realloc(subdirs, sizeof(char*) * new_capacity);
+                if(temp == NULL) {
+                    fprintf(stderr, "failed to grow the directory list\n");
+                    free(job.path);
+                    local_scan_fail(scan);
+                    break;
+                }
+                subdirs  = temp;
+                capacity = new_capacity;
+            }
+            subdirs[count] = strdup(job.path);
+            if(subdirs[count] == NULL) {
+                free(job.path);
+                local_scan_fail(scan);
+                break;
+            }
+            count++;
+        }
+
+        batch->jobs[batch->count++] = job;
+        if(batch->count == LOCAL_SCAN_BATCH_SIZE &&
+           !local_scan_flush(scan, batch)) {
+            break;
+        }
+        errno = 0;
+    }
+
+    if(entry == NULL && errno != 0) {
+        fprintf(stderr, "error reading the folder %s: %d\n", dir, errno);
+        local_scan_fail(scan);
+    }
+    closedir(stream);
+
+    if(local_scan_flush(scan, batch)) {
+        local_scan_push(worker, subdirs, count);
+    } else {
+        for(int i = 0; i < count; i++) free(subdirs[i]);
+    }
+    free(subdirs);
+}
+
+/**
+ * Whether the directory of job is to be read. A directory reached before
+ * while following links gets where that was in its link instead.
+ */
+static bool local_scan_visit(LocalScan scan, struct local_scan_job* job) {
+    const char* first;
+
+    if(!scan->follow) return true;
+
+    pthread_mutex_lock(&scan->seen_lock);
+    first = inode_set_add(scan->seen, job->device, job->inode, job->path);
+    if(first != NULL) {
+        job->link = strdup(first);
+        if(job->link == NULL) {
+            fprintf(stderr, "failed to allocate memory for %s\n", job->path);
+        }
+    }
+    pthread_mutex_unlock(&scan->seen_lock);
+
+    // without a link the directory is left out rather than read in a loop
+    return first == NULL;
+}
+
+/**
+ * Moves the batch to the job queue, waiting for room if the consumer is
+ * behind. Returns false and drops the batch if the scan was stopped.
+ */
+static bool local_scan_flush(LocalScan scan, struct local_scan_batch* batch) {
+    size_t tail;
+
+    pthread_mutex_lock(&scan->lock);
+    while(!scan->cancel && LOCAL_SCAN_QUEUE_SIZE - scan->jobs_count <
+                               (size_t)batch->count) {
+        pthread_cond_wait(&scan->space, &scan->lock);
+    }
+
+    if(scan->cancel) {
+        pthread_mutex_unlock(&scan->lock);
+        for(int i = 0; i < batch->count; i++) free(batch->jobs[i].path);
+        batch->count = 0;
+        return false;
+    }
+
+    for(int i = 0; i < batch->count; i++) {
+        tail = (scan->jobs_head + scan->jobs_count) % LOCAL_SCAN_QUEUE_SIZE;
+        scan->jobs[tail] = batch->jobs[i];
+        scan->jobs_count++;
+    }
+    if(batch->count > 0) pthread_cond_signal(&scan->ready);
+    pthread_mutex_unlock(&scan->lock);
+
+    batch->count = 0;
+    return true;
+}
+
+/**
+ * Queues directories on the worker's own deque. They are counted first so
+ * no other worker can see the scan as finished in between.
+ */
+static void local_scan_push(struct local_scan_worker* worker,
+                            char**                    dirs,
+                            int                       count) {
+    LocalScan scan = worker->scan;
+
+    if(count == 0) return;
+
+    pthread_mutex_lock(&scan->lock);
+    scan->pending += count;
+    scan->queued  += count;
+    pthread_mutex_unlock(&scan->lock);
+
+    for(int i = 0; i < count; i++) {
+        if(!local_scan_deque_push(&worker->deque, dirs[i])) {
+            free(dirs[i]);
+            pthread_mutex_lock(&scan->lock);
+            scan->pending--;
+            scan->queued--;
+            scan->failed = true;
+            pthread_mutex_unlock(&scan->lock);
+        }
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    pthread_cond_broadcast(&scan->work);
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static void local_scan_fail(LocalScan scan) {
+    pthread_mutex_lock(&scan->lock);
+    scan->failed = true;
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static char* local_scan_join(const char* dir, const char* name) {
+    size_t dir_len  = strlen(dir);
+    size_t name_len = strlen(name);
+    char*  path;
+
+    path = (char*)malloc(dir_len + name_len + 2);
+    if(path == NULL) {
+        fprintf(stderr, "failed to allocate memory for a scanned path\n");
+        return NULL;
+    }
+
+    if(dir_len == 0) {
+        memcpy(path, name, name_len + 1);
+    } else {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+
+    return path;
+}
+
+static bool local_scan_deque_init(struct local_scan_deque* deque) {
+    deque->tasks = (char**)malloc(sizeof(char*) * LOCAL_SCAN_INITIAL_DEQUE);
+    if(deque->tasks == NULL) {
+        fprintf(stderr, "failed to allocate memory for the scan deque\n");
+        return false;
+    }
+
+    deque->head     = 0;
+    deque->count    = 0;
+    deque->capacity = LOCAL_SCAN_INITIAL_DEQUE;
+    pthread_mutex_init(&deque->lock, NULL);
+
+    return true;
+}
+
+static bool local_scan_deque_push(struct local_scan_deque* deque, char* dir) {
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count == deque->capacity) {
+        char** tasks = (char**)malloc(sizeof(char*) * deque->capacity * 2);
+        if(tasks == NULL) {
+            fprintf(stderr, "failed to grow the scan deque\n");
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+
+        for(size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks     = tasks;
+        deque->head      = 0;
+        deque->capacity *= 2;
+    }
+
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = dir;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+
+    return true;
+}
+
+static char* local_scan_deque_pop(struct local_scan_deque* deque) {
+    char* dir = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0) {
+        deque->count--;
+        dir = deque->tasks[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return dir;
+}
+
+static char* local_scan_deque_steal(struct local_scan_deque* deque) {
+    char* dir = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count > 0) {
+        dir         = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return dir;
+}
@@ -1,86 +1,436 @@
 #include "main.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <libssh/libssh.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "batch.h"
+#include "checksum.h"
+#include "cipher_bench.h"
+#include "conn_pool.h"
+#include "download_cache.h"
+#include "dynamic_str.h"
+#include "fanin.h"
+#include "fanout.h"
+#include "fleet.h"
+#include "fleet_exec.h"
+#include "mux.h"
 #include "pssh.h"
 
 /**
- * The command line interface for the application
+ * The command line interface for the application. With arguments it runs them
+ * as a batch instead of showing the menus.
  */
-int main(void) {
-    int   verbosity = SSH_LOG_NOLOG;
-    int   port      = 22;
-    char* user      = "remoteuser";
+int main(int argc, char** argv) {
     char* host;
     char  buffer[BUFFER_SIZE];
 
+    ConnPool    pool;
+    PoolConn    conn;
+    ssh_session session;
+
+    download_cache_from_env();
+
+    if(argc > 1) return batch_main(argc, argv);
+
     printf("Enter name of host: ");
     pfgets(buffer, BUFFER_SIZE);
     host = strdup(buffer);
 
-    ssh_session session = ssh_new();
+    // a master left by an earlier run is already logged in to the host, the
+    // full menu needs a connection of its own
+    if(mux_available(host) && !attached_mode(host)) {
+        free(host);
+        return 0;
+    }
+
+    session = open_session(host);
     if(session == NULL) {
-        fprintf(stderr, "failed to create ssh session\n");
         free(host);
         exit(-1);
     }
 
-    // get the host name from environment variable
+    printf("You are now connected to \"%s\" user at host \"%s\"\n",
+           DEFAULT_USER,
+           host);
+
+    // the pool owns the session from here on
+    pool = conn_pool_init(session, conn_pool_size_from_env());
+    if(pool == NULL) {
+        ssh_disconnect(session);
+        ssh_free(session);
+        free(host);
+        exit(-1);
+    }
+
+    do {
+        print_home_menu();
+        pfgets(buffer, BUFFER_SIZE);
+
+        if(strcmp(buffer, "1") == 0) {
+            conn = conn_pool_acquire(pool);
+            terminal_session(conn->session);
+            conn_pool_release(pool, conn);
+        } else if(strcmp(buffer, "2") == 0) {
+            upload_mode(pool);
+        } else if(strcmp(buffer, "3") == 0) {
+            easy_navigate_mode_sftp(pool);
+        } else if(strcmp(buffer, "4") == 0) {
+            if(mux_start_master(pool, host) == MUX_OK) {
+                printf("The connection to \"%s\" stays open in the "
+                       "background\n",
+                       host);
+                // the master owns the pool now
+                free(host);
+                return 0;
+            }
+        }
+
+    } while(buffer[0] != 'q' && buffer[0] != '0');
+
+    conn_pool_free(pool);
+    free(host);
+    return 0;
+}
+
+/**
+ * A session to host with the user, port and logging every connection uses,
+ * not connected yet. Returns NULL after printing why if it could not.
+ */
+ssh_session create_session(const char* host) {
+    int         verbosity = SSH_LOG_NOLOG;
+    int         port      = DEFAULT_PORT;
+    ssh_session session;
+
+    session = ssh_new();
+    if(session == NULL) {
+        fprintf(stderr, "failed to create ssh session\n");
+        return NULL;
+    }
+
     ssh_options_set(session, SSH_OPTIONS_HOST, host);
-    ssh_options_set(session, SSH_OPTIONS_USER, user);
+    ssh_options_set(session, SSH_OPTIONS_USER, DEFAULT_USER);
     ssh_options_set(session, SSH_OPTIONS_PORT, &port);
     ssh_options_set(session, SSH_OPTIONS_LOG_VERBOSITY, &verbosity);
 
+    return session;
+}
+
+/**
+ * Connects and logs in to host, public keys first and then the password.
+ * Returns NULL after printing why if it could not.
+ */
+ssh_session open_session(const char* host) {
+    ssh_session session;
+
+    session = create_session(host);
+    if(session == NULL) return NULL;
+
+    // the library defaults are used if the ciphers could not be ranked
+    cipher_bench_apply(session);
+
     // Connect to the server
     if(ssh_connect(session) != SSH_OK) {
         fprintf(stderr,
                 "Error connecting to %s: %s\n",
                 host,
                 ssh_get_error(session));
-        free(host);
-        exit(-1);
+        ssh_free(session);
+        return NULL;
     }
 
     if(verify_knownhost(session) < 0) {
         ssh_disconnect(session);
         ssh_free(session);
-        free(host);
-        exit(-1);
+        return NULL;
     }
 
-    if(pauthenticate(session) != 0) {
+    if(ssh_userauth_publickey_auto(session, NULL, NULL) != SSH_AUTH_SUCCESS &&
+       pauthenticate(session) != SSH_AUTH_SUCCESS) {
         puts("Wrong password");
         ssh_disconnect(session);
         ssh_free(session);
-        free(host);
-        exit(-1);
+        return NULL;
     }
 
-    printf("You are now connected to \"%s\" user at host \"%s\"\n", user, host);
+    return session;
+}
 
-    do {
-        print_home_menu();
-        pfgets(buffer, BUFFER_SIZE);
+/**
+ * Runs the operations on the command line and in the manifest without asking
+ * anything and reports on them. With -H the operation runs on a whole fleet
+ * instead of a single host. Returns the exit status of the program, 0 if
+ * every operation succeeded.
+ */
+int batch_main(int argc, char** argv) {
+    enum path_conflict policy      = PATH_CONFLICT_SKIP;
+    const char*        manifest    = NULL;
+    const char*        report_name = NULL;
+    const char*        hosts       = NULL;
+    const char*        output_dir  = NULL;
+    int                jobs        = 0;
+    uint64_t           bandwidth   = 0;
+    enum checksum_type checksum    = CHECKSUM_NONE;
+    bool               follow      = false;
+    FILE*              report      = stdout;
+    ssh_session        session;
+    ConnPool           pool;
+    Batch              batch;
+    int                status;
+    int                opt;
 
-        if(strcmp(buffer, "1") == 0) {
-            terminal_session(session);
-        } else if(strcmp(buffer, "2") == 0) {
-            upload_mode(session);
-        } else if(strcmp(buffer, "3") == 0) {
-            easy_navigate_mode_sftp(session);
+    while((opt = getopt(argc, argv, "b:c:d:f:H:j:Lo:s:h")) != -1) {
+        switch(opt) {
+            case 'b':
+                if(parse_bandwidth(optarg, &bandwidth) != 0) {
+                    fprintf(stderr, "-b takes bytes per second like 500k\n");
+                    return 2;
+                }
+                break;
+            case 'c':
+                if(batch_parse_policy(optarg, &policy) != BATCH_OK) return 2;
+                break;
+            case 'd': output_dir = optarg; break;
+            case 'f': manifest = optarg; break;
+            case 'H': hosts = optarg; break;
+            case 'j':
+                jobs = atoi(optarg);
+                if(jobs < 1) {
+                    fprintf(stderr, "-j takes a positive number\n");
+                    return 2;
+                }
+                break;
+            case 'L': follow = true; break;
+            case 'o': report_name = optarg; break;
+            case 's':
+                if(checksum_parse(optarg, &checksum) != CHECKSUM_OK) return 2;
+                break;
+            default:  print_batch_usage(); return 2;
         }
+    }
 
-    } while(buffer[0] != 'q' && buffer[0] != '0');
+    transfer_set_bandwidth(bandwidth);
+    transfer_set_checksum(checksum);
+    transfer_set_follow_links(follow);
 
-    ssh_disconnect(session);
-    ssh_free(session);
-    free(host);
+    if(hosts != NULL && manifest == NULL) {
+        return fleet_main(hosts,
+                          policy,
+                          jobs,
+                          report_name,
+                          output_dir,
+                          argc - optind,
+                          argv + optind);
+    }
+
+    if(optind >= argc || hosts != NULL || output_dir != NULL) {
+        print_batch_usage();
+        return 2;
+    }
+    if(jobs == 0) jobs = conn_pool_size_from_env();
+
+    batch = batch_init(policy);
+    if(batch == NULL) return 1;
+
+    if((manifest != NULL && batch_load(batch, manifest) != BATCH_OK) ||
+       batch_parse_args(batch, argc - optind - 1, argv + optind + 1) !=
+           BATCH_OK) {
+        batch_free(batch);
+        return 2;
+    }
+    if(batch->count == 0) {
+        print_batch_usage();
+        batch_free(batch);
+        return 2;
+    }
+
+    if(report_name != NULL) {
+        report = fopen(report_name, "w");
+        if(report == NULL) {
+            fprintf(stderr, "failed to open the report %s\n", report_name);
+            batch_free(batch);
+            return 1;
+        }
+    }
+
+    session = open_session(argv[optind]);
+    pool    = (session != NULL) ? conn_pool_init(session, jobs) : NULL;
+    if(pool == NULL) {
+        if(session != NULL) {
+            ssh_disconnect(session);
+            ssh_free(session);
+        }
+        if(report != stdout) fclose(report);
+        batch_free(batch);
+        return 1;
+    }
+
+    batch_run(batch, pool, jobs);
+    batch_report(batch, report);
+    status = batch_succeeded(batch) ? 0 : 1;
+
+    conn_pool_free(pool);
+    if(report != stdout) fclose(report);
+    batch_free(batch);
+    return status;
+}
+
+/**
+ * Runs the operation in argv on every host of hosts, jobs of them at a time,
+ * and reports on each host. A put reads the local files once for all hosts, a
+ * get puts what every host has in a directory of its own and an exec prints
+ * the output of every host, or writes it under output_dir.
+ */
+int fleet_main(const char*        hosts,
+               enum path_conflict policy,
+               int                jobs,
+               const char*        report_name,
+               const char*        output_dir,
+               int                argc,
+               char**             argv) {
+    FILE*      report = stdout;
+    Fleet      fleet;
+    Fanout     fanout = NULL;
+    Fanin      fanin  = NULL;
+    FleetExec  exec   = NULL;
+    DynamicStr command;
+    bool       valid;
+    int        status;
+
+    if(argc > 0 && strcmp(argv[0], "exec") == 0) {
+        valid = argc >= 2;
+    } else {
+        valid = argc >= 3 && output_dir == NULL &&
+                (strcmp(argv[0], "get") == 0 ||
+                 (strcmp(argv[0], "put") == 0 && argc == 3));
+    }
+    if(!valid) {
+        print_batch_usage();
+        return 2;
+    }
+
+    fleet = fleet_load(hosts);
+    if(fleet == NULL) return 2;
+
+    if(report_name != NULL) {
+        report = fopen(report_name, "w");
+        if(report == NULL) {
+            fprintf(stderr, "failed to open the report %s\n", report_name);
+            fleet_free(fleet);
+            return 1;
+        }
+    }
+
+    if(argv[0][0] == 'p') {
+        fanout = fanout_init(argv[1], argv[2], policy);
+    } else if(argv[0][0] == 'g') {
+        fanin = fanin_init(argv + 1, argc - 2, argv[argc - 1], policy);
+    } else {
+        // the words are given to the remote shell as one command line
+        command = dynamic_str_init(argv[1]);
+        for(int i = 2; command != NULL && i < argc; i++) {
+            if(dynamic_str_cat(command, " ") != DYNAMIC_STR_OK ||
+               dynamic_str_cat(command, argv[i]) != DYNAMIC_STR_OK) {
+                dynamic_str_free(command);
+                command = NULL;
+            }
+        }
+        if(command != NULL) {
+            exec = fleet_exec_init(command->str, output_dir);
+            dynamic_str_free(command);
+        }
+    }
+    if(fanout == NULL && fanin == NULL && exec == NULL) {
+        if(report != stdout) fclose(report);
+        fleet_free(fleet);
+        return 1;
+    }
+
+    if(fanout != NULL) fanout_run(fanout, fleet, jobs);
+    if(fanin != NULL) fanin_run(fanin, fleet, jobs);
+    if(exec != NULL) fleet_exec_run(exec, fleet, jobs);
+    fleet_report(fleet, report);
+    status = fleet_succeeded(fleet) ? 0 : 1;
+
+    if(fanout != NULL) fanout_free(fanout);
+    if(fanin != NULL) fanin_free(fanin);
+    if(exec != NULL) fleet_exec_free(exec);
+    if(report != stdout) fclose(report);
+    fleet_free(fleet);
+    return status;
+}
+
+/**
+ * Reads a number of bytes per second with an optional k, m or g after it.
+ * Returns 0 on success.
+ */
+int parse_bandwidth(const char* str, uint64_t* bandwidth) {
+    unsigned long long value;
+    char*              end;
+
+    errno = 0;
+    value = strtoull(str, &end, 10);
+    if(errno != 0 || end == str) return -1;
+
+    switch(tolower((unsigned char)*end)) {
+        case 'g': value *= BYTES_IN_GB; end++; break;
+        case 'm': value *= BYTES_IN_MB; end++; break;
+        case 'k': value *= BYTES_IN_KB; end++; break;
+        default:  break;
+    }
+    if(*end != '\0') return -1;
+
+    *bandwidth = value;
     return 0;
 }
 
+/**
+ * Turns the download cache on with the size the environment gives it, in
+ * bytes with an optional k, m or g after it.
+ */
+void download_cache_from_env(void) {
+    const char* value = getenv(DOWNLOAD_CACHE_SIZE_ENV);
+    uint64_t    limit = 0;
+
+    if(value == NULL || value[0] == '\0') return;
+
+    if(parse_bandwidth(value, &limit) != 0) {
+        fprintf(stderr,
+                "ignoring %s=%s, it should be a size like 10g\n",
+                DOWNLOAD_CACHE_SIZE_ENV,
+                value);
+        return;
+    }
+
+    download_cache_set_limit(limit);
+}
+
+void print_batch_usage(void) {
+    fputs("usage: pws [-b bytes per second] [-c overwrite|skip|newer] "
+          "[-j jobs] [-L] [-o report] [-s md5|sha1|sha256|sha512] "
+          "[-f manifest] host [operation]...\n"
+          "       pws -H hosts [-b bytes per second] "
+          "[-c overwrite|skip|newer] [-j hosts at once] [-o report] "
+          "[-d output directory] fleet operation\n"
+          "fleet operations:\n"
+          "  put <local> <remote directory>\n"
+          "  get <remote pattern>... <local directory>\n"
+          "  exec <command>...\n"
+          "operations:\n"
+          "  get <remote> <local directory>\n"
+          "  put <local> <remote directory>\n"
+          "  sync <local> <remote directory>\n"
+          "  mkdir <remote directory>\n"
+          "  rm <remote>\n",
+          stderr);
+}
+
 /**
  * Print the home menu that allows the user to open a new terminal session
  */
@@ -88,7 +438,52 @@ void print_home_menu(void) {
     puts(
         "You are at home menu type in the number of the action you want to do "
         "(0 or quit to quit)");
-    puts("1. open new terminal session(does not work)");
+    puts("1. open new terminal session");
     puts("2. upload mode");
     puts("3. easy navigate mode sftp");
+    puts("4. keep the connection open in the background and quit");
+}
+
+/**
+ * The menu of a run attached to a background master, which can only run
+ * commands on the master's connections. Returns true if the user asked for a
+ * connection of their own with the full menu instead.
+ */
+bool attached_mode(const char* host) {
+    char buffer[BUFFER_SIZE];
+    char command[BUFFER_SIZE];
+    int  status;
+
+    printf("Attached to the background connection to \"%s\"\n", host);
+
+    do {
+        print_attached_menu();
+        pfgets(buffer, BUFFER_SIZE);
+
+        if(strcmp(buffer, "1") == 0) {
+            printf("Command: ");
+            pfgets(command, BUFFER_SIZE);
+            if(mux_exec(host, command, &status) == MUX_OK) {
+                printf("exited with %d\n", status);
+            }
+        } else if(strcmp(buffer, "2") == 0) {
+            mux_stop(host);
+            break;
+        } else if(strcmp(buffer, "3") == 0) {
+            return true;
+        }
+
+    } while(buffer[0] != 'q' && buffer[0] != '0');
+
+    return false;
+}
+
+void print_attached_menu(void) {
+    puts(
+        "You are attached to a background connection type in the number of "
+        "the action you want to do (0 or quit to quit)");
+    puts("1. run a command");
+    puts("2. close the background connection and quit");
+    puts("3. open a connection of your own for uploads, downloads and the "
+         "terminal");
 }
@@ -0,0 +1,517 @@
+#include "mux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libssh/libssh.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conn_pool.h"
+#include "path.h"
+#include "pssh.h"
+
+/**
+ * What a request thread of the master needs.
+ */
+struct mux_client {
+    ConnPool pool;
+    int      fd;
+};
+
+static int             mux_active   = 0;
+static bool            mux_stopping = false;
+static time_t          mux_last_request;
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* mux_socket_path(const char* host, bool create);
+static int   mux_connect(const char* host);
+static void  mux_serve(ConnPool pool, int listener, char* socket_path);
+static void* mux_handle(void* arg);
+static int   mux_run(ConnPool pool, int fd, const char* command);
+static int   mux_write_frame(int         fd,
+                             uint32_t    type,
+                             const void* data,
+                             uint32_t    length);
+static int   mux_read_frame(int fd, struct mux_header* header, char** data);
+static int   mux_write_all(int fd, const void* data, size_t length);
+static int   mux_read_all(int fd, void* data, size_t length);
+
+/**
+ * Moves pool to a background master for host. Returns MUX_OK in the calling
+ * process once the master is listening, after that the caller must not use or
+ * free the pool anymore. The master itself never returns.
+ */
+int mux_start_master(ConnPool pool, const char* host) {
+    struct sockaddr_un address;
+    char*              socket_path;
+    int                listener;
+    pid_t              pid;
+    mode_t             mask;
+
+    if(pool == NULL || host == NULL) {
+        fprintf(stderr, "pool and host cannot be null\n");
+        return MUX_ERROR;
+    }
+
+    if(mux_available(host)) {
+        fprintf(stderr, "a master for %s is already running\n", host);
+        return MUX_ERROR;
+    }
+
+    socket_path = mux_socket_path(host, true);
+    if(socket_path == NULL) return MUX_ERROR;
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path %s is too long\n", socket_path);
+        free(socket_path);
+        return MUX_ERROR;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listener == -1) {
+        fprintf(stderr, "failed to create the master socket: %d\n", errno);
+        free(socket_path);
+        return MUX_ERROR;
+    }
+
+    // a socket left behind by a master that died is not in use anymore
+    unlink(socket_path);
+    mask = umask(0077);
+    if(bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+       listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "failed to listen on %s: %d\n", socket_path, errno);
+        umask(mask);
+        close(listener);
+        free(socket_path);
+        return MUX_ERROR;
+    }
+    umask(mask);
+
+    // the keepalive thread would write to the sessions the master now owns
+    conn_pool_keepalive_stop(pool);
+
+    pid = fork();
+    if(pid == -1) {
+        fprintf(stderr, "failed to start the master: %d\n", errno);
+        conn_pool_keepalive_start(pool);
+        close(listener);
+        unlink(socket_path);
+        free(socket_path);
+        return MUX_ERROR;
+    }
+
+    if(pid > 0) {
+        close(listener);
+        free(socket_path);
+        return MUX_OK;
+    }
+
+    conn_pool_keepalive_start(pool);
+    mux_serve(pool, listener, socket_path);
+    exit(0);
+}
+
+/**
+ * True if a master for host answers.
+ */
+bool mux_available(const char* host) {
+    struct mux_header header;
+    char*             data = NULL;
+    int               fd;
+    bool              alive;
+
+    fd = mux_connect(host);
+    if(fd == -1) return false;
+
+    alive = mux_write_frame(fd, MUX_PING, NULL, 0) == MUX_OK &&
+            mux_read_frame(fd, &header, &data) == MUX_OK &&
+            header.type == MUX_PING;
+
+    free(data);
+    close(fd);
+    return alive;
+}
+
+/**
+ * Runs command through the master of host with its output going to stdout
+ * and stderr as it arrives.
+ */
+int mux_exec(const char* host, const char* command, int* exit_status) {
+    struct mux_header header;
+    char*             data;
+    int               fd;
+    int               rc = MUX_ERROR;
+
+    if(host == NULL || command == NULL) {
+        fprintf(stderr, "host and command cannot be null\n");
+        return MUX_ERROR;
+    }
+
+    fd = mux_connect(host);
+    if(fd == -1) {
+        fprintf(stderr, "no master is running for %s\n", host);
+        return MUX_ERROR;
+    }
+
+    if(mux_write_frame(fd, MUX_EXEC, command, strlen(command)) != MUX_OK) {
+        close(fd);
+        return MUX_ERROR;
+    }
+
+    while(mux_read_frame(fd, &header, &data) == MUX_OK) {
+        if(header.type == MUX_STDOUT) {
+            fwrite(data, 1, header.length, stdout);
+            fflush(stdout);
+        } else if(header.type == MUX_STDERR) {
+            fwrite(data, 1, header.length, stderr);
+        } else if(header.type == MUX_EXIT &&
+                  header.length == sizeof(int32_t)) {
+            int32_t status;
+
+            memcpy(&status, data, sizeof(int32_t));
+            if(exit_status != NULL) *exit_status = status;
+            rc = MUX_OK;
+        } else if(header.type == MUX_FAILED) {
+            fprintf(stderr, "master: %.*s\n", (int)header.length, data);
+        }
+        free(data);
+
+        if(header.type == MUX_EXIT || header.type == MUX_FAILED) break;
+    }
+
+    close(fd);
+    return rc;
+}
+
+/**
+ * Asks the master of host to exit once its running requests are done.
+ */
+int mux_stop(const char* host) {
+    struct mux_header header;
+    char*             data = NULL;
+    int               fd;
+    int               rc;
+
+    fd = mux_connect(host);
+    if(fd == -1) {
+        fprintf(stderr, "no master is running for %s\n", host);
+        return MUX_ERROR;
+    }
+
+    rc = mux_write_frame(fd, MUX_STOP, NULL, 0);
+    if(rc == MUX_OK) rc = mux_read_frame(fd, &header, &data);
+
+    free(data);
+    close(fd);
+    return rc;
+}
+
+static char* mux_socket_path(const char* host, bool create) {
+    Path  file;
+    char  name[BUFFER_SIZE];
+    char* socket_path;
+
+    file = path_get_cache_directory(create);
+    if(file == NULL) return NULL;
+
+    snprintf(name, BUFFER_SIZE, "%s%s", host, MUX_SOCKET_EXTENSION);
+    path_go_into(file, name);
+
+    socket_path = strdup(file->path->str);
+    path_free(file);
+    if(socket_path == NULL) {
+        fprintf(stderr, "failed to allocate memory for the socket path\n");
+    }
+
+    return socket_path;
+}
+
+static int mux_connect(const char* host) {
+    struct sockaddr_un address;
+    char*              socket_path;
+    int                fd;
+
+    socket_path = mux_socket_path(host, false);
+    if(socket_path == NULL) return -1;
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address.sun_path)) {
+        free(socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    free(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1) return -1;
+
+    if(connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * The master's accept loop. Every request gets its own thread which borrows
+ * a connection from the pool for as long as the request runs. Exits when
+ * asked to, when idle for MUX_IDLE_TIMEOUT or when the connection to the host
+ * is lost.
+ */
+static void mux_serve(ConnPool pool, int listener, char* socket_path) {
+    struct mux_client* client;
+    struct pollfd      pfd;
+    pthread_t          thread;
+    int                fd;
+    int                null_fd;
+    int                active;
+    bool               stopping;
+
+    setsid();
+    signal(SIGPIPE, SIG_IGN);
+    null_fd = open("/dev/null", O_RDWR);
+    if(null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if(null_fd > STDERR_FILENO) close(null_fd);
+    }
+
+    mux_last_request = time(NULL);
+    pfd.fd           = listener;
+    pfd.events       = POLLIN;
+    while(1) {
+        int rc = poll(&pfd, 1, MUX_POLL_INTERVAL);
+
+        pthread_mutex_lock(&mux_lock);
+        active   = mux_active;
+        stopping = mux_stopping;
+        if(rc == 0 && active == 0 &&
+           time(NULL) - mux_last_request > MUX_IDLE_TIMEOUT) {
+            stopping = true;
+        }
+        pthread_mutex_unlock(&mux_lock);
+
+        if(stopping && active == 0) break;
+        // with no request running nothing else is using the first session
+        if(active == 0 && !ssh_is_connected(pool->connections[0].session)) {
+            break;
+        }
+        if(rc <= 0 || stopping) continue;
+
+        fd = accept(listener, NULL, NULL);
+        if(fd == -1) continue;
+
+        client = (struct mux_client*)malloc(sizeof(struct mux_client));
+        if(client == NULL) {
+            close(fd);
+            continue;
+        }
+        client->pool = pool;
+        client->fd   = fd;
+
+        pthread_mutex_lock(&mux_lock);
+        mux_active++;
+        mux_last_request = time(NULL);
+        pthread_mutex_unlock(&mux_lock);
+
+        if(pthread_create(&thread, NULL, mux_handle, client) != 0) {
+            pthread_mutex_lock(&mux_lock);
+            mux_active--;
+            pthread_mutex_unlock(&mux_lock);
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    free(socket_path);
+    conn_pool_free(pool);
+}
+
+static void* mux_handle(void* arg) {
+    struct mux_client* client = (struct mux_client*)arg;
+    struct mux_header  header;
+    char*              data;
+    int32_t            status = 0;
+
+    if(mux_read_frame(client->fd, &header, &data) == MUX_OK) {
+        switch(header.type) {
+            case MUX_PING:
+                mux_write_frame(client->fd, MUX_PING, NULL, 0);
+                break;
+
+            case MUX_STOP:
+                pthread_mutex_lock(&mux_lock);
+                mux_stopping = true;
+                pthread_mutex_unlock(&mux_lock);
+                mux_write_frame(client->fd, MUX_EXIT, &status, sizeof(status));
+                break;
+
+            case MUX_EXEC: mux_run(client->pool, client->fd, data); break;
+
+            default:
+                mux_write_frame(client->fd, MUX_FAILED, "unknown request", 15);
+                break;
+        }
+        free(data);
+    }
+
+    close(client->fd);
+    free(client);
+
+    pthread_mutex_lock(&mux_lock);
+    mux_active--;
+    mux_last_request = time(NULL);
+    pthread_mutex_unlock(&mux_lock);
+
+    return NULL;
+}
+
+/**
+ * Runs command on a pooled connection and streams its output to fd.
+ */
+static int mux_run(ConnPool pool, int fd, const char* command) {
+    PoolConn    conn;
+    ssh_channel channel;
+    char        buffer[MUX_BUFFER_SIZE];
+    int         nbytes;
+    int         nbytes_err;
+    int32_t     status;
+    int         rc = MUX_OK;
+
+    conn    = conn_pool_acquire(pool);
+    channel = create_channel_with_open_session(conn->session);
+    if(channel == NULL ||
+       ssh_channel_request_exec(channel, command) != SSH_OK) {
+        const char* error = ssh_get_error(conn->session);
+
+        mux_write_frame(fd, MUX_FAILED, error, strlen(error));
+        if(channel != NULL) {
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+        }
+        conn_pool_release(pool, conn);
+        return MUX_ERROR;
+    }
+
+    while(rc == MUX_OK) {
+        nbytes = ssh_channel_read_timeout(channel,
+                                          buffer,
+                                          MUX_BUFFER_SIZE,
+                                          0,
+                                          MUX_READ_TIMEOUT);
+        if(nbytes > 0) rc = mux_write_frame(fd, MUX_STDOUT, buffer, nbytes);
+
+        nbytes_err =
+            ssh_channel_read_nonblocking(channel, buffer, MUX_BUFFER_SIZE, 1);
+        if(nbytes_err > 0 && rc == MUX_OK) {
+            rc = mux_write_frame(fd, MUX_STDERR, buffer, nbytes_err);
+        }
+
+        if(nbytes < 0 || nbytes_err < 0) break;
+        if(nbytes == 0 && nbytes_err == 0 && ssh_channel_is_eof(channel)) {
+            break;
+        }
+    }
+
+    if(rc == MUX_OK) {
+        ssh_channel_send_eof(channel);
+        status = ssh_channel_get_exit_status(channel);
+        rc     = mux_write_frame(fd, MUX_EXIT, &status, sizeof(status));
+    }
+
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    conn_pool_release(pool, conn);
+
+    return rc;
+}
+
+static int mux_write_frame(int         fd,
+                           uint32_t    type,
+                           const void* data,
+                           uint32_t    length) {
+    struct mux_header header;
+
+    header.type   = type;
+    header.length = length;
+
+    if(mux_write_all(fd, &header, sizeof(header)) != MUX_OK) return MUX_ERROR;
+    if(length == 0) return MUX_OK;
+
+    return mux_write_all(fd, data, length);
+}
+
+/**
+ * Reads one frame. data is allocated with a NUL after the payload and has to
+ * be freed even when the payload is empty.
+ */
+static int mux_read_frame(int fd, struct mux_header* header, char** data) {
+    *data = NULL;
+
+    if(mux_read_all(fd, header, sizeof(struct mux_header)) != MUX_OK) {
+        return MUX_ERROR;
+    }
+    if(header->length > MUX_MAX_PAYLOAD) return MUX_ERROR;
+
+    *data = (char*)malloc(header->length + 1);
+    if(*data == NULL) return MUX_ERROR;
+
+    if(mux_read_all(fd, *data, header->length) != MUX_OK) {
+        free(*data);
+        *data = NULL;
+        return MUX_ERROR;
+    }
+    (*data)[header->length] = '\0';
+
+    return MUX_OK;
+}
+
+static int mux_write_all(int fd, const void* data, size_t length) {
+    const char* p = (const char*)data;
+    ssize_t     nbytes;
+
+    while(length > 0) {
+        nbytes = send(fd, p, length, MSG_NOSIGNAL);
+        if(nbytes < 0 && errno == EINTR) continue;
+        if(nbytes <= 0) return MUX_ERROR;
+        p      += nbytes;
+        length -= nbytes;
+    }
+
+    return MUX_OK;
+}
+
+static int mux_read_all(int fd, void* data, size_t length) {
+    char*   p = (char*)data;
+    ssize_t nbytes;
+
+    while(length > 0) {
+        nbytes = read(fd, p, length);
+        if(nbytes < 0 && errno == EINTR) continue;
+        if(nbytes <= 0) return MUX_ERROR;
+        p      += nbytes;
+        length -= nbytes;
+    }
+
+    return MUX_OK;
+}
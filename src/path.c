@@ -20,109 +20,178 @@
 
 const char* SEPERATOR[] = {"\\", "/"};
 
+static __thread enum path_conflict path_conflict = PATH_CONFLICT_ASK;
+
+static int path_push(Path path, int start);
+static int path_parse(Path path, int from);
+
 Path path_init(const char* path, enum platform platform) {
+    return path_init_arena(NULL, path, platform);
+}
+
+Path path_init_arena(Arena arena, const char* path, enum platform platform) {
     Path new_path;
 
-    new_path = (Path)malloc(sizeof(struct path));
+    if(arena != NULL) {
+        new_path = (Path)arena_alloc(arena, sizeof(struct path));
+    } else {
+        new_path = (Path)malloc(sizeof(struct path));
+    }
     if(new_path == NULL) {
         fprintf(stderr, "failed to allocate memory for new path\n");
         return NULL;
     }
 
-    new_path->path = dynamic_str_init(path);
+    new_path->arena = arena;
+    new_path->path  = dynamic_str_init_arena(arena, path);
     if(new_path->path == NULL) {
         fprintf(stderr, "failed to initialize dynamic string\n");
-        free(new_path);
+        if(arena == NULL) free(new_path);
         return NULL;
     }
 
-    new_path->platform = platform;
+    new_path->platform    = platform;
+    new_path->depth       = 0;
+    new_path->capacity    = PATH_INITIAL_DEPTH;
+    new_path->stat_cached = false;
+    if(arena != NULL) {
+        new_path->components =
+            (int*)arena_alloc(arena, sizeof(int) * new_path->capacity);
+    } else {
+        new_path->components = (int*)malloc(sizeof(int) * new_path->capacity);
+    }
+    if(new_path->components == NULL) {
+        fprintf(stderr, "failed to allocate memory for path components\n");
+        path_free(new_path);
+        return NULL;
+    }
+
+    if(path_parse(new_path, 0) != PATH_OK) {
+        path_free(new_path);
+        return NULL;
+    }
 
     return new_path;
 }
 
-Path path_duplicate(Path path) {
-    return path_init(path->path->str, path->platform);
+Path path_duplicate(Path path) { return path_duplicate_arena(NULL, path); }
+
+Path path_duplicate_arena(Arena arena, Path path) {
+    Path new_path;
+
+    new_path = path_init_arena(arena, "", path->platform);
+    if(new_path == NULL) return NULL;
+
+    // copy the component stack instead of parsing the string again
+    if(dynamic_str_append(new_path->path,
+                          path->path->str,
+                          dynamic_str_length(path->path)) != DYNAMIC_STR_OK) {
+        path_free(new_path);
+        return NULL;
+    }
+    for(int i = 0; i < path->depth; i++) {
+        if(path_push(new_path, path->components[i]) != PATH_OK) {
+            path_free(new_path);
+            return NULL;
+        }
+    }
+
+    if(path->stat_cached) path_set_stat(new_path, &path->cached_stat);
+
+    return new_path;
 }
 
+/**
+ * Replaces the whole path with str.
+ */
+int path_set(Path path, const char* str) {
+    if(path == NULL || str == NULL) {
+        fprintf(stderr, "path or the new string cannot be null\n");
+        return PATH_ERROR;
+    }
+
+    if(dynamic_str_change(path->path, (char*)str) != DYNAMIC_STR_OK) {
+        return PATH_ERROR;
+    }
+
+    path->depth       = 0;
+    path->stat_cached = false;
+    return path_parse(path, 0);
+}
+
+/**
+ * Removes the last component. The root separator is kept so the parent of
+ * /home is /.
+ */
 int path_prev(Path path) {
-    DynamicStr  pathstr;
-    int         i;
-    const char* seperator = SEPERATOR[path->platform];
+    int start;
 
     if(path == NULL || path->path->size == 1) {
         fprintf(stderr, "pwd cannot be null or empty\n");
         return PATH_ERROR;
     }
 
-    i       = path->path->size;
-    pathstr = path->path;
-
-    if(strcmp(pathstr->str, seperator) == 0) {
+    if(path->depth == 0) {
         fprintf(stderr, "cannot move to before the root directory");
         return PATH_ERROR;
     }
 
-    i--;
-    while(i > 0 && pathstr->str[i] != seperator[0]) {
-        i--;
-    }
-
-    i = (i == 0) ? 1 : i;
+    start             = path->components[--path->depth];
+    path->stat_cached = false;
 
-    dynamic_str_remove(pathstr, i);
-
-    return PATH_OK;
+    return dynamic_str_truncate(path->path, (start > 1) ? start - 1 : start) ==
+                   DYNAMIC_STR_OK
+               ? PATH_OK
+               : PATH_ERROR;
 }
 
-int path_go_into(Path path, char* s) {
-    DynamicStr  pathstr;
-    int         rc;
-    const char* seperator = SEPERATOR[path->platform];
+int path_go_into(Path path, const char* s) {
+    DynamicStr pathstr;
+    int        length;
+    char       seperator;
 
     if(path == NULL || s == NULL) {
         fprintf(stderr, "pwd or node or cannot be null\n");
         return PATH_ERROR;
     }
 
-    pathstr = path->path;
+    pathstr           = path->path;
+    length            = dynamic_str_length(pathstr);
+    seperator         = SEPERATOR[path->platform][0];
+    path->stat_cached = false;
 
-    // if the array is just '/' and '\0' we are at root directory
-    if(pathstr->size != 2) {
-        rc = dynamic_str_cat(pathstr, seperator);
-        if(rc != DYNAMIC_STR_OK) {
+    // the root directory already ends with the separator
+    if(length == 0 || pathstr->str[length - 1] != seperator) {
+        if(dynamic_str_append(pathstr, &seperator, 1) != DYNAMIC_STR_OK) {
             fprintf(stderr, "error concaconating pwd\n");
             return PATH_ERROR;
         }
+        length++;
     }
 
-    rc = dynamic_str_cat(pathstr, s);
-    if(rc != DYNAMIC_STR_OK) {
+    if(dynamic_str_append(pathstr, s, strlen(s)) != DYNAMIC_STR_OK) {
         fprintf(stderr, "error concaconating pwd\n");
         return PATH_ERROR;
     }
 
-    return PATH_OK;
-}
-
-char* path_get_curr(Path path) {
-    char*       filename;
-    DynamicStr  pathstr = path->path;
-    int         i;
-    const char* seperator = SEPERATOR[path->platform];
+    if(path_push(path, length) != PATH_OK) return PATH_ERROR;
 
-    i = strlen(pathstr->str) - 1;
-    while(i > 0 && pathstr->str[i] != seperator[0]) {
-        i--;
-    }
-
-    filename = (char*)malloc(sizeof(char) * (strlen(pathstr->str) - i));
+    // s usually is a single name but it can hold more than one component
+    return path_parse(path, length);
+}
 
-    strcpy(filename, pathstr->str + i + 1);
+/**
+ * Returns the last component of the path without copying it. It is valid
+ * until the path changes.
+ */
+const char* path_basename(Path path) {
+    if(path->depth == 0) return path->path->str;
 
-    return filename;
+    return path->path->str + path->components[path->depth - 1];
 }
 
+char* path_get_curr(Path path) { return strdup(path_basename(path)); }
+
 Path path_get_downloads_directory(void) {
     Path new_path;
 
@@ -132,63 +201,113 @@ Path path_get_downloads_directory(void) {
     return new_path;
 }
 
+/**
+ * Returns the stat of the path, calling stat only if it is not cached. NULL
+ * is returned with errno set if stat fails, failures are not cached.
+ */
+const struct stat* path_stat(Path path) {
+    if(path->stat_cached) return &path->cached_stat;
+
+    errno = 0;
+    if(stat(path->path->str, &path->cached_stat) != 0) return NULL;
+
+    path->stat_cached = true;
+    return &path->cached_stat;
+}
+
+/**
+ * Caches a stat the caller already has, for example from fstatat in a walk.
+ */
+void path_set_stat(Path path, const struct stat* info) {
+    path->cached_stat = *info;
+    path->stat_cached = true;
+}
+
+/**
+ * Forgets the cached stat. Has to be called after the file is changed through
+ * anything but the path functions.
+ */
+void path_invalidate(Path path) { path->stat_cached = false; }
+
+/**
+ * Returns ~/.cache/pws, creating the missing directories when create is set.
+ */
+Path path_get_cache_directory(bool create) {
+    Path  dir;
+    char* component;
+    char* rest;
+    char* directories;
+
+    dir = path_init(HOME_DIRECTORY, CURR_PLATFORM);
+    if(dir == NULL) return NULL;
+
+    directories = strdup(PATH_CACHE_DIRECTORY);
+    if(directories == NULL) {
+        fprintf(stderr, "failed to allocate memory for the cache directory\n");
+        path_free(dir);
+        return NULL;
+    }
+
+    for(component = strtok_r(directories, "/", &rest); component != NULL;
+        component = strtok_r(NULL, "/", &rest)) {
+        path_go_into(dir, component);
+        if(create) mkdir(dir->path->str, 0700);
+    }
+
+    free(directories);
+    return dir;
+}
+
 unsigned long long path_get_file_size(Path path) {
-    struct stat path_stat;
-    int         rc;
+    const struct stat* info;
 
-    rc = stat(path->path->str, &path_stat);
-    if(rc != 0) {
+    info = path_stat(path);
+    if(info == NULL) {
         fprintf(stderr, "failed to get the stat of the path: %d\n", errno);
         return 0;
     }
 
-    if(!S_ISREG(path_stat.st_mode)) {
+    if(!S_ISREG(info->st_mode)) {
         fprintf(stderr, "the path is not a regular file\n");
         return 0;
     }
 
-    return (unsigned long long)path_stat.st_size;
+    return (unsigned long long)info->st_size;
 }
 
 bool path_is_directory(Path path) {
-    struct stat path_stat;
-    int         rc;
+    const struct stat* info;
 
-    rc = stat(path->path->str, &path_stat);
-    if(rc != 0) {
+    info = path_stat(path);
+    if(info == NULL) {
         fprintf(stderr, "failed to get the statof the path: %d\n", errno);
         return false;
     }
 
-    if(S_ISDIR(path_stat.st_mode)) {
+    if(S_ISDIR(info->st_mode)) {
         return true;
     }
     return false;
 }
 
 bool path_is_file(Path path) {
-    struct stat path_stat;
-    int         rc;
+    const struct stat* info;
 
-    rc = stat(path->path->str, &path_stat);
-    if(rc != 0) {
+    info = path_stat(path);
+    if(info == NULL) {
         fprintf(stderr, "failed to get the statof the path: %d\n", errno);
         return false;
     }
 
-    if(S_ISREG(path_stat.st_mode)) {
+    if(S_ISREG(info->st_mode)) {
         return true;
     }
     return false;
 }
 
 bool path_exists(Path path) {
-    struct stat path_stat;
-
-    errno  = 0;
-    int rc = stat(path->path->str, &path_stat);
-    if(rc == -1) {
-        if(errno == 2) {
+    if(path_stat(path) == NULL) {
+        if(errno == ENOENT) {
             return false;
         } else {
             fprintf(stderr,
@@ -204,16 +323,49 @@ bool path_exists(Path path) {
 
 DIR* path_opendir(Path path) { return opendir(path->path->str); }
 
+/**
+ * Sets the conflict policy of the calling thread.
+ */
+void path_set_conflict(enum path_conflict policy) { path_conflict = policy; }
+
+enum path_conflict path_get_conflict(void) { return path_conflict; }
+
+/**
+ * True if the policy keeps the file at path instead of replacing it with a
+ * source last modified at source_mtime. Asking is left to path_fopen.
+ */
+bool path_keep_existing(Path path, time_t source_mtime) {
+    const struct stat* info;
+
+    if(path_conflict == PATH_CONFLICT_ASK ||
+       path_conflict == PATH_CONFLICT_OVERWRITE) {
+        return false;
+    }
+
+    info = path_stat(path);
+    if(info == NULL) return false;
+
+    return path_conflict == PATH_CONFLICT_SKIP ||
+           info->st_mtime >= source_mtime;
+}
+
+/**
+ * Asks before replacing an existing file unless the thread has a conflict
+ * policy, in which case the caller already decided to replace it.
+ */
 FILE* path_fopen(Path path, const char* modes) {
     char buffer[BUFFER_SIZE];
 
-    if(modes[0] == 'w' && path_exists(path)) {
+    if(path_conflict == PATH_CONFLICT_ASK && modes[0] == 'w' &&
+       path_exists(path)) {
         printf("File %s already exists override?[y/N]", path->path->str);
         pfgets(buffer, BUFFER_SIZE);
 
         if(buffer[0] != 'Y' && buffer[0] != 'y') return NULL;
     }
 
+    if(modes[0] != 'r' || strchr(modes, '+') != NULL) path_invalidate(path);
+
     return fopen(path->path->str, modes);
 }
 
@@ -223,8 +375,12 @@ int path_create_directory(Path path) {
 
     errno = 0;
 
+    path_invalidate(path);
     rc = mkdir(path->path->str, 0775);
-    if(rc == -1 && errno == 17) {
+    if(rc == -1 && errno == 17 && path_conflict != PATH_CONFLICT_ASK) {
+        // without a user to ask the files are merged into the directory
+        rc = path_is_directory(path) ? 0 : -1;
+    } else if(rc == -1 && errno == 17) {
         printf("Directory %s already exists override?[y/N]: ", path->path->str);
         pfgets(buffer, BUFFER_SIZE);
         if(buffer[0] == 'y' || buffer[0] == 'Y') {
@@ -243,6 +399,7 @@ int path_create_directory(Path path) {
 int path_rm_directory(Path path) {
     int rc;
 
+    path_invalidate(path);
     rc = remove(path->path->str);
     if(rc == -1) {
         fprintf(stderr, "Error deleting %s: %d\n", path->path->str, errno);
@@ -254,7 +411,53 @@ int path_rm_directory(Path path) {
 sftp_file path_sftp_open(Path path) { }
 
 int path_free(Path path) {
+    if(path->arena != NULL) return PATH_OK;
+
+    free(path->components);
     dynamic_str_free(path->path);
     free(path);
     return PATH_OK;
 }
+
+static int path_push(Path path, int start) {
+    if(path->depth == path->capacity) {
+        int* temp;
+
+        if(path->arena != NULL) {
+            temp = (int*)arena_alloc(path->arena,
+                                     sizeof(int) * path->capacity * 2);
+            if(temp != NULL) {
+                memcpy(temp, path->components, sizeof(int) * path->depth);
+            }
+        } else {
+            temp = (int*)realloc(path->components,
+                                 sizeof(int) * path->capacity * 2);
+        }
+        if(temp == NULL) {
+            fprintf(stderr, "failed to grow the path components\n");
+            return PATH_ERROR;
+        }
+        path->components  = temp;
+        path->capacity   *= 2;
+    }
+
+    path->components[path->depth++] = start;
+    return PATH_OK;
+}
+
+/**
+ * Pushes every component that starts after a separator at or past from.
+ */
+static int path_parse(Path path, int from) {
+    const char* str       = path->path->str;
+    char        seperator = SEPERATOR[path->platform][0];
+
+    for(int i = from; str[i] != '\0'; i++) {
+        if(str[i] == seperator && str[i + 1] != '\0' &&
+           str[i + 1] != seperator) {
+            if(path_push(path, i + 1) != PATH_OK) return PATH_ERROR;
+        }
+    }
+
+    return PATH_OK;
+}
@@ -2,6 +2,8 @@
  * function definitions for interactions with the pi server
  */
 
+#define _GNU_SOURCE  // SEEK_DATA and SEEK_HOLE
+
 #include "pssh.h"
 
 #include <dirent.h>
@@ -9,6 +11,8 @@
 #include <fcntl.h>
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,17 +20,119 @@
 #include <time.h>
 
 #include "attr_list.h"
+#include "checksum.h"
+#include "dir_listing.h"
+#include "disk_usage.h"
+#include "download_cache.h"
 #include "dynamic_str.h"
+#include "inode_set.h"
+#include "local_scan.h"
 #include "path.h"
+#include "remote_ls.h"
+#include "terminal.h"
+#include "tree_index.h"
+#include "tree_search.h"
 
 #ifndef _WIN32
 #  include <bsd/readpassphrase.h>
+#  include <termios.h>
 #  include <unistd.h>
 #else
 #  include <_mingw_stat64.h>
 #  include <conio.h>
 #endif
 
+/**
+ * Progress of the directory being downloaded, directory_total is 0 when its
+ * size is not known.
+ */
+static __thread uint64_t directory_total   = 0;
+static __thread uint64_t directory_written = 0;
+static __thread time_t   directory_start;
+
+/**
+ * Kept per thread so transfers running side by side do not mix their
+ * progress lines or their counts.
+ */
+static __thread bool                  transfer_quiet = false;
+static __thread struct transfer_stats transfer_stats;
+
+/**
+ * A cap on the bytes per second of all transfers together, 0 for none. Every
+ * chunk moves the time the cap allows the next one to and waits for it.
+ */
+static pthread_mutex_t transfer_bandwidth_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        transfer_bandwidth      = 0;
+static double          transfer_bandwidth_next = 0;
+
+/**
+ * The hash every transfer is checked with, CHECKSUM_NONE for none. The files
+ * of a directory transfer are collected in the thread's batch and checked
+ * together once the whole directory is done.
+ */
+static enum checksum_type     transfer_checksum = CHECKSUM_NONE;
+static __thread ChecksumBatch transfer_checks   = NULL;
+
+/**
+ * A download waiting for its check before it goes into the download cache,
+ * object is filled in once its hash is known. It is stored through the
+ * session doing the check, the one it came through may be gone by then.
+ */
+static __thread ssh_session transfer_store_session = NULL;
+
+struct transfer_store {
+    char*                         local;
+    struct sftp_attributes_struct attr;
+    char                          object[DOWNLOAD_CACHE_NAME_SIZE];
+};
+
+/**
+ * Whether directory uploads go into symbolic links to directories. A file or
+ * directory reached again through another name is not sent twice either way.
+ */
+static bool transfer_follow_links = false;
+
+static sftp_file transfer_open(sftp_session* session,
+                               const char*   path,
+                               int           access,
+                               mode_t        mode);
+static sftp_file transfer_reopen(sftp_session* session,
+                                 sftp_file     file,
+                                 const char*   path,
+                                 int           access,
+                                 uint64_t      offset);
+static int       transfer_mkdir(sftp_session* session, const char* path);
+static bool      transfer_keep_remote(sftp_session session,
+                                      const char*  path,
+                                      Path         source);
+static int       transfer_check(sftp_session           session,
+                                const char*            path,
+                                Checksum               sum,
+                                struct transfer_store* store);
+static struct transfer_store* transfer_store_init(const char*     local,
+                                                  sftp_attributes attr);
+static void transfer_store_done(void* data, const char* path, bool verified);
+static char*     transfer_link_target(const char* path, const char* link);
+static int       transfer_link(sftp_session session,
+                               const char*  target,
+                               Path         local,
+                               const char*  remote);
+static bool      transfer_is_zero(const char* data, size_t length);
+static bool      transfer_skip_hole(FILE*     local,
+                                    Checksum  sum,
+                                    uint64_t  size,
+                                    uint64_t* offset,
+                                    uint64_t* data_end);
+static void      transfer_hash_zeros(Checksum sum, uint64_t length);
+static int       download_group(sftp_session*        session,
+                                struct download_job* jobs,
+                                int                  count);
+static int       download_collect(sftp_session         session,
+                                  struct download_job* job,
+                                  sftp_file            file,
+                                  const int*           requests,
+                                  int                  sent);
+
 /**
  * verify if the host is in the known host files and if not adds the host if
  * trusted.
@@ -212,24 +318,33 @@ sftp_session create_sftp_session(ssh_session session) {
 }
 
 /**
- * Returns the provided directories content. Simmilar to running ls.
+ * Returns the provided directories content. Simmilar to running ls. Uses a
+ * single remote find over an exec channel when the remote supports it and
+ * falls back to reading the directory over sftp otherwise.
  */
-AttrList directory_ls_sftp(sftp_session session_sftp, Path path) {
-    char* directory_name;
+AttrList directory_ls_sftp(sftp_session session_sftp, Path path, Arena arena) {
+    char*    directory_name;
+    AttrList list;
 
     if(session_sftp == NULL || path == NULL) {
         fprintf(stdout, "sftp session and directory name cannot be empty\n");
         return NULL;
     }
 
+    if(remote_ls_supported(session_sftp->session)) {
+        list = remote_ls_exec(session_sftp->session, path, 1, arena);
+        if(list != NULL) return list;
+    }
+
     directory_name = path->path->str;
-    AttrList list  = attr_list_initialize();
+    list           = attr_list_initialize_arena(arena);
 
     sftp_dir directory = sftp_opendir(session_sftp, directory_name);
     if(!directory) {
         fprintf(stderr,
                 "Failed to open directory: %s\n",
                 ssh_get_error(session_sftp));
+        attr_list_free(list);
         return NULL;
     }
 
@@ -248,6 +363,7 @@ AttrList directory_ls_sftp(sftp_session session_sftp, Path path) {
                 "Failed to read directory: %s\n",
                 ssh_get_error(session_sftp));
         sftp_closedir(directory);
+        attr_list_free(list);
         return NULL;
     }
 
@@ -324,11 +440,25 @@ int handle_directory_sftp(sftp_session session, Path pwd, AttrNode node) {
     printf("%s is a directory what do you want to do?\n", pwdstr);
     printf("1. Download the directory recursively\n");
     printf("2. Go inside the directory\n");
+    printf("3. Show disk usage\n");
     pfgets(buffer, BUFFER_SIZE);
 
     switch(buffer[0]) {
-        case '1': download_directory(session, curr_dir, default_path); break;
+        case '1':
+            // a measured directory gets an overall ETA while downloading, the
+            // total is from the last measurement and may be out of date
+            directory_written = 0;
+            directory_start   = time(NULL);
+            if(!disk_usage_cached(curr_dir->path->str,
+                                  &directory_total,
+                                  NULL)) {
+                directory_total = 0;
+            }
+            download_directory(session, curr_dir, default_path);
+            directory_total = 0;
+            break;
         case '2': path_go_into(pwd, node->data->name); break;
+        case '3': disk_usage_show(session, curr_dir, DISK_USAGE_TOP); break;
         default:  printf("Invalid input going back\n"); break;
     }
 
@@ -337,49 +467,63 @@ int handle_directory_sftp(sftp_session session, Path pwd, AttrNode node) {
     return SSH_OK;
 }
 
+/**
+ * The paths and listing of every level are taken from the thread's arena and
+ * released together when the level is done.
+ */
 int download_directory(sftp_session session, Path dir, Path location) {
-    AttrList list;
-    AttrNode node;
-    Path     curr_download_location;
-    Path     curr_downloading;
-    char*    folder_name;
+    AttrList          list;
+    AttrNode          node;
+    Path              curr_download_location;
+    Path              curr_downloading;
+    Arena             arena;
+    struct arena_mark mark;
+    bool              checks;
 
     if(session == NULL || dir == NULL) {
         fprintf(stderr, "session and dir path cannot be null\n");
         return SSH_ERROR;
     }
 
-    curr_download_location = path_duplicate(location);
-    folder_name            = path_get_curr(dir);
+    arena = arena_thread();
+    if(arena == NULL) return SSH_ERROR;
+    mark = arena_mark(arena);
 
-    path_go_into(curr_download_location, folder_name);
-
-    free(folder_name);
+    curr_download_location = path_duplicate_arena(arena, location);
+    path_go_into(curr_download_location, path_basename(dir));
 
     if(path_create_directory(curr_download_location) != 0) {
         fprintf(stderr,
                 "Failed to create directory at %s\n",
                 curr_download_location->path->str);
-        path_free(curr_download_location);
+        arena_rewind(arena, mark);
         return SSH_ERROR;
     }
 
-    list = directory_ls_sftp(session, dir);
+    list = directory_ls_sftp(session, dir, arena);
+    if(list == NULL && (session = conn_pool_recover(session)) != NULL) {
+        list = directory_ls_sftp(session, dir, arena);
+    }
     if(list == NULL) {
-        path_free(curr_download_location);
+        arena_rewind(arena, mark);
         return SSH_OK;
     }
 
-    curr_downloading = path_duplicate(dir);
+    curr_downloading = path_duplicate_arena(arena, dir);
     node             = list->head;
+    checks           = transfer_checks_begin();
     while(node != NULL) {
+        // the connection may have been opened again by the last download
+        session = conn_pool_current(session);
         path_go_into(curr_downloading, node->data->name);
 
         if(node->data->type == SSH_FILEXFER_TYPE_REGULAR) {
-            download_file(session,
-                          curr_downloading,
-                          curr_download_location,
-                          node->data);
+            if(download_file(session,
+                             curr_downloading,
+                             curr_download_location,
+                             node->data) != SSH_OK) {
+                transfer_stats.failed++;
+            }
         } else if(node->data->type == SSH_FILEXFER_TYPE_DIRECTORY) {
             download_directory(session,
                                curr_downloading,
@@ -391,10 +535,10 @@ int download_directory(sftp_session session, Path dir, Path location) {
 
         node = node->next;
     }
+    if(checks) transfer_checks_end(conn_pool_current(session));
 
     attr_list_free(list);
-    path_free(curr_download_location);
-    path_free(curr_downloading);
+    arena_rewind(arena, mark);
     return SSH_OK;
 }
 
@@ -402,248 +546,377 @@ int download_file(sftp_session    session,
                   Path            file,
                   Path            location,
                   sftp_attributes attr) {
-    sftp_file file_sftp;
-    char      chunk_buffer[CHUNK_SIZE];
-    Path      download_file;
-    char*     file_name;
-    char*     readable_size;
-    char*     readable_written;
-    FILE*     fp;
-    ssize_t   nbytes;
+    sftp_file   file_sftp;
+    char        chunk_buffer[CHUNK_SIZE];
+    Path        download_file;
+    const char* file_name;
+    char*       readable_size;
+    char*       readable_written;
+    FILE*       fp  = NULL;
+    Checksum    sum = NULL;
+    ssize_t     nbytes;
+    int         retries = 0;
+    int         cached;
+    int         rc;
+    bool        hole_at_end = false;
 
     unsigned long long total_written = 0;
 
-    file_sftp = sftp_open(session, file->path->str, O_RDONLY, 0);
+    file_name     = path_basename(file);
+    download_file = path_duplicate(location);
+    path_go_into(download_file, file_name);
+
+    if(path_keep_existing(download_file, (time_t)attr->mtime)) {
+        transfer_stats.skipped++;
+        path_free(download_file);
+        return SSH_OK;
+    }
+
+    // the local file is only touched once the cache has the contents
+    cached = download_cache_lookup(session->session,
+                                   file->path->str,
+                                   attr,
+                                   transfer_checksum);
+    if(cached >= 0) {
+        fp = path_fopen(download_file, "wb");
+        rc = (fp != NULL) ? download_cache_fetch(cached, fp)
+                          : DOWNLOAD_CACHE_ERROR;
+        close(cached);
+
+        if(rc == DOWNLOAD_CACHE_OK) {
+            if(!transfer_quiet) {
+                printf("[%s] taken from the cache\n", file_name);
+            }
+            fclose(fp);
+            path_free(download_file);
+            transfer_stats.files++;
+            return SSH_OK;
+        }
+        // a failed copy leaves the file empty for the download
+    }
+
+    file_sftp = transfer_open(&session, file->path->str, O_RDONLY, 0);
     if(file_sftp == NULL) {
         fprintf(stderr, "could not open file\n");
+        if(fp != NULL) fclose(fp);
+        path_free(download_file);
         return SSH_ERROR;
     }
 
-    file_name     = path_get_curr(file);
-    download_file = path_duplicate(location);
-    path_go_into(download_file, file_name);
-
-    fp = path_fopen(download_file, "wb");
+    if(fp == NULL) fp = path_fopen(download_file, "wb");
     if(fp == NULL) {
         fprintf(stderr,
                 "Failed to open file at %s\n",
                 download_file->path->str);
-        free(file_name);
         path_free(download_file);
+        sftp_close(file_sftp);
         return SSH_ERROR;
     }
-    // no longer needed so it is freed
-    path_free(download_file);
+
+    if(transfer_checksum != CHECKSUM_NONE) {
+        sum = checksum_init(transfer_checksum);
+        if(sum == NULL) {
+            fclose(fp);
+            sftp_close(file_sftp);
+            path_free(download_file);
+            return SSH_ERROR;
+        }
+    }
 
     readable_size = get_readable_size(attr->size);
 
     time_t last_report  = time(NULL);
     time_t current_time = last_report;
     while((nbytes = sftp_read(file_sftp, chunk_buffer, CHUNK_SIZE)) != 0) {
+        if(nbytes < 0 && retries++ < CONN_POOL_RETRIES) {
+            // picks up after the last chunk that made it to the disk
+            file_sftp = transfer_reopen(&session,
+                                        file_sftp,
+                                        file->path->str,
+                                        O_RDONLY,
+                                        total_written);
+            if(file_sftp != NULL) continue;
+        }
         if(nbytes < 0) {
             fprintf(stderr, "Error while reading from the file\n");
             fclose(fp);
             free(readable_size);
-            free(file_name);
-            sftp_close(file_sftp);
+            checksum_free(sum);
+            path_free(download_file);
+            if(file_sftp != NULL) sftp_close(file_sftp);
             return SSH_ERROR;
         }
+        retries = 0;
 
-        if(fwrite(chunk_buffer, sizeof(char), nbytes, fp) != (size_t)nbytes) {
+        // chunks of zeros are left as holes so sparse files stay sparse
+        hole_at_end = transfer_is_zero(chunk_buffer, nbytes);
+        if((hole_at_end && fseeko(fp, nbytes, SEEK_CUR) != 0) ||
+           (!hole_at_end && fwrite(chunk_buffer, sizeof(char), nbytes, fp) !=
+                                (size_t)nbytes)) {
             fprintf(stderr, "Error while writing to the file\n");
             fclose(fp);
             free(readable_size);
-            free(file_name);
+            checksum_free(sum);
+            path_free(download_file);
             sftp_close(file_sftp);
             return SSH_ERROR;
         }
-        total_written += nbytes;
+        // hashed on the way through, no second read of the file
+        if(sum != NULL) checksum_update(sum, chunk_buffer, nbytes);
+        total_written     += nbytes;
+        directory_written += nbytes;
+        transfer_throttle(nbytes);
 
         current_time = time(NULL);
-        if(current_time > last_report) {
+        if(!transfer_quiet && current_time > last_report) {
             readable_written = get_readable_size(total_written);
             printf("\r[%s] wrote %s of %s   ",
                    file_name,
                    readable_written,
                    readable_size);
+            print_directory_eta(current_time);
             fflush(stdout);
             last_report = time(NULL);
             free(readable_written);
         }
     }
-    printf("\n");
+    if(!transfer_quiet) printf("\n");
+
+    // a hole at the end is only there once the file is as long as the source
+    if(hole_at_end &&
+       (fflush(fp) != 0 || ftruncate(fileno(fp), total_written) != 0)) {
+        fprintf(stderr, "Error while writing to the file\n");
+        fclose(fp);
+        free(readable_size);
+        checksum_free(sum);
+        path_free(download_file);
+        sftp_close(file_sftp);
+        return SSH_ERROR;
+    }
 
     fclose(fp);
     free(readable_size);
-    free(file_name);
     sftp_close(file_sftp);
-    return SSH_OK;
-}
 
-int upload_directory(sftp_session session, Path from, Path to) {
-    Path  to_directory;
-    char* dir_name;
-    int   rc;
-    DIR*  local_dir;
-    Path  curr_path;
+    // only a download that passed its check is kept in the cache
+    rc = transfer_check(session,
+                        file->path->str,
+                        sum,
+                        download_cache_wants(attr)
+                            ? transfer_store_init(download_file->path->str,
+                                                  attr)
+                            : NULL);
+    checksum_free(sum);
+    path_free(download_file);
 
-    struct dirent* attr;
-    struct stat    path_stat;
+    transfer_stats.files++;
+    transfer_stats.bytes += total_written;
+    return rc;
+}
 
-    if(session == NULL || from == NULL || to == NULL) {
-        fprintf(stderr, "cannot pass null values to upload_file function\n");
-        return SSH_ERROR;
+/**
+ * Downloads small files DOWNLOAD_FILES_MAX_COUNT at a time. Returns how many
+ * of them failed.
+ */
+int download_files(sftp_session         session,
+                   struct download_job* jobs,
+                   int                  count) {
+    int failed = 0;
+    int group;
+
+    if(session == NULL || jobs == NULL) {
+        fprintf(stderr, "cannot pass null values to download_files\n");
+        return (count > 0) ? count : 0;
     }
 
-    dir_name = path_get_curr(from);
-    if(dir_name == NULL) {
-        fprintf(stderr, "Failed to get current file name from path\n");
-        return SSH_ERROR;
-    }
+    for(int first = 0; first < count; first += DOWNLOAD_FILES_MAX_COUNT) {
+        group = count - first;
+        if(group > DOWNLOAD_FILES_MAX_COUNT) group = DOWNLOAD_FILES_MAX_COUNT;
 
-    to_directory = path_duplicate(to);
-    if(to_directory == NULL) {
-        fprintf(stderr, "Failed to duplicate path\n");
-        free(dir_name);
-        return SSH_ERROR;
+        failed += download_group(&session, jobs + first, group);
+        session = conn_pool_current(session);
     }
 
-    rc = path_go_into(to_directory, dir_name);
-    if(rc != PATH_OK) {
-        fprintf(stderr, "Failed to go into path\n");
-        free(dir_name);
-        path_free(to_directory);
-        return SSH_ERROR;
-    }
+    return failed;
+}
 
-    rc = sftp_mkdir(session, to_directory->path->str, S_IRWXU | S_IRWXG);
-    if(rc != SSH_OK) {
-        fprintf(stderr,
-                "Failed to create remote directory: %d\n",
-                sftp_get_error(session));
-        path_free(to_directory);
-        free(dir_name);
-        return SSH_ERROR;
-    }
+/**
+ * The local tree is read by a local scan in the background so files start
+ * uploading as soon as the first directory has been read, the scan hands out
+ * every directory before its contents.
+ *
+ * A file with several names is sent once and its other names are made hard
+ * links to it on the remote where the server can. With links followed a
+ * directory reached again becomes a symbolic link to where it was uploaded.
+ */
+int upload_directory(sftp_session session, Path from, Path to) {
+    LocalScan   scan;
+    InodeSet    uploaded;
+    Path        remote;
+    Path        local;
+    const char* first;
+    char*       target;
+    int         remote_depth;
+    int         local_depth;
+    bool        checks;
+    int         rc = SSH_OK;
+
+    struct local_scan_job job;
+    struct stat           info;
 
-    local_dir = path_opendir(from);
-    if(local_dir == NULL) {
-        fprintf(stderr,
-                "Failed to open local directory: %s\n",
-                from->path->str);
-        path_free(to_directory);
-        free(dir_name);
+    if(session == NULL || from == NULL || to == NULL) {
+        fprintf(stderr, "cannot pass null values to upload_file function\n");
         return SSH_ERROR;
     }
 
-    curr_path = path_duplicate(from);
-
-    errno = 0;
-    while((attr = readdir(local_dir)) != NULL) {
-        if(attr->d_name[0] == '.') continue;
+    scan = local_scan_start(from->path->str, 0, transfer_follow_links);
+    if(scan == NULL) return SSH_ERROR;
 
-        path_go_into(curr_path, attr->d_name);
-
-        rc = stat(curr_path->path->str, &path_stat);
-        if(rc == -1) {
-            fprintf(stderr,
-                    "Could not stat for %s error: %d\n",
-                    attr->d_name,
-                    errno);
-            path_free(curr_path);
-            closedir(local_dir);
-            path_free(to_directory);
-            free(dir_name);
-            return SSH_ERROR;
-        }
+    uploaded = inode_set_init();
+    remote   = path_duplicate(to);
+    local    = path_duplicate(from);
+    if(uploaded == NULL || remote == NULL || local == NULL) {
+        fprintf(stderr, "Failed to duplicate path\n");
+        if(remote != NULL) path_free(remote);
+        if(local != NULL) path_free(local);
+        inode_set_free(uploaded);
+        local_scan_free(scan);
+        return SSH_ERROR;
+    }
 
-        if(S_ISDIR(path_stat.st_mode)) {
-            rc = upload_directory(session, curr_path, to_directory);
-            if(rc != SSH_OK) {
-                closedir(local_dir);
-                path_free(to_directory);
-                free(dir_name);
-                return SSH_ERROR;
-            }
-        } else if(S_ISREG(path_stat.st_mode)) {
-            rc = upload_file(session, curr_path, to_directory);
-            if(rc != SSH_OK) {
-                closedir(local_dir);
-                path_free(to_directory);
-                free(dir_name);
-                return SSH_ERROR;
+    path_go_into(remote, path_basename(from));
+    rc           = transfer_mkdir(&session, remote->path->str);
+    remote_depth = remote->depth;
+    local_depth  = local->depth;
+    checks       = transfer_checks_begin();
+
+    while(rc == SSH_OK && local_scan_next(scan, &job)) {
+        // the connection may have been opened again by the last upload
+        session = conn_pool_current(session);
+        path_go_into(remote, job.path);
+        path_go_into(local, job.path);
+
+        if(job.type == LOCAL_SCAN_DIRECTORY && job.link != NULL) {
+            target = transfer_link_target(job.path, job.link);
+            if(target == NULL ||
+               sftp_symlink(session, target, remote->path->str) != SSH_OK) {
+                fprintf(stderr,
+                        "Failed to link %s to %s: %s\n",
+                        remote->path->str,
+                        job.link,
+                        ssh_get_error(session));
+                transfer_stats.failed++;
             }
+            free(target);
+        } else if(job.type == LOCAL_SCAN_DIRECTORY) {
+            rc = transfer_mkdir(&session, remote->path->str);
         } else {
-            fprintf(stderr,
-                    "cannot print the path %s skipping\n",
-                    curr_path->path->str);
+            // the scan already has the stat upload_file asks for
+            memset(&info, 0, sizeof(struct stat));
+            info.st_mode   = job.mode;
+            info.st_size   = job.size;
+            info.st_mtime  = job.mtime;
+            info.st_ino    = job.inode;
+            info.st_blocks = job.blocks;
+            path_set_stat(local, &info);
+
+            // a followed link may be another name of a file with one name
+            first = NULL;
+            if(job.links > 1 || transfer_follow_links) {
+                first = inode_set_add(uploaded,
+                                      job.device,
+                                      job.inode,
+                                      remote->path->str);
+            }
+
+            if(first == NULL ||
+               transfer_link(session, first, local, remote->path->str) !=
+                   SSH_OK) {
+                path_prev(remote);
+                rc = upload_file(session, local, remote);
+            }
         }
-        path_prev(curr_path);
+        free(job.path);
+        free(job.link);
+
+        while(remote->depth > remote_depth) path_prev(remote);
+        while(local->depth > local_depth) path_prev(local);
     }
 
-    if(errno != 0) {
-        fprintf(stderr, "error reading the folder %d\n", errno);
-        closedir(local_dir);
-        path_free(to_directory);
-        free(dir_name);
-        return SSH_ERROR;
+    if(checks) transfer_checks_end(conn_pool_current(session));
+
+    if(rc == SSH_OK && local_scan_failed(scan)) {
+        fprintf(stderr, "Parts of %s could not be read\n", from->path->str);
+        rc = SSH_ERROR;
     }
 
-    path_free(curr_path);
-    closedir(local_dir);
-    path_free(to_directory);
-    free(dir_name);
-    return SSH_OK;
+    local_scan_free(scan);
+    inode_set_free(uploaded);
+    path_free(remote);
+    path_free(local);
+    return rc;
 }
 
 int upload_file(sftp_session session, Path from, Path to_directory) {
-    Path      to_file;
-    char*     file_name;
-    char*     readable_written;
-    char*     readable_size;
-    char      chunk[CHUNK_SIZE];
-    int       rc;
-    sftp_file remote_file;
-    FILE*     local_file;
-    size_t    nbytes;
+    Path        to_file;
+    const char* file_name;
+    char*       readable_written;
+    char*       readable_size;
+    char        chunk[CHUNK_SIZE];
+    int         rc;
+    sftp_file   remote_file;
+    FILE*       local_file;
+    Checksum    sum = NULL;
+    size_t      nbytes;
+    size_t      length;
+    int         retries = 0;
+    int         error;
+    int         access  = O_WRONLY | O_CREAT | O_EXCL;
+    bool        sparse      = false;
+    bool        hole_at_end = false;
+
+    const struct stat*            info;
+    struct sftp_attributes_struct attr;
 
     if(session == NULL || from == NULL || to_directory == NULL) {
         fprintf(stderr, "cannot pass null values to upload_file function\n");
         return SSH_ERROR;
     }
 
-    file_name = path_get_curr(from);
-    if(file_name == NULL) {
-        fprintf(stderr, "Failed to get current file name from path\n");
-        return SSH_ERROR;
-    }
+    file_name = path_basename(from);
 
     to_file = path_duplicate(to_directory);
     if(to_file == NULL) {
         fprintf(stderr, "Failed to duplicate path\n");
-        free(file_name);
         return SSH_ERROR;
     }
 
     rc = path_go_into(to_file, file_name);
     if(rc != PATH_OK) {
         fprintf(stderr, "Failed to go into path\n");
-        free(file_name);
         path_free(to_file);
         return SSH_ERROR;
     }
 
     // TODO: MAKE IT SO THAT USER GETS THE OPTION TO OVERIDE IF EXISTS
-    remote_file = sftp_open(session,
-                            to_file->path->str,
-                            O_WRONLY | O_CREAT | O_EXCL,
-                            S_IRWXU | S_IRWXG);
+    if(path_get_conflict() != PATH_CONFLICT_ASK) {
+        if(transfer_keep_remote(session, to_file->path->str, from)) {
+            transfer_stats.skipped++;
+            path_free(to_file);
+            return SSH_OK;
+        }
+        access = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+
+    remote_file = transfer_open(&session,
+                                to_file->path->str,
+                                access,
+                                S_IRWXU | S_IRWXG);
     if(remote_file == NULL) {
         fprintf(stderr,
                 "Failed to open remote file for writing: %s\n",
                 ssh_get_error(session));
         path_free(to_file);
-        free(file_name);
         return SSH_ERROR;
     }
 
@@ -654,33 +927,82 @@ int upload_file(sftp_session session, Path from, Path to_directory) {
                 from->path->str);
         sftp_close(remote_file);
         path_free(to_file);
-        free(file_name);
         return SSH_ERROR;
     }
 
+    if(transfer_checksum != CHECKSUM_NONE) {
+        sum = checksum_init(transfer_checksum);
+        if(sum == NULL) {
+            fclose(local_file);
+            sftp_close(remote_file);
+            path_free(to_file);
+            return SSH_ERROR;
+        }
+    }
+
     unsigned long long total_written = 0;
     unsigned long long total_size    = path_get_file_size(from);
+    uint64_t           offset        = 0;
+    uint64_t           data_end      = 0;
+
+    // a file with fewer blocks than its size has holes, only its data is sent
+#ifdef SEEK_DATA
+    info   = path_stat(from);
+    sparse = info != NULL &&
+             (unsigned long long)info->st_blocks * 512 < total_size;
+#endif
 
     readable_size = get_readable_size(total_size);
 
     time_t last_report  = time(NULL);
     time_t current_time = last_report;
-    while((nbytes = fread(chunk, sizeof(char), CHUNK_SIZE, local_file)) != 0) {
-        if(sftp_write(remote_file, chunk, nbytes) != (ssize_t)nbytes) {
-            fprintf(stderr,
-                    "Error writing to remote file: %d\n",
-                    sftp_get_error(session));
+    while(true) {
+        length = CHUNK_SIZE;
+        if(sparse && offset >= data_end) {
+            if(!transfer_skip_hole(local_file,
+                                   sum,
+                                   total_size,
+                                   &offset,
+                                   &data_end)) {
+                hole_at_end = true;
+                break;
+            }
+            // the server leaves what is not written a hole
+            sftp_seek64(remote_file, offset);
+        }
+        if(sparse && data_end - offset < length) length = data_end - offset;
+
+        nbytes = fread(chunk, sizeof(char), length, local_file);
+        if(nbytes == 0) break;
+
+        while(sftp_write(remote_file, chunk, nbytes) != (ssize_t)nbytes) {
+            error = sftp_get_error(session);
+            if(retries++ < CONN_POOL_RETRIES) {
+                // the chunk is written again after the last confirmed one
+                remote_file = transfer_reopen(&session,
+                                              remote_file,
+                                              to_file->path->str,
+                                              O_WRONLY,
+                                              offset);
+                if(remote_file != NULL) continue;
+            }
+
+            fprintf(stderr, "Error writing to remote file: %d\n", error);
             fclose(local_file);
-            sftp_close(remote_file);
+            checksum_free(sum);
+            if(remote_file != NULL) sftp_close(remote_file);
             path_free(to_file);
-            free(file_name);
             return SSH_ERROR;
         }
+        if(sum != NULL) checksum_update(sum, chunk, nbytes);
+        retries        = 0;
+        offset        += nbytes;
         total_written += nbytes;
+        transfer_throttle(nbytes);
 
         current_time = time(NULL);
-        if(current_time > last_report) {
-            readable_written = get_readable_size(total_written);
+        if(!transfer_quiet && current_time > last_report) {
+            readable_written = get_readable_size(offset);
             printf("\r[%s] wrote %s of %s",
                    file_name,
                    readable_written,
@@ -690,31 +1012,681 @@ int upload_file(sftp_session session, Path from, Path to_directory) {
             free(readable_written);
         }
     }
-    printf("\n");
+    if(!transfer_quiet) printf("\n");
+    free(readable_size);
 
     if(ferror(local_file)) {
         fprintf(stderr, "Error reading from local file: %s\n", from->path->str);
         fclose(local_file);
+        checksum_free(sum);
         sftp_close(remote_file);
         path_free(to_file);
-        free(file_name);
         return SSH_ERROR;
     }
 
     fclose(local_file);
     sftp_close(remote_file);
+
+    // nothing is written after the last hole, the size makes it part of the
+    // file
+    if(hole_at_end) {
+        memset(&attr, 0, sizeof(struct sftp_attributes_struct));
+        attr.flags = SSH_FILEXFER_ATTR_SIZE;
+        attr.size  = total_size;
+        if(sftp_setstat(session, to_file->path->str, &attr) != SSH_OK) {
+            fprintf(stderr,
+                    "Failed to set the size of %s: %s\n",
+                    to_file->path->str,
+                    ssh_get_error(session));
+            checksum_free(sum);
+            path_free(to_file);
+            return SSH_ERROR;
+        }
+    }
+
+    rc = transfer_check(session, to_file->path->str, sum, NULL);
+    checksum_free(sum);
     path_free(to_file);
-    free(file_name);
+
+    transfer_stats.files++;
+    transfer_stats.bytes += total_written;
+    return rc;
+}
+
+/**
+ * Opens path, opening the connection again first if it turns out to be lost.
+ * The lost attempt may have created the file already, so the retry does not
+ * insist on creating it and empties it instead.
+ */
+static sftp_file transfer_open(sftp_session* session,
+                               const char*   path,
+                               int           access,
+                               mode_t        mode) {
+    sftp_file    file;
+    sftp_session recovered;
+
+    file = sftp_open(*session, path, access, mode);
+    if(file != NULL) return file;
+
+    recovered = conn_pool_recover(*session);
+    if(recovered == NULL) return NULL;
+    *session = recovered;
+
+    if(access & O_EXCL) access = (access & ~O_EXCL) | O_TRUNC;
+    return sftp_open(recovered, path, access, mode);
+}
+
+/**
+ * Called when a read or write on file failed. If the connection was lost it
+ * is opened again and path is opened on it at offset. Returns NULL if the
+ * transfer cannot go on. file is closed either way.
+ */
+static sftp_file transfer_reopen(sftp_session* session,
+                                 sftp_file     file,
+                                 const char*   path,
+                                 int           access,
+                                 uint64_t      offset) {
+    sftp_session recovered;
+    sftp_file    reopened;
+
+    recovered = conn_pool_recover(*session);
+    sftp_close(file);
+    if(recovered == NULL) return NULL;
+    *session = recovered;
+
+    reopened = sftp_open(recovered, path, access, 0);
+    if(reopened == NULL) {
+        fprintf(stderr, "Failed to open %s again\n", path);
+        return NULL;
+    }
+
+    if(sftp_seek64(reopened, offset) < 0) {
+        fprintf(stderr, "Failed to seek in %s\n", path);
+        sftp_close(reopened);
+        return NULL;
+    }
+
+    return reopened;
+}
+
+/**
+ * Creates a remote directory, opening the connection again if it was lost. A
+ * directory found after a reconnect was made by the first attempt.
+ */
+static int transfer_mkdir(sftp_session* session, const char* path) {
+    sftp_session    recovered;
+    sftp_attributes attr;
+    int             error;
+
+    if(sftp_mkdir(*session, path, S_IRWXU | S_IRWXG) == SSH_OK) return SSH_OK;
+    error = sftp_get_error(*session);
+
+    // without a user to ask the files are merged into the directory, servers
+    // mostly report an existing one as a generic failure so it is looked up
+    if(path_get_conflict() != PATH_CONFLICT_ASK) {
+        attr = sftp_stat(*session, path);
+        if(attr != NULL && attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+            sftp_attributes_free(attr);
+            return SSH_OK;
+        }
+        if(attr != NULL) sftp_attributes_free(attr);
+    }
+
+    recovered = conn_pool_recover(*session);
+    if(recovered != NULL) {
+        *session = recovered;
+        if(sftp_mkdir(recovered, path, S_IRWXU | S_IRWXG) == SSH_OK) {
+            return SSH_OK;
+        }
+        error = sftp_get_error(recovered);
+
+        attr = sftp_stat(recovered, path);
+        if(attr != NULL && attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+            sftp_attributes_free(attr);
+            return SSH_OK;
+        }
+        if(attr != NULL) sftp_attributes_free(attr);
+    }
+
+    fprintf(stderr, "Failed to create remote directory: %d\n", error);
+    return SSH_ERROR;
+}
+
+/**
+ * Waits until the bandwidth cap lets nbytes more through.
+ */
+void transfer_throttle(size_t nbytes) {
+    struct timespec now;
+    struct timespec wait;
+    double          current;
+    double          due;
+
+    pthread_mutex_lock(&transfer_bandwidth_lock);
+    if(transfer_bandwidth == 0) {
+        pthread_mutex_unlock(&transfer_bandwidth_lock);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    current = now.tv_sec + now.tv_nsec / 1e9;
+
+    // time nobody used does not build up into a burst
+    if(transfer_bandwidth_next < current) transfer_bandwidth_next = current;
+    transfer_bandwidth_next += (double)nbytes / transfer_bandwidth;
+    due                      = transfer_bandwidth_next;
+    pthread_mutex_unlock(&transfer_bandwidth_lock);
+
+    if(due > current) {
+        wait.tv_sec  = (time_t)(due - current);
+        wait.tv_nsec = (long)((due - current - wait.tv_sec) * 1e9);
+        nanosleep(&wait, NULL);
+    }
+}
+
+/**
+ * True if the thread's conflict policy keeps the remote file at path over
+ * source, false if there is no file there or it is replaced.
+ */
+static bool transfer_keep_remote(sftp_session session,
+                                 const char*  path,
+                                 Path         source) {
+    sftp_attributes    attr;
+    const struct stat* info;
+    bool               keep;
+
+    attr = sftp_stat(session, path);
+    if(attr == NULL) return false;
+
+    switch(path_get_conflict()) {
+        case PATH_CONFLICT_SKIP: keep = true; break;
+        case PATH_CONFLICT_NEWER:
+            info = path_stat(source);
+            keep = info != NULL && (time_t)attr->mtime >= info->st_mtime;
+            break;
+        default: keep = false; break;
+    }
+
+    sftp_attributes_free(attr);
+    return keep;
+}
+
+/**
+ * Starts collecting the checks of the calling thread unless it already does.
+ * Returns true if the caller started it and has to end it.
+ */
+bool transfer_checks_begin(void) {
+    if(transfer_checksum == CHECKSUM_NONE || transfer_checks != NULL) {
+        return false;
+    }
+
+    transfer_checks = checksum_batch_init(transfer_checksum);
+    return transfer_checks != NULL;
+}
+
+/**
+ * Checks every collected file, a file that does not match counts as failed.
+ * Downloads waiting for their check go into the cache if they pass.
+ */
+void transfer_checks_end(sftp_session session) {
+    transfer_store_session = (session != NULL) ? session->session : NULL;
+    transfer_stats.failed += checksum_batch_verify(transfer_checks,
+                                                   transfer_store_session,
+                                                   transfer_store_done);
+    checksum_batch_free(transfer_checks);
+    transfer_checks = NULL;
+}
+
+/**
+ * Checks the remote file at path against sum, or leaves it to the end of the
+ * directory being transferred. store, unless it is NULL, goes into the
+ * download cache once the file passed, named after its hash when there is
+ * one. Returns SSH_OK without a sum.
+ */
+static int transfer_check(sftp_session           session,
+                          const char*            path,
+                          Checksum               sum,
+                          struct transfer_store* store) {
+    ChecksumBatch batch;
+    char          hex[CHECKSUM_HEX_SIZE];
+    int           failed = 1;
+
+    transfer_store_session = session->session;
+    if(sum == NULL) {
+        transfer_store_done(store, path, true);
+        return SSH_OK;
+    }
+    if(checksum_final(sum, hex) != CHECKSUM_OK) {
+        transfer_store_done(store, path, false);
+        return SSH_ERROR;
+    }
+
+    // kept under its contents so other names find it
+    if(store != NULL &&
+       download_cache_object_name(transfer_checksum, hex, store->object) !=
+           DOWNLOAD_CACHE_OK) {
+        store->object[0] = '\0';
+    }
+
+    if(transfer_checks != NULL) {
+        if(checksum_batch_add(transfer_checks, path, hex, store) ==
+           CHECKSUM_OK) {
+            return SSH_OK;
+        }
+        transfer_store_done(store, path, false);
+        return SSH_ERROR;
+    }
+
+    batch = checksum_batch_init(transfer_checksum);
+    if(batch != NULL && checksum_batch_add(batch, path, hex, store) ==
+                            CHECKSUM_OK) {
+        failed = checksum_batch_verify(batch,
+                                       session->session,
+                                       transfer_store_done);
+    } else {
+        transfer_store_done(store, path, false);
+    }
+    checksum_batch_free(batch);
+
+    return (failed == 0) ? SSH_OK : SSH_ERROR;
+}
+
+/**
+ * Remembers a download for the cache until its check is done. Returns NULL if
+ * it could not, the download is then just not cached.
+ */
+static struct transfer_store* transfer_store_init(const char*     local,
+                                                  sftp_attributes attr) {
+    struct transfer_store* store;
+
+    store = (struct transfer_store*)malloc(sizeof(struct transfer_store));
+    if(store == NULL) return NULL;
+
+    store->local = strdup(local);
+    if(store->local == NULL) {
+        free(store);
+        return NULL;
+    }
+    store->attr               = *attr;
+    store->attr.name          = NULL;
+    store->attr.longname      = NULL;
+    store->attr.owner         = NULL;
+    store->attr.group         = NULL;
+    store->attr.acl           = NULL;
+    store->attr.extended_type = NULL;
+    store->attr.extended_data = NULL;
+    store->object[0]          = '\0';
+
+    return store;
+}
+
+/**
+ * Puts the download waiting in data into the cache if it was verified and
+ * frees it either way.
+ */
+static void transfer_store_done(void* data, const char* path, bool verified) {
+    struct transfer_store* store = (struct transfer_store*)data;
+
+    if(store == NULL) return;
+
+    if(verified) {
+        download_cache_store(transfer_store_session,
+                             path,
+                             &store->attr,
+                             (store->object[0] != '\0') ? store->object : NULL,
+                             store->local);
+    }
+
+    free(store->local);
+    free(store);
+}
+
+/**
+ * The target of a symbolic link at path to link, both relative to the same
+ * directory, relative to the link so it holds wherever the tree ends up.
+ */
+static char* transfer_link_target(const char* path, const char* link) {
+    DynamicStr target;
+    char*      str;
+    int        length;
+
+    target = dynamic_str_init("");
+    if(target == NULL) return NULL;
+
+    for(const char* c = strchr(path, '/'); c != NULL; c = strchr(c + 1, '/')) {
+        dynamic_str_cat(target, "../");
+    }
+    dynamic_str_cat(target, link);
+
+    // a link to the top directory has nothing after its last ..
+    length = dynamic_str_length(target);
+    if(length > 0 && target->str[length - 1] == '/') {
+        dynamic_str_truncate(target, length - 1);
+    }
+    if(dynamic_str_length(target) == 0) dynamic_str_cat(target, ".");
+
+    str = strdup(target->str);
+    dynamic_str_free(target);
+    return str;
+}
+
+/**
+ * Makes remote another name of target, which was uploaded from the same local
+ * file, instead of uploading local again. Returns SSH_ERROR if the server
+ * cannot make hard links or this one, local has to be uploaded then.
+ */
+static int transfer_link(sftp_session session,
+                         const char*  target,
+                         Path         local,
+                         const char*  remote) {
+    if(!sftp_extension_supported(session, "hardlink@openssh.com", "1")) {
+        return SSH_ERROR;
+    }
+
+    // a link cannot replace a file, asking is left to upload_file
+    if(path_get_conflict() != PATH_CONFLICT_ASK) {
+        if(transfer_keep_remote(session, remote, local)) {
+            transfer_stats.skipped++;
+            return SSH_OK;
+        }
+        sftp_unlink(session, remote);
+    }
+
+    if(sftp_hardlink(session, target, remote) != SSH_OK) return SSH_ERROR;
+
+    transfer_stats.files++;
     return SSH_OK;
 }
 
+/**
+ * Whether all of data is zeros. The first bytes rule out most chunks and the
+ * rest is compared with itself one byte further on, which the vectorized
+ * memcmp of the C library does faster than a loop over it could.
+ */
+static bool transfer_is_zero(const char* data, size_t length) {
+    static const char zeros[16] = {0};
+
+    if(length == 0) return false;
+    if(memcmp(data, zeros, (length < 16) ? length : 16) != 0) return false;
+
+    return memcmp(data, data + 1, length - 1) == 0;
+}
+
+/**
+ * Moves local to the data at or after offset and sets offset to where it
+ * starts and data_end to where the next hole starts. The skipped hole is
+ * hashed into sum as the zeros it reads as. Returns false if only a hole is
+ * left, with offset at size.
+ */
+static bool transfer_skip_hole(FILE*     local,
+                               Checksum  sum,
+                               uint64_t  size,
+                               uint64_t* offset,
+                               uint64_t* data_end) {
+    off_t data = (off_t)*offset;
+    off_t hole = (off_t)size;
+
+#ifdef SEEK_DATA
+    data = lseek(fileno(local), (off_t)*offset, SEEK_DATA);
+    if(data < 0 && errno == ENXIO) {
+        data = (off_t)size;
+    } else if(data < 0) {
+        // holes cannot be found here, the rest is read as data
+        data = (off_t)*offset;
+    } else {
+        hole = lseek(fileno(local), data, SEEK_HOLE);
+        if(hole < 0 || (uint64_t)hole > size) hole = (off_t)size;
+    }
+#endif
+
+    transfer_hash_zeros(sum, (uint64_t)data - *offset);
+    *offset   = (uint64_t)data;
+    *data_end = (uint64_t)hole;
+
+    // the stream reads from the new offset, not from what it had buffered
+    fseeko(local, data, SEEK_SET);
+    return *offset < size;
+}
+
+static void transfer_hash_zeros(Checksum sum, uint64_t length) {
+    static const char zeros[CHUNK_SIZE] = {0};
+    size_t            part;
+
+    while(sum != NULL && length > 0) {
+        part = (length < CHUNK_SIZE) ? (size_t)length : CHUNK_SIZE;
+        checksum_update(sum, zeros, part);
+        length -= part;
+    }
+}
+
+/**
+ * Every file of the group is opened and all the reads it takes are sent right
+ * away, the replies are only collected once the whole group is open. The reads
+ * of the group then wait on the server about once instead of once per file,
+ * opens and closes still wait since libssh has no way to send them ahead. A
+ * file too large for that, or one that changed while it was read, is
+ * downloaded on its own. Returns how many files failed.
+ */
+static int download_group(sftp_session*        session,
+                          struct download_job* jobs,
+                          int                  count) {
+    sftp_file files[DOWNLOAD_FILES_MAX_COUNT];
+    int       requests[DOWNLOAD_FILES_MAX_COUNT][DOWNLOAD_FILES_REQUESTS];
+    int       sent[DOWNLOAD_FILES_MAX_COUNT];
+    bool      skip[DOWNLOAD_FILES_MAX_COUNT];
+    Path      destination;
+    uint64_t  offset;
+    int       failed = 0;
+    int       rc;
+
+    for(int i = 0; i < count; i++) {
+        files[i] = NULL;
+        sent[i]  = 0;
+        skip[i]  = false;
+        if(jobs[i].attr.size > DOWNLOAD_FILES_MAX_SIZE) continue;
+
+        destination = path_duplicate(jobs[i].local);
+        if(destination == NULL) continue;
+        path_go_into(destination, path_basename(jobs[i].remote));
+        skip[i] = path_keep_existing(destination, (time_t)jobs[i].attr.mtime);
+        path_free(destination);
+        if(skip[i]) {
+            transfer_stats.skipped++;
+            continue;
+        }
+
+        files[i] = transfer_open(session,
+                                 jobs[i].remote->path->str,
+                                 O_RDONLY,
+                                 0);
+
+        // one read past the listed size finds the end, or that the file grew
+        for(offset = 0; files[i] != NULL && offset <= jobs[i].attr.size;
+            offset += CHUNK_SIZE) {
+            requests[i][sent[i]] = sftp_async_read_begin(files[i], CHUNK_SIZE);
+            if(requests[i][sent[i]] < 0) break;
+            sent[i]++;
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(skip[i]) continue;
+
+        rc = SSH_AGAIN;
+        if(files[i] != NULL) {
+            rc = download_collect(*session,
+                                  &jobs[i],
+                                  files[i],
+                                  requests[i],
+                                  sent[i]);
+            sftp_close(files[i]);
+        }
+        if(rc == SSH_AGAIN) {
+            *session = conn_pool_current(*session);
+            rc       = download_file(*session,
+                                     jobs[i].remote,
+                                     jobs[i].local,
+                                     &jobs[i].attr);
+        }
+        if(rc != SSH_OK) failed++;
+    }
+
+    return failed;
+}
+
+/**
+ * Writes the replies to the reads sent for job into its local file. Returns
+ * SSH_AGAIN, with nothing left behind, if the file has to be downloaded again
+ * on its own.
+ */
+static int download_collect(sftp_session         session,
+                            struct download_job* job,
+                            sftp_file            file,
+                            const int*           requests,
+                            int                  sent) {
+    char     chunk[CHUNK_SIZE];
+    Path     destination;
+    FILE*    fp      = NULL;
+    Checksum sum     = NULL;
+    uint64_t written = 0;
+    int      nbytes  = CHUNK_SIZE;
+    int      last;
+    int      rc = SSH_ERROR;
+
+    destination = path_duplicate(job->local);
+    if(destination != NULL &&
+       path_go_into(destination, path_basename(job->remote)) == PATH_OK) {
+        fp = path_fopen(destination, "wb");
+        if(fp == NULL) {
+            fprintf(stderr,
+                    "Failed to open file at %s\n",
+                    destination->path->str);
+        } else if(transfer_checksum == CHECKSUM_NONE ||
+                  (sum = checksum_init(transfer_checksum)) != NULL) {
+            rc = SSH_OK;
+        }
+    }
+
+    // replies are taken even after a failure, up to the end of the file since
+    // libssh answers 0 for the handle from then on without dequeuing. Those to
+    // the reads past the end stay on the session until it is freed.
+    for(int k = 0; k < sent && nbytes != 0; k++) {
+        last   = nbytes;
+        nbytes = sftp_async_read(file, chunk, CHUNK_SIZE, requests[k]);
+        if(rc != SSH_OK) continue;
+
+        // data after a short reply would leave a gap, the file changed
+        if(nbytes < 0 || (nbytes > 0 && last < CHUNK_SIZE)) {
+            rc = SSH_AGAIN;
+        } else if(nbytes > 0 &&
+                  fwrite(chunk, sizeof(char), nbytes, fp) != (size_t)nbytes) {
+            fprintf(stderr, "Error while writing to the file\n");
+            rc = SSH_ERROR;
+        } else if(nbytes > 0) {
+            if(sum != NULL) checksum_update(sum, chunk, nbytes);
+            written += nbytes;
+            transfer_throttle(nbytes);
+        }
+    }
+
+    // no end was seen, the file grew since it was listed. Every reply was
+    // taken then, so the handle reads on from where they left off.
+    while(rc == SSH_OK && nbytes > 0) {
+        nbytes = sftp_read(file, chunk, CHUNK_SIZE);
+        if(nbytes < 0) {
+            rc = SSH_AGAIN;
+        } else if(fwrite(chunk, sizeof(char), nbytes, fp) != (size_t)nbytes) {
+            fprintf(stderr, "Error while writing to the file\n");
+            rc = SSH_ERROR;
+        } else {
+            if(sum != NULL) checksum_update(sum, chunk, nbytes);
+            written += nbytes;
+            transfer_throttle(nbytes);
+        }
+    }
+
+    if(fp != NULL && fclose(fp) != 0 && rc == SSH_OK) {
+        fprintf(stderr, "Error while writing to the file\n");
+        rc = SSH_ERROR;
+    }
+    if(rc == SSH_OK) {
+        rc = transfer_check(session, job->remote->path->str, sum, NULL);
+        transfer_stats.files++;
+        transfer_stats.bytes += written;
+    } else if(rc == SSH_AGAIN) {
+        // the download on its own would keep it under a newer-only policy
+        remove(destination->path->str);
+        path_invalidate(destination);
+    }
+
+    checksum_free(sum);
+    if(destination != NULL) path_free(destination);
+    return rc;
+}
+
+/**
+ * Progress lines are left out on the calling thread while quiet is set.
+ */
+void transfer_set_quiet(bool quiet) { transfer_quiet = quiet; }
+
+/**
+ * Caps the transfers of every thread together at bytes_per_second, 0 lifts
+ * the cap.
+ */
+void transfer_set_bandwidth(uint64_t bytes_per_second) {
+    pthread_mutex_lock(&transfer_bandwidth_lock);
+    transfer_bandwidth      = bytes_per_second;
+    transfer_bandwidth_next = 0;
+    pthread_mutex_unlock(&transfer_bandwidth_lock);
+}
+
+/**
+ * Lets directory uploads go into symbolic links to directories.
+ */
+void transfer_set_follow_links(bool follow) { transfer_follow_links = follow; }
+
+/**
+ * Checks every transferred file against a hash of it made on the remote,
+ * CHECKSUM_NONE turns the checks off.
+ */
+void transfer_set_checksum(enum checksum_type type) {
+    transfer_checksum = type;
+}
+
+void transfer_stats_reset(void) {
+    memset(&transfer_stats, 0, sizeof(struct transfer_stats));
+}
+
+/**
+ * What the transfers of the calling thread did since the last reset.
+ */
+struct transfer_stats transfer_stats_get(void) { return transfer_stats; }
+
+/**
+ * Adds what other threads did on behalf of the calling one to its counts.
+ */
+void transfer_stats_add(const struct transfer_stats* stats) {
+    if(stats == NULL) return;
+
+    transfer_stats.files   += stats->files;
+    transfer_stats.skipped += stats->skipped;
+    transfer_stats.failed  += stats->failed;
+    transfer_stats.bytes   += stats->bytes;
+}
+
+/**
+ * Starts a shell on channel in a pty the size of the local terminal.
+ */
 int request_interactive_shell(ssh_channel channel) {
+    int columns;
+    int rows;
+
     int rc = ssh_channel_request_pty(channel);
     if(rc != SSH_OK) {
         return rc;
     }
 
-    rc = ssh_channel_change_pty_size(channel, 80, 24);
+    terminal_get_size(&columns, &rows);
+    rc = ssh_channel_change_pty_size(channel, columns, rows);
     if(rc != SSH_OK) {
         return rc;
     }
@@ -728,27 +1700,31 @@ int request_interactive_shell(ssh_channel channel) {
 }
 
 /**
- * Executes a command and writes output to stdout.
+ * Executes a command and writes output to stdout. Waits for the first output
+ * and then for more until the shell is quiet for TERMINAL_QUIET_TIMEOUT.
  */
 int execute_command_on_shell(ssh_channel channel, char* command) {
-    char buffer[BUFFER_SIZE];
-    int  nbytes;
-    char command_with_nextline[strlen(command) + 1];
+    char   buffer[TERMINAL_BUFFER_SIZE];
+    int    nbytes;
+    size_t length = strlen(command);
+    char   command_with_nextline[length + 2];
 
     // add nextline to the command so that it executes
-    strncpy(command_with_nextline, command, strlen(command));
-    strcat(command_with_nextline, "\n");
-
-    ssh_channel_write(channel,
-                      command_with_nextline,
-                      strlen(command_with_nextline));
-    // sleep(3);
-
-    while(ssh_channel_read(channel, buffer, BUFFER_SIZE, 0) == 0);
-    while((nbytes =
-               ssh_channel_read_nonblocking(channel, buffer, BUFFER_SIZE, 0)) >
-          0) {
-        puts("read");
+    memcpy(command_with_nextline, command, length);
+    command_with_nextline[length]     = '\n';
+    command_with_nextline[length + 1] = '\0';
+
+    if(ssh_channel_write(channel, command_with_nextline, length + 1) !=
+       (int)(length + 1)) {
+        fprintf(stderr,
+                "Error sending \"%s\" to the shell: %s\n",
+                command,
+                ssh_get_error(channel));
+        return SSH_ERROR;
+    }
+
+    nbytes = ssh_channel_read(channel, buffer, TERMINAL_BUFFER_SIZE, 0);
+    while(nbytes > 0) {
         if(fwrite(buffer, 1, nbytes, stdout) != (size_t)nbytes) {
             fprintf(stderr,
                     "Error writing \"%s\" command output to stdout: %s",
@@ -757,80 +1733,185 @@ int execute_command_on_shell(ssh_channel channel, char* command) {
 
             return SSH_ERROR;
         }
-        puts("wrote");
-        // usleep(5000L);
+
+        nbytes = ssh_channel_read_timeout(channel,
+                                          buffer,
+                                          TERMINAL_BUFFER_SIZE,
+                                          0,
+                                          TERMINAL_QUIET_TIMEOUT);
     }
+    fflush(stdout);
 
-    return 0;
+    return (nbytes == SSH_ERROR) ? SSH_ERROR : 0;
 }
 
+/**
+ * Opens an interactive shell on session and hands the terminal to it until
+ * the shell exits.
+ */
 int terminal_session(ssh_session session) {
-    (void)session;
-    puts("Not available yet");
-    return 0;
-}
+    ssh_channel channel;
+    int         rc;
 
-int easy_navigate_mode_sftp(ssh_session session) {
-    char     buffer[BUFFER_SIZE];
-    Path     pwd;
-    AttrList list;
-    AttrNode node;
-    int      quit = 0;
+    channel = create_channel_with_open_session(session);
+    if(channel == NULL) {
+        fprintf(stderr,
+                "Failed to open a channel: %s\n",
+                ssh_get_error(session));
+        return SSH_ERROR;
+    }
+
+    if(request_interactive_shell(channel) != SSH_OK) {
+        fprintf(stderr,
+                "Failed to start a shell: %s\n",
+                ssh_get_error(session));
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return SSH_ERROR;
+    }
+
+    rc = terminal_run(session, channel);
+
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return (rc == TERMINAL_OK) ? SSH_OK : SSH_ERROR;
+}
 
-    sftp_session sftp = create_sftp_session(session);
+int easy_navigate_mode_sftp(ConnPool pool) {
+    char       buffer[BUFFER_SIZE];
+    char       filter[BUFFER_SIZE];
+    char*      host;
+    Path       pwd;
+    DirListing listing;
+    TreeIndex  index  = NULL;
+    TreeSearch search = NULL;
+    AttrNode   node;
+    int        page;
+    int        quit = 0;
+
+    PoolConn     conn = conn_pool_acquire(pool);
+    sftp_session sftp = conn_pool_sftp(conn);
     if(sftp == NULL) {
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
 
     // set the present working direcrory as initial working directory
     pwd = path_init(INITIAL_WORKING_DIRECTORY, PLATFORM_LINUX);
     if(pwd == NULL) {
-        sftp_free(sftp);
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
 
+    // directories already indexed for this host are listed without a readdir
+    if(ssh_options_get(conn->session, SSH_OPTIONS_HOST, &host) == SSH_OK) {
+        index = tree_index_open(host);
+        ssh_string_free_char(host);
+    }
+
     while(!quit) {
+        // a transfer of the last round may have opened the connection again
+        sftp = conn_pool_current(sftp);
         printf("\nYou are now at \"%s\" directory\n", pwd->path->str);
 
-        list = directory_ls_sftp(sftp, pwd);
-        if(list == NULL) {
+        // the listing keeps loading while the first page is shown
+        listing = dir_listing_start(sftp, pwd, index);
+        if(listing != NULL && dir_listing_failed(listing)) {
+            // freeing the listing is what makes its loader let go of sftp
+            dir_listing_free(listing);
+            listing = NULL;
+            if((sftp = conn_pool_recover(sftp)) != NULL) {
+                listing = dir_listing_start(sftp, pwd, index);
+            }
+        }
+        if(listing == NULL || dir_listing_failed(listing)) {
+            dir_listing_free(listing);
+            tree_search_free(search);
+            tree_index_save(index);
+            tree_index_free(index);
             path_free(pwd);
-            sftp_free(sftp);
+            conn_pool_release(pool, conn);
             return SSH_ERROR;
         }
 
-        attr_list_show_with_index(list);
-        printf("Choose a file or directory(0-%d) or q to quit\n", list->size);
-        pfgets(buffer, BUFFER_SIZE);
-        printf("\n");
-
-        if(buffer[0] == 'q') {
-            quit = 1;
-        } else {
-            // convert input to number and detect errors
-            char* endptr;
-            long  num = strtol(buffer, &endptr, 10);
-            if(endptr == buffer) {
-                printf("Invalid input, not a number\n");
+        page      = 0;
+        filter[0] = '\0';
+        node      = NULL;
+        while(node == NULL && !quit) {
+            if(dir_listing_show_page(listing, page, filter) == 0 && page > 0) {
+                page--;
                 continue;
             }
+            printf(
+                "Choose a file or directory by number, n/p for next/previous "
+                "page, /text to filter, s to search everything indexed, r to "
+                "index everything under this directory, u to show disk usage "
+                "or q to quit\n");
+            pfgets(buffer, BUFFER_SIZE);
+            printf("\n");
+
+            if(buffer[0] == 'q') {
+                quit = 1;
+            } else if(buffer[0] == 'r') {
+                if(index == NULL) {
+                    printf("No index available for this host\n");
+                    continue;
+                }
+                dir_listing_stop(listing);
+                tree_index_refresh(index, sftp, pwd);
+                tree_index_save(index);
+                tree_search_free(search);
+                search = NULL;
+                break;
+            } else if(buffer[0] == 'u') {
+                dir_listing_stop(listing);
+                disk_usage_show(sftp, pwd, DISK_USAGE_TOP);
+                break;
+            } else if(buffer[0] == 's') {
+                if(index == NULL) {
+                    printf("No index available for this host\n");
+                    continue;
+                }
+                if(search == NULL) search = tree_search_build(index);
+                dir_listing_stop(listing);
+                search_mode_sftp(sftp, search, pwd);
+                break;
+            } else if(buffer[0] == 'n') {
+                page++;
+            } else if(buffer[0] == 'p') {
+                if(page > 0) page--;
+            } else if(buffer[0] == '/') {
+                strcpy(filter, buffer + 1);
+                page = 0;
+            } else {
+                // convert input to number and detect errors
+                char* endptr;
+                long  num = strtol(buffer, &endptr, 10);
+                if(endptr == buffer) {
+                    printf("Invalid input, not a number\n");
+                    continue;
+                }
 
-            if(num < 0 || num > list->size) {
-                fprintf(stderr,
-                        "number %ld is not in range (%d-%d)\n",
-                        num,
-                        1,
-                        list->size);
-                continue;
-            }
+                if(num == 0) {
+                    path_prev(pwd);
+                    break;
+                }
 
-            if(num == 0) {
-                path_prev(pwd);
-                continue;
+                node = dir_listing_get(listing, num);
+                if(node == NULL) {
+                    fprintf(stderr,
+                            "number %ld is not in range (%d-%d)\n",
+                            num,
+                            1,
+                            dir_listing_size(listing, NULL));
+                }
             }
+        }
 
-            node = attr_list_get_from_postion(list, num);
+        // the session is only ours again once the loader has stopped
+        dir_listing_stop(listing);
 
+        if(node != NULL) {
             switch(node->data->type) {
                 case SSH_FILEXFER_TYPE_REGULAR:
                     handle_file_sftp(sftp, pwd, node);
@@ -847,37 +1928,210 @@ int easy_navigate_mode_sftp(ssh_session session) {
                 default: puts("others"); break;
             }
         }
+
+        dir_listing_free(listing);
     }
 
-    attr_list_free(list);
+    tree_search_free(search);
+    tree_index_save(index);
+    tree_index_free(index);
     path_free(pwd);
-    sftp_free(sftp);
+    conn_pool_release(pool, conn);
+    return SSH_OK;
+}
+
+/**
+ * Searches every indexed path of the host while the user types and opens the
+ * chosen result like it was picked in easy navigate mode. pwd is moved to the
+ * directory of the result.
+ */
+int search_mode_sftp(sftp_session sftp, TreeSearch search, Path pwd) {
+    struct tree_search_result results[TREE_SEARCH_MAX_RESULTS];
+    struct attributes_node    node;
+    char                      pattern[TREE_SEARCH_MAX_PATTERN] = "";
+    char                      buffer[BUFFER_SIZE];
+    Path                      parent;
+    int                       count = 0;
+    long                      num;
+    char*                     endptr;
+
+    if(sftp == NULL || search == NULL || pwd == NULL) {
+        fprintf(stderr, "sftp session, search and pwd cannot be null\n");
+        return SSH_ERROR;
+    }
+
+    if(search->count == 0) {
+        printf("Nothing is indexed yet, use r to index a directory first\n");
+        return SSH_OK;
+    }
+
+    if(read_search_pattern(search, pattern, results, &count) != SSH_OK) {
+        return SSH_OK;
+    }
+
+    if(count == 0) {
+        printf("No match for \"%s\"\n", pattern);
+        return SSH_OK;
+    }
+
+    for(int i = 0; i < count; i++) {
+        printf("%d. \e[%sm%s\e[0m\n",
+               i + 1,
+               get_file_type_color(results[i].type),
+               results[i].path);
+    }
+    printf("Choose a result(1-%d) or anything else to go back\n", count);
+    pfgets(buffer, BUFFER_SIZE);
+
+    num = strtol(buffer, &endptr, 10);
+    if(endptr == buffer || num < 1 || num > count) return SSH_OK;
+
+    // the index can be stale so ask the remote for the current attributes
+    node.next = NULL;
+    node.data = sftp_lstat(sftp, results[num - 1].path);
+    if(node.data == NULL) {
+        fprintf(stderr,
+                "%s no longer exists: %s\n",
+                results[num - 1].path,
+                ssh_get_error(sftp));
+        return SSH_ERROR;
+    }
+
+    parent = path_init(results[num - 1].path, PLATFORM_LINUX);
+    if(parent == NULL) {
+        sftp_attributes_free(node.data);
+        return SSH_ERROR;
+    }
+    node.data->name = path_get_curr(parent);
+    path_prev(parent);
+    path_set(pwd, parent->path->str);
+    path_free(parent);
+
+    switch(node.data->type) {
+        case SSH_FILEXFER_TYPE_REGULAR:
+            handle_file_sftp(sftp, pwd, &node);
+            break;
+
+        case SSH_FILEXFER_TYPE_DIRECTORY:
+            handle_directory_sftp(sftp, pwd, &node);
+            break;
+
+        default: printf("%s cannot be opened\n", node.data->name); break;
+    }
+
+    sftp_attributes_free(node.data);
     return SSH_OK;
 }
 
-int upload_mode(ssh_session session) {
-    char buffer[BUFFER_SIZE];
-    Path uploaded;
-    Path destination;
-    int  rc;
+/**
+ * Reads the search pattern one key at a time and shows the best matches after
+ * every key. Falls back to reading a whole line when stdin is not a terminal.
+ * Returns SSH_ERROR if the user cancelled with escape.
+ */
+int read_search_pattern(TreeSearch                 search,
+                        char*                      pattern,
+                        struct tree_search_result* results,
+                        int*                       count) {
+#ifndef _WIN32
+    struct termios original;
+    struct termios raw;
+    size_t         len = 0;
+    int            ch;
+    int            rc = SSH_OK;
+
+    if(!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &original) != 0) {
+        printf("Search for: ");
+        pfgets(pattern, TREE_SEARCH_MAX_PATTERN);
+        *count = tree_search_run(search,
+                                 pattern,
+                                 results,
+                                 TREE_SEARCH_MAX_RESULTS);
+        return SSH_OK;
+    }
+
+    raw = original;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN]  = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
 
-    if(session == NULL) {
-        fprintf(stderr, "Error: SSH session is NULL.\n");
+    while(1) {
+        // redraw the prompt and the current best matches
+        printf("\e[H\e[JSearch (enter to choose, esc to cancel): %s\n",
+               pattern);
+        for(int i = 0; i < *count; i++) {
+            printf("  \e[%sm%s\e[0m\n",
+                   get_file_type_color(results[i].type),
+                   results[i].path);
+        }
+        fflush(stdout);
+
+        ch = getchar();
+        if(ch == '\n' || ch == '\r') break;
+        if(ch == EOF || ch == 27 || ch == 3 || ch == 4) {
+            rc = SSH_ERROR;
+            break;
+        }
+
+        if(ch == 127 || ch == '\b') {
+            if(len > 0) pattern[--len] = '\0';
+        } else if(isprint(ch) && len < TREE_SEARCH_MAX_PATTERN - 1) {
+            pattern[len++] = (char)ch;
+            pattern[len]   = '\0';
+        } else {
+            continue;
+        }
+
+        *count = tree_search_run(search,
+                                 pattern,
+                                 results,
+                                 TREE_SEARCH_MAX_RESULTS);
+    }
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &original);
+    printf("\n");
+    return rc;
+#else
+    printf("Search for: ");
+    pfgets(pattern, TREE_SEARCH_MAX_PATTERN);
+    *count =
+        tree_search_run(search, pattern, results, TREE_SEARCH_MAX_RESULTS);
+    return SSH_OK;
+#endif
+}
+
+int upload_mode(ConnPool pool) {
+    char         buffer[BUFFER_SIZE];
+    Path         uploaded;
+    Path         destination;
+    PoolConn     conn;
+    sftp_session sftp;
+    int          rc;
+
+    if(pool == NULL) {
+        fprintf(stderr, "Error: connection pool is NULL.\n");
+        return SSH_ERROR;
     }
 
-    sftp_session sftp = create_sftp_session(session);
+    // the sftp session stays with the pooled connection for the next upload
+    conn = conn_pool_acquire(pool);
+    sftp = conn_pool_sftp(conn);
     if(sftp == NULL) {
         fprintf(stderr, "Error creating SFTP session.\n");
+        conn_pool_release(pool, conn);
+        return SSH_ERROR;
     }
 
     puts("Enter the path of the file or directory you want to upload:");
     if(pfgets(buffer, BUFFER_SIZE) == NULL) {
         fprintf(stderr, "Error reading input.\n");
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
     uploaded = path_init(buffer, CURR_PLATFORM);
     if(uploaded == NULL) {
         fprintf(stderr, "Error initializing path for upload.\n");
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
 
@@ -885,21 +2139,25 @@ int upload_mode(ssh_session session) {
     if(pfgets(buffer, BUFFER_SIZE) == NULL) {
         fprintf(stderr, "Error reading input.\n");
         path_free(uploaded);
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
     destination = path_init(buffer, PLATFORM_LINUX);
     if(destination == NULL) {
         fprintf(stderr, "Error initializing destination path.\n");
         path_free(uploaded);
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
 
+    // both checks share one stat through the path's cache
     if(path_is_directory(uploaded)) {
         rc = upload_directory(sftp, uploaded, destination);
         if(rc != SSH_OK) {
             fprintf(stderr, "Error uploading directory.\n");
             path_free(uploaded);
             path_free(destination);
+            conn_pool_release(pool, conn);
             return SSH_ERROR;
         }
     } else if(path_is_file(uploaded)) {
@@ -908,17 +2166,20 @@ int upload_mode(ssh_session session) {
             fprintf(stderr, "Error uploading file.\n");
             path_free(uploaded);
             path_free(destination);
+            conn_pool_release(pool, conn);
             return SSH_ERROR;
         }
     } else {
         fprintf(stderr, "Error finding the file to be uploaded\n");
         path_free(uploaded);
         path_free(destination);
+        conn_pool_release(pool, conn);
         return SSH_ERROR;
     }
 
     path_free(uploaded);
     path_free(destination);
+    conn_pool_release(pool, conn);
     return SSH_OK;
 }
 
@@ -965,6 +2226,35 @@ char* get_file_type_color(int type) {
     }
 }
 
+/**
+ * Appends the overall progress and ETA of the directory download to the
+ * current progress line, if the size of the directory is known.
+ */
+void print_directory_eta(time_t now) {
+    char*    readable_written;
+    char*    readable_total;
+    time_t   elapsed = now - directory_start;
+    uint64_t remaining;
+    long     eta;
+
+    if(directory_total == 0 || elapsed <= 0 || directory_written == 0) return;
+
+    remaining = (directory_written < directory_total)
+                    ? directory_total - directory_written
+                    : 0;
+    eta       = (long)((double)remaining * elapsed / directory_written);
+
+    readable_written = get_readable_size(directory_written);
+    readable_total   = get_readable_size(directory_total);
+    printf("(total %s of about %s, ETA %ldm%02lds)   ",
+           readable_written,
+           readable_total,
+           eta / 60,
+           eta % 60);
+    free(readable_written);
+    free(readable_total);
+}
+
 char* get_readable_size(size_t size) {
     char* result;
     char  buffer[BUFFER_SIZE];
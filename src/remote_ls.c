@@ -0,0 +1,441 @@
+#include "remote_ls.h"
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "attr_list.h"
+#include "path.h"
+#include "pssh.h"
+
+#define REMOTE_LS_PROBE "find / -maxdepth 0 -printf 'pws\\0' 2>/dev/null"
+
+// type, size, mtime, mode, uid, gid and the path relative to the start point
+#define REMOTE_LS_FORMAT "%y %s %T@ %m %U %G %P\\0"
+
+static bool remote_ls_enabled = true;
+
+/**
+ * What a probed host answered. Shared by every thread since each directory
+ * listing runs on a thread of its own.
+ */
+struct remote_ls_host {
+    char*                  name;
+    bool                   supported;
+    struct remote_ls_host* next;
+};
+
+static struct remote_ls_host* remote_ls_hosts = NULL;
+static pthread_mutex_t        remote_ls_lock  = PTHREAD_MUTEX_INITIALIZER;
+
+static sftp_attributes remote_ls_parse_record(char* record);
+static int             remote_ls_run(ssh_session        session,
+                                     const char*        command,
+                                     remote_ls_callback callback,
+                                     void*              data);
+static int             remote_ls_add_to_list(void* data, sftp_attributes attr);
+static struct remote_ls_host* remote_ls_find_host(const char* name);
+static void                   remote_ls_remember(const char* name,
+                                                 bool        supported);
+
+/**
+ * Checks once per host whether the remote find understands -printf. Busybox
+ * and some BSD finds do not, in which case callers fall back to sftp.
+ */
+bool remote_ls_supported(ssh_session session) {
+    struct remote_ls_host* known;
+    ssh_channel            channel;
+    char                   buffer[BUFFER_SIZE];
+    char*                  host = NULL;
+    bool                   supported;
+    int                    nbytes;
+    int                    total = 0;
+
+    if(!remote_ls_enabled || session == NULL) return false;
+
+    if(ssh_options_get(session, SSH_OPTIONS_HOST, &host) == SSH_OK) {
+        pthread_mutex_lock(&remote_ls_lock);
+        known     = remote_ls_find_host(host);
+        supported = known != NULL && known->supported;
+        pthread_mutex_unlock(&remote_ls_lock);
+
+        if(known != NULL) {
+            ssh_string_free_char(host);
+            return supported;
+        }
+    }
+
+    // a channel that cannot be opened says nothing about find, ask again later
+    channel = create_channel_with_open_session(session);
+    if(channel == NULL) {
+        ssh_string_free_char(host);
+        return false;
+    }
+
+    if(ssh_channel_request_exec(channel, REMOTE_LS_PROBE) != SSH_OK) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        ssh_string_free_char(host);
+        return false;
+    }
+
+    while(total < BUFFER_SIZE &&
+          (nbytes = ssh_channel_read(channel,
+                                     buffer + total,
+                                     BUFFER_SIZE - total,
+                                     0)) > 0) {
+        total += nbytes;
+    }
+    supported = total == 4 && memcmp(buffer, "pws", 4) == 0;
+
+    ssh_channel_send_eof(channel);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+
+    if(host != NULL) {
+        remote_ls_remember(host, supported);
+        ssh_string_free_char(host);
+    }
+
+    return supported;
+}
+
+void remote_ls_set_enabled(bool enabled) { remote_ls_enabled = enabled; }
+
+/**
+ * Lists the path on the remote with find. max_depth of 1 gives the same
+ * entries as directory_ls_sftp, REMOTE_LS_RECURSIVE gives the whole tree with
+ * names relative to path. Hidden entries are skipped (and not descended into)
+ * just like the sftp listing. A path that is a symbolic link to a directory is
+ * listed as that directory. Returns NULL if the command fails so the caller
+ * can fall back to sftp. The list nodes come from arena unless it is NULL.
+ */
+AttrList remote_ls_exec(ssh_session session,
+                        Path        path,
+                        int         max_depth,
+                        Arena       arena) {
+    AttrList list;
+
+    list = attr_list_initialize_arena(arena);
+    if(list == NULL) return NULL;
+
+    if(remote_ls_each(session, path, max_depth, remote_ls_add_to_list, list) !=
+       REMOTE_LS_OK) {
+        attr_list_free(list);
+        return NULL;
+    }
+
+    return list;
+}
+
+/**
+ * Same listing as remote_ls_exec but hands every entry to callback as soon as
+ * its record arrives instead of collecting them. The callback owns the
+ * attributes it is given and can return REMOTE_LS_ERROR to stop the listing
+ * early, which is not treated as a failure.
+ */
+int remote_ls_each(ssh_session        session,
+                   Path               path,
+                   int                max_depth,
+                   remote_ls_callback callback,
+                   void*              data) {
+    char*  quoted;
+    char*  command;
+    size_t command_size;
+    char   depth[BUFFER_SIZE] = "";
+    int    rc;
+
+    if(session == NULL || path == NULL || callback == NULL) {
+        fprintf(stderr, "session, path and callback cannot be null\n");
+        return REMOTE_LS_ERROR;
+    }
+
+    quoted = remote_ls_quote(path->path->str);
+    if(quoted == NULL) return REMOTE_LS_ERROR;
+
+    if(max_depth != REMOTE_LS_RECURSIVE) {
+        snprintf(depth, BUFFER_SIZE, "-maxdepth %d ", max_depth);
+    }
+
+    command_size = strlen(quoted) + strlen(depth) + BUFFER_SIZE;
+    command      = (char*)malloc(sizeof(char) * command_size);
+    if(command == NULL) {
+        fprintf(stderr, "failed to allocate memory for the list command\n");
+        free(quoted);
+        return REMOTE_LS_ERROR;
+    }
+
+    snprintf(command,
+             command_size,
+             "find -H %s -mindepth 1 %s-name '.*' -prune -o -printf '%s' "
+             "2>/dev/null",
+             quoted,
+             depth,
+             REMOTE_LS_FORMAT);
+    free(quoted);
+
+    rc = remote_ls_run(session, command, callback, data);
+
+    free(command);
+    return rc;
+}
+
+/**
+ * Wraps the string in single quotes so it can be passed to the remote shell.
+ * The returned string must be freed.
+ */
+char* remote_ls_quote(const char* str) {
+    char*  quoted;
+    size_t len = 2;
+    size_t j   = 0;
+
+    for(size_t i = 0; str[i] != '\0'; i++) {
+        len += (str[i] == '\'') ? 4 : 1;
+    }
+
+    quoted = (char*)malloc(sizeof(char) * (len + 1));
+    if(quoted == NULL) {
+        fprintf(stderr, "failed to allocate memory for quoted string\n");
+        return NULL;
+    }
+
+    quoted[j++] = '\'';
+    for(size_t i = 0; str[i] != '\0'; i++) {
+        if(str[i] == '\'') {
+            memcpy(quoted + j, "'\\''", 4);
+            j += 4;
+        } else {
+            quoted[j++] = str[i];
+        }
+    }
+    quoted[j++] = '\'';
+    quoted[j]   = '\0';
+
+    return quoted;
+}
+
+/**
+ * Runs the command and passes every NUL terminated record of its output to the
+ * callback. Records are parsed as they stream in so the whole output is never
+ * held in memory at once.
+ */
+static int remote_ls_run(ssh_session        session,
+                         const char*        command,
+                         remote_ls_callback callback,
+                         void*              data) {
+    ssh_channel     channel;
+    sftp_attributes attr;
+    char*           buffer;
+    char*           record;
+    char*           end;
+    size_t          capacity = REMOTE_LS_READ_SIZE;
+    size_t          len      = 0;
+    int             nbytes   = 0;
+    int             count    = 0;
+    bool            stopped  = false;
+    int             status;
+
+    channel = create_channel_with_open_session(session);
+    if(channel == NULL) return REMOTE_LS_ERROR;
+
+    if(ssh_channel_request_exec(channel, command) != SSH_OK) {
+        fprintf(stderr,
+                "Failed to run list command: %s\n",
+                ssh_get_error(session));
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return REMOTE_LS_ERROR;
+    }
+
+    buffer = (char*)malloc(sizeof(char) * capacity);
+    if(buffer == NULL) {
+        fprintf(stderr, "failed to allocate memory for the list buffer\n");
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return REMOTE_LS_ERROR;
+    }
+
+    while(1) {
+        // a single record longer than the buffer means a very long path
+        if(len == capacity) {
+            char* temp = (char*)realloc(buffer, capacity * 2);
+            if(temp == NULL) {
+                fprintf(stderr, "failed to grow the list buffer\n");
+                nbytes = SSH_ERROR;
+                break;
+            }
+            buffer    = temp;
+            capacity *= 2;
+        }
+
+        nbytes = ssh_channel_read(channel, buffer + len, capacity - len, 0);
+        if(nbytes <= 0) break;
+        len += nbytes;
+
+        record = buffer;
+        while(!stopped &&
+              (end = memchr(record, '\0', len - (record - buffer))) != NULL) {
+            attr = remote_ls_parse_record(record);
+            if(attr != NULL) {
+                count++;
+                stopped = callback(data, attr) != REMOTE_LS_OK;
+            }
+            record = end + 1;
+        }
+        if(stopped) break;
+
+        len -= record - buffer;
+        memmove(buffer, record, len);
+    }
+
+    free(buffer);
+
+    ssh_channel_send_eof(channel);
+    status = stopped ? 0 : ssh_channel_get_exit_status(channel);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+
+    if(nbytes < 0) {
+        fprintf(stderr,
+                "Error reading list output: %s\n",
+                ssh_get_error(session));
+        return REMOTE_LS_ERROR;
+    }
+
+    // find exits with 1 on unreadable subdirectories but still lists the rest
+    if(!stopped && status != 0 && count == 0) {
+        return REMOTE_LS_ERROR;
+    }
+
+    return REMOTE_LS_OK;
+}
+
+/**
+ * The answer of the host named name, NULL if it was not probed yet. The caller
+ * holds remote_ls_lock.
+ */
+static struct remote_ls_host* remote_ls_find_host(const char* name) {
+    struct remote_ls_host* host;
+
+    for(host = remote_ls_hosts; host != NULL; host = host->next) {
+        if(strcmp(host->name, name) == 0) return host;
+    }
+
+    return NULL;
+}
+
+/**
+ * Keeps the answer of the host for every thread, unless another thread got
+ * it in first.
+ */
+static void remote_ls_remember(const char* name, bool supported) {
+    struct remote_ls_host* host;
+
+    pthread_mutex_lock(&remote_ls_lock);
+    if(remote_ls_find_host(name) == NULL) {
+        host = (struct remote_ls_host*)malloc(sizeof(struct remote_ls_host));
+        if(host != NULL) host->name = strdup(name);
+        if(host != NULL && host->name != NULL) {
+            host->supported = supported;
+            host->next      = remote_ls_hosts;
+            remote_ls_hosts = host;
+        } else {
+            // only means the host is probed again next time
+            free(host);
+        }
+    }
+    pthread_mutex_unlock(&remote_ls_lock);
+}
+
+static int remote_ls_add_to_list(void* data, sftp_attributes attr) {
+    if(attr_list_add((AttrList)data, attr) != ATTR_LIST_OK) {
+        sftp_attributes_free(attr);
+    }
+    return REMOTE_LS_OK;
+}
+
+/**
+ * Turns one "type size mtime mode uid gid name" record into sftp attributes
+ * equivalent to what sftp_readdir returns.
+ */
+static sftp_attributes remote_ls_parse_record(char* record) {
+    sftp_attributes attr;
+    char*           p = record;
+    mode_t          file_type;
+
+    attr = (sftp_attributes)calloc(1, sizeof(struct sftp_attributes_struct));
+    if(attr == NULL) {
+        fprintf(stderr, "failed to allocate memory for attributes\n");
+        return NULL;
+    }
+
+    switch(*p) {
+        case 'f':
+            attr->type = SSH_FILEXFER_TYPE_REGULAR;
+            file_type  = S_IFREG;
+            break;
+        case 'd':
+            attr->type = SSH_FILEXFER_TYPE_DIRECTORY;
+            file_type  = S_IFDIR;
+            break;
+        case 'l':
+            attr->type = SSH_FILEXFER_TYPE_SYMLINK;
+            file_type  = S_IFLNK;
+            break;
+        case 'b':
+            attr->type = SSH_FILEXFER_TYPE_SPECIAL;
+            file_type  = S_IFBLK;
+            break;
+        case 'c':
+            attr->type = SSH_FILEXFER_TYPE_SPECIAL;
+            file_type  = S_IFCHR;
+            break;
+        case 'p':
+            attr->type = SSH_FILEXFER_TYPE_SPECIAL;
+            file_type  = S_IFIFO;
+            break;
+        case 's':
+            attr->type = SSH_FILEXFER_TYPE_SPECIAL;
+            file_type  = S_IFSOCK;
+            break;
+        default:
+            attr->type = SSH_FILEXFER_TYPE_UNKNOWN;
+            file_type  = 0;
+            break;
+    }
+    p++;
+
+    attr->size  = strtoull(p, &p, 10);
+    attr->mtime = (uint32_t)strtoull(p, &p, 10);
+    // skip the fractional seconds of %T@
+    while(*p != '\0' && *p != ' ') p++;
+    attr->mtime64     = attr->mtime;
+    attr->atime       = attr->mtime;
+    attr->atime64     = attr->mtime;
+    attr->permissions = file_type | (uint32_t)strtoul(p, &p, 8);
+    attr->uid         = (uint32_t)strtoul(p, &p, 10);
+    attr->gid         = (uint32_t)strtoul(p, &p, 10);
+
+    if(*p != ' ' || p[1] == '\0') {
+        fprintf(stderr, "malformed list record: %s\n", record);
+        free(attr);
+        return NULL;
+    }
+
+    attr->name = strdup(p + 1);
+    if(attr->name == NULL) {
+        fprintf(stderr, "failed to allocate memory for the entry name\n");
+        free(attr);
+        return NULL;
+    }
+
+    attr->flags = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID |
+                  SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME;
+
+    return attr;
+}
@@ -0,0 +1,194 @@
+#include "terminal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libssh/libssh.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+static int  terminal_forward(ssh_channel channel, char* buffer);
+static int  terminal_write_all(int fd, const char* data, size_t length);
+static void terminal_resized(int signal_number);
+
+/**
+ * Written to by the SIGWINCH handler so poll wakes up for a resize.
+ */
+static int terminal_wake[2] = {-1, -1};
+
+/**
+ * The size of the local terminal, the defaults if stdout is not one.
+ */
+void terminal_get_size(int* columns, int* rows) {
+    struct winsize size;
+
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 &&
+       size.ws_row > 0) {
+        *columns = size.ws_col;
+        *rows    = size.ws_row;
+    } else {
+        *columns = TERMINAL_DEFAULT_COLUMNS;
+        *rows    = TERMINAL_DEFAULT_ROWS;
+    }
+}
+
+/**
+ * Passes keys to channel and its output to the terminal until the remote
+ * shell exits. channel has to have a shell running on it already.
+ */
+int terminal_run(ssh_session session, ssh_channel channel) {
+    struct termios   saved;
+    struct termios   raw;
+    struct sigaction resize;
+    struct sigaction saved_resize;
+    struct pollfd    fds[3];
+    char             buffer[TERMINAL_BUFFER_SIZE];
+    char             drain[64];
+    bool             tty;
+    ssize_t          nbytes;
+    int              columns;
+    int              rows;
+    int              rc = TERMINAL_OK;
+
+    if(session == NULL || channel == NULL) {
+        fprintf(stderr, "cannot pass null values to terminal_run\n");
+        return TERMINAL_ERROR;
+    }
+
+    if(pipe(terminal_wake) != 0) {
+        fprintf(stderr, "Failed to create a pipe: %s\n", strerror(errno));
+        return TERMINAL_ERROR;
+    }
+    fcntl(terminal_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(terminal_wake[1], F_SETFL, O_NONBLOCK);
+
+    memset(&resize, 0, sizeof(struct sigaction));
+    resize.sa_handler = terminal_resized;
+    sigemptyset(&resize.sa_mask);
+    sigaction(SIGWINCH, &resize, &saved_resize);
+
+    tty = isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &saved) == 0;
+    if(tty) {
+        raw = saved;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+
+    fds[0].fd     = STDIN_FILENO;
+    fds[1].fd     = ssh_get_fd(session);
+    fds[2].fd     = terminal_wake[0];
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
+
+    while(rc == TERMINAL_OK) {
+        // libssh may have read more than it handed out, so the channel is
+        // emptied before waiting on the socket
+        rc = terminal_forward(channel, buffer);
+        if(rc != TERMINAL_OK || ssh_channel_is_eof(channel) ||
+           ssh_channel_is_closed(channel)) {
+            break;
+        }
+
+        if(poll(fds, 3, -1) < 0) {
+            if(errno == EINTR) continue;
+            rc = TERMINAL_ERROR;
+            break;
+        }
+
+        if(fds[2].revents & POLLIN) {
+            while(read(terminal_wake[0], drain, sizeof(drain)) > 0);
+            terminal_get_size(&columns, &rows);
+            ssh_channel_change_pty_size(channel, columns, rows);
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP)) {
+            nbytes = read(STDIN_FILENO, buffer, TERMINAL_BUFFER_SIZE);
+            if(nbytes < 0 && errno == EINTR) continue;
+            if(nbytes <= 0) {
+                // poll would keep reporting the hang up if it still watched
+                ssh_channel_send_eof(channel);
+                fds[0].fd = -1;
+            } else if(ssh_channel_write(channel, buffer, nbytes) != nbytes) {
+                rc = TERMINAL_ERROR;
+            }
+        }
+
+        // whatever came before the hang up is written out first
+        if(fds[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            if(terminal_forward(channel, buffer) == TERMINAL_OK &&
+               !ssh_channel_is_eof(channel)) {
+                rc = TERMINAL_ERROR;
+            }
+            break;
+        }
+    }
+
+    if(tty) tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    sigaction(SIGWINCH, &saved_resize, NULL);
+    close(terminal_wake[0]);
+    close(terminal_wake[1]);
+    terminal_wake[0] = -1;
+    terminal_wake[1] = -1;
+
+    if(rc != TERMINAL_OK) {
+        fprintf(stderr, "\nThe session ended: %s\n", ssh_get_error(session));
+    }
+
+    return rc;
+}
+
+/**
+ * Writes everything the channel has on stdout and stderr without waiting for
+ * more.
+ */
+static int terminal_forward(ssh_channel channel, char* buffer) {
+    int nbytes;
+
+    for(int is_stderr = 0; is_stderr <= 1; is_stderr++) {
+        while((nbytes = ssh_channel_read_nonblocking(channel,
+                                                     buffer,
+                                                     TERMINAL_BUFFER_SIZE,
+                                                     is_stderr)) > 0) {
+            if(terminal_write_all(is_stderr ? STDERR_FILENO : STDOUT_FILENO,
+                                  buffer,
+                                  nbytes) != TERMINAL_OK) {
+                return TERMINAL_ERROR;
+            }
+        }
+        if(nbytes == SSH_ERROR) return TERMINAL_ERROR;
+    }
+
+    return TERMINAL_OK;
+}
+
+static int terminal_write_all(int fd, const char* data, size_t length) {
+    ssize_t written;
+
+    while(length > 0) {
+        written = write(fd, data, length);
+        if(written < 0 && errno == EINTR) continue;
+        if(written < 0) return TERMINAL_ERROR;
+
+        data   += written;
+        length -= written;
+    }
+
+    return TERMINAL_OK;
+}
+
+static void terminal_resized(int signal_number) {
+    int saved_errno = errno;
+
+    (void)signal_number;
+    if(terminal_wake[1] >= 0) {
+        // a full pipe already has a resize waiting in it
+        if(write(terminal_wake[1], "", 1) < 0) errno = saved_errno;
+    }
+    errno = saved_errno;
+}
@@ -0,0 +1,363 @@
+#include "transfer_plan.h"
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "attr_list.h"
+#include "conn_pool.h"
+#include "path.h"
+#include "pssh.h"
+
+static int   transfer_plan_add(TransferPlan    plan,
+                               Path            remote,
+                               Path            local,
+                               sftp_attributes attr);
+static int   transfer_plan_compare(const void* a, const void* b);
+static void* transfer_plan_helper(void* data);
+static int   transfer_plan_scan_dir(TransferPlan plan,
+                                    sftp_session session,
+                                    Path         dir,
+                                    Path         location,
+                                    bool         nested);
+static void  transfer_plan_work(TransferPlan plan,
+                                sftp_session session,
+                                bool         small_first);
+static bool  transfer_plan_take(TransferPlan plan,
+                                bool         small_first,
+                                int*         first,
+                                int*         count);
+
+/**
+ * pool lends the connections of the threads helping the caller, without one
+ * the caller downloads everything itself.
+ */
+TransferPlan transfer_plan_init(ConnPool pool) {
+    TransferPlan plan;
+
+    plan = (TransferPlan)calloc(1, sizeof(struct transfer_plan));
+    if(plan == NULL) {
+        fprintf(stderr, "failed to allocate memory for the transfer plan\n");
+        return NULL;
+    }
+    plan->pool = pool;
+    pthread_mutex_init(&plan->lock, NULL);
+
+    return plan;
+}
+
+/**
+ * Adds every file under the remote dir to the plan and creates the directories
+ * they go into under location on the way. The scan fails if dir itself cannot
+ * be listed, a directory below it that cannot be listed is left out and counted
+ * as failed once the plan runs. One that cannot be created anywhere in the tree
+ * fails the whole scan.
+ */
+int transfer_plan_scan(TransferPlan plan,
+                       sftp_session session,
+                       Path         dir,
+                       Path         location) {
+    if(plan == NULL || session == NULL || dir == NULL || location == NULL) {
+        fprintf(stderr, "cannot pass null values to transfer_plan_scan\n");
+        return TRANSFER_PLAN_ERROR;
+    }
+
+    return transfer_plan_scan_dir(plan, session, dir, location, false);
+}
+
+/**
+ * Downloads every planned file on the calling thread's session and on one
+ * thread for every connection the pool has free, but no more threads than
+ * there are pieces of work. What the other threads did and the directories
+ * the scan left out are added to the counts of the calling thread.
+ */
+int transfer_plan_run(TransferPlan plan, sftp_session session) {
+    struct transfer_plan_helper helpers[CONN_POOL_MAX_SIZE - 1];
+    struct transfer_stats       unlisted = {0};
+    int                         pieces;
+    int                         acquired = 0;
+    int                         small;
+    bool                        checks;
+
+    if(plan == NULL || session == NULL) {
+        fprintf(stderr, "cannot pass null values to transfer_plan_run\n");
+        return TRANSFER_PLAN_ERROR;
+    }
+
+    if(plan->count > 1) {
+        qsort(plan->files,
+              plan->count,
+              sizeof(struct download_job),
+              transfer_plan_compare);
+    }
+    plan->large = 0;
+    while(plan->large < plan->count &&
+          plan->files[plan->large].attr.size > DOWNLOAD_FILES_MAX_SIZE) {
+        plan->large++;
+    }
+    plan->next_large = 0;
+    plan->next_small = plan->large;
+    plan->policy     = path_get_conflict();
+
+    pieces = plan->large + (plan->count - plan->large +
+                            DOWNLOAD_FILES_MAX_COUNT - 1) /
+                               DOWNLOAD_FILES_MAX_COUNT;
+
+    // the calling thread takes a piece as well
+    while(acquired < CONN_POOL_MAX_SIZE - 1 && acquired < pieces - 1) {
+        helpers[acquired].conn = conn_pool_try_acquire(plan->pool);
+        if(helpers[acquired].conn == NULL) break;
+        acquired++;
+    }
+
+    small = (acquired + 1) / TRANSFER_PLAN_SMALL_SHARE;
+    if(small == 0 && acquired > 0) small = 1;
+    for(int i = 0; i < acquired; i++) {
+        helpers[i].plan        = plan;
+        helpers[i].small_first = i < small;
+        helpers[i].started     = pthread_create(&helpers[i].thread,
+                                                NULL,
+                                                transfer_plan_helper,
+                                                &helpers[i]) == 0;
+        if(!helpers[i].started) {
+            fprintf(stderr, "failed to start a thread\n");
+            conn_pool_release(plan->pool, helpers[i].conn);
+        }
+    }
+
+    checks = transfer_checks_begin();
+    transfer_plan_work(plan, session, false);
+
+    for(int i = 0; i < acquired; i++) {
+        if(!helpers[i].started) continue;
+
+        pthread_join(helpers[i].thread, NULL);
+        transfer_stats_add(&helpers[i].stats);
+    }
+    if(checks) transfer_checks_end(conn_pool_current(session));
+
+    unlisted.failed = plan->unlisted;
+    transfer_stats_add(&unlisted);
+
+    return TRANSFER_PLAN_OK;
+}
+
+int transfer_plan_free(TransferPlan plan) {
+    if(plan == NULL) return TRANSFER_PLAN_ERROR;
+
+    for(int i = 0; i < plan->count; i++) {
+        path_free(plan->files[i].remote);
+        path_free(plan->files[i].local);
+    }
+    free(plan->files);
+    pthread_mutex_destroy(&plan->lock);
+    free(plan);
+
+    return TRANSFER_PLAN_OK;
+}
+
+static int transfer_plan_add(TransferPlan    plan,
+                             Path            remote,
+                             Path            local,
+                             sftp_attributes attr) {
+    struct download_job* files;
+    struct download_job* job;
+    int                  capacity;
+
+    if(plan->count == plan->capacity) {
+        capacity = (plan->capacity == 0) ? TRANSFER_PLAN_INITIAL_FILES
+                                         : plan->capacity * 2;
+        files    = (struct download_job*)realloc(
+            plan->files,
+            capacity * sizeof(struct download_job));
+        if(files == NULL) {
+            fprintf(stderr,
+                    "failed to allocate memory for the transfer plan\n");
+            return TRANSFER_PLAN_ERROR;
+        }
+        plan->files    = files;
+        plan->capacity = capacity;
+    }
+
+    job         = &plan->files[plan->count];
+    job->remote = path_duplicate(remote);
+    job->local  = path_duplicate(local);
+    if(job->remote == NULL || job->local == NULL) {
+        if(job->remote != NULL) path_free(job->remote);
+        if(job->local != NULL) path_free(job->local);
+        return TRANSFER_PLAN_ERROR;
+    }
+
+    // the strings belong to the listing, only the numbers are kept
+    job->attr               = *attr;
+    job->attr.name          = NULL;
+    job->attr.longname      = NULL;
+    job->attr.owner         = NULL;
+    job->attr.group         = NULL;
+    job->attr.acl           = NULL;
+    job->attr.extended_type = NULL;
+    job->attr.extended_data = NULL;
+    plan->count++;
+
+    return TRANSFER_PLAN_OK;
+}
+
+/**
+ * Large files first from the largest down, then small files in the order of
+ * their paths so the files of a directory go out together.
+ */
+static int transfer_plan_compare(const void* a, const void* b) {
+    const struct download_job* x       = (const struct download_job*)a;
+    const struct download_job* y       = (const struct download_job*)b;
+    bool                       x_large = x->attr.size > DOWNLOAD_FILES_MAX_SIZE;
+    bool                       y_large = y->attr.size > DOWNLOAD_FILES_MAX_SIZE;
+
+    if(x_large != y_large) return x_large ? -1 : 1;
+    if(x_large && x->attr.size != y->attr.size) {
+        return (x->attr.size > y->attr.size) ? -1 : 1;
+    }
+
+    return strcmp(x->remote->path->str, y->remote->path->str);
+}
+
+static void* transfer_plan_helper(void* data) {
+    struct transfer_plan_helper* helper = (struct transfer_plan_helper*)data;
+    TransferPlan                 plan   = helper->plan;
+    sftp_session                 session;
+    bool                         checks;
+
+    // nobody is there to answer a prompt or read a progress line
+    transfer_set_quiet(true);
+    path_set_conflict(plan->policy);
+    transfer_stats_reset();
+
+    session = conn_pool_sftp(helper->conn);
+    if(session != NULL) {
+        checks = transfer_checks_begin();
+        transfer_plan_work(plan, session, helper->small_first);
+        if(checks) transfer_checks_end(conn_pool_current(session));
+    }
+    conn_pool_release(plan->pool, helper->conn);
+
+    helper->stats = transfer_stats_get();
+    return NULL;
+}
+
+/**
+ * nested tells a directory found by the scan from the one it started at.
+ */
+static int transfer_plan_scan_dir(TransferPlan plan,
+                                  sftp_session session,
+                                  Path         dir,
+                                  Path         location,
+                                  bool         nested) {
+    AttrList          list;
+    AttrNode          node;
+    Path              local;
+    Path              remote;
+    Arena             arena;
+    struct arena_mark mark;
+    int               rc = TRANSFER_PLAN_OK;
+
+    arena = arena_thread();
+    if(arena == NULL) return TRANSFER_PLAN_ERROR;
+    mark = arena_mark(arena);
+
+    local = path_duplicate_arena(arena, location);
+    path_go_into(local, path_basename(dir));
+    if(path_create_directory(local) != 0) {
+        fprintf(stderr, "Failed to create directory at %s\n", local->path->str);
+        arena_rewind(arena, mark);
+        return TRANSFER_PLAN_ERROR;
+    }
+
+    list = directory_ls_sftp(session, dir, arena);
+    if(list == NULL && (session = conn_pool_recover(session)) != NULL) {
+        list = directory_ls_sftp(session, dir, arena);
+    }
+    if(list == NULL) {
+        arena_rewind(arena, mark);
+        if(!nested) return TRANSFER_PLAN_ERROR;
+
+        plan->unlisted++;
+        return TRANSFER_PLAN_OK;
+    }
+
+    remote = path_duplicate_arena(arena, dir);
+    for(node = list->head; node != NULL && rc == TRANSFER_PLAN_OK;
+        node = node->next) {
+        path_go_into(remote, node->data->name);
+
+        if(node->data->type == SSH_FILEXFER_TYPE_REGULAR) {
+            rc = transfer_plan_add(plan, remote, local, node->data);
+        } else if(node->data->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+            rc = transfer_plan_scan_dir(plan,
+                                        conn_pool_current(session),
+                                        remote,
+                                        local,
+                                        true);
+        } else {
+            fprintf(stderr,
+                    "download not supported for %s\n",
+                    node->data->name);
+        }
+        path_prev(remote);
+    }
+
+    attr_list_free(list);
+    arena_rewind(arena, mark);
+    return rc;
+}
+
+/**
+ * Downloads pieces of the plan until none are left.
+ */
+static void transfer_plan_work(TransferPlan plan,
+                               sftp_session session,
+                               bool         small_first) {
+    struct transfer_stats lost = {0};
+    int                   first;
+    int                   count;
+
+    while(transfer_plan_take(plan, small_first, &first, &count)) {
+        // the connection may have been opened again by the last piece
+        session      = conn_pool_current(session);
+        lost.failed += download_files(session, &plan->files[first], count);
+    }
+
+    transfer_stats_add(&lost);
+}
+
+/**
+ * Hands out the next large file, or the next DOWNLOAD_FILES_MAX_COUNT small
+ * ones, whichever small_first asks for while there are both. Returns false
+ * once everything was handed out.
+ */
+static bool transfer_plan_take(TransferPlan plan,
+                               bool         small_first,
+                               int*         first,
+                               int*         count) {
+    bool large;
+
+    pthread_mutex_lock(&plan->lock);
+    large = plan->next_large < plan->large &&
+            (!small_first || plan->next_small == plan->count);
+
+    if(large) {
+        *first = plan->next_large++;
+        *count = 1;
+    } else {
+        *first = plan->next_small;
+        *count = plan->count - plan->next_small;
+        if(*count > DOWNLOAD_FILES_MAX_COUNT) *count = DOWNLOAD_FILES_MAX_COUNT;
+        plan->next_small += *count;
+    }
+    pthread_mutex_unlock(&plan->lock);
+
+    return *count > 0;
+}
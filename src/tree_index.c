@@ -0,0 +1,812 @@
+#include "tree_index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libssh/sftp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "attr_list.h"
+#include "path.h"
+#include "pssh.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/**
+ * A directory that is going to be written by tree_index_save.
+ */
+struct tree_index_record {
+    struct tree_index_view view;
+    uint64_t               string_base;
+    bool                   referenced;
+};
+
+static void tree_index_map(TreeIndex index);
+static bool tree_index_check(const struct tree_index_header* header);
+static bool tree_index_find_locked(TreeIndex               index,
+                                   const char*             dir,
+                                   struct tree_index_view* view);
+static struct tree_index_overlay** tree_index_slot(TreeIndex   index,
+                                                   const char* dir);
+static int             tree_index_grow(TreeIndex index);
+static void            tree_index_overlay_free(struct tree_index_overlay* dir);
+static sftp_attributes tree_index_make_attr(
+    const struct tree_index_entry* entry,
+    const char*                    strings);
+static int  tree_index_refresh_dir(TreeIndex    index,
+                                   sftp_session session,
+                                   Path         dir,
+                                   int*         relisted);
+static int  tree_index_compare_records(const void* a, const void* b);
+static void tree_index_mark_children(struct tree_index_record* records,
+                                     size_t                    count);
+
+/**
+ * Opens the index of the host, mapping the existing file if there is one. A
+ * missing or unreadable file gives an empty index rather than an error.
+ */
+TreeIndex tree_index_open(const char* host) {
+    TreeIndex index;
+    Path      file;
+    char      name[BUFFER_SIZE];
+
+    if(host == NULL) {
+        fprintf(stderr, "host cannot be null\n");
+        return NULL;
+    }
+
+    index = (TreeIndex)calloc(1, sizeof(struct tree_index));
+    if(index == NULL) {
+        fprintf(stderr, "failed to allocate memory for the tree index\n");
+        return NULL;
+    }
+
+    index->overlay = (struct tree_index_overlay**)calloc(
+        TREE_INDEX_INITIAL_CAPACITY,
+        sizeof(struct tree_index_overlay*));
+    if(index->overlay == NULL) {
+        fprintf(stderr, "failed to allocate memory for the tree index\n");
+        free(index);
+        return NULL;
+    }
+    index->overlay_capacity = TREE_INDEX_INITIAL_CAPACITY;
+
+    file = path_get_cache_directory(false);
+    if(file == NULL) {
+        free(index->overlay);
+        free(index);
+        return NULL;
+    }
+    snprintf(name, BUFFER_SIZE, "%s%s", host, TREE_INDEX_EXTENSION);
+    path_go_into(file, name);
+
+    index->file = strdup(file->path->str);
+    path_free(file);
+    if(index->file == NULL) {
+        fprintf(stderr, "failed to allocate memory for the index file name\n");
+        free(index->overlay);
+        free(index);
+        return NULL;
+    }
+
+    pthread_mutex_init(&index->lock, NULL);
+    tree_index_map(index);
+
+    return index;
+}
+
+/**
+ * Finds the directory in the index. The view stays valid until the directory
+ * is updated or the index is freed.
+ */
+bool tree_index_find(TreeIndex               index,
+                     const char*             dir,
+                     struct tree_index_view* view) {
+    bool found;
+
+    if(index == NULL || dir == NULL || view == NULL) return false;
+
+    pthread_mutex_lock(&index->lock);
+    found = tree_index_find_locked(index, dir, view);
+    pthread_mutex_unlock(&index->lock);
+
+    return found;
+}
+
+/**
+ * Returns the indexed content of the directory as a listing if the index has
+ * it with the same mtime as the remote, NULL otherwise.
+ */
+AttrList tree_index_lookup(TreeIndex index, const char* dir, uint64_t mtime) {
+    struct tree_index_view view;
+    AttrList               list;
+    sftp_attributes        attr;
+
+    if(index == NULL || dir == NULL) return NULL;
+
+    pthread_mutex_lock(&index->lock);
+    if(!tree_index_find_locked(index, dir, &view) || view.mtime != mtime) {
+        pthread_mutex_unlock(&index->lock);
+        return NULL;
+    }
+
+    list = attr_list_initialize();
+    for(uint64_t i = 0; list != NULL && i < view.count; i++) {
+        attr = tree_index_make_attr(&view.entries[i], view.strings);
+        if(attr == NULL || attr_list_add(list, attr) != ATTR_LIST_OK) {
+            if(attr != NULL) sftp_attributes_free(attr);
+            attr_list_free(list);
+            list = NULL;
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    return list;
+}
+
+/**
+ * Stores a fresh listing of the directory, replacing what the index had.
+ */
+int tree_index_update(TreeIndex   index,
+                      const char* dir,
+                      uint64_t    mtime,
+                      AttrList    list) {
+    struct tree_index_overlay*  record;
+    struct tree_index_overlay** slot;
+    struct tree_index_entry*    entries;
+    AttrNode                    node;
+    char*                       path_copy;
+    char*                       strings;
+    size_t                      strings_size = 0;
+    size_t                      offset       = 0;
+    uint64_t                    i            = 0;
+
+    if(index == NULL || dir == NULL || list == NULL) {
+        fprintf(stderr, "index, directory and list cannot be null\n");
+        return TREE_INDEX_ERROR;
+    }
+
+    for(node = list->head; node != NULL; node = node->next) {
+        strings_size += strlen(node->data->name) + 1;
+    }
+
+    record    = (struct tree_index_overlay*)malloc(sizeof(*record));
+    path_copy = strdup(dir);
+    entries   =
+        (struct tree_index_entry*)calloc(list->size + 1, sizeof(*entries));
+    strings   = (char*)malloc(strings_size + 1);
+    if(record == NULL || path_copy == NULL || entries == NULL ||
+       strings == NULL) {
+        fprintf(stderr, "failed to allocate memory for indexed directory\n");
+        free(record);
+        free(path_copy);
+        free(entries);
+        free(strings);
+        return TREE_INDEX_ERROR;
+    }
+
+    for(node = list->head; node != NULL; node = node->next, i++) {
+        size_t len = strlen(node->data->name) + 1;
+
+        entries[i].name        = offset;
+        entries[i].size        = node->data->size;
+        entries[i].mtime       = node->data->mtime;
+        entries[i].permissions = node->data->permissions;
+        entries[i].type        = node->data->type;
+        memcpy(strings + offset, node->data->name, len);
+        offset += len;
+    }
+
+    record->path    = path_copy;
+    record->mtime   = mtime;
+    record->entries = entries;
+    record->count   = i;
+    record->strings = strings;
+
+    pthread_mutex_lock(&index->lock);
+    if((index->overlay_size + 1) * 2 > index->overlay_capacity &&
+       tree_index_grow(index) != TREE_INDEX_OK) {
+        pthread_mutex_unlock(&index->lock);
+        tree_index_overlay_free(record);
+        return TREE_INDEX_ERROR;
+    }
+
+    slot = tree_index_slot(index, dir);
+    if(*slot != NULL) {
+        tree_index_overlay_free(*slot);
+    } else {
+        index->overlay_size++;
+    }
+    *slot        = record;
+    index->dirty = true;
+    pthread_mutex_unlock(&index->lock);
+
+    return TREE_INDEX_OK;
+}
+
+/**
+ * Calls callback with every directory in the index, the ones refreshed this
+ * run first. Stops early when callback returns TREE_INDEX_ERROR.
+ */
+int tree_index_for_each(TreeIndex           index,
+                        tree_index_callback callback,
+                        void*               data) {
+    struct tree_index_view view;
+    int                    rc = TREE_INDEX_OK;
+
+    if(index == NULL || callback == NULL) return TREE_INDEX_ERROR;
+
+    pthread_mutex_lock(&index->lock);
+    for(int i = 0; rc == TREE_INDEX_OK && i < index->overlay_capacity; i++) {
+        struct tree_index_overlay* o = index->overlay[i];
+        if(o == NULL) continue;
+
+        view = (struct tree_index_view){o->path,
+                                        o->mtime,
+                                        o->entries,
+                                        o->count,
+                                        o->strings};
+        rc   = callback(data, &view);
+    }
+    for(uint64_t i = 0; rc == TREE_INDEX_OK && index->header != NULL &&
+                        i < index->header->dir_count;
+        i++) {
+        const char* path = index->strings + index->dirs[i].path;
+        if(*tree_index_slot(index, path) != NULL) continue;
+
+        view = (struct tree_index_view){path,
+                                        index->dirs[i].mtime,
+                                        index->entries + index->dirs[i].first,
+                                        index->dirs[i].count,
+                                        index->strings};
+        rc   = callback(data, &view);
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    return rc;
+}
+
+/**
+ * Brings the index of the whole tree under root up to date. Every indexed
+ * directory is stated and only the ones whose mtime changed are listed again,
+ * so an unchanged tree costs one stat per directory instead of a listing. The
+ * mtimes in a parent's entries are not trusted since the parent is not listed
+ * again when only something below it changed.
+ */
+int tree_index_refresh(TreeIndex index, sftp_session session, Path root) {
+    Path dir;
+    int  relisted = 0;
+    int  rc;
+
+    if(index == NULL || session == NULL || root == NULL) {
+        fprintf(stderr, "index, session and root cannot be null\n");
+        return TREE_INDEX_ERROR;
+    }
+
+    dir = path_duplicate(root);
+    if(dir == NULL) return TREE_INDEX_ERROR;
+
+    rc = tree_index_refresh_dir(index, session, dir, &relisted);
+    printf("\nIndexed %s, %d directories changed\n", root->path->str, relisted);
+
+    path_free(dir);
+    return rc;
+}
+
+/**
+ * Writes the mapped directories merged with the ones refreshed this run to a
+ * new file and maps it, unless nothing was refreshed since the last save.
+ * Directories that disappeared from their parent are dropped along the way,
+ * together with everything indexed below them.
+ */
+int tree_index_save(TreeIndex index) {
+    struct tree_index_record* records;
+    struct tree_index_header  header;
+    struct tree_index_dir     dir;
+    struct tree_index_entry   entry;
+    size_t                    count = 0;
+    size_t                    capacity;
+    uint64_t                  offset      = 0;
+    uint64_t                  first       = 0;
+    uint64_t                  entry_count = 0;
+    char*                     temp_file;
+    char*                     slash;
+    FILE*                     fp;
+    Path                      cache;
+
+    if(index == NULL) return TREE_INDEX_ERROR;
+
+    pthread_mutex_lock(&index->lock);
+    if(!index->dirty) {
+        pthread_mutex_unlock(&index->lock);
+        return TREE_INDEX_OK;
+    }
+
+    capacity = index->overlay_size +
+               (index->header != NULL ? index->header->dir_count : 0) + 1;
+    records =
+        (struct tree_index_record*)calloc(capacity, sizeof(*records));
+    temp_file = (char*)malloc(strlen(index->file) + 5);
+    if(records == NULL || temp_file == NULL) {
+        fprintf(stderr, "failed to allocate memory to save the index\n");
+        pthread_mutex_unlock(&index->lock);
+        free(records);
+        free(temp_file);
+        return TREE_INDEX_ERROR;
+    }
+    sprintf(temp_file, "%s.tmp", index->file);
+
+    for(int i = 0; i < index->overlay_capacity; i++) {
+        struct tree_index_overlay* o = index->overlay[i];
+        if(o == NULL) continue;
+        records[count].view = (struct tree_index_view){o->path,
+                                                       o->mtime,
+                                                       o->entries,
+                                                       o->count,
+                                                       o->strings};
+        count++;
+    }
+    for(uint64_t i = 0; index->header != NULL && i < index->header->dir_count;
+        i++) {
+        const char* path = index->strings + index->dirs[i].path;
+        if(*tree_index_slot(index, path) != NULL) continue;
+        records[count].view =
+            (struct tree_index_view){path,
+                                     index->dirs[i].mtime,
+                                     index->entries + index->dirs[i].first,
+                                     index->dirs[i].count,
+                                     index->strings};
+        count++;
+    }
+
+    qsort(records, count, sizeof(*records), tree_index_compare_records);
+    tree_index_mark_children(records, count);
+
+    // a directory whose parent is indexed is kept only while the parent is
+    // kept and still lists it, a parent sorts before its children so it is
+    // decided first and a removed directory takes its whole subtree along
+    for(size_t i = 0; i < count; i++) {
+        struct tree_index_record  key;
+        struct tree_index_record* parent_record;
+        char*                     parent;
+
+        parent = strdup(records[i].view.path);
+        slash  = parent != NULL ? strrchr(parent, '/') : NULL;
+        if(slash == NULL || slash[1] == '\0') {
+            records[i].referenced = true;
+            free(parent);
+            continue;
+        }
+        if(slash == parent) slash++;
+        *slash = '\0';
+
+        key.view.path = parent;
+        parent_record = bsearch(&key,
+                                records,
+                                count,
+                                sizeof(*records),
+                                tree_index_compare_records);
+        records[i].referenced =
+            parent_record == NULL ||
+            (records[i].referenced && parent_record->referenced);
+        free(parent);
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        if(!records[i].referenced) continue;
+        records[i].string_base = offset;
+        offset += strlen(records[i].view.path) + 1;
+        for(uint64_t j = 0; j < records[i].view.count; j++) {
+            offset += strlen(records[i].view.strings +
+                             records[i].view.entries[j].name) +
+                      1;
+        }
+        entry_count += records[i].view.count;
+    }
+
+    cache = path_get_cache_directory(true);
+    if(cache != NULL) path_free(cache);
+
+    fp = fopen(temp_file, "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "Failed to write index %s: %d\n", temp_file, errno);
+        pthread_mutex_unlock(&index->lock);
+        free(records);
+        free(temp_file);
+        return TREE_INDEX_ERROR;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TREE_INDEX_MAGIC, sizeof(TREE_INDEX_MAGIC));
+    header.version      = TREE_INDEX_VERSION;
+    header.entry_count  = entry_count;
+    header.strings_size = offset;
+    for(size_t i = 0; i < count; i++) {
+        if(records[i].referenced) header.dir_count++;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+
+    for(size_t i = 0; i < count; i++) {
+        if(!records[i].referenced) continue;
+        dir.path  = records[i].string_base;
+        dir.mtime = records[i].view.mtime;
+        dir.first = first;
+        dir.count = records[i].view.count;
+        fwrite(&dir, sizeof(dir), 1, fp);
+        first += dir.count;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        if(!records[i].referenced) continue;
+        offset = records[i].string_base + strlen(records[i].view.path) + 1;
+        for(uint64_t j = 0; j < records[i].view.count; j++) {
+            entry      = records[i].view.entries[j];
+            entry.name = offset;
+            fwrite(&entry, sizeof(entry), 1, fp);
+            offset += strlen(records[i].view.strings +
+                             records[i].view.entries[j].name) +
+                      1;
+        }
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        if(!records[i].referenced) continue;
+        fwrite(records[i].view.path, strlen(records[i].view.path) + 1, 1, fp);
+        for(uint64_t j = 0; j < records[i].view.count; j++) {
+            const char* name =
+                records[i].view.strings + records[i].view.entries[j].name;
+            fwrite(name, strlen(name) + 1, 1, fp);
+        }
+    }
+
+    free(records);
+
+    if(fclose(fp) != 0 || rename(temp_file, index->file) != 0) {
+        fprintf(stderr, "Failed to write index %s: %d\n", index->file, errno);
+        remove(temp_file);
+        pthread_mutex_unlock(&index->lock);
+        free(temp_file);
+        return TREE_INDEX_ERROR;
+    }
+    free(temp_file);
+
+    // everything in the overlay is in the new file now
+    for(int i = 0; i < index->overlay_capacity; i++) {
+        if(index->overlay[i] != NULL) {
+            tree_index_overlay_free(index->overlay[i]);
+            index->overlay[i] = NULL;
+        }
+    }
+    index->overlay_size = 0;
+    index->dirty        = false;
+
+    if(index->map != NULL) munmap(index->map, index->map_size);
+    index->map    = NULL;
+    index->header = NULL;
+    tree_index_map(index);
+
+    pthread_mutex_unlock(&index->lock);
+    return TREE_INDEX_OK;
+}
+
+int tree_index_free(TreeIndex index) {
+    if(index == NULL) return TREE_INDEX_ERROR;
+
+    for(int i = 0; i < index->overlay_capacity; i++) {
+        if(index->overlay[i] != NULL) {
+            tree_index_overlay_free(index->overlay[i]);
+        }
+    }
+    if(index->map != NULL) munmap(index->map, index->map_size);
+
+    pthread_mutex_destroy(&index->lock);
+    free(index->overlay);
+    free(index->file);
+    free(index);
+
+    return TREE_INDEX_OK;
+}
+
+/**
+ * Maps the index file and checks that its layout is consistent, down to every
+ * directory's entries and every string offset. The index is left empty when
+ * it is not.
+ */
+static void tree_index_map(TreeIndex index) {
+    struct stat               file_stat;
+    struct tree_index_header* header;
+    uint64_t                  expected;
+    void*                     map;
+    int                       fd;
+
+    fd = open(index->file, O_RDONLY);
+    if(fd == -1) return;
+
+    if(fstat(fd, &file_stat) != 0 ||
+       (size_t)file_stat.st_size < sizeof(struct tree_index_header)) {
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map index %s: %d\n", index->file, errno);
+        return;
+    }
+
+    header   = (struct tree_index_header*)map;
+    expected = sizeof(*header) +
+               header->dir_count * sizeof(struct tree_index_dir) +
+               header->entry_count * sizeof(struct tree_index_entry) +
+               header->strings_size;
+    if(memcmp(header->magic, TREE_INDEX_MAGIC, sizeof(TREE_INDEX_MAGIC)) != 0 ||
+       header->version != TREE_INDEX_VERSION ||
+       header->dir_count > (uint64_t)file_stat.st_size ||
+       header->entry_count > (uint64_t)file_stat.st_size ||
+       expected != (uint64_t)file_stat.st_size || header->strings_size == 0 ||
+       ((char*)map)[file_stat.st_size - 1] != '\0') {
+        fprintf(stderr, "Ignoring invalid index %s\n", index->file);
+        munmap(map, file_stat.st_size);
+        return;
+    }
+
+    if(!tree_index_check(header)) {
+        fprintf(stderr, "Ignoring corrupt index %s\n", index->file);
+        munmap(map, file_stat.st_size);
+        return;
+    }
+
+    index->map      = map;
+    index->map_size = file_stat.st_size;
+    index->header   = header;
+    index->dirs     = (struct tree_index_dir*)(header + 1);
+    index->entries =
+        (struct tree_index_entry*)(index->dirs + header->dir_count);
+    index->strings  = (const char*)(index->entries + header->entry_count);
+}
+
+/**
+ * Checks that every directory's entries and every string offset lie within
+ * the file. The string table ends in a NUL, so any offset into it is a
+ * terminated string.
+ */
+static bool tree_index_check(const struct tree_index_header* header) {
+    const struct tree_index_dir*   dirs;
+    const struct tree_index_entry* entries;
+
+    dirs    = (const struct tree_index_dir*)(header + 1);
+    entries = (const struct tree_index_entry*)(dirs + header->dir_count);
+
+    for(uint64_t i = 0; i < header->dir_count; i++) {
+        if(dirs[i].path >= header->strings_size ||
+           dirs[i].count > header->entry_count ||
+           dirs[i].first > header->entry_count - dirs[i].count) {
+            return false;
+        }
+    }
+    for(uint64_t i = 0; i < header->entry_count; i++) {
+        if(entries[i].name >= header->strings_size) return false;
+    }
+
+    return true;
+}
+
+static bool tree_index_find_locked(TreeIndex               index,
+                                   const char*             dir,
+                                   struct tree_index_view* view) {
+    struct tree_index_overlay* record = *tree_index_slot(index, dir);
+    uint64_t                   low    = 0;
+    uint64_t                   high;
+
+    if(record != NULL) {
+        view->path    = record->path;
+        view->mtime   = record->mtime;
+        view->entries = record->entries;
+        view->count   = record->count;
+        view->strings = record->strings;
+        return true;
+    }
+
+    if(index->header == NULL) return false;
+
+    // directories in the file are sorted by path
+    high = index->header->dir_count;
+    while(low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        int      cmp = strcmp(dir, index->strings + index->dirs[mid].path);
+
+        if(cmp == 0) {
+            view->path    = index->strings + index->dirs[mid].path;
+            view->mtime   = index->dirs[mid].mtime;
+            view->entries = index->entries + index->dirs[mid].first;
+            view->count   = index->dirs[mid].count;
+            view->strings = index->strings;
+            return true;
+        }
+        if(cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Returns the overlay slot that holds the directory or the empty slot it would
+ * go into.
+ */
+static struct tree_index_overlay** tree_index_slot(TreeIndex   index,
+                                                   const char* dir) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    int      mask = index->overlay_capacity - 1;
+    int      i;
+
+    for(const char* p = dir; *p != '\0'; p++) {
+        hash = (hash ^ (unsigned char)*p) * FNV_PRIME;
+    }
+
+    i = hash & mask;
+    while(index->overlay[i] != NULL &&
+          strcmp(index->overlay[i]->path, dir) != 0) {
+        i = (i + 1) & mask;
+    }
+
+    return &index->overlay[i];
+}
+
+static int tree_index_grow(TreeIndex index) {
+    struct tree_index_overlay** old          = index->overlay;
+    int                         old_capacity = index->overlay_capacity;
+
+    index->overlay = (struct tree_index_overlay**)calloc(
+        old_capacity * 2,
+        sizeof(struct tree_index_overlay*));
+    if(index->overlay == NULL) {
+        fprintf(stderr, "failed to grow the tree index\n");
+        index->overlay = old;
+        return TREE_INDEX_ERROR;
+    }
+    index->overlay_capacity = old_capacity * 2;
+
+    for(int i = 0; i < old_capacity; i++) {
+        if(old[i] != NULL) *tree_index_slot(index, old[i]->path) = old[i];
+    }
+
+    free(old);
+    return TREE_INDEX_OK;
+}
+
+static void tree_index_overlay_free(struct tree_index_overlay* dir) {
+    free(dir->path);
+    free(dir->entries);
+    free(dir->strings);
+    free(dir);
+}
+
+static sftp_attributes tree_index_make_attr(
+    const struct tree_index_entry* entry,
+    const char*                    strings) {
+    sftp_attributes attr;
+
+    attr = (sftp_attributes)calloc(1, sizeof(struct sftp_attributes_struct));
+    if(attr == NULL) {
+        fprintf(stderr, "failed to allocate memory for attributes\n");
+        return NULL;
+    }
+
+    attr->name = strdup(strings + entry->name);
+    if(attr->name == NULL) {
+        fprintf(stderr, "failed to allocate memory for the entry name\n");
+        free(attr);
+        return NULL;
+    }
+
+    attr->type        = entry->type;
+    attr->size        = entry->size;
+    attr->mtime       = entry->mtime;
+    attr->mtime64     = entry->mtime;
+    attr->atime       = entry->mtime;
+    attr->atime64     = entry->mtime;
+    attr->permissions = entry->permissions;
+    attr->flags       = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS |
+                  SSH_FILEXFER_ATTR_ACMODTIME;
+
+    return attr;
+}
+
+static int tree_index_refresh_dir(TreeIndex    index,
+                                  sftp_session session,
+                                  Path         dir,
+                                  int*         relisted) {
+    struct tree_index_view view;
+    sftp_attributes        attr;
+    AttrList               list;
+    uint64_t               mtime;
+
+    attr = sftp_stat(session, dir->path->str);
+    if(attr == NULL) {
+        fprintf(stderr,
+                "Failed to stat %s: %s\n",
+                dir->path->str,
+                ssh_get_error(session));
+        return TREE_INDEX_ERROR;
+    }
+    mtime = attr->mtime;
+    sftp_attributes_free(attr);
+
+    if(!tree_index_find(index, dir->path->str, &view) || view.mtime != mtime) {
+        list = directory_ls_sftp(session, dir, NULL);
+        if(list == NULL) return TREE_INDEX_ERROR;
+
+        tree_index_update(index, dir->path->str, mtime, list);
+        attr_list_free(list);
+        (*relisted)++;
+
+        printf("\r%d directories changed", *relisted);
+        fflush(stdout);
+
+        if(!tree_index_find(index, dir->path->str, &view)) {
+            return TREE_INDEX_ERROR;
+        }
+    }
+
+    // the view stays valid since only the subdirectories get updated below
+    for(uint64_t i = 0; i < view.count; i++) {
+        if(view.entries[i].type != SSH_FILEXFER_TYPE_DIRECTORY) continue;
+
+        path_go_into(dir, (char*)(view.strings + view.entries[i].name));
+        tree_index_refresh_dir(index, session, dir, relisted);
+        path_prev(dir);
+    }
+
+    return TREE_INDEX_OK;
+}
+
+static int tree_index_compare_records(const void* a, const void* b) {
+    return strcmp(((const struct tree_index_record*)a)->view.path,
+                  ((const struct tree_index_record*)b)->view.path);
+}
+
+/**
+ * Marks every record that is listed as a subdirectory by another record.
+ */
+static void tree_index_mark_children(struct tree_index_record* records,
+                                     size_t                    count) {
+    struct tree_index_record  key;
+    struct tree_index_record* child;
+    Path                      path;
+
+    for(size_t i = 0; i < count; i++) {
+        path = path_init(records[i].view.path, PLATFORM_LINUX);
+        if(path == NULL) continue;
+
+        for(uint64_t j = 0; j < records[i].view.count; j++) {
+            const struct tree_index_entry* entry = &records[i].view.entries[j];
+
+            if(entry->type != SSH_FILEXFER_TYPE_DIRECTORY) continue;
+
+            path_go_into(path, (char*)(records[i].view.strings + entry->name));
+            key.view.path = path->path->str;
+            child         = bsearch(&key,
+                            records,
+                            count,
+                            sizeof(*records),
+                            tree_index_compare_records);
+            if(child != NULL) child->referenced = true;
+            path_prev(path);
+        }
+
+        path_free(path);
+    }
+}
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE  // memmem
+#include "tree_search.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree_index.h"
+
+#define TREE_SEARCH_SUBSTRING_SCORE 3000
+#define TREE_SEARCH_BASENAME_BONUS  1000
+#define TREE_SEARCH_PREFIX_BONUS    500
+#define TREE_SEARCH_FUZZY_SCORE     1000
+#define TREE_SEARCH_CONSECUTIVE     15
+#define TREE_SEARCH_BOUNDARY        10
+
+static int    tree_search_add_dir(void*                         data,
+                                  const struct tree_index_view* view);
+static int    tree_search_append(TreeSearch  search,
+                                 const char* dir,
+                                 const char* name,
+                                 uint8_t     type);
+static size_t tree_search_path_of(TreeSearch search, size_t offset);
+static int    tree_search_substring_score(TreeSearch  search,
+                                          size_t      index,
+                                          const char* match);
+static int    tree_search_fuzzy_score(TreeSearch  search,
+                                      size_t      index,
+                                      const char* pattern,
+                                      size_t      len);
+static void   tree_search_keep(TreeSearch                 search,
+                               struct tree_search_result* results,
+                               int*                       count,
+                               int                        max_results,
+                               size_t                     index,
+                               int                        score);
+
+/**
+ * Packs every path in the index into a search structure.
+ */
+TreeSearch tree_search_build(TreeIndex index) {
+    TreeSearch search;
+
+    if(index == NULL) {
+        fprintf(stderr, "tree index cannot be null\n");
+        return NULL;
+    }
+
+    search = (TreeSearch)calloc(1, sizeof(struct tree_search));
+    if(search == NULL) {
+        fprintf(stderr, "failed to allocate memory for the search\n");
+        return NULL;
+    }
+
+    search->paths_capacity = TREE_SEARCH_INITIAL_CAPACITY * 32;
+    search->capacity       = TREE_SEARCH_INITIAL_CAPACITY;
+    search->paths          = (char*)malloc(search->paths_capacity);
+    search->offsets =
+        (uint64_t*)malloc(sizeof(uint64_t) * (search->capacity + 1));
+    search->types = (uint8_t*)malloc(search->capacity);
+    if(search->paths == NULL || search->offsets == NULL ||
+       search->types == NULL) {
+        fprintf(stderr, "failed to allocate memory for the search\n");
+        tree_search_free(search);
+        return NULL;
+    }
+
+    if(tree_index_for_each(index, tree_search_add_dir, search) !=
+       TREE_INDEX_OK) {
+        tree_search_free(search);
+        return NULL;
+    }
+    search->offsets[search->count] = search->paths_size;
+
+    search->lower      = (char*)malloc(search->paths_size + 1);
+    search->candidates =
+        (size_t*)malloc(sizeof(size_t) * (search->count + 1));
+    if(search->lower == NULL || search->candidates == NULL) {
+        fprintf(stderr, "failed to allocate memory for the search\n");
+        tree_search_free(search);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < search->paths_size; i++) {
+        search->lower[i] = tolower((unsigned char)search->paths[i]);
+    }
+
+    return search;
+}
+
+/**
+ * Finds the best max_results paths matching pattern, case insensitively, and
+ * writes them to results from best to worst. Returns how many were found.
+ */
+int tree_search_run(TreeSearch                 search,
+                    const char*                pattern,
+                    struct tree_search_result* results,
+                    int                        max_results) {
+    char        lower[TREE_SEARCH_MAX_PATTERN];
+    size_t      len;
+    size_t      kept  = 0;
+    size_t      next  = 0;
+    int         count = 0;
+    const char* match;
+
+    if(search == NULL || pattern == NULL || results == NULL ||
+       max_results <= 0) {
+        return 0;
+    }
+
+    len = strlen(pattern);
+    if(len == 0 || len >= TREE_SEARCH_MAX_PATTERN) return 0;
+
+    for(size_t i = 0; i <= len; i++) {
+        lower[i] = tolower((unsigned char)pattern[i]);
+    }
+
+    if(search->last_pattern[0] != '\0' &&
+       strncmp(lower, search->last_pattern, strlen(search->last_pattern)) ==
+           0) {
+        // a longer pattern can only match paths the shorter one matched
+        for(size_t i = 0; i < search->candidate_count; i++) {
+            size_t index = search->candidates[i];
+            size_t start = search->offsets[index];
+            size_t size  = search->offsets[index + 1] - start - 1;
+
+            if(memmem(search->lower + start, size, lower, len) != NULL) {
+                search->candidates[kept++] = index;
+            }
+        }
+    } else {
+        const char* p   = search->lower;
+        const char* end = search->lower + search->paths_size;
+
+        // the pattern has no NUL so a match never spans two paths
+        while((match = memmem(p, end - p, lower, len)) != NULL) {
+            size_t index = tree_search_path_of(search, match - search->lower);
+
+            search->candidates[kept++] = index;
+            p = search->lower + search->offsets[index + 1];
+        }
+    }
+    search->candidate_count = kept;
+    strcpy(search->last_pattern, lower);
+
+    for(size_t i = 0; i < kept; i++) {
+        size_t index = search->candidates[i];
+        size_t start = search->offsets[index];
+
+        match = memmem(search->lower + start,
+                       search->offsets[index + 1] - start - 1,
+                       lower,
+                       len);
+        tree_search_keep(search,
+                         results,
+                         &count,
+                         max_results,
+                         index,
+                         tree_search_substring_score(search, index, match));
+    }
+
+    // not enough exact hits, look for the characters in order as well
+    if(count < max_results) {
+        for(size_t index = 0; index < search->count; index++) {
+            int score;
+
+            if(next < kept && search->candidates[next] == index) {
+                next++;
+                continue;
+            }
+
+            score = tree_search_fuzzy_score(search, index, lower, len);
+            if(score >= 0) {
+                tree_search_keep(search,
+                                 results,
+                                 &count,
+                                 max_results,
+                                 index,
+                                 score);
+            }
+        }
+    }
+
+    return count;
+}
+
+int tree_search_free(TreeSearch search) {
+    if(search == NULL) return TREE_SEARCH_ERROR;
+
+    free(search->paths);
+    free(search->lower);
+    free(search->offsets);
+    free(search->types);
+    free(search->candidates);
+    free(search);
+
+    return TREE_SEARCH_OK;
+}
+
+static int tree_search_add_dir(void*                         data,
+                               const struct tree_index_view* view) {
+    TreeSearch search = (TreeSearch)data;
+
+    for(uint64_t i = 0; i < view->count; i++) {
+        if(tree_search_append(search,
+                              view->path,
+                              view->strings + view->entries[i].name,
+                              view->entries[i].type) != TREE_SEARCH_OK) {
+            return TREE_INDEX_ERROR;
+        }
+    }
+
+    return TREE_INDEX_OK;
+}
+
+static int tree_search_append(TreeSearch  search,
+                              const char* dir,
+                              const char* name,
+                              uint8_t     type) {
+    size_t dir_len  = strlen(dir);
+    size_t name_len = strlen(name);
+    bool   root     = dir_len == 1 && dir[0] == '/';
+    size_t needed   = dir_len + name_len + 2;
+
+    while(search->paths_size + needed > search->paths_capacity) {
+        char* temp = (char*)realloc(search->paths, search->paths_capacity * 2);
+        if(temp == NULL) {
+            fprintf(stderr, "failed to grow the search paths\n");
+            return TREE_SEARCH_ERROR;
+        }
+        search->paths           = temp;
+        search->paths_capacity *= 2;
+    }
+
+    if(search->count == search->capacity) {
+        uint64_t* offsets = (uint64_t*)realloc(
+            search->offsets,
+            sizeof(uint64_t) * (search->capacity * 2 + 1));
+        if(offsets == NULL) {
+            fprintf(stderr, "failed to grow the search paths\n");
+            return TREE_SEARCH_ERROR;
+        }
+        search->offsets = offsets;
+
+        uint8_t* types = (uint8_t*)realloc(search->types, search->capacity * 2);
+        if(types == NULL) {
+            fprintf(stderr, "failed to grow the search paths\n");
+            return TREE_SEARCH_ERROR;
+        }
+        search->types     = types;
+        search->capacity *= 2;
+    }
+
+    search->offsets[search->count] = search->paths_size;
+    search->types[search->count]   = type;
+    search->count++;
+
+    memcpy(search->paths + search->paths_size, dir, dir_len);
+    search->paths_size += dir_len;
+    if(!root) search->paths[search->paths_size++] = '/';
+    memcpy(search->paths + search->paths_size, name, name_len + 1);
+    search->paths_size += name_len + 1;
+
+    return TREE_SEARCH_OK;
+}
+
+/**
+ * Returns the index of the path that contains the byte at offset.
+ */
+static size_t tree_search_path_of(TreeSearch search, size_t offset) {
+    size_t low  = 0;
+    size_t high = search->count;
+
+    while(high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+
+        if(search->offsets[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Hits in the file name beat hits in the directories, hits at the start of
+ * the name beat the rest and shorter paths beat longer ones.
+ */
+static int tree_search_substring_score(TreeSearch  search,
+                                       size_t      index,
+                                       const char* match) {
+    const char* path     = search->lower + search->offsets[index];
+    size_t      len      = search->offsets[index + 1] - search->offsets[index];
+    const char* basename = strrchr(path, '/');
+    int         score    = TREE_SEARCH_SUBSTRING_SCORE;
+
+    basename = (basename == NULL) ? path : basename + 1;
+
+    if(match >= basename) score += TREE_SEARCH_BASENAME_BONUS;
+    if(match == basename) score += TREE_SEARCH_PREFIX_BONUS;
+
+    return score - (int)(len < 1000 ? len : 1000) / 2;
+}
+
+/**
+ * Matches the pattern as a subsequence of the path. Consecutive characters and
+ * characters at the start of a word score higher. Returns -1 if the path does
+ * not contain the pattern characters in order.
+ */
+static int tree_search_fuzzy_score(TreeSearch  search,
+                                   size_t      index,
+                                   const char* pattern,
+                                   size_t      len) {
+    const char* path  = search->lower + search->offsets[index];
+    const char* end   = search->lower + search->offsets[index + 1] - 1;
+    const char* p     = path;
+    const char* prev  = NULL;
+    int         score = TREE_SEARCH_FUZZY_SCORE;
+
+    for(size_t i = 0; i < len; i++) {
+        const char* hit = memchr(p, pattern[i], end - p);
+        if(hit == NULL) return -1;
+
+        if(prev != NULL && hit == prev + 1) {
+            score += TREE_SEARCH_CONSECUTIVE;
+        } else if(prev != NULL) {
+            score -= (int)(hit - prev);
+        }
+        if(hit == path || strchr("/_-. ", hit[-1]) != NULL) {
+            score += TREE_SEARCH_BOUNDARY;
+        }
+
+        prev = hit;
+        p    = hit + 1;
+    }
+
+    score -= (int)(end - path) / 4;
+    return score < 0 ? 0 : score;
+}
+
+static void tree_search_keep(TreeSearch                 search,
+                             struct tree_search_result* results,
+                             int*                       count,
+                             int                        max_results,
+                             size_t                     index,
+                             int                        score) {
+    int i;
+
+    if(*count == max_results && results[*count - 1].score >= score) return;
+
+    i = (*count < max_results) ? (*count)++ : *count - 1;
+    while(i > 0 && results[i - 1].score < score) {
+        results[i] = results[i - 1];
+        i--;
+    }
+
+    results[i].index = index;
+    results[i].score = score;
+    results[i].path  = search->paths + search->offsets[index];
+    results[i].type  = search->types[index];
+}